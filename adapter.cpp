@@ -45,6 +45,15 @@ CreateMiniportMidiFMAdLibGold
     IN      POOL_TYPE   PoolType
 );
 
+NTSTATUS
+CreateMiniportDMusFMAdLibGold
+(
+    OUT     PUNKNOWN *  Unknown,
+    IN      REFCLSID,
+    IN      PUNKNOWN    UnknownOuter    OPTIONAL,
+    IN      POOL_TYPE   PoolType
+);
+
 NTSTATUS
 CreateMiniportWaveCyclicAdLibGold
 (
@@ -285,7 +294,8 @@ InstallSubdevice
  * Ad Lib Gold resource layout (from INF):
  *   1 I/O port range:  base+0 through base+7  (8 ports)
  *   1 IRQ
- *   1 DMA channel      (playback)
+ *   1 DMA channel      (playback; capture too in half duplex)
+ *   1 DMA channel      (optional: capture on MMA channel 1, full duplex)
  *
  * All subsystems (FM, Control Chip, MMA) share the single port range.
  */
@@ -346,7 +356,10 @@ StartDevice
     }
 
     //
-    // Create and initialize the adapter common object.
+    // Create and initialize the adapter common object.  Its Init only
+    // writes the mixer registers the chip does not already hold, and
+    // leaves the slow ones to its mixer timer, so they go out while the
+    // subdevices below install.
     //
     PADAPTERCOMMON pAdapterCommon = NULL;
     if (NT_SUCCESS(ntStatus))
@@ -444,22 +457,41 @@ StartDevice
     }
 
     //
-    // Install the FM synth miniport.
+    // Install the FM synth miniport.  The DirectMusic port gives
+    // timestamped playback; fall back to the plain MIDI port where
+    // DirectMusic is unavailable.
     //
     if (NT_SUCCESS(ntStatus) && resourceListFmSynth)
     {
         ntStatus = InstallSubdevice(DeviceObject,
                                     Irp,
                                     L"FMSynth",
-                                    CLSID_PortMidi,
-                                    CLSID_PortMidi,     /* not used */
-                                    CreateMiniportMidiFMAdLibGold,
+                                    CLSID_PortDMus,
+                                    CLSID_PortDMus,     /* not used */
+                                    CreateMiniportDMusFMAdLibGold,
                                     pAdapterCommon,
                                     resourceListFmSynth,
                                     GUID_NULL,
                                     NULL,
                                     &unknownFmSynth);
 
+        if (!NT_SUCCESS(ntStatus))
+        {
+            _DbgPrintF(DEBUGLVL_VERBOSE, ("StartDevice: DirectMusic FM install failed (0x%08X), using MIDI port", ntStatus));
+
+            ntStatus = InstallSubdevice(DeviceObject,
+                                        Irp,
+                                        L"FMSynth",
+                                        CLSID_PortMidi,
+                                        CLSID_PortMidi,     /* not used */
+                                        CreateMiniportMidiFMAdLibGold,
+                                        pAdapterCommon,
+                                        resourceListFmSynth,
+                                        GUID_NULL,
+                                        NULL,
+                                        &unknownFmSynth);
+        }
+
         if (!NT_SUCCESS(ntStatus))
         {
             _DbgPrintF(DEBUGLVL_TERSE, ("StartDevice: FM synth install failed (0x%08X)", ntStatus));
@@ -494,17 +526,25 @@ StartDevice
         // Build the resource sub-list for the wave miniport:
         // ports + IRQ + DMA.
         //
+        // A second DMA channel, when assigned, goes along for full duplex.
+        //
+        ULONG countDmaWave = (ResourceList->NumberOfDmas() >= 2) ? 2 : 1;
+
         PRESOURCELIST resourceListWave = NULL;
         ntStatus = PcNewResourceSublist(&resourceListWave,
                                         NULL,
                                         PagedPool,
                                         ResourceList,
-                                        3);
+                                        2 + countDmaWave);
         if (NT_SUCCESS(ntStatus))
         {
             SUCCEEDS(resourceListWave->AddPortFromParent(ResourceList, 0));
             SUCCEEDS(resourceListWave->AddInterruptFromParent(ResourceList, 0));
             SUCCEEDS(resourceListWave->AddDmaFromParent(ResourceList, 0));
+            if (countDmaWave > 1)
+            {
+                SUCCEEDS(resourceListWave->AddDmaFromParent(ResourceList, 1));
+            }
         }
 
         if (NT_SUCCESS(ntStatus) && resourceListWave)
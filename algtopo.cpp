@@ -169,6 +169,29 @@ PCPROPERTY_ITEM PropertiesCpuResources[] =
 DEFINE_PCAUTOMATION_TABLE_PROP(AutomationCpuResources, PropertiesCpuResources);
 
 
+/* Private property set on the filter itself (see common.h) */
+static NTSTATUS PropertyHandler_TopoPrivate(PPCPROPERTY_REQUEST);
+
+static
+PCPROPERTY_ITEM PropertiesTopoFilter[] =
+{
+    {
+        &KSPROPSETID_AdLibGold,
+        KSPROPERTY_ADLIBGOLD_PERF_COUNTERS,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_TopoPrivate
+    },
+    {
+        &KSPROPSETID_AdLibGold,
+        KSPROPERTY_ADLIBGOLD_TRACE,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_TopoPrivate
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationTopoFilter, PropertiesTopoFilter);
+
+
 /* Volume property (KSPROPERTY_AUDIO_VOLUMELEVEL) */
 static NTSTATUS PropertyHandler_Level(PPCPROPERTY_REQUEST);
 
@@ -358,7 +381,7 @@ static
 PCFILTER_DESCRIPTOR MiniportFilterDescriptor =
 {
     0,                                      /* Version                */
-    NULL,                                   /* AutomationTable        */
+    &AutomationTopoFilter,                  /* AutomationTable        */
     sizeof(PCPIN_DESCRIPTOR),               /* PinSize                */
     SIZEOF_ARRAY(MiniportPins),             /* PinCount               */
     MiniportPins,                           /* Pins                   */
@@ -665,23 +688,44 @@ PropertyHandler_Level
         if (val < map->MinVal) val = map->MinVal;
         if (val > map->MaxVal) val = map->MaxVal;
 
+        CONTROLREGWRITE writes[2];
+        ULONG           count = 0;
+
         if (channel == CHAN_RIGHT && map->RegRight)
         {
-            that->AdapterCommon->ControlRegWrite(map->RegRight, val);
+            writes[count].Register = map->RegRight;
+            writes[count++].Value  = val;
         }
         else if (channel == CHAN_LEFT || !map->RegRight)
         {
-            that->AdapterCommon->ControlRegWrite(map->RegLeft, val);
+            writes[count].Register = map->RegLeft;
+            writes[count++].Value  = val;
         }
         else
         {
-            /* CHAN_MASTER: set both channels */
-            that->AdapterCommon->ControlRegWrite(map->RegLeft, val);
-            if (map->RegRight)
+            /* CHAN_MASTER: set both channels in one bank switch */
+            writes[count].Register = map->RegLeft;
+            writes[count++].Value  = val;
+            writes[count].Register = map->RegRight;
+            writes[count++].Value  = val;
+        }
+
+        /*
+         * Master volume sits in the slow registers: queue it for the
+         * adapter's mixer timer instead of busy-waiting here.
+         */
+        if (CTRL_REG_IS_SLOW(map->RegLeft))
+        {
+            for (ULONG i = 0; i < count; i++)
             {
-                that->AdapterCommon->ControlRegWrite(map->RegRight, val);
+                that->AdapterCommon->ControlRegWriteDeferred(
+                    writes[i].Register, writes[i].Value);
             }
         }
+        else
+        {
+            that->AdapterCommon->ControlRegWriteBatch(writes, count);
+        }
 
         ntStatus = STATUS_SUCCESS;
     }
@@ -806,7 +850,7 @@ PropertyHandler_OnOff
         /* Ensure forced bits are set */
         mode |= CTRL_MODE_FORCED_BITS;
 
-        that->AdapterCommon->ControlRegWrite(CTRL_REG_OUTPUT_MODE, mode);
+        that->AdapterCommon->ControlRegWriteDeferred(CTRL_REG_OUTPUT_MODE, mode);
         ntStatus = STATUS_SUCCESS;
     }
     else if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
@@ -918,7 +962,7 @@ PropertyHandler_Tone
         if (nibble > 0xF) nibble = 0xF;
 
         BYTE regVal = CTRL_TONE_FORCED_BITS | (BYTE)(nibble & CTRL_TONE_MASK);
-        that->AdapterCommon->ControlRegWrite(reg, regVal);
+        that->AdapterCommon->ControlRegWriteDeferred(reg, regVal);
 
         ntStatus = STATUS_SUCCESS;
     }
@@ -1034,3 +1078,119 @@ PropertyHandler_CpuResources
 
     return STATUS_INVALID_PARAMETER;
 }
+
+
+/*****************************************************************************
+ * PropertyHandler_TopoPrivate()
+ *****************************************************************************
+ * KSPROPSETID_AdLibGold items on the topology filter.
+ *
+ * KSPROPERTY_ADLIBGOLD_PERF_COUNTERS: GET returns the adapter's hot-path
+ * ADLIBGOLD_PERF_COUNTERS; SET (any value) zeroes them.
+ *
+ * KSPROPERTY_ADLIBGOLD_TRACE: GET returns an ADLIBGOLD_TRACE holding as
+ * many records as the buffer has room for; SET takes a ULONG, non-zero
+ * to start tracing and zero to stop.
+ */
+static
+NTSTATUS
+PropertyHandler_TopoPrivate
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+)
+{
+    PAGED_CODE();
+
+    ASSERT(PropertyRequest);
+
+    CMiniportTopologyAdLibGold *that =
+        (CMiniportTopologyAdLibGold *)PropertyRequest->MajorTarget;
+
+    ULONG id = PropertyRequest->PropertyItem->Id;
+    ULONG valueSize;
+
+    switch (id)
+    {
+    case KSPROPERTY_ADLIBGOLD_PERF_COUNTERS:
+        valueSize = sizeof(ADLIBGOLD_PERF_COUNTERS);
+        break;
+
+    case KSPROPERTY_ADLIBGOLD_TRACE:
+        valueSize = FIELD_OFFSET(ADLIBGOLD_TRACE, Record) +
+                    ADLIBGOLD_TRACE_RECORDS * sizeof(ADLIBGOLD_TRACE_RECORD);
+        break;
+
+    default:
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        if (PropertyRequest->ValueSize < sizeof(ULONG))
+        {
+            PropertyRequest->ValueSize = sizeof(ULONG);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        *PULONG(PropertyRequest->Value) = KSPROPERTY_TYPE_GET |
+                                          KSPROPERTY_TYPE_SET |
+                                          KSPROPERTY_TYPE_BASICSUPPORT;
+        PropertyRequest->ValueSize = sizeof(ULONG);
+        return STATUS_SUCCESS;
+    }
+
+    if (!that->AdapterCommon)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_GET)
+    {
+        if (id == KSPROPERTY_ADLIBGOLD_TRACE)
+        {
+            /* Any room for the header will do; the rest is filled */
+            if (PropertyRequest->ValueSize < FIELD_OFFSET(ADLIBGOLD_TRACE, Record))
+            {
+                PropertyRequest->ValueSize = valueSize;
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+
+            PropertyRequest->ValueSize = that->AdapterCommon->ReadTrace(
+                PADLIBGOLD_TRACE(PropertyRequest->Value),
+                PropertyRequest->ValueSize);
+            return STATUS_SUCCESS;
+        }
+
+        if (PropertyRequest->ValueSize < valueSize)
+        {
+            PropertyRequest->ValueSize = valueSize;
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        that->AdapterCommon->QueryPerfCounters(
+            PADLIBGOLD_PERF_COUNTERS(PropertyRequest->Value), FALSE);
+
+        PropertyRequest->ValueSize = valueSize;
+        return STATUS_SUCCESS;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_SET)
+    {
+        if (id == KSPROPERTY_ADLIBGOLD_TRACE)
+        {
+            if (PropertyRequest->ValueSize < sizeof(ULONG))
+            {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+
+            that->AdapterCommon->EnableTrace(
+                (BOOLEAN)(*PULONG(PropertyRequest->Value) != 0));
+            return STATUS_SUCCESS;
+        }
+
+        that->AdapterCommon->QueryPerfCounters(NULL, TRUE);
+        return STATUS_SUCCESS;
+    }
+
+    return STATUS_INVALID_DEVICE_REQUEST;
+}
@@ -129,6 +129,12 @@ public:
     (
         IN      PPCPROPERTY_REQUEST PropertyRequest
     );
+    friend
+    NTSTATUS
+    PropertyHandler_TopoPrivate
+    (
+        IN      PPCPROPERTY_REQUEST PropertyRequest
+    );
 };
 
 #endif  /* _ALGTOPO_PRIVATE_H_ */
@@ -6,7 +6,9 @@
  *
  * Two transfer modes depending on bit depth:
  *   8-bit PCM  -> ISA DMA to FIFO  (hardware transfer, low CPU)
- *   16-bit PCM -> PIO with TPDF dithering  (software transfer in DPC)
+ *   16-bit PCM -> render: ISA DMA from a TPDF-dithered shadow buffer when
+ *                 one could be allocated (refilled from a timer DPC);
+ *                 otherwise PIO with TPDF dithering (per FIFO interrupt)
  *
  * Adapted from the Windows 2000 DDK SB16 wave miniport sample.
  */
@@ -54,13 +56,30 @@ KSDATARANGE_AUDIO PinDataRangesStream[] =
         16,         /* MaximumBitsPerSample */
         7350,       /* MinimumSampleFrequency */
         44100       /* MaximumSampleFrequency */
+    },
+    {
+        {
+            sizeof(KSDATARANGE_AUDIO),
+            0,
+            0,
+            0,
+            STATICGUIDOF(KSDATAFORMAT_TYPE_AUDIO),
+            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM),
+            STATICGUIDOF(KSDATAFORMAT_SPECIFIER_WAVEFORMATEX)
+        },
+        2,          /* MaximumChannels      */
+        ADPCM_BITS_PER_SAMPLE,  /* MinimumBitsPerSample */
+        ADPCM_BITS_PER_SAMPLE,  /* MaximumBitsPerSample */
+        7350,       /* MinimumSampleFrequency */
+        44100       /* MaximumSampleFrequency */
     }
 };
 
 static
 PKSDATARANGE PinDataRangePointersStream[] =
 {
-    PKSDATARANGE(&PinDataRangesStream[0])
+    PKSDATARANGE(&PinDataRangesStream[0]),
+    PKSDATARANGE(&PinDataRangesStream[1])
 };
 
 /*****************************************************************************
@@ -330,6 +349,18 @@ CMiniportWaveCyclicAdLibGold::
         m_DmaChannel = NULL;
     }
 
+    if (m_ShadowDmaChannel)
+    {
+        m_ShadowDmaChannel->Release();
+        m_ShadowDmaChannel = NULL;
+    }
+
+    if (m_CaptureDmaChannel)
+    {
+        m_CaptureDmaChannel->Release();
+        m_CaptureDmaChannel = NULL;
+    }
+
     if (m_ServiceGroup)
     {
         m_ServiceGroup->Release();
@@ -373,12 +404,43 @@ Init
     m_RenderAllocated   = FALSE;
     m_SamplingFrequency = 44100;
     m_NotificationInterval = 0;
+    m_PioStream[MMA_CHANNEL_0] = NULL;
+    m_PioStream[MMA_CHANNEL_1] = NULL;
+    m_ShadowDmaChannel  = NULL;
+    m_CaptureDmaChannel = NULL;
+    m_FullDuplex        = FALSE;
+    m_LatencyMs         = 0;
+    m_HeadroomUs        = MMA_FIFO_HEADROOM_US;
+    m_Underruns         = 0;
     m_PowerState.DeviceState = PowerDeviceD0;
 
     NTSTATUS ntStatus =
         UnknownAdapter->QueryInterface(IID_IAdapterCommon,
                                         (PVOID *)&m_AdapterCommon);
 
+    if (NT_SUCCESS(ntStatus))
+    {
+        ULONG latencyMs;
+
+        if (NT_SUCCESS(m_AdapterCommon->QuerySettingsValue(L"WaveLatencyMs",
+                                                           &latencyMs)) &&
+            latencyMs)
+        {
+            if (latencyMs < WAVE_LATENCY_MIN_MS)
+            {
+                latencyMs = WAVE_LATENCY_MIN_MS;
+            }
+            if (latencyMs > WAVE_LATENCY_MAX_MS)
+            {
+                latencyMs = WAVE_LATENCY_MAX_MS;
+            }
+            m_LatencyMs = latencyMs;
+
+            _DbgPrintF(DEBUGLVL_VERBOSE,
+                ("Init: low-latency profile, %d ms", m_LatencyMs));
+        }
+    }
+
     if (NT_SUCCESS(ntStatus))
     {
         ntStatus = PcNewServiceGroup(&m_ServiceGroup, NULL);
@@ -474,6 +536,83 @@ ProcessResources
         while (!NT_SUCCESS(ntStatus) && (bufferLength >= (PAGE_SIZE / 2)));
     }
 
+    /*
+     * Create the shadow channel on the same DMA resource.  It is never
+     * handed to PortCls: 16-bit render dithers the client buffer into it
+     * and runs the hardware from it.  Optional — without it 16-bit
+     * streams fall back to PIO.
+     */
+    if (NT_SUCCESS(ntStatus))
+    {
+        NTSTATUS shadowStatus =
+            m_Port->NewSlaveDmaChannel(
+                &m_ShadowDmaChannel,
+                NULL,
+                ResourceList,
+                0,
+                MAXLEN_DMA_BUFFER,
+                FALSE,
+                Compatible);
+
+        if (NT_SUCCESS(shadowStatus))
+        {
+            shadowStatus =
+                m_ShadowDmaChannel->AllocateBuffer(
+                    m_DmaChannel->AllocatedBufferSize(), NULL);
+        }
+
+        if (!NT_SUCCESS(shadowStatus) && m_ShadowDmaChannel)
+        {
+            m_ShadowDmaChannel->Release();
+            m_ShadowDmaChannel = NULL;
+        }
+
+        _DbgPrintF(DEBUGLVL_VERBOSE,
+            ("ProcessResources: 16-bit render via %s",
+             m_ShadowDmaChannel ? "shadow DMA" : "PIO"));
+    }
+
+    /*
+     * A second DMA resource gives capture its own channel on MMA channel 1
+     * (full duplex).  Optional — without it capture shares channel 0.
+     */
+    if (NT_SUCCESS(ntStatus) && (countDMA >= 2))
+    {
+        NTSTATUS captureStatus =
+            m_Port->NewSlaveDmaChannel(
+                &m_CaptureDmaChannel,
+                NULL,
+                ResourceList,
+                1,                      /* DMA resource index */
+                MAXLEN_DMA_BUFFER,
+                FALSE,
+                Compatible);
+
+        if (NT_SUCCESS(captureStatus))
+        {
+            ULONG bufferLength = MAXLEN_DMA_BUFFER;
+
+            do
+            {
+                captureStatus =
+                    m_CaptureDmaChannel->AllocateBuffer(bufferLength, NULL);
+                bufferLength >>= 1;
+            }
+            while (!NT_SUCCESS(captureStatus) && (bufferLength >= (PAGE_SIZE / 2)));
+        }
+
+        if (!NT_SUCCESS(captureStatus) && m_CaptureDmaChannel)
+        {
+            m_CaptureDmaChannel->Release();
+            m_CaptureDmaChannel = NULL;
+        }
+
+        m_FullDuplex = (m_CaptureDmaChannel != NULL);
+
+        _DbgPrintF(DEBUGLVL_VERBOSE,
+            ("ProcessResources: %s duplex", m_FullDuplex ? "full" : "half"));
+    }
+
     /*
      * Configure Control Chip registers 13h/14h for IRQ and DMA.
      */
@@ -549,12 +688,38 @@ ConfigureDmaAndIrq
     /*
      * Register 13h: DMA ch0 enable + DMA select + IRQ enable + IRQ select
      */
+    CONTROLREGWRITE writes[2];
+    ULONG           count = 0;
+
     BYTE reg13 = CTRL_DMA0_ENABLE | dmaSel | CTRL_IRQ_ENABLE | irqSel;
-    m_AdapterCommon->ControlRegWrite(CTRL_REG_IRQ_DMA0, reg13);
+    writes[count].Register = CTRL_REG_IRQ_DMA0;
+    writes[count++].Value  = reg13;
 
     _DbgPrintF(DEBUGLVL_VERBOSE,
         ("ConfigureDmaAndIrq: IRQ=%d DMA=%d reg13=0x%02X",
          irqLine, dmaChan, (ULONG)reg13));
+
+    /*
+     * Register 14h: DMA ch1 enable + select, for full-duplex capture.
+     */
+    if (m_FullDuplex)
+    {
+        PCM_PARTIAL_RESOURCE_DESCRIPTOR dma1Desc =
+            ResourceList->FindUntranslatedDma(1);
+        ULONG dma1Chan = dma1Desc->u.Dma.Channel;
+
+        BYTE reg14 = (BYTE)(CTRL_DMA1_ENABLE |
+                            ((dma1Chan & 0x03) << CTRL_DMA1_SEL_SHIFT));
+        writes[count].Register = CTRL_REG_DMA1;
+        writes[count++].Value  = reg14;
+
+        _DbgPrintF(DEBUGLVL_VERBOSE,
+            ("ConfigureDmaAndIrq: DMA1=%d reg14=0x%02X",
+             dma1Chan, (ULONG)reg14));
+    }
+
+    /* Both routing registers in one bank switch */
+    m_AdapterCommon->ControlRegWriteBatch(writes, count);
 }
 
 
@@ -581,7 +746,7 @@ GetDescription
 /*****************************************************************************
  * CMiniportWaveCyclicAdLibGold::ValidateFormat()
  *****************************************************************************
- * Check that a KSDATAFORMAT represents a PCM format we can handle.
+ * Check that a KSDATAFORMAT represents a PCM or ADPCM format we can handle.
  */
 NTSTATUS
 CMiniportWaveCyclicAdLibGold::
@@ -597,11 +762,10 @@ ValidateFormat
     _DbgPrintF(DEBUGLVL_VERBOSE, ("[CMiniportWaveCyclicAdLibGold::ValidateFormat]"));
 
     /*
-     * Must be audio/PCM with WAVEFORMATEX specifier.
+     * Must be audio/PCM or audio/ADPCM with WAVEFORMATEX specifier.
      */
     if ((Format->FormatSize < sizeof(KSDATAFORMAT_WAVEFORMATEX)) ||
         !IsEqualGUIDAligned(Format->MajorFormat, KSDATAFORMAT_TYPE_AUDIO) ||
-        !IsEqualGUIDAligned(Format->SubFormat,   KSDATAFORMAT_SUBTYPE_PCM) ||
         !IsEqualGUIDAligned(Format->Specifier,   KSDATAFORMAT_SPECIFIER_WAVEFORMATEX))
     {
         return STATUS_INVALID_PARAMETER;
@@ -609,19 +773,35 @@ ValidateFormat
 
     PWAVEFORMATEX wfx = PWAVEFORMATEX(Format + 1);
 
-    if (wfx->wFormatTag != WAVE_FORMAT_PCM)
-    {
-        return STATUS_INVALID_PARAMETER;
-    }
-
     /* Channels: mono or stereo */
     if ((wfx->nChannels < 1) || (wfx->nChannels > 2))
     {
         return STATUS_INVALID_PARAMETER;
     }
 
-    /* Bit depth: 8-bit or 16-bit (16 maps to 12-bit hardware via dithering) */
-    if ((wfx->wBitsPerSample != 8) && (wfx->wBitsPerSample != 16))
+    if (IsEqualGUIDAligned(Format->SubFormat, KSDATAFORMAT_SUBTYPE_PCM))
+    {
+        if (wfx->wFormatTag != WAVE_FORMAT_PCM)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        /* Bit depth: 8-bit or 16-bit (16 maps to 12-bit hardware via dithering) */
+        if ((wfx->wBitsPerSample != 8) && (wfx->wBitsPerSample != 16))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+    else if (IsEqualGUIDAligned(Format->SubFormat, KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM))
+    {
+        /* ADPCM: 4-bit codes, decoded/encoded by the MMA itself */
+        if ((wfx->wFormatTag != WAVE_FORMAT_YAMAHA_ADPCM) ||
+            (wfx->wBitsPerSample != ADPCM_BITS_PER_SAMPLE))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+    else
     {
         return STATUS_INVALID_PARAMETER;
     }
@@ -670,6 +850,69 @@ SampleRateToFreqBits
 }
 
 
+/*****************************************************************************
+ * CMiniportWaveCyclicAdLibGold::FormatByteRate()
+ *****************************************************************************
+ * Bytes per second of a validated PCM or ADPCM format.
+ */
+ULONG
+CMiniportWaveCyclicAdLibGold::
+FormatByteRate
+(
+    IN      PWAVEFORMATEX   WaveFormat
+)
+{
+    if (WaveFormat->wFormatTag == WAVE_FORMAT_YAMAHA_ADPCM)
+    {
+        return WaveFormat->nSamplesPerSec * WaveFormat->nChannels / 2;
+    }
+
+    return WaveFormat->nSamplesPerSec * WaveFormat->nChannels *
+           (WaveFormat->wBitsPerSample / 8);
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicAdLibGold::ProfileBufferSize()
+ *****************************************************************************
+ * Cyclic buffer size for a new stream under the current latency profile:
+ * WAVE_LATENCY_PERIODS notification periods, frame aligned, no smaller
+ * than the FIFO work needs and no larger than what was allocated.
+ */
+ULONG
+CMiniportWaveCyclicAdLibGold::
+ProfileBufferSize
+(
+    IN      PDMACHANNELSLAVE DmaChannel,
+    IN      PWAVEFORMATEX   WaveFormat
+)
+{
+    PAGED_CODE();
+
+    ULONG allocated = DmaChannel->AllocatedBufferSize();
+
+    if (!m_LatencyMs)
+    {
+        return allocated;
+    }
+
+    ULONG size = FormatByteRate(WaveFormat) * m_LatencyMs / 1000;
+
+    size = (size + 3) & ~3UL;       /* Whole frames in every format */
+
+    if (size < WAVE_BUFFER_MIN)
+    {
+        size = WAVE_BUFFER_MIN;
+    }
+    if (size > allocated)
+    {
+        size = allocated;
+    }
+
+    return size;
+}
+
+
 /*****************************************************************************
  * CMiniportWaveCyclicAdLibGold::DataRangeIntersection()
  *****************************************************************************
@@ -699,10 +942,22 @@ DataRangeIntersection
     if (!IsEqualGUIDAligned(ClientDataRange->Specifier,
                             KSDATAFORMAT_SPECIFIER_NONE))
     {
+        /*
+         * PortCls offers each of our stream ranges in turn (PCM, then
+         * ADPCM); only intersect with the one of the same subtype.
+         */
         if (!IsEqualGUIDAligned(ClientDataRange->MajorFormat,
                                 KSDATAFORMAT_TYPE_AUDIO) ||
             !IsEqualGUIDAligned(ClientDataRange->SubFormat,
-                                KSDATAFORMAT_SUBTYPE_PCM))
+                                MyDataRange->SubFormat))
+        {
+            return STATUS_NO_MATCH;
+        }
+
+        if (!IsEqualGUIDAligned(ClientDataRange->SubFormat,
+                                KSDATAFORMAT_SUBTYPE_PCM) &&
+            !IsEqualGUIDAligned(ClientDataRange->SubFormat,
+                                KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM))
         {
             return STATUS_INVALID_PARAMETER;
         }
@@ -774,17 +1029,22 @@ DataRangeIntersection
 
         *ResultantFormatLength = RequiredSize;
 
-        WaveFormatEx->wFormatTag = WAVE_FORMAT_PCM;
+        BOOLEAN Adpcm =
+            IsEqualGUIDAligned(ClientDataRange->SubFormat,
+                               KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM);
+
+        WaveFormatEx->wFormatTag =
+            Adpcm ? WAVE_FORMAT_YAMAHA_ADPCM : WAVE_FORMAT_PCM;
         WaveFormatEx->nChannels =
             (USHORT)min(AudioRange->MaximumChannels,
                         ((PKSDATARANGE_AUDIO)ClientDataRange)->MaximumChannels);
 
         /*
-         * Sample rate: if a stream is already active, force the same rate
-         * (full-duplex constraint).  Otherwise pick the highest supported
-         * rate within the client's range.
+         * Sample rate: if a stream is already active on the shared channel,
+         * force the same rate (half-duplex constraint).  Otherwise pick the
+         * highest supported rate within the client's range.
          */
-        if (m_CaptureAllocated || m_RenderAllocated)
+        if (!m_FullDuplex && (m_CaptureAllocated || m_RenderAllocated))
         {
             if ((m_SamplingFrequency >
                     ((PKSDATARANGE_AUDIO)ClientDataRange)->MaximumSampleFrequency) ||
@@ -833,7 +1093,15 @@ DataRangeIntersection
             (USHORT)min(AudioRange->MaximumBitsPerSample,
                         ((PKSDATARANGE_AUDIO)ClientDataRange)->MaximumBitsPerSample);
 
-        if (BitsPerSample >= 16)
+        if (Adpcm)
+        {
+            if (BitsPerSample < ADPCM_BITS_PER_SAMPLE)
+            {
+                return STATUS_NO_MATCH;
+            }
+            BitsPerSample = ADPCM_BITS_PER_SAMPLE;
+        }
+        else if (BitsPerSample >= 16)
         {
             BitsPerSample = 16;
         }
@@ -847,10 +1115,21 @@ DataRangeIntersection
         }
 
         WaveFormatEx->wBitsPerSample  = BitsPerSample;
-        WaveFormatEx->nBlockAlign     =
-            (WaveFormatEx->wBitsPerSample * WaveFormatEx->nChannels) / 8;
-        WaveFormatEx->nAvgBytesPerSec =
-            WaveFormatEx->nSamplesPerSec * WaveFormatEx->nBlockAlign;
+
+        if (Adpcm)
+        {
+            /* One byte carries a code for each channel of two frames */
+            WaveFormatEx->nBlockAlign     = WaveFormatEx->nChannels;
+            WaveFormatEx->nAvgBytesPerSec =
+                WaveFormatEx->nSamplesPerSec * WaveFormatEx->nChannels / 2;
+        }
+        else
+        {
+            WaveFormatEx->nBlockAlign     =
+                (WaveFormatEx->wBitsPerSample * WaveFormatEx->nChannels) / 8;
+            WaveFormatEx->nAvgBytesPerSec =
+                WaveFormatEx->nSamplesPerSec * WaveFormatEx->nBlockAlign;
+        }
         WaveFormatEx->cbSize = 0;
 
         ((PKSDATAFORMAT)ResultantFormat)->SampleSize = WaveFormatEx->nBlockAlign;
@@ -922,9 +1201,10 @@ NewStream
     }
 
     /*
-     * Full-duplex constraint: both streams must share the same sample rate.
+     * Half-duplex constraint: streams sharing MMA channel 0 must share the
+     * same sample rate.
      */
-    if (NT_SUCCESS(ntStatus))
+    if (NT_SUCCESS(ntStatus) && !m_FullDuplex)
     {
         if (m_CaptureAllocated || m_RenderAllocated)
         {
@@ -936,6 +1216,21 @@ NewStream
         }
     }
 
+    /*
+     * Size the cyclic buffer for the latency profile before the stream
+     * reads it.  In half duplex the buffer is shared by both directions,
+     * so leave it alone while the other one is open.
+     */
+    PDMACHANNELSLAVE dmaChannel =
+        (Capture && m_FullDuplex) ? m_CaptureDmaChannel : m_DmaChannel;
+
+    if (NT_SUCCESS(ntStatus) &&
+        (m_FullDuplex || (!m_CaptureAllocated && !m_RenderAllocated)))
+    {
+        dmaChannel->SetBufferSize(
+            ProfileBufferSize(dmaChannel, PWAVEFORMATEX(DataFormat + 1)));
+    }
+
     if (NT_SUCCESS(ntStatus))
     {
         CMiniportWaveCyclicStreamAdLibGold *stream =
@@ -964,8 +1259,8 @@ NewStream
                 *OutStream = PMINIPORTWAVECYCLICSTREAM(stream);
                 stream->AddRef();
 
-                *OutDmaChannel = PDMACHANNEL(m_DmaChannel);
-                m_DmaChannel->AddRef();
+                *OutDmaChannel = PDMACHANNEL(dmaChannel);
+                dmaChannel->AddRef();
 
                 *OutServiceGroup = m_ServiceGroup;
                 m_ServiceGroup->AddRef();
@@ -984,19 +1279,43 @@ NewStream
 
 
 /*****************************************************************************
- * CMiniportWaveCyclicAdLibGold::ServiceWaveISR()
+ * CMiniportWaveCyclicAdLibGold::ServiceWave()
  *****************************************************************************
- * Called from the adapter common ISR when a sampling interrupt occurs.
- * Notifies PortCls to schedule the DPC.
+ * Called from the adapter common's service DPC (DISPATCH_LEVEL, MMA lock
+ * held) for each MMA channel with a FIFO request pending.  Notifies
+ * PortCls to schedule its DPC.
  */
 #pragma code_seg()
 
 STDMETHODIMP_(void)
 CMiniportWaveCyclicAdLibGold::
-ServiceWaveISR
-(   void
+ServiceWave
+(
+    IN      ULONG   Channel
 )
 {
+    if (Channel >= MMA_CHANNELS)
+        return;
+
+    /*
+     * A 16-bit PIO stream must be serviced before the FIFO runs dry (or
+     * overflows on record), so move its chunk here rather than waiting on
+     * PortCls's DPC.
+     * The FIFO interrupts many times per notification period; only wake
+     * PortCls once the stream says a period's worth has moved.
+     */
+    /*
+     * m_PioStream is only set and cleared under the MMA lock, which the
+     * service DPC holds across this call, so the stream cannot be halted
+     * or restarted underneath ServiceFifo.
+     */
+    CMiniportWaveCyclicStreamAdLibGold * pioStream = m_PioStream[Channel];
+
+    if (pioStream && !pioStream->ServiceFifo())
+    {
+        return;
+    }
+
     if (m_Port && m_ServiceGroup)
     {
         m_Port->Notify(m_ServiceGroup);
@@ -1036,125 +1355,387 @@ PowerChangeState
 
 
 /*****************************************************************************
- * CMiniportWaveCyclicStreamAdLibGold non-delegating IUnknown
+ * WaveShadowTimerDPC()
+ *****************************************************************************
+ * Timer DPC: keeps the 16-bit render shadow buffer ahead of the DMA, then
+ * re-arms for the next period.  The run is counted so StopShadowTimer can
+ * wait it out; with no KeFlushQueuedDpcs before XP, m_ShadowArmed covers
+ * the gap between the DPC being dequeued and this routine taking the lock.
  */
-STDMETHODIMP
-CMiniportWaveCyclicStreamAdLibGold::
-NonDelegatingQueryInterface
+#pragma code_seg()
+
+VOID
+NTAPI
+WaveShadowTimerDPC
 (
-    IN      REFIID  Interface,
-    OUT     PVOID * Object
+    IN      PKDPC   Dpc,
+    IN      PVOID   DeferredContext,
+    IN      PVOID   SystemArgument1,
+    IN      PVOID   SystemArgument2
 )
 {
-    PAGED_CODE();
+    ASSERT(DeferredContext);
 
-    ASSERT(Object);
+    CMiniportWaveCyclicStreamAdLibGold *that =
+        (CMiniportWaveCyclicStreamAdLibGold *)DeferredContext;
+    BOOLEAN fRun;
 
-    if (IsEqualGUIDAligned(Interface, IID_IUnknown))
+    KeAcquireSpinLockAtDpcLevel(&that->m_ShadowLock);
+    that->m_ShadowArmed = FALSE;
+    that->m_ShadowActive++;
+    fRun = !that->m_ShadowStopping;
+    KeReleaseSpinLockFromDpcLevel(&that->m_ShadowLock);
+
+    if (fRun)
     {
-        *Object = PVOID((PUNKNOWN)(IMiniportWaveCyclicStream *)this);
+        that->ServiceShadow();
     }
-    else if (IsEqualGUIDAligned(Interface, IID_IMiniportWaveCyclicStream))
+
+    /* StopShadowTimer's caller may free the stream once the lock is released */
+    KeAcquireSpinLockAtDpcLevel(&that->m_ShadowLock);
+    if (!that->m_ShadowStopping)
     {
-        *Object = PVOID((PMINIPORTWAVECYCLICSTREAM)this);
+        LARGE_INTEGER timeDue100ns;
+
+        timeDue100ns.QuadPart = that->m_ShadowPeriod;
+        KeSetTimer(&that->m_ShadowTimer, timeDue100ns, &that->m_ShadowDpc);
+        that->m_ShadowArmed = TRUE;
     }
-    else
+    if (!--that->m_ShadowActive && that->m_ShadowStopping && !that->m_ShadowArmed)
     {
-        *Object = NULL;
+        KeSetEvent(&that->m_ShadowIdle, 0, FALSE);
     }
+    KeReleaseSpinLockFromDpcLevel(&that->m_ShadowLock);
+}
 
-    if (*Object)
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::StartShadowTimer()
+ *****************************************************************************
+ * Arm the shadow refill at SHADOW_TIMER_DIVISOR runs per lead.  The DPC
+ * re-arms itself, so a stop can tell exactly whether a run is owed.
+ * Only called after StopShadowTimer (or Init), with no run outstanding.
+ */
+void
+CMiniportWaveCyclicStreamAdLibGold::
+StartShadowTimer
+(   void
+)
+{
+    ULONG         byteRate = (1 << (m_Stereo + m_16Bit)) *
+                                 m_SamplingFrequency;
+    ULONG         periodMs = (m_DmaBufferSize / SHADOW_LEAD_DIVISOR /
+                                 SHADOW_TIMER_DIVISOR) * 1000 / byteRate;
+    LARGE_INTEGER timeDue100ns;
+    KIRQL         oldIrql;
+
+    if (periodMs < 1)
     {
-        PUNKNOWN(*Object)->AddRef();
-        return STATUS_SUCCESS;
+        periodMs = 1;
     }
 
-    return STATUS_INVALID_PARAMETER;
+    m_ShadowPeriod = -(LONGLONG)periodMs * 10000;
+
+    KeAcquireSpinLock(&m_ShadowLock, &oldIrql);
+    ASSERT(!m_ShadowArmed && !m_ShadowActive);
+    m_ShadowStopping = FALSE;
+    KeClearEvent(&m_ShadowIdle);
+    timeDue100ns.QuadPart = m_ShadowPeriod;
+    KeSetTimer(&m_ShadowTimer, timeDue100ns, &m_ShadowDpc);
+    m_ShadowArmed = TRUE;
+    KeReleaseSpinLock(&m_ShadowLock, oldIrql);
 }
 
 
 /*****************************************************************************
- * CMiniportWaveCyclicStreamAdLibGold::~CMiniportWaveCyclicStreamAdLibGold()
+ * CMiniportWaveCyclicStreamAdLibGold::StopShadowTimer()
+ *****************************************************************************
+ * Stop the shadow refill and wait for a run already under way on another
+ * CPU, so the caller may stop the shadow channel or free the stream.
+ * Harmless when the timer is not running.  PASSIVE_LEVEL.
  */
+void
 CMiniportWaveCyclicStreamAdLibGold::
-~CMiniportWaveCyclicStreamAdLibGold
+StopShadowTimer
 (   void
 )
 {
-    PAGED_CODE();
+    KIRQL   oldIrql;
+    BOOLEAN fWait;
 
-    _DbgPrintF(DEBUGLVL_VERBOSE, ("[~CMiniportWaveCyclicStreamAdLibGold]"));
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
 
-    if (m_State != KSSTATE_STOP)
+    KeAcquireSpinLock(&m_ShadowLock, &oldIrql);
+    m_ShadowStopping = TRUE;
+    if (KeCancelTimer(&m_ShadowTimer) || KeRemoveQueueDpc(&m_ShadowDpc))
     {
-        ProgramMmaStop();
+        m_ShadowArmed = FALSE;
     }
+    fWait = (BOOLEAN)(m_ShadowArmed || m_ShadowActive);
+    KeReleaseSpinLock(&m_ShadowLock, oldIrql);
 
-    if (m_Miniport)
+    if (fWait)
     {
-        if (m_Capture)
-        {
-            m_Miniport->m_CaptureAllocated = FALSE;
-        }
-        else
-        {
-            m_Miniport->m_RenderAllocated = FALSE;
-        }
-
-        m_Miniport->Release();
-        m_Miniport = NULL;
+        KeWaitForSingleObject(&m_ShadowIdle, Executive, KernelMode, FALSE, NULL);
     }
 }
 
 
 /*****************************************************************************
- * CMiniportWaveCyclicStreamAdLibGold::Init()
+ * Synchronized MMA programming context
+ *
+ * Passed to CallMmaSynchronized by SetState, ProgramMmaStart and
+ * ProgramMmaStop.
+ */
+typedef struct
+{
+    CMiniportWaveCyclicStreamAdLibGold *Stream;
+    BOOLEAN                             Reset;      /* Pulse PB_RST first   */
+    BYTE                                Format;     /* Reg 0Ch value        */
+    BYTE                                Playback;   /* Reg 09h value        */
+}
+SYNCMMACONTEXT, *PSYNCMMACONTEXT;
+
+
+/*****************************************************************************
+ * SynchronizedMmaHalt()
  *****************************************************************************
- * Initialize a stream instance.
+ * Withdraw the channel's PIO stream from ServiceWave, halt (or reset) the
+ * playback engine and write the format register, all between two passes
+ * of the service DPC.  Once this returns the DPC no longer touches the
+ * stream's FIFO state.
+ *
+ * Called via IAdapterCommon::CallMmaSynchronized().
  */
 NTSTATUS
-CMiniportWaveCyclicStreamAdLibGold::
-Init
+SynchronizedMmaHalt
 (
-    IN      CMiniportWaveCyclicAdLibGold *  Miniport,
-    IN      BOOLEAN                         Capture,
-    IN      PKSDATAFORMAT                   DataFormat
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
 )
 {
-    PAGED_CODE();
-
-    ASSERT(Miniport);
-    ASSERT(DataFormat);
+    PSYNCMMACONTEXT context = (PSYNCMMACONTEXT)DynamicContext;
 
-    _DbgPrintF(DEBUGLVL_VERBOSE, ("[CMiniportWaveCyclicStreamAdLibGold::Init]"));
+    ASSERT(context->Stream);
 
-    m_Miniport = Miniport;
-    m_Miniport->AddRef();
+    CMiniportWaveCyclicStreamAdLibGold *that = context->Stream;
+    PADAPTERCOMMON ac = that->m_Miniport->m_AdapterCommon;
 
-    PWAVEFORMATEX wfx = PWAVEFORMATEX(DataFormat + 1);
+    that->m_Miniport->m_PioStream[that->m_MmaChannel] = NULL;
 
-    m_Capture   = Capture;
-    m_16Bit     = (wfx->wBitsPerSample == 16);
-    m_Stereo    = (wfx->nChannels == 2);
-    m_State     = KSSTATE_STOP;
+    if (context->Reset)
+    {
+        ac->WriteMMAChannel(that->m_MmaChannel, MMA_REG_PLAYBACK, MMA_PB_RST);
+        KeStallExecutionProcessor(1);
+    }
+    ac->WriteMMAChannel(that->m_MmaChannel, MMA_REG_PLAYBACK, 0x00);
 
-    /* PIO state */
-    m_SoftwarePosition = 0;
-    m_DmaBufferSize    = m_Miniport->m_DmaChannel->BufferSize();
-    m_LfsrState        = 0xACE1;    /* Non-zero seed */
+    ac->WriteMMAChannel(that->m_MmaChannel, MMA_REG_FORMAT, context->Format);
 
     return STATUS_SUCCESS;
 }
 
 
 /*****************************************************************************
- * CMiniportWaveCyclicStreamAdLibGold::SetFormat()
+ * SynchronizedMmaGo()
  *****************************************************************************
- * Set the data format for this stream.  Only allowed when not running.
+ * Start the playback engine.  A PIO render stream pre-fills the (empty)
+ * FIFO first, and a PIO stream is published to ServiceWave in the same
+ * pass, so the first FIFO request finds it.
+ *
+ * Called via IAdapterCommon::CallMmaSynchronized().
  */
-STDMETHODIMP
-CMiniportWaveCyclicStreamAdLibGold::
-SetFormat
+NTSTATUS
+SynchronizedMmaGo
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    PSYNCMMACONTEXT context = (PSYNCMMACONTEXT)DynamicContext;
+
+    ASSERT(context->Stream);
+
+    CMiniportWaveCyclicStreamAdLibGold *that = context->Stream;
+
+    if (that->m_16Bit && !that->m_ShadowDma)
+    {
+        if (!that->m_Capture)
+        {
+            that->FillFifo(MMA_FIFO_SIZE);  /* FIFO is empty after reset */
+        }
+
+        that->m_Miniport->m_PioStream[that->m_MmaChannel] = that;
+    }
+
+    that->m_Miniport->m_AdapterCommon->WriteMMAChannel(
+        that->m_MmaChannel, MMA_REG_PLAYBACK, context->Playback);
+
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold non-delegating IUnknown
+ */
+STDMETHODIMP
+CMiniportWaveCyclicStreamAdLibGold::
+NonDelegatingQueryInterface
+(
+    IN      REFIID  Interface,
+    OUT     PVOID * Object
+)
+{
+    PAGED_CODE();
+
+    ASSERT(Object);
+
+    if (IsEqualGUIDAligned(Interface, IID_IUnknown))
+    {
+        *Object = PVOID((PUNKNOWN)(IMiniportWaveCyclicStream *)this);
+    }
+    else if (IsEqualGUIDAligned(Interface, IID_IMiniportWaveCyclicStream))
+    {
+        *Object = PVOID((PMINIPORTWAVECYCLICSTREAM)this);
+    }
+    else
+    {
+        *Object = NULL;
+    }
+
+    if (*Object)
+    {
+        PUNKNOWN(*Object)->AddRef();
+        return STATUS_SUCCESS;
+    }
+
+    return STATUS_INVALID_PARAMETER;
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::~CMiniportWaveCyclicStreamAdLibGold()
+ */
+CMiniportWaveCyclicStreamAdLibGold::
+~CMiniportWaveCyclicStreamAdLibGold
+(   void
+)
+{
+    PAGED_CODE();
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("[~CMiniportWaveCyclicStreamAdLibGold]"));
+
+    if (m_State != KSSTATE_STOP)
+    {
+        ProgramMmaStop();
+    }
+
+    StopShadowTimer();
+
+    if (m_Miniport)
+    {
+        if (m_Capture)
+        {
+            m_Miniport->m_CaptureAllocated = FALSE;
+        }
+        else
+        {
+            m_Miniport->m_RenderAllocated = FALSE;
+        }
+
+        m_Miniport->Release();
+        m_Miniport = NULL;
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::Init()
+ *****************************************************************************
+ * Initialize a stream instance.
+ */
+NTSTATUS
+CMiniportWaveCyclicStreamAdLibGold::
+Init
+(
+    IN      CMiniportWaveCyclicAdLibGold *  Miniport,
+    IN      BOOLEAN                         Capture,
+    IN      PKSDATAFORMAT                   DataFormat
+)
+{
+    PAGED_CODE();
+
+    ASSERT(Miniport);
+    ASSERT(DataFormat);
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("[CMiniportWaveCyclicStreamAdLibGold::Init]"));
+
+    m_Miniport = Miniport;
+    m_Miniport->AddRef();
+
+    PWAVEFORMATEX wfx = PWAVEFORMATEX(DataFormat + 1);
+
+    m_Capture   = Capture;
+    m_16Bit     = (wfx->wBitsPerSample == 16);
+    m_Stereo    = (wfx->nChannels == 2);
+    m_Adpcm     = (wfx->wFormatTag == WAVE_FORMAT_YAMAHA_ADPCM);
+    m_State     = KSSTATE_STOP;
+    m_SamplingFrequency = wfx->nSamplesPerSec;
+
+    /* Full duplex: capture runs on MMA channel 1 with its own DMA */
+    if (Capture && m_Miniport->m_FullDuplex)
+    {
+        m_MmaChannel = MMA_CHANNEL_1;
+        m_DmaChannel = m_Miniport->m_CaptureDmaChannel;
+    }
+    else
+    {
+        m_MmaChannel = MMA_CHANNEL_0;
+        m_DmaChannel = m_Miniport->m_DmaChannel;
+    }
+
+    m_NotificationBytes = 0;
+    m_BytesSinceNotify  = 0;
+
+    /* PIO state */
+    m_SoftwarePosition = 0;
+    m_DmaBufferSize    = m_DmaChannel->BufferSize();
+    m_LfsrState        = 0xACE1;    /* Non-zero seed */
+    m_FifoThreshold    = MMA_FIFO_THR_DEFAULT;
+    m_FifoChunk        = MMA_FIFO_SIZE - MMA_FIFO_THR_BYTES(MMA_FIFO_THR_DEFAULT);
+    m_FifoStamp        = 0;
+    m_LastPosition     = 0;
+
+    LARGE_INTEGER perfFrequency;
+    KeQueryPerformanceCounter(&perfFrequency);
+    m_PerfFrequency    = perfFrequency.QuadPart;
+
+    /* Shadow DMA state */
+    m_ShadowDma            = FALSE;
+    m_ShadowWritePosition  = 0;
+    m_ShadowPeriod         = 0;
+    m_ShadowArmed          = FALSE;
+    m_ShadowStopping       = TRUE;      /* Not started */
+    m_ShadowActive         = 0;
+    KeInitializeSpinLock(&m_ShadowLock);
+    KeInitializeEvent(&m_ShadowIdle, NotificationEvent, FALSE);
+    KeInitializeDpc(&m_ShadowDpc, WaveShadowTimerDPC, PVOID(this));
+    KeInitializeTimer(&m_ShadowTimer);
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::SetFormat()
+ *****************************************************************************
+ * Set the data format for this stream.  Only allowed when not running.
+ */
+STDMETHODIMP
+CMiniportWaveCyclicStreamAdLibGold::
+SetFormat
 (
     IN      PKSDATAFORMAT   Format
 )
@@ -1172,18 +1753,25 @@ SetFormat
         PWAVEFORMATEX wfx = PWAVEFORMATEX(Format + 1);
 
         /*
-         * Full-duplex constraint: if the other direction is active,
-         * the sample rate must match.
+         * Half-duplex constraint: if the other direction shares channel 0
+         * and is active, the sample rate must match.
          */
-        if ((m_Miniport->m_CaptureAllocated && m_Miniport->m_RenderAllocated) &&
-            (m_Miniport->m_SamplingFrequency != wfx->nSamplesPerSec))
+        if (!m_Miniport->m_FullDuplex &&
+            (m_Miniport->m_CaptureAllocated && m_Miniport->m_RenderAllocated) &&
+            (m_SamplingFrequency != wfx->nSamplesPerSec))
         {
             return STATUS_INVALID_PARAMETER;
         }
 
         m_16Bit  = (wfx->wBitsPerSample == 16);
         m_Stereo = (wfx->nChannels == 2);
-        m_Miniport->m_SamplingFrequency = wfx->nSamplesPerSec;
+        m_Adpcm  = (wfx->wFormatTag == WAVE_FORMAT_YAMAHA_ADPCM);
+        m_SamplingFrequency = wfx->nSamplesPerSec;
+
+        if (!m_Miniport->m_FullDuplex)
+        {
+            m_Miniport->m_SamplingFrequency = m_SamplingFrequency;
+        }
     }
 
     return ntStatus;
@@ -1210,6 +1798,10 @@ SetState
         ("[CMiniportWaveCyclicStreamAdLibGold::SetState %d -> %d]",
          m_State, NewState));
 
+    m_Miniport->m_AdapterCommon->TraceEvent(ADLIBGOLD_TRACE_STREAM_STATE,
+        NewState, m_Capture ? ADLIBGOLD_TRACE_STREAM_WAVE_CAPTURE :
+                              ADLIBGOLD_TRACE_STREAM_WAVE_RENDER);
+
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
     /*
@@ -1227,32 +1819,57 @@ SetState
         case KSSTATE_PAUSE:
             if (m_State == KSSTATE_RUN)
             {
+                ULONG position;
+
                 /*
-                 * Stop playback/recording.  Clear GO bit in reg 09h.
+                 * Latch the position while still running; it is held
+                 * for the whole pause.
                  */
-                m_Miniport->m_AdapterCommon->WriteMMA(MMA_REG_PLAYBACK, 0x00);
-
-                if (!m_16Bit)
-                {
-                    /* 8-bit DMA mode: stop the DMA channel */
-                    m_Miniport->m_DmaChannel->Stop();
-                }
+                GetPosition(&position);
 
                 /*
-                 * Mask FIFO interrupt to avoid spurious interrupts while paused.
+                 * Stop playback/recording: clear the GO bit in reg 09h and
+                 * mask the FIFO interrupt to avoid spurious interrupts
+                 * while paused.
                  */
-                BYTE fmtReg = (BYTE)(
+                SYNCMMACONTEXT context;
+                context.Stream   = this;
+                context.Reset    = FALSE;
+                context.Format   = (BYTE)(
                     ((m_16Bit ? MMA_DATA_FMT_12B_2 : MMA_DATA_FMT_8BIT)
                         << MMA_FMT_DATA_SHIFT) |
-                    (MMA_FIFO_THR_DEFAULT << MMA_FMT_FIFO_SHIFT) |
+                    (m_FifoThreshold << MMA_FMT_FIFO_SHIFT) |
                     MMA_FMT_MSK);   /* Mask FIFO IRQ */
+                context.Playback = 0x00;
+
+                if (!m_16Bit || m_ShadowDma)
+                {
+                    context.Format |= MMA_FMT_ENB;  /* Keep DMA mode flag */
+                }
 
-                if (!m_16Bit)
+                m_Miniport->m_AdapterCommon->CallMmaSynchronized(
+                    SynchronizedMmaHalt, PVOID(&context));
+
+                /*
+                 * PIO render: the FIFO is reset on resume, so restart
+                 * from what was actually played rather than written.
+                 */
+                if (m_16Bit && !m_ShadowDma && !m_Capture)
                 {
-                    fmtReg |= MMA_FMT_ENB;     /* Keep DMA mode flag */
+                    m_SoftwarePosition = position;
                 }
 
-                m_Miniport->m_AdapterCommon->WriteMMA(MMA_REG_FORMAT, fmtReg);
+                if (m_ShadowDma)
+                {
+                    /* 16-bit shadow mode: stop refilling, then the DMA */
+                    StopShadowTimer();
+                    m_Miniport->m_ShadowDmaChannel->Stop();
+                }
+                else if (!m_16Bit)
+                {
+                    /* 8-bit DMA mode: stop the DMA channel */
+                    m_DmaChannel->Stop();
+                }
             }
             break;
 
@@ -1286,24 +1903,44 @@ ProgramMmaStart
     PADAPTERCOMMON ac = m_Miniport->m_AdapterCommon;
 
     /*
-     * Reset the MMA playback/record engine.
+     * Program register 0Ch (format, FIFO threshold, DMA/PIO mode).
      */
-    ac->WriteMMA(MMA_REG_PLAYBACK, MMA_PB_RST);
-    KeStallExecutionProcessor(1);
-    ac->WriteMMA(MMA_REG_PLAYBACK, 0x00);
+    SelectFifoThreshold();
 
     /*
-     * Program register 0Ch (format, FIFO threshold, DMA/PIO mode).
+     * 16-bit render goes over DMA when the shadow buffer can hold the
+     * whole client buffer, so shadow offsets equal client offsets.
      */
+    m_DmaBufferSize = m_DmaChannel->BufferSize();
+    BOOLEAN wasPio  = (BOOLEAN)(m_16Bit && !m_ShadowDma);
+    m_ShadowDma = (BOOLEAN)(
+        m_16Bit && !m_Capture && m_Miniport->m_ShadowDmaChannel &&
+        (m_DmaBufferSize <=
+            m_Miniport->m_ShadowDmaChannel->AllocatedBufferSize()));
+
     BYTE fmtReg = (BYTE)(
-        (MMA_FIFO_THR_DEFAULT << MMA_FMT_FIFO_SHIFT));
+        (m_FifoThreshold << MMA_FMT_FIFO_SHIFT));
 
-    if (m_16Bit)
+    if (m_ShadowDma)
+    {
+        /* 16-bit: DMA mode — hardware reads pre-dithered format 2 data */
+        fmtReg |= (MMA_DATA_FMT_12B_2 << MMA_FMT_DATA_SHIFT);
+        fmtReg |= MMA_FMT_ENB;         /* DMA enabled */
+        fmtReg |= MMA_FMT_MSK;         /* Mask FIFO IRQ (DMA handles flow) */
+    }
+    else if (m_16Bit)
     {
         /* 16-bit: PIO mode — software fills FIFO with dithered data */
         fmtReg |= (MMA_DATA_FMT_12B_2 << MMA_FMT_DATA_SHIFT);
         /* ENB=0 (PIO), MSK=0 (FIFO interrupt enabled) */
     }
+    else if (m_Adpcm)
+    {
+        /* ADPCM: DMA mode — MMA decodes/encodes the 4-bit codes */
+        fmtReg |= (MMA_DATA_FMT_ADPCM << MMA_FMT_DATA_SHIFT);
+        fmtReg |= MMA_FMT_ENB;         /* DMA enabled */
+        fmtReg |= MMA_FMT_MSK;         /* Mask FIFO IRQ (DMA handles flow) */
+    }
     else
     {
         /* 8-bit: DMA mode — hardware transfers directly */
@@ -1312,20 +1949,48 @@ ProgramMmaStart
         fmtReg |= MMA_FMT_MSK;         /* Mask FIFO IRQ (DMA handles flow) */
     }
 
-    ac->WriteMMA(MMA_REG_FORMAT, fmtReg);
+    /*
+     * Reset the MMA playback/record engine and program the format.
+     */
+    SYNCMMACONTEXT context;
+    context.Stream   = this;
+    context.Reset    = TRUE;
+    context.Format   = fmtReg;
+    context.Playback = 0x00;
+
+    ac->CallMmaSynchronized(SynchronizedMmaHalt, PVOID(&context));
 
     /*
-     * For 16-bit PIO mode: reset software position and pre-fill FIFO.
+     * For 16-bit shadow mode: dither the lead into the shadow buffer,
+     * which PortCls pre-filled in the client buffer before RUN, and start
+     * the DMA from the shadow channel.
      */
-    if (m_16Bit)
+    if (m_ShadowDma)
     {
-        m_SoftwarePosition = 0;
-        m_DmaBufferSize    = m_Miniport->m_DmaChannel->BufferSize();
+        PDMACHANNELSLAVE shadow = m_Miniport->m_ShadowDmaChannel;
+
+        shadow->SetBufferSize(m_DmaBufferSize);
 
-        if (!m_Capture)
+        m_ShadowWritePosition = 0;
+        FillShadow(m_DmaBufferSize / SHADOW_LEAD_DIVISOR);
+
+        shadow->Start(m_DmaBufferSize, TRUE);
+        StartShadowTimer();
+    }
+
+    /*
+     * For 16-bit PIO mode: continue from the position held over a pause
+     * (zero after STOP).  The FIFO is pre-filled as the engine starts.
+     */
+    else if (m_16Bit)
+    {
+        if (!wasPio || (m_SoftwarePosition >= m_DmaBufferSize))
         {
-            FillFifo();     /* Pre-fill before starting */
+            m_SoftwarePosition = 0;
         }
+        m_LastPosition = m_SoftwarePosition;
+        m_BytesSinceNotify = 0;
+        m_FifoStamp = KeQueryPerformanceCounter(NULL).QuadPart;
     }
 
     /*
@@ -1333,24 +1998,36 @@ ProgramMmaStart
      * Second parameter: TRUE = write-to-device (playback),
      *                   FALSE = read-from-device (capture).
      */
+    if (!m_16Bit || m_ShadowDma)
+    {
+        /* DMA always restarts at the top of the buffer */
+        m_LastPosition = 0;
+    }
+
     if (!m_16Bit)
     {
-        m_Miniport->m_DmaChannel->Start(
-            m_Miniport->m_DmaChannel->BufferSize(),
+        m_DmaChannel->Start(
+            m_DmaChannel->BufferSize(),
             !m_Capture);
     }
 
     /*
      * Program register 09h to start playback or recording.
      */
-    BYTE pbReg = MMA_PB_PCM | MMA_PB_GO;   /* PCM mode, start */
+    BYTE pbReg = MMA_PB_GO;                /* Start */
+
+    /* PCM=0 selects the MMA's ADPCM codec */
+    if (!m_Adpcm)
+    {
+        pbReg |= MMA_PB_PCM;
+    }
 
     /* Enable left and right channels */
     pbReg |= MMA_PB_LEFT | MMA_PB_RIGHT;
 
     /* Frequency select */
     BYTE freqBits = CMiniportWaveCyclicAdLibGold::SampleRateToFreqBits(
-        m_Miniport->m_SamplingFrequency);
+        m_SamplingFrequency);
     pbReg |= (freqBits << MMA_PB_FREQ_SHIFT);
 
     /* Playback vs. record */
@@ -1359,13 +2036,16 @@ ProgramMmaStart
         pbReg |= MMA_PB_PLAYBACK;
     }
 
-    ac->WriteMMA(MMA_REG_PLAYBACK, pbReg);
+    context.Playback = pbReg;
+
+    ac->CallMmaSynchronized(SynchronizedMmaGo, PVOID(&context));
 
     _DbgPrintF(DEBUGLVL_VERBOSE,
-        ("ProgramMmaStart: fmt=0x%02X pb=0x%02X rate=%d %s %s",
+        ("ProgramMmaStart: fmt=0x%02X pb=0x%02X rate=%d chunk=%d %s %s",
          (ULONG)fmtReg, (ULONG)pbReg,
-         m_Miniport->m_SamplingFrequency,
-         m_16Bit ? "16bit-PIO" : "8bit-DMA",
+         m_SamplingFrequency, m_FifoChunk,
+         m_ShadowDma ? "16bit-DMA" :
+             (m_16Bit ? "16bit-PIO" : (m_Adpcm ? "ADPCM-DMA" : "8bit-DMA")),
          m_Capture ? "capture" : "render"));
 }
 
@@ -1381,23 +2061,65 @@ ProgramMmaStop
 (   void
 )
 {
-    PADAPTERCOMMON ac = m_Miniport->m_AdapterCommon;
-
-    /* Reset the MMA engine */
-    ac->WriteMMA(MMA_REG_PLAYBACK, MMA_PB_RST);
-    KeStallExecutionProcessor(1);
-    ac->WriteMMA(MMA_REG_PLAYBACK, 0x00);
+    /* Reset the MMA engine, mask FIFO interrupt and disable DMA */
+    SYNCMMACONTEXT context;
+    context.Stream   = this;
+    context.Reset    = TRUE;
+    context.Format   = MMA_FMT_MSK;
+    context.Playback = 0x00;
 
-    /* Mask FIFO interrupt and disable DMA */
-    ac->WriteMMA(MMA_REG_FORMAT, MMA_FMT_MSK);
+    m_Miniport->m_AdapterCommon->CallMmaSynchronized(
+        SynchronizedMmaHalt, PVOID(&context));
 
-    /* Stop DMA channel if it was running (8-bit mode) */
-    if (!m_16Bit)
+    /* Stop DMA channel if it was running (8-bit or 16-bit shadow mode) */
+    if (m_ShadowDma)
     {
-        m_Miniport->m_DmaChannel->Stop();
+        StopShadowTimer();
+        m_Miniport->m_ShadowDmaChannel->Stop();
+    }
+    else if (!m_16Bit)
+    {
+        m_DmaChannel->Stop();
     }
 
     m_SoftwarePosition = 0;
+    m_LastPosition     = 0;
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::SelectFifoThreshold()
+ *****************************************************************************
+ * Choose the FIFO interrupt threshold for the current format and rate.
+ *
+ * The threshold trades interrupt rate against underrun margin: the lower
+ * the level, the larger each refill and the fewer interrupts, but the less
+ * time the service DPC has to respond.  Take the lowest level that still covers
+ * the miniport's headroom (MMA_FIFO_HEADROOM_US, raised by underruns) at
+ * this stream's byte rate.  At the default 300us that is 16 bytes left
+ * for 22kHz 8-bit mono (7 needed) and 64 for 44.1kHz 16-bit stereo (53).
+ */
+void
+CMiniportWaveCyclicStreamAdLibGold::
+SelectFifoThreshold
+(   void
+)
+{
+    ULONG bytesPerFrame = (1 << (m_Stereo + m_16Bit));
+    ULONG byteRate      = bytesPerFrame * m_SamplingFrequency;
+    ULONG needed        = (byteRate * m_Miniport->m_HeadroomUs + 999999) / 1000000;
+    BYTE  threshold     = MMA_FIFO_THR_16;
+
+    while ((threshold > MMA_FIFO_THR_112) &&
+           ((ULONG)MMA_FIFO_THR_BYTES(threshold) < needed))
+    {
+        threshold--;
+    }
+
+    m_FifoThreshold = threshold;
+
+    /* Every level is a multiple of 16, so the chunk never splits a frame */
+    m_FifoChunk = MMA_FIFO_SIZE - MMA_FIFO_THR_BYTES(threshold);
 }
 
 
@@ -1407,45 +2129,56 @@ ProgramMmaStop
  * 16-bit playback PIO: read samples from DMA buffer, apply TPDF dither,
  * truncate to 12-bit, write byte pairs to FIFO.
  *
- * Called from the DPC (via PortCls notification) or during pre-fill.
- * Writes up to MMA_FIFO_SIZE bytes to the FIFO.
+ * Called from ServiceFifo at the FIFO interrupt, or during pre-fill.
+ * Writes Count bytes (at most MMA_FIFO_SIZE) to the FIFO.
  */
 #pragma code_seg()
 
 void
 CMiniportWaveCyclicStreamAdLibGold::
 FillFifo
-(   void
+(
+    IN      ULONG   Count
 )
 {
     PADAPTERCOMMON ac = m_Miniport->m_AdapterCommon;
-    PUCHAR pBuffer = (PUCHAR)m_Miniport->m_DmaChannel->SystemAddress();
+    PUCHAR pBuffer = (PUCHAR)m_DmaChannel->SystemAddress();
 
     if (!pBuffer)
         return;
 
     /*
-     * Write up to one FIFO's worth of bytes.
+     * Stage up to one FIFO's worth of bytes, then burst them out.
      * For 16-bit stereo at format 2, each sample frame = 4 bytes (2 per channel).
      * For 16-bit mono, each frame = 2 bytes.
      */
-    ULONG bytesToWrite = MMA_FIFO_SIZE;
+    BYTE  staging[MMA_FIFO_SIZE];
+    ULONG bytesToWrite = (Count > MMA_FIFO_SIZE) ? MMA_FIFO_SIZE : Count;
     ULONG bytesWritten = 0;
+    ULONG chunk;
+
+    ac->TraceEvent(ADLIBGOLD_TRACE_FIFO_START, Count,
+                   ADLIBGOLD_TRACE_STREAM_WAVE_RENDER);
 
     while (bytesWritten < bytesToWrite)
     {
-        /* Read a 16-bit sample from the cyclic buffer */
-        SHORT sample = *((SHORT *)(pBuffer + m_SoftwarePosition));
-
-        /* Apply TPDF dither and truncate to 12-bit */
-        SHORT dithered = DitherSample(sample, &m_LfsrState);
+        /*
+         * Dither the contiguous run up to the buffer wrap in one pass.
+         * Output and input are both 2 bytes per 16-bit sample.
+         */
+        chunk = bytesToWrite - bytesWritten;
+        if (chunk > m_DmaBufferSize - m_SoftwarePosition)
+        {
+            chunk = m_DmaBufferSize - m_SoftwarePosition;
+        }
 
-        /* Write in format 2 byte order: low byte first, high byte second */
-        ac->WriteMMA(MMA_REG_PCM_DATA, (BYTE)(dithered & 0xFF));
-        ac->WriteMMA(MMA_REG_PCM_DATA, (BYTE)((dithered >> 8) & 0xFF));
+        DitherBlock(staging + bytesWritten,
+                    (const SHORT *)(pBuffer + m_SoftwarePosition),
+                    chunk / 2,
+                    &m_LfsrState);
 
-        m_SoftwarePosition += 2;    /* 2 bytes per 16-bit sample */
-        bytesWritten += 2;
+        m_SoftwarePosition += chunk;
+        bytesWritten += chunk;
 
         /* Wrap at buffer end */
         if (m_SoftwarePosition >= m_DmaBufferSize)
@@ -1453,6 +2186,14 @@ FillFifo
             m_SoftwarePosition = 0;
         }
     }
+
+    ac->WriteMMABurst(m_MmaChannel, MMA_REG_PCM_DATA, staging, bytesWritten);
+
+    ac->TraceEvent(ADLIBGOLD_TRACE_FIFO_END, bytesWritten,
+                   ADLIBGOLD_TRACE_STREAM_WAVE_RENDER);
+
+    /* The FIFO is full again from here; GetPosition times its drain */
+    m_FifoStamp = KeQueryPerformanceCounter(NULL).QuadPart;
 }
 
 
@@ -1461,40 +2202,325 @@ FillFifo
  *****************************************************************************
  * 16-bit capture PIO: read byte pairs from FIFO, store as 16-bit in buffer.
  * Lower 4 bits are zero (12-bit hardware resolution).
+ * Reads Count bytes (at most MMA_FIFO_SIZE) from the FIFO.
  */
 void
 CMiniportWaveCyclicStreamAdLibGold::
 DrainFifo
-(   void
+(
+    IN      ULONG   Count
 )
 {
     PADAPTERCOMMON ac = m_Miniport->m_AdapterCommon;
-    PUCHAR pBuffer = (PUCHAR)m_Miniport->m_DmaChannel->SystemAddress();
+    PUCHAR pBuffer = (PUCHAR)m_DmaChannel->SystemAddress();
 
     if (!pBuffer)
         return;
 
-    ULONG bytesToRead = MMA_FIFO_SIZE;
+    ULONG bytesToRead = (Count > MMA_FIFO_SIZE) ? MMA_FIFO_SIZE : Count;
     ULONG bytesRead = 0;
+    ULONG chunk;
+
+    ac->TraceEvent(ADLIBGOLD_TRACE_FIFO_START, Count,
+                   ADLIBGOLD_TRACE_STREAM_WAVE_CAPTURE);
 
     while (bytesRead < bytesToRead)
     {
-        /* Read format 2 byte pair from FIFO */
-        BYTE lo = ac->ReadMMA(MMA_REG_PCM_DATA);
-        BYTE hi = ac->ReadMMA(MMA_REG_PCM_DATA);
+        /*
+         * Format 2 byte pairs land in the cyclic buffer as 16-bit samples
+         * unchanged, so burst straight in, split only at the wrap.
+         */
+        chunk = bytesToRead - bytesRead;
+        if (chunk > m_DmaBufferSize - m_SoftwarePosition)
+        {
+            chunk = m_DmaBufferSize - m_SoftwarePosition;
+        }
 
-        /* Store as 16-bit in the cyclic buffer */
-        pBuffer[m_SoftwarePosition]     = lo;
-        pBuffer[m_SoftwarePosition + 1] = hi;
+        ac->ReadMMABurst(m_MmaChannel, MMA_REG_PCM_DATA,
+                         pBuffer + m_SoftwarePosition, chunk);
 
-        m_SoftwarePosition += 2;
-        bytesRead += 2;
+        m_SoftwarePosition += chunk;
+        bytesRead += chunk;
 
         if (m_SoftwarePosition >= m_DmaBufferSize)
         {
             m_SoftwarePosition = 0;
         }
     }
+
+    ac->TraceEvent(ADLIBGOLD_TRACE_FIFO_END, bytesRead,
+                   ADLIBGOLD_TRACE_STREAM_WAVE_CAPTURE);
+
+    m_FifoStamp = KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::ServiceFifo()
+ *****************************************************************************
+ * FIFO threshold interrupt for a 16-bit PIO stream.  At the interrupt the
+ * FIFO holds (play) or lacks (record) exactly MMA_FIFO_THR_BYTES of data, so
+ * one chunk fills or empties it without overrunning or polling.
+ *
+ * If more time passed since the last service than a whole FIFO lasts,
+ * it ran dry (play) or overflowed (record) in between.
+ *
+ * Returns TRUE once a notification period's worth of bytes has moved
+ * since the last time it did.
+ */
+BOOLEAN
+CMiniportWaveCyclicStreamAdLibGold::
+ServiceFifo
+(   void
+)
+{
+    LONGLONG elapsed  = KeQueryPerformanceCounter(NULL).QuadPart - m_FifoStamp;
+    ULONG    byteRate = (1 << (m_Stereo + m_16Bit)) *
+                            m_SamplingFrequency;
+
+    if (elapsed * byteRate > (LONGLONG)MMA_FIFO_SIZE * m_PerfFrequency)
+    {
+        ReportUnderrun();
+    }
+
+    if (m_Capture)
+    {
+        DrainFifo(m_FifoChunk);
+    }
+    else
+    {
+        FillFifo(m_FifoChunk);
+    }
+
+    m_Miniport->m_AdapterCommon->CountPerfEvent(ADLIBGOLD_PERF_FIFO_REFILL, 1);
+    m_Miniport->m_AdapterCommon->CountPerfEvent(ADLIBGOLD_PERF_FIFO_BYTES, m_FifoChunk);
+
+    m_BytesSinceNotify += m_FifoChunk;
+
+    if (m_BytesSinceNotify < m_NotificationBytes)
+    {
+        return FALSE;
+    }
+
+    m_BytesSinceNotify = 0;
+    return TRUE;
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::ReportUnderrun()
+ *****************************************************************************
+ * Adapt the profile after an underrun (or record overrun): double the FIFO
+ * headroom and grow the latency target by half.  Both apply from the next
+ * RUN and the next stream respectively; nothing is reprogrammed mid-stream.
+ */
+void
+CMiniportWaveCyclicStreamAdLibGold::
+ReportUnderrun
+(   void
+)
+{
+    CMiniportWaveCyclicAdLibGold * miniport = m_Miniport;
+
+    miniport->m_Underruns++;
+    miniport->m_AdapterCommon->CountPerfEvent(m_Capture ?
+        ADLIBGOLD_PERF_FIFO_OVERRUN : ADLIBGOLD_PERF_FIFO_UNDERRUN, 1);
+
+    if (miniport->m_HeadroomUs < MMA_FIFO_HEADROOM_MAX_US)
+    {
+        miniport->m_HeadroomUs *= 2;
+        if (miniport->m_HeadroomUs > MMA_FIFO_HEADROOM_MAX_US)
+        {
+            miniport->m_HeadroomUs = MMA_FIFO_HEADROOM_MAX_US;
+        }
+    }
+
+    if (miniport->m_LatencyMs && (miniport->m_LatencyMs < WAVE_LATENCY_MAX_MS))
+    {
+        miniport->m_LatencyMs += (miniport->m_LatencyMs + 1) / 2;
+        if (miniport->m_LatencyMs > WAVE_LATENCY_MAX_MS)
+        {
+            miniport->m_LatencyMs = WAVE_LATENCY_MAX_MS;
+        }
+    }
+
+    _DbgPrintF(DEBUGLVL_VERBOSE,
+        ("ReportUnderrun: #%d, headroom %d us, latency %d ms",
+         miniport->m_Underruns, miniport->m_HeadroomUs, miniport->m_LatencyMs));
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::FillShadow()
+ *****************************************************************************
+ * 16-bit render DMA: dither Count bytes of the client buffer into the same
+ * offsets of the shadow buffer, starting at the shadow write position.
+ */
+void
+CMiniportWaveCyclicStreamAdLibGold::
+FillShadow
+(
+    IN      ULONG   Count
+)
+{
+    PUCHAR pClient = (PUCHAR)m_DmaChannel->SystemAddress();
+    PUCHAR pShadow = (PUCHAR)m_Miniport->m_ShadowDmaChannel->SystemAddress();
+    ULONG  chunk;
+
+    if (!pClient || !pShadow)
+        return;
+
+    while (Count)
+    {
+        chunk = Count;
+        if (chunk > m_DmaBufferSize - m_ShadowWritePosition)
+        {
+            chunk = m_DmaBufferSize - m_ShadowWritePosition;
+        }
+
+        DitherBlock(pShadow + m_ShadowWritePosition,
+                    (const SHORT *)(pClient + m_ShadowWritePosition),
+                    chunk / 2,
+                    &m_LfsrState);
+
+        m_ShadowWritePosition += chunk;
+        Count -= chunk;
+
+        if (m_ShadowWritePosition >= m_DmaBufferSize)
+        {
+            m_ShadowWritePosition = 0;
+        }
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::ServiceShadow()
+ *****************************************************************************
+ * Shadow timer: top the shadow buffer back up to the lead ahead of the DMA
+ * pointer.  We never fill further than the lead, so finding more than that
+ * ahead means the DMA overtook the write position; restart from the DMA.
+ */
+void
+CMiniportWaveCyclicStreamAdLibGold::
+ServiceShadow
+(   void
+)
+{
+    PDMACHANNELSLAVE shadow = m_Miniport->m_ShadowDmaChannel;
+    ULONG lead = (m_DmaBufferSize / SHADOW_LEAD_DIVISOR) & ~3UL;
+    ULONG transferCount;
+    ULONG dmaPosition;
+    ULONG ahead;
+
+    if (!m_ShadowDma || !shadow)
+        return;
+
+    transferCount = shadow->TransferCount();
+    if (!transferCount)
+        return;
+
+    dmaPosition = (transferCount - shadow->ReadCounter()) & ~3UL;
+    if (dmaPosition >= m_DmaBufferSize)
+    {
+        dmaPosition = 0;
+    }
+
+    ahead = (m_ShadowWritePosition + m_DmaBufferSize - dmaPosition) %
+                m_DmaBufferSize;
+
+    if (ahead > lead)
+    {
+        _DbgPrintF(DEBUGLVL_VERBOSE, ("ServiceShadow: underrun at %d", dmaPosition));
+        ReportUnderrun();
+        m_ShadowWritePosition = dmaPosition;
+        ahead = 0;
+    }
+
+    FillShadow(lead - ahead);
+}
+
+
+/*****************************************************************************
+ * CMiniportWaveCyclicStreamAdLibGold::EstimatePosition()
+ *****************************************************************************
+ * Byte offset in the client buffer of the sample the hardware is playing
+ * (render) or the last sample it has delivered (record).
+ *
+ * DMA mode: read the live ISA DMA counter.  On render the DMA runs ahead
+ * of the DAC by what sits in the FIFO, which is never less than the
+ * threshold level, so step back by that much.
+ * 16-bit PIO render: the write pointer less the FIFO contents.  The FIFO
+ * was full at the last fill and drains at the byte rate, so time it with
+ * the performance counter.
+ * 16-bit PIO record: the drain pointer; FIFO data is not yet in the buffer.
+ */
+ULONG
+CMiniportWaveCyclicStreamAdLibGold::
+EstimatePosition
+(   void
+)
+{
+    ULONG bytesPerFrame = (1 << (m_Stereo + m_16Bit));
+    ULONG size          = m_DmaBufferSize;
+    ULONG position;
+    ULONG inFifo;
+
+    if (!size)
+        return 0;
+
+    if (m_16Bit && !m_ShadowDma)
+    {
+        if (m_Capture)
+            return m_SoftwarePosition;
+
+        LONGLONG elapsed =
+            KeQueryPerformanceCounter(NULL).QuadPart - m_FifoStamp;
+
+        if ((elapsed < 0) || (elapsed > m_PerfFrequency))
+        {
+            elapsed = m_PerfFrequency;  /* Long gone; also bounds the math */
+        }
+
+        ULONG played = (ULONG)(elapsed * (bytesPerFrame *
+                                          m_SamplingFrequency) /
+                               m_PerfFrequency);
+
+        inFifo = (played < MMA_FIFO_SIZE) ? (MMA_FIFO_SIZE - played) : 0;
+        position = m_SoftwarePosition;
+    }
+    else
+    {
+        /*
+         * The shadow buffer mirrors the client buffer byte for byte, so
+         * its DMA position is the client position.
+         */
+        PDMACHANNELSLAVE dma = m_ShadowDma ?
+                                   m_Miniport->m_ShadowDmaChannel :
+                                   m_DmaChannel;
+        ULONG transferCount = dma ? dma->TransferCount() : 0;
+
+        if (!transferCount)
+            return m_LastPosition;
+
+        position = (transferCount - dma->ReadCounter()) % size;
+        inFifo   = m_Capture ? 0 : MMA_FIFO_THR_BYTES(m_FifoThreshold);
+    }
+
+    if (inFifo > size)
+    {
+        inFifo = 0;
+    }
+
+    position = (position + size - inFifo) % size;
+
+    /* ADPCM packs two frames per byte per channel; it stays byte aligned */
+    if (!m_Adpcm)
+    {
+        position -= position % bytesPerFrame;
+    }
+
+    return position;
 }
 
 
@@ -1504,8 +2530,13 @@ DrainFifo
  * Return the current byte position in the DMA buffer.
  * Called at DISPATCH_LEVEL — must be non-paged.
  *
- * 8-bit DMA mode: read from ISA DMA counter.
- * 16-bit PIO mode: return software-tracked position.
+ * Monotonic: an estimate that would step backwards (timing jitter, or an
+ * 8237 counter read straddling a byte) repeats the last position instead.
+ * Such a step is never more than a FIFO's worth, so only that close
+ * behind counts as backwards; any other reading is forward progress.  A
+ * low-latency buffer is only two notification periods, so a late call
+ * can legitimately find it more than half way round.
+ * Outside RUN the position is held.
  */
 STDMETHODIMP
 CMiniportWaveCyclicStreamAdLibGold::
@@ -1516,38 +2547,26 @@ GetPosition
 {
     ASSERT(Position);
 
-    if (m_16Bit)
+    if ((m_State == KSSTATE_RUN) && m_DmaBufferSize)
     {
-        /*
-         * PIO mode: software position tracks where we've read/written.
-         */
-        *Position = m_SoftwarePosition;
-    }
-    else
-    {
-        /*
-         * DMA mode: position = BufferSize - bytes remaining.
-         */
-        if (m_Miniport->m_DmaChannel)
-        {
-            ULONG transferCount = m_Miniport->m_DmaChannel->TransferCount();
+        ULONG position = EstimatePosition();
+        ULONG advance  = (position + m_DmaBufferSize - m_LastPosition) %
+                             m_DmaBufferSize;
+        ULONG jitter   = MMA_FIFO_SIZE;
 
-            if (transferCount)
-            {
-                ULONG counter = m_Miniport->m_DmaChannel->ReadCounter();
-                *Position = (counter != 0) ? (transferCount - counter) : 0;
-            }
-            else
-            {
-                *Position = 0;
-            }
+        if (jitter > m_DmaBufferSize / 2)
+        {
+            jitter = m_DmaBufferSize / 2;
         }
-        else
+
+        if (advance <= m_DmaBufferSize - jitter)
         {
-            *Position = 0;
+            m_LastPosition = position;
         }
     }
 
+    *Position = m_LastPosition;
+
     return STATUS_SUCCESS;
 }
 
@@ -1565,11 +2584,21 @@ NormalizePhysicalPosition
     IN OUT  PLONGLONG   PhysicalPosition
 )
 {
+    if (m_Adpcm)
+    {
+        /* Two frames per byte per channel */
+        *PhysicalPosition =
+            (_100NS_UNITS_PER_SECOND * 2 / (1 + m_Stereo) * *PhysicalPosition) /
+                m_SamplingFrequency;
+
+        return STATUS_SUCCESS;
+    }
+
     ULONG bytesPerFrame = (1 << (m_Stereo + m_16Bit));
 
     *PhysicalPosition =
         (_100NS_UNITS_PER_SECOND / bytesPerFrame * *PhysicalPosition) /
-            m_Miniport->m_SamplingFrequency;
+            m_SamplingFrequency;
 
     return STATUS_SUCCESS;
 }
@@ -1582,6 +2611,7 @@ NormalizePhysicalPosition
  * Called at DISPATCH_LEVEL — must be non-paged.
  * 8-bit unsigned PCM: 0x80 is silence.
  * 16-bit signed PCM: 0x00 is silence.
+ * ADPCM: 0x80 codes alternate +/- the smallest step, so hold the level.
  */
 STDMETHODIMP_(void)
 CMiniportWaveCyclicStreamAdLibGold::
@@ -1601,6 +2631,10 @@ Silence
  * CMiniportWaveCyclicStreamAdLibGold::SetNotificationFreq()
  *****************************************************************************
  * Set the notification interval and return the framing size.
+ *
+ * Under a low-latency profile the interval is the profile's period, not
+ * PortCls's request.  Either way it is at least one full FIFO's worth of
+ * audio, so every notification covers at least one FIFO interrupt.
  */
 STDMETHODIMP_(ULONG)
 CMiniportWaveCyclicStreamAdLibGold::
@@ -1616,13 +2650,38 @@ SetNotificationFreq
         ("[CMiniportWaveCyclicStreamAdLibGold::SetNotificationFreq %d ms]",
          Interval));
 
+    ULONG byteRate = m_Adpcm ?
+        ((1 + m_Stereo) * m_SamplingFrequency / 2) :
+        ((1 << (m_Stereo + m_16Bit)) * m_SamplingFrequency);
+    ULONG minInterval = (MMA_FIFO_SIZE * 1000 + byteRate - 1) / byteRate;
+
+    if (m_Miniport->m_LatencyMs)
+    {
+        Interval = m_Miniport->m_LatencyMs / WAVE_LATENCY_PERIODS;
+    }
+    if (Interval < minInterval)
+    {
+        Interval = minInterval;
+    }
+
     m_Miniport->m_NotificationInterval = Interval;
 
-    ULONG bytesPerFrame = (1 << (m_Stereo + m_16Bit));
+    if (m_Adpcm)
+    {
+        *FramingSize =
+            (1 + m_Stereo) *
+            (m_SamplingFrequency * Interval / 1000) / 2;
+    }
+    else
+    {
+        ULONG bytesPerFrame = (1 << (m_Stereo + m_16Bit));
+
+        *FramingSize =
+            bytesPerFrame *
+            (m_SamplingFrequency * Interval / 1000);
+    }
 
-    *FramingSize =
-        bytesPerFrame *
-        (m_Miniport->m_SamplingFrequency * Interval / 1000);
+    m_NotificationBytes = *FramingSize;
 
     return m_Miniport->m_NotificationInterval;
 }
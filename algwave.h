@@ -3,8 +3,8 @@
  *****************************************************************************
  *
  * WaveCyclic miniport for YMZ263 (MMA) digital audio.  Supports 8-bit
- * PCM via DMA and 16-bit PCM via PIO with TPDF dithering for clean
- * 16-bit to 12-bit conversion.
+ * PCM and 4-bit Yamaha ADPCM via DMA, and 16-bit PCM with TPDF dithering
+ * for clean 16-bit to 12-bit conversion.
  */
 
 #ifndef _ALGWAVE_PRIVATE_H_
@@ -70,6 +70,12 @@
 #define MMA_DATA_FMT_12B_1  1
 #define MMA_DATA_FMT_12B_2  2       /* Use this for 16-bit Windows PCM       */
 
+/*
+ * In ADPCM mode (reg 09h PCM=0) the FIFO carries packed 4-bit codes, two
+ * samples per byte, so the byte-wide 8-bit transfer format is used.
+ */
+#define MMA_DATA_FMT_ADPCM  MMA_DATA_FMT_8BIT
+
 /*
  * FIFO threshold values (bytes remaining before interrupt)
  *   5 = 32 bytes  (good balance of latency vs. overhead)
@@ -85,65 +91,143 @@
 /* Default threshold: 32 bytes — enough to avoid underrun at DPC latency */
 #define MMA_FIFO_THR_DEFAULT    MMA_FIFO_THR_32
 
+/*
+ * Shadow DMA refill (16-bit render over DMA)
+ *
+ * The shadow buffer is kept SHADOW_LEAD_DIVISOR-th of the client buffer
+ * ahead of the DMA pointer.  PortCls refills each region of the client
+ * buffer as soon as the position passes it, so data half a buffer ahead
+ * has been written for at least half a buffer.  The timer runs at a
+ * quarter of the lead so the lead never drains.
+ */
+#define SHADOW_LEAD_DIVISOR     2
+#define SHADOW_TIMER_DIVISOR    4
+
 /* FIFO size in bytes */
 #define MMA_FIFO_SIZE           128
 
+/* Bytes left in (play) or free in (record) the FIFO at the interrupt */
+#define MMA_FIFO_THR_BYTES(t)   (112 - 16 * (t))
+
+/*
+ * Minimum time the FIFO must cover between the interrupt and the refill.
+ * Streams with a low byte rate take a low threshold (big, rare refills);
+ * fast streams keep enough data queued to ride out ISA interrupt latency
+ * plus the wait for the adapter's service DPC.
+ */
+#define MMA_FIFO_HEADROOM_US    300
+
+/* Each underrun doubles the headroom up to this (THR_112 at any rate) */
+#define MMA_FIFO_HEADROOM_MAX_US    1200
+
+
+/*****************************************************************************
+ * Low-latency stream profile
+ *
+ * Settings\WaveLatencyMs (DWORD) selects a target output latency.  0 or
+ * absent keeps the default profile: the full DMA buffer and whatever
+ * notification interval PortCls asks for.  Otherwise each new stream gets
+ * a buffer of two notification periods of WaveLatencyMs / 2 each, and the
+ * FIFO threshold headroom and the latency both back off on underruns.
+ */
+#define WAVE_LATENCY_MIN_MS     4
+#define WAVE_LATENCY_MAX_MS     100     /* Growth cap after underruns    */
+#define WAVE_LATENCY_PERIODS    2       /* Notification periods per buffer */
+#define WAVE_BUFFER_MIN         (4 * MMA_FIFO_SIZE)
+
+
+/*****************************************************************************
+ * Yamaha ADPCM stream format
+ *
+ * The MMA decodes (playback) and encodes (record) the same 4-bit Yamaha
+ * ADPCM that the Windows Yamaha codec uses, so it is exposed under the
+ * standard WAVE_FORMAT_YAMAHA_ADPCM tag and its WAVEFORMATEX subtype.
+ */
+#ifndef WAVE_FORMAT_YAMAHA_ADPCM
+#define WAVE_FORMAT_YAMAHA_ADPCM    0x0020
+#endif
+
+#define STATIC_KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM \
+    DEFINE_WAVEFORMATEX_GUID(WAVE_FORMAT_YAMAHA_ADPCM)
+DEFINE_GUIDSTRUCT("00000020-0000-0010-8000-00aa00389b71",
+                  KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM);
+#define KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM \
+    DEFINE_GUIDNAMED(KSDATAFORMAT_SUBTYPE_YAMAHA_ADPCM)
+
+#define ADPCM_BITS_PER_SAMPLE       4
+
 
 /*****************************************************************************
  * TPDF dither helpers (integer only — no FPU in kernel mode)
  *
- * 16-bit Galois LFSR for pseudo-random generation.
+ * 16-bit Fibonacci LFSR for pseudo-random generation.
  * Triangular PDF dither at +/- 1 LSB in 12-bit scale.
  */
 
 /*
- * Advance a 16-bit Galois LFSR by one step.
+ * Advance a 16-bit LFSR by eight steps at once.
  * Polynomial: x^16 + x^14 + x^13 + x^11 + 1 (maximal-length).
+ *
+ * Step j feeds back s[j] ^ s[j+2] ^ s[j+3] ^ s[j+5] into bit 15.  For the
+ * first eight steps every tap (j + 5 <= 12) still lies in the original
+ * state, so all eight feedback bits come from one word-wide XOR and land
+ * in the high byte.  The low byte of the result is eight fresh bits.
  */
 static USHORT
-LfsrNext
+LfsrNext8
 (
     IN      USHORT  State
 )
 {
-    USHORT bit = ((State >> 0) ^ (State >> 2) ^
-                  (State >> 3) ^ (State >> 5)) & 1;
-    return (USHORT)((State >> 1) | (bit << 15));
+    USHORT feedback = (USHORT)(State ^ (State >> 2) ^
+                               (State >> 3) ^ (State >> 5));
+    return (USHORT)((State >> 8) | (feedback << 8));
 }
 
 /*
- * Apply TPDF dither to a 16-bit signed sample and truncate to 12-bit.
- * Returns a 16-bit value with the lower 4 bits cleared.
+ * Apply TPDF dither to a run of 16-bit signed samples and truncate each
+ * to 12-bit, writing format 2 byte pairs (low byte first) to Dest.
+ *
+ * Runs over a whole FIFO chunk in one pass so the arithmetic stays out
+ * of the port I/O that follows.
  */
-static SHORT
-DitherSample
+static void
+DitherBlock
 (
-    IN      SHORT       Sample16,
-    IN OUT  USHORT *    pLfsr
+    OUT     PUCHAR          Dest,
+    IN      const SHORT *   Source,
+    IN      ULONG           Samples,
+    IN OUT  USHORT *        pLfsr
 )
 {
     /*
      * Two uniform random values in [-8, +7] summed give triangular
      * PDF in [-16, +14].  One LSB at 12-bit resolution = 16 at
-     * 16-bit resolution, so this is +/- 1 LSB dither.
+     * 16-bit resolution, so this is +/- 1 LSB dither.  Both nibbles
+     * come from the eight fresh bits of one LFSR jump, so they are
+     * independent of each other and of the previous sample's pair.
      */
-    LONG r1;
-    LONG r2;
-    LONG dithered;
+    USHORT lfsr = *pLfsr;
+    LONG   dithered;
+
+    while (Samples--)
+    {
+        lfsr = LfsrNext8(lfsr);
 
-    r1 = (LONG)(*pLfsr & 0x0F) - 8;
-    *pLfsr = LfsrNext(*pLfsr);
-    r2 = (LONG)(*pLfsr & 0x0F) - 8;
-    *pLfsr = LfsrNext(*pLfsr);
+        dithered = (LONG)*Source++
+                 + (LONG)(lfsr & 0x0F) + (LONG)((lfsr >> 4) & 0x0F) - 16;
 
-    dithered = (LONG)Sample16 + r1 + r2;
+        /* Clamp to signed 16-bit range */
+        if (dithered > 32767)  dithered = 32767;
+        if (dithered < -32768) dithered = -32768;
 
-    /* Clamp to signed 16-bit range */
-    if (dithered > 32767)  dithered = 32767;
-    if (dithered < -32768) dithered = -32768;
+        /* Truncate: clear lower 4 bits */
+        Dest[0] = (UCHAR)(dithered & 0xF0);
+        Dest[1] = (UCHAR)(dithered >> 8);
+        Dest += 2;
+    }
 
-    /* Truncate: clear lower 4 bits */
-    return (SHORT)(dithered & 0xFFF0);
+    *pLfsr = lfsr;
 }
 
 
@@ -175,6 +259,10 @@ class CMiniportWaveCyclicStreamAdLibGold;
  *
  * 8-bit PCM: DMA mode (ISA DMA transfers to FIFO directly).
  * 16-bit PCM: PIO mode with TPDF dithering (software fills FIFO in DPC).
+ *
+ * Render always runs on MMA channel 0 and the first DMA resource.  With a
+ * second DMA resource, capture gets MMA channel 1 and that DMA channel
+ * (full duplex, independent rates); otherwise it shares channel 0.
  */
 class CMiniportWaveCyclicAdLibGold
 :   public IMiniportWaveCyclic,
@@ -187,12 +275,22 @@ private:
     PPORTWAVECYCLIC     m_Port;                 /* Callback interface        */
     PSERVICEGROUP       m_ServiceGroup;         /* Notification service group */
     PDMACHANNELSLAVE    m_DmaChannel;           /* Slave DMA channel         */
+    PDMACHANNELSLAVE    m_ShadowDmaChannel;     /* 16-bit render DMA buffer  */
+    PDMACHANNELSLAVE    m_CaptureDmaChannel;    /* 2nd DMA (full duplex)     */
+    BOOLEAN             m_FullDuplex;           /* Capture on MMA channel 1  */
 
     BOOLEAN             m_CaptureAllocated;     /* Capture stream active     */
     BOOLEAN             m_RenderAllocated;      /* Render stream active      */
-    ULONG               m_SamplingFrequency;    /* Current sample rate       */
+    ULONG               m_SamplingFrequency;    /* Shared rate (half duplex) */
     ULONG               m_NotificationInterval; /* ms between notifications  */
 
+    ULONG               m_LatencyMs;            /* Profile target, 0=default */
+    ULONG               m_HeadroomUs;           /* FIFO threshold headroom   */
+    ULONG               m_Underruns;            /* Underruns/overruns seen   */
+
+    /* Running PIO stream per MMA channel (under the MMA lock) */
+    CMiniportWaveCyclicStreamAdLibGold * m_PioStream[MMA_CHANNELS];
+
     POWER_STATE         m_PowerState;           /* Current device power      */
 
     /*
@@ -253,10 +351,11 @@ public:
     );
 
     /*
-     * IWaveMiniportAdLibGold (ISR dispatch from adapter common)
+     * IWaveMiniportAdLibGold (service DPC dispatch from adapter common)
      */
-    STDMETHODIMP_(void) ServiceWaveISR
-    (   void
+    STDMETHODIMP_(void) ServiceWave
+    (
+        IN      ULONG   Channel
     );
 
     /*
@@ -277,10 +376,35 @@ public:
         IN      ULONG           SampleRate
     );
 
+    static ULONG FormatByteRate
+    (
+        IN      PWAVEFORMATEX   WaveFormat
+    );
+
+    ULONG ProfileBufferSize
+    (
+        IN      PDMACHANNELSLAVE DmaChannel,
+        IN      PWAVEFORMATEX   WaveFormat
+    );
+
     /*
      * Friends
      */
     friend class CMiniportWaveCyclicStreamAdLibGold;
+    friend
+    NTSTATUS
+    SynchronizedMmaHalt
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedMmaGo
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
 };
 
 
@@ -289,8 +413,11 @@ public:
  *****************************************************************************
  * WaveCyclic stream for a single playback or capture instance.
  *
- * For 8-bit formats, uses hardware DMA (ENB=1 in reg 0Ch).
- * For 16-bit formats, uses PIO with TPDF dithering (ENB=0, FIFO interrupt).
+ * For 8-bit and ADPCM formats, uses hardware DMA (ENB=1 in reg 0Ch).
+ * For 16-bit render, dithers ahead into a shadow DMA buffer (ENB=1) when
+ * one could be allocated.
+ * For other 16-bit formats, uses PIO with TPDF dithering (ENB=0, FIFO
+ * interrupt).
  */
 class CMiniportWaveCyclicStreamAdLibGold
 :   public IMiniportWaveCyclicStream,
@@ -301,18 +428,56 @@ private:
     BOOLEAN     m_Capture;              /* TRUE for record, FALSE for play   */
     BOOLEAN     m_16Bit;                /* TRUE for 16-bit (PIO+dither)      */
     BOOLEAN     m_Stereo;               /* TRUE for stereo                   */
+    BOOLEAN     m_Adpcm;                /* TRUE for 4-bit ADPCM (DMA)        */
     KSSTATE     m_State;                /* Current stream state              */
+    BYTE        m_MmaChannel;           /* MMA_CHANNEL_x this stream drives  */
+    PDMACHANNELSLAVE m_DmaChannel;      /* Client buffer (and 8-bit DMA)     */
+    ULONG       m_SamplingFrequency;    /* This stream's rate                */
+    ULONG       m_NotificationBytes;    /* Bytes per PortCls notification    */
+    ULONG       m_BytesSinceNotify;     /* PIO bytes moved since last one    */
 
     /* PIO mode state (16-bit only) */
     ULONG       m_SoftwarePosition;     /* Read/write position in DMA buffer */
     ULONG       m_DmaBufferSize;        /* Size of allocated DMA buffer      */
     USHORT      m_LfsrState;            /* LFSR state for dither generation  */
+    BYTE        m_FifoThreshold;        /* MMA_FIFO_THR_* code for reg 0Ch   */
+    ULONG       m_FifoChunk;            /* Bytes moved per FIFO interrupt    */
+    LONGLONG    m_FifoStamp;            /* Perf counter at last FIFO fill    */
+    LONGLONG    m_PerfFrequency;        /* KeQueryPerformanceCounter rate    */
+
+    /* Position reporting */
+    ULONG       m_LastPosition;         /* Last position given to PortCls    */
+
+    /* Shadow DMA state (16-bit render only) */
+    BOOLEAN     m_ShadowDma;            /* TRUE: 16-bit over shadow buffer   */
+    ULONG       m_ShadowWritePosition;  /* Next shadow byte to dither into   */
+    KDPC        m_ShadowDpc;            /* Shadow refill, re-armed each run  */
+    KTIMER      m_ShadowTimer;
+    LONGLONG    m_ShadowPeriod;         /* Refill period, relative 100ns     */
+
+    /*
+     * Shadow timer teardown.  m_ShadowArmed says a DPC run is owed (the
+     * timer is set or its DPC queued) and m_ShadowActive counts runs in
+     * progress; once m_ShadowStopping is set nothing re-arms, and the
+     * last run out signals m_ShadowIdle.  All under m_ShadowLock.
+     */
+    KSPIN_LOCK  m_ShadowLock;
+    KEVENT      m_ShadowIdle;
+    BOOLEAN     m_ShadowArmed;
+    BOOLEAN     m_ShadowStopping;
+    ULONG       m_ShadowActive;
 
     /*
      * Private methods
      */
-    void FillFifo(void);                /* 16-bit playback: dither + write   */
-    void DrainFifo(void);               /* 16-bit capture: read + zero-pad   */
+    void FillFifo(ULONG Count);         /* 16-bit playback: dither + write   */
+    void DrainFifo(ULONG Count);        /* 16-bit capture: read + zero-pad   */
+    void SelectFifoThreshold(void);     /* Pick threshold from byte rate     */
+    void FillShadow(ULONG Count);       /* Dither client bytes into shadow   */
+    void StartShadowTimer(void);        /* Arm periodic shadow refill        */
+    void StopShadowTimer(void);         /* Cancel it and wait out a run      */
+    ULONG EstimatePosition(void);       /* Raw hardware play/record offset   */
+    void ReportUnderrun(void);          /* Count and back off the profile    */
 
     void ProgramMmaStart(void);         /* Write regs 0Ch + 09h to start    */
     void ProgramMmaStop(void);          /* Reset reg 09h, mask FIFO IRQ     */
@@ -360,6 +525,44 @@ public:
         IN      PVOID           Buffer,
         IN      ULONG           ByteCount
     );
+
+    /*
+     * Called by the miniport's ServiceWave for a running PIO stream.
+     */
+    BOOLEAN ServiceFifo(void);          /* FIFO interrupt; TRUE: notify due  */
+
+    /*
+     * Called by the shadow timer DPC.
+     */
+    void ServiceShadow(void);           /* Keep shadow half a buffer ahead   */
+
+    /*
+     * Friends
+     */
+    friend
+    VOID
+    NTAPI
+    WaveShadowTimerDPC
+    (
+        IN      PKDPC   Dpc,
+        IN      PVOID   DeferredContext,
+        IN      PVOID   SystemArgument1,
+        IN      PVOID   SystemArgument2
+    );
+    friend
+    NTSTATUS
+    SynchronizedMmaHalt
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedMmaGo
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
 };
 
 
@@ -11,6 +11,29 @@
 
 #define STR_MODULENAME "AdLibGold: "
 
+/*
+ * Per-CPU copies of the hot-path counters.  Must be a power of 2; CPUs
+ * beyond it share a copy, which only costs the odd lost count.
+ */
+#define ALG_PERF_CPUS           32
+
+/*
+ * Each CPU's copy is padded and aligned to ALG_PERF_LINE bytes, which
+ * covers the 32 to 128-byte cache lines (and sector pairs) of the CPUs
+ * this runs on, so no two copies ever share a line.
+ */
+#define ALG_PERF_LINE           128
+
+typedef union
+{
+    ADLIBGOLD_PERF_COUNTERS Perf;
+    BYTE                    Pad[(sizeof(ADLIBGOLD_PERF_COUNTERS) +
+                                 ALG_PERF_LINE - 1) & ~(ALG_PERF_LINE - 1)];
+}
+ALG_PERF_BLOCK, *PALG_PERF_BLOCK;
+
+#define ALG_TRACE_MASK          (ADLIBGOLD_TRACE_RECORDS - 1)
+
 
 /*****************************************************************************
  * CAdapterCommon
@@ -32,8 +55,125 @@ private:
     BYTE                    m_CardOptions;
     PWAVEMINIPORTADLIBGOLD  m_pWaveMiniport;
     PMIDIMINIPORTADLIBGOLD  m_pMidiMiniport;
+    PFMSYNTHADLIBGOLD       m_pFMSynth;         /* Guarded by m_MmaLock      */
+    ULONG                   m_OPL3Timing;       /* OPL3_TIMING_xxx           */
+    ULONG                   m_OPL3DelayUs;      /* Stall per OPL3 access     */
+    ULONG                   m_OPL3DelayReads;   /* Status reads, calibrated  */
+    BYTE                    m_Bank;             /* Guarded by interrupt sync */
+
+    /*
+     * Deferred interrupt service.  The ISR ORs each channel's MMA status
+     * into m_IsrMmaStatus (under the interrupt spinlock) and queues
+     * m_ServiceDpc; the DPC collects it into m_DpcMmaStatus (under
+     * m_MmaLock) and runs the wave and MIDI FIFO work.
+     */
+    KDPC                    m_ServiceDpc;
+    KSPIN_LOCK              m_MmaLock;
+    BYTE                    m_IsrMmaStatus[MMA_CHANNELS];
+    BYTE                    m_DpcMmaStatus[MMA_CHANNELS];
+    ULONGLONG               m_IsrRxTime;        /* Perf counter, first RRQ   */
+    ULONGLONG               m_DpcRxTime;
+
+    /*
+     * Deferred mixer writes.  m_MixerDirty has a bit per slow register
+     * whose shadow value has not reached the chip; it and m_MixerArmed
+     * are guarded by m_MixerLock.
+     */
+    KSPIN_LOCK              m_MixerLock;
+    KTIMER                  m_MixerTimer;
+    KDPC                    m_MixerDpc;
+    ULONG                   m_MixerDirty;
+    BOOLEAN                 m_MixerArmed;
+
+    /*
+     * OPL3 array 0 (base+0/1) port ownership.  WriteOPL3 and the ISR's
+     * Timer 1 acknowledge both write an address/data pair there, and
+     * WriteOPL3 runs outside the interrupt sync, so each takes
+     * m_OPL3PortLock with an interlocked exchange.  The ISR never spins:
+     * finding the port held, it leaves m_OPL3AckPending for the holder
+     * to write on release.
+     */
+    volatile LONG           m_OPL3PortLock;
+    volatile BOOLEAN        m_OPL3AckPending;
+
+    /*
+     * OPL3 Timer 1 clock.  m_ClockRoutine and m_ClockContext are guarded
+     * by m_ClockLock, which the clock DPC holds across the call.  The ISR
+     * tests m_ClockRunning and advances m_ClockTicks.
+     */
+    KSPIN_LOCK              m_ClockLock;
+    KDPC                    m_ClockDpc;
+    PADLIBGOLD_CLOCK_ROUTINE m_ClockRoutine;
+    PVOID                   m_ClockContext;
+    volatile ULONG          m_ClockTicks;
+    ULONG                   m_ClockPeriod;      /* Ticks per interrupt       */
+    BYTE                    m_ClockPreset;      /* Timer 1 register value    */
+    BYTE                    m_ClockControl;     /* OPL3_TIMER1_BITS in use   */
+    volatile BOOLEAN        m_ClockRunning;
+
+    /*
+     * Hot-path counters, one copy per CPU so counting never takes a lock
+     * or shares a cache line with another processor.  An interrupt that
+     * lands inside an update on the same CPU can lose a count; the
+     * figures are for graphing, not accounting.  m_Perf points at the
+     * first ALG_PERF_LINE boundary in m_PerfSpace.
+     */
+    ALG_PERF_BLOCK          m_PerfSpace[ALG_PERF_CPUS + 1];
+    PALG_PERF_BLOCK         m_Perf;
+    ULONGLONG               m_PerfFrequency;    /* KeQueryPerformanceCounter */
+
+    /*
+     * Trace ring.  Writers claim a sequence number with one interlocked
+     * increment and store the record's Sequence last, so a reader can
+     * tell a finished record from one being written.
+     */
+    ADLIBGOLD_TRACE_RECORD  m_Trace[ADLIBGOLD_TRACE_RECORDS];
+    volatile LONG           m_TraceSequence;    /* Last sequence claimed     */
+    volatile BOOLEAN        m_TraceEnabled;
+
+    void Trace(ULONG Event, ULONG Arg0, ULONG Arg1)
+    {
+        if (m_TraceEnabled)
+        {
+            WriteTraceRecord(Event, Arg0, Arg1);
+        }
+    }
+    void WriteTraceRecord(ULONG Event, ULONG Arg0, ULONG Arg1);
+
+    void PerfCount(ULONG Counter, ULONG Amount)
+    {
+        m_Perf[KeGetCurrentProcessorNumber() & (ALG_PERF_CPUS - 1)].
+            Perf.Counter[Counter] += Amount;
+    }
+    void PerfStall(ULONG Counter, ULONG Microseconds)
+    {
+        PerfCount(Counter, Microseconds);
+        KeStallExecutionProcessor(Microseconds);
+    }
 
     BOOLEAN WaitForReady(void);
+    void SelectControlBank(void);
+    void SelectOPL3Bank(void);
+    void WriteControlRegs(PCONTROLREGWRITE Writes, ULONG Count);
+    void ReadControlRegs(PBYTE Values);
+    void LoadControlRegs(void);
+    void ControlRegUpdate(BYTE Register, BYTE Value);
+    void ArmMixerTimer(void);
+    void ServiceMixerWrites(void);
+    void FlushMixerWrites(void);
+    void RunEEPROMCommand(BYTE Command);
+    void OPL3Delay(void);
+    void InitOPL3Timing(void);
+    void AcquireOPL3Port(void);
+    void ReleaseOPL3Port(void);
+    void WriteOPL3Port(BYTE Address, BYTE Data);
+    void WriteOPL3Clock(void);
+    NTSTATUS QuerySettings
+    (
+        IN      PCWSTR                          ValueName,
+        OUT     PKEY_VALUE_PARTIAL_INFORMATION  KeyInfo,
+        IN      ULONG                           KeyInfoSize
+    );
 
 public:
     DECLARE_STD_UNKNOWN();
@@ -63,6 +203,16 @@ public:
     STDMETHODIMP_(void) ControlRegReset
     (   void
     );
+    STDMETHODIMP_(void) ControlRegWriteBatch
+    (
+        IN      PCONTROLREGWRITE    Writes,
+        IN      ULONG               Count
+    );
+    STDMETHODIMP_(void) ControlRegWriteDeferred
+    (
+        IN      BYTE    Register,
+        IN      BYTE    Value
+    );
     STDMETHODIMP_(void) EnableControlBank
     (   void
     );
@@ -83,6 +233,41 @@ public:
     (
         IN      BYTE    Register
     );
+    STDMETHODIMP_(void) WriteMMAChannel
+    (
+        IN      BYTE    Channel,
+        IN      BYTE    Register,
+        IN      BYTE    Value
+    );
+    STDMETHODIMP_(BYTE) ReadMMAChannel
+    (
+        IN      BYTE    Channel,
+        IN      BYTE    Register
+    );
+    STDMETHODIMP_(void) WriteMMABurst
+    (
+        IN      BYTE    Channel,
+        IN      BYTE    Register,
+        IN      PUCHAR  Buffer,
+        IN      ULONG   Count
+    );
+    STDMETHODIMP_(void) ReadMMABurst
+    (
+        IN      BYTE    Channel,
+        IN      BYTE    Register,
+        OUT     PUCHAR  Buffer,
+        IN      ULONG   Count
+    );
+    STDMETHODIMP_(BYTE) ReadMMAStatus
+    (
+        IN      BYTE    Channel,
+        IN      BYTE    Handled
+    );
+    STDMETHODIMP_(NTSTATUS) CallMmaSynchronized
+    (
+        IN      PINTERRUPTSYNCROUTINE   Routine,
+        IN      PVOID                   DynamicContext
+    );
     STDMETHODIMP_(void) SetWaveMiniport(IN PWAVEMINIPORTADLIBGOLD Miniport)
     {
         m_pWaveMiniport = Miniport;
@@ -91,12 +276,76 @@ public:
     {
         m_pMidiMiniport = Miniport;
     }
+    STDMETHODIMP_(void) SetFMSynth(IN PFMSYNTHADLIBGOLD Synth);
+    STDMETHODIMP_(PFMSYNTHADLIBGOLD) GetFMSynth(void)
+    {
+        return m_pFMSynth;
+    }
+    STDMETHODIMP_(NTSTATUS) StartOPL3Clock
+    (
+        IN      ULONG                       PeriodTicks,
+        IN      PADLIBGOLD_CLOCK_ROUTINE    Routine,
+        IN      PVOID                       Context
+    );
+    STDMETHODIMP_(void) StopOPL3Clock
+    (   void
+    );
+    STDMETHODIMP_(ULONG) ReadOPL3Clock(void)
+    {
+        return m_ClockTicks;
+    }
     STDMETHODIMP_(NTSTATUS) RestoreMixerSettingsFromRegistry
     (   void
     );
     STDMETHODIMP_(NTSTATUS) SaveMixerSettingsToRegistry
     (   void
     );
+    STDMETHODIMP_(NTSTATUS) QuerySettingsValue
+    (
+        IN      PCWSTR  ValueName,
+        OUT     PULONG  Value
+    );
+    STDMETHODIMP_(NTSTATUS) QuerySettingsString
+    (
+        IN      PCWSTR  ValueName,
+        OUT     PWSTR   Buffer,
+        IN      ULONG   BufferSize
+    );
+    STDMETHODIMP_(void) CountPerfEvent
+    (
+        IN      ULONG   Counter,
+        IN      ULONG   Amount
+    )
+    {
+        ASSERT(Counter < ADLIBGOLD_PERF_COUNTERS);
+        PerfCount(Counter, Amount);
+    }
+    STDMETHODIMP_(void) QueryPerfCounters
+    (
+        OUT     PADLIBGOLD_PERF_COUNTERS    Totals  OPTIONAL,
+        IN      BOOLEAN                     Reset
+    );
+    STDMETHODIMP_(void) TraceEvent
+    (
+        IN      ULONG   Event,
+        IN      ULONG   Arg0,
+        IN      ULONG   Arg1
+    )
+    {
+        Trace(Event, Arg0, Arg1);
+    }
+    STDMETHODIMP_(void) EnableTrace
+    (
+        IN      BOOLEAN Enable
+    )
+    {
+        m_TraceEnabled = Enable;
+    }
+    STDMETHODIMP_(ULONG) ReadTrace
+    (
+        OUT     PADLIBGOLD_TRACE    Buffer,
+        IN      ULONG               Size
+    );
     STDMETHODIMP_(NTSTATUS) SaveToEEPROM
     (   void
     );
@@ -121,6 +370,78 @@ public:
         IN      PINTERRUPTSYNC  InterruptSync,
         IN      PVOID           DynamicContext
     );
+    friend
+    NTSTATUS
+    SynchronizedControlRegWrite
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedControlRegRead
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedMixerWrite
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedOPL3Write
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedEEPROMCommand
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    VOID
+    NTAPI
+    MixerTimerDPC
+    (
+        IN      PKDPC   Dpc,
+        IN      PVOID   DeferredContext,
+        IN      PVOID   SystemArgument1,
+        IN      PVOID   SystemArgument2
+    );
+    friend
+    NTSTATUS
+    CollectMmaStatus
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    VOID
+    NTAPI
+    InterruptServiceDPC
+    (
+        IN      PKDPC   Dpc,
+        IN      PVOID   DeferredContext,
+        IN      PVOID   SystemArgument1,
+        IN      PVOID   SystemArgument2
+    );
+    friend
+    VOID
+    NTAPI
+    ClockDPC
+    (
+        IN      PKDPC   Dpc,
+        IN      PVOID   DeferredContext,
+        IN      PVOID   SystemArgument1,
+        IN      PVOID   SystemArgument2
+    );
 };
 
 
@@ -202,6 +523,35 @@ Init
     ASSERT(ResourceList);
     ASSERT(DeviceObject);
 
+    /*
+     * Deferred interrupt service; set up first so the destructor can
+     * always dequeue it.
+     */
+    RtlZeroMemory(m_IsrMmaStatus, sizeof(m_IsrMmaStatus));
+    RtlZeroMemory(m_DpcMmaStatus, sizeof(m_DpcMmaStatus));
+    m_IsrRxTime = 0;
+    m_DpcRxTime = 0;
+    KeInitializeSpinLock(&m_MmaLock);
+    KeInitializeDpc(&m_ServiceDpc, InterruptServiceDPC, PVOID(this));
+
+    m_MixerDirty = 0;
+    m_MixerArmed = FALSE;
+    KeInitializeSpinLock(&m_MixerLock);
+    KeInitializeDpc(&m_MixerDpc, MixerTimerDPC, PVOID(this));
+    KeInitializeTimer(&m_MixerTimer);
+
+    m_OPL3PortLock   = 0;
+    m_OPL3AckPending = FALSE;
+    m_ClockRoutine   = NULL;
+    m_ClockContext   = NULL;
+    m_ClockTicks     = 0;
+    m_ClockPeriod    = 0;
+    m_ClockPreset    = 0;
+    m_ClockControl   = OPL3_TIMER1_MASK;
+    m_ClockRunning   = FALSE;
+    KeInitializeSpinLock(&m_ClockLock);
+    KeInitializeDpc(&m_ClockDpc, ClockDPC, PVOID(this));
+
     /*
      * Validate resources: need at least one I/O port range and one IRQ.
      */
@@ -218,7 +568,24 @@ Init
     m_pDeviceObject     = DeviceObject;
     m_pWaveMiniport     = NULL;
     m_pMidiMiniport     = NULL;
+    m_pFMSynth          = NULL;
     m_pInterruptSync    = NULL;
+    m_OPL3Timing        = OPL3_TIMING_CONSERVATIVE;
+    m_OPL3DelayUs       = OPL3_DELAY_CONSERVATIVE_US;
+    m_OPL3DelayReads    = 0;
+    m_Bank              = ALG_BANK_UNKNOWN;
+
+    m_Perf = PALG_PERF_BLOCK((ULONG_PTR(m_PerfSpace) + ALG_PERF_LINE - 1) &
+                             ~ULONG_PTR(ALG_PERF_LINE - 1));
+    RtlZeroMemory(m_Perf, ALG_PERF_CPUS * sizeof(ALG_PERF_BLOCK));
+    {
+        LARGE_INTEGER frequency;
+        KeQueryPerformanceCounter(&frequency);
+        m_PerfFrequency = frequency.QuadPart;
+    }
+    RtlZeroMemory(m_Trace, sizeof(m_Trace));
+    m_TraceSequence     = 0;
+    m_TraceEnabled      = FALSE;
 
     /*
      * Get the base I/O address from the resource list.
@@ -247,7 +614,7 @@ Init
      */
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_CONTROL);
+    SelectControlBank();
 
     if (!WaitForReady())
     {
@@ -259,7 +626,6 @@ Init
     {
         WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, CTRL_REG_CONTROL_ID);
         BYTE idByte = READ_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA);
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
 
         m_CardModel   = idByte & CTRL_ID_MODEL_MASK;
         m_CardOptions = idByte;
@@ -284,6 +650,8 @@ Init
         }
     }
 
+    SelectOPL3Bank();
+
     /*
      * Set up interrupt synchronization.
      */
@@ -326,102 +694,417 @@ Init
         ControlRegReset();
     }
 
+    /*
+     * Select OPL3 access timing before any miniport writes the chip.
+     */
+    if (NT_SUCCESS(ntStatus))
+    {
+        InitOPL3Timing();
+    }
+
     return ntStatus;
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::~CAdapterCommon()
+ * CAdapterCommon::InitOPL3Timing()
  *****************************************************************************
- * Destructor.
+ * Select the OPL3 access delay.  The mode comes from the "OPL3Timing"
+ * setting (default OPL3_TIMING_CALIBRATED).  Calibration times a run of
+ * OPL3 status port reads against the performance counter and derives how
+ * many reads cover the YMF262's 2.2us wait.  Reads that are implausibly
+ * fast (not a real ISA cycle) or a useless counter fall back to fixed 3us
+ * stalls.
  */
+void
 CAdapterCommon::
-~CAdapterCommon
+InitOPL3Timing
 (   void
 )
 {
     PAGED_CODE();
 
-    _DbgPrintF(DEBUGLVL_VERBOSE, ("[CAdapterCommon::~CAdapterCommon]"));
+    ULONG mode;
 
-    if (m_pInterruptSync)
+    if (!NT_SUCCESS(QuerySettingsValue(L"OPL3Timing", &mode)))
     {
-        m_pInterruptSync->Disconnect();
-        m_pInterruptSync->Release();
-        m_pInterruptSync = NULL;
+        mode = OPL3_TIMING_CALIBRATED;
+    }
+
+    m_OPL3Timing     = OPL3_TIMING_CONSERVATIVE;
+    m_OPL3DelayUs    = OPL3_DELAY_CONSERVATIVE_US;
+    m_OPL3DelayReads = 0;
+
+    if (mode == OPL3_TIMING_CALIBRATED)
+    {
+        LARGE_INTEGER   frequency;
+        LARGE_INTEGER   start;
+        LARGE_INTEGER   end;
+        ULONGLONG       elapsedNs;
+        ULONG           readNs;
+        ULONG           i;
+
+        start = KeQueryPerformanceCounter(&frequency);
+        for (i = 0; i < OPL3_CALIBRATE_READS; i++)
+        {
+            (void) READ_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_ADDR);
+        }
+        end = KeQueryPerformanceCounter(NULL);
+
+        readNs = 0;
+        if (frequency.QuadPart > 0)
+        {
+            elapsedNs = ULONGLONG(end.QuadPart - start.QuadPart) * 1000000000 /
+                        ULONGLONG(frequency.QuadPart);
+            readNs = ULONG(elapsedNs / OPL3_CALIBRATE_READS);
+        }
+
+        if (readNs >= OPL3_MIN_READ_NS)
+        {
+            m_OPL3Timing     = OPL3_TIMING_CALIBRATED;
+            m_OPL3DelayReads = (OPL3_DELAY_YMF262_NS + readNs - 1) / readNs;
+            if (m_OPL3DelayReads > OPL3_MAX_DELAY_READS)
+            {
+                m_OPL3DelayReads = OPL3_MAX_DELAY_READS;
+            }
+        }
+        else
+        {
+            _DbgPrintF(DEBUGLVL_TERSE,
+                ("InitOPL3Timing: calibration failed (%d ns/read)", readNs));
+            mode = OPL3_TIMING_YMF262;
+        }
+    }
+
+    if (mode == OPL3_TIMING_YMF262)
+    {
+        m_OPL3Timing  = OPL3_TIMING_YMF262;
+        m_OPL3DelayUs = OPL3_DELAY_YMF262_US;
     }
+
+    _DbgPrintF(DEBUGLVL_VERBOSE,
+        ("InitOPL3Timing: mode %d, %d us, %d reads",
+         m_OPL3Timing, m_OPL3DelayUs, m_OPL3DelayReads));
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::NonDelegatingQueryInterface()
+ * CAdapterCommon::QuerySettings()
  *****************************************************************************
- * Obtains an interface.
+ * Read a value from the driver's Settings registry key into KeyInfo.
  */
-STDMETHODIMP
+NTSTATUS
 CAdapterCommon::
-NonDelegatingQueryInterface
+QuerySettings
 (
-    REFIID  Interface,
-    PVOID * Object
+    IN      PCWSTR                          ValueName,
+    OUT     PKEY_VALUE_PARTIAL_INFORMATION  KeyInfo,
+    IN      ULONG                           KeyInfoSize
 )
 {
     PAGED_CODE();
 
-    ASSERT(Object);
+    ASSERT(ValueName);
+    ASSERT(KeyInfo);
 
-    if (IsEqualGUIDAligned(Interface, IID_IUnknown))
-    {
-        *Object = PVOID(PUNKNOWN(PADAPTERCOMMON(this)));
-    }
-    else
-    if (IsEqualGUIDAligned(Interface, IID_IAdapterCommon))
-    {
-        *Object = PVOID(PADAPTERCOMMON(this));
-    }
-    else
-    if (IsEqualGUIDAligned(Interface, IID_IAdapterPowerManagment))
-    {
-        *Object = PVOID(PADAPTERPOWERMANAGMENT(this));
-    }
-    else
-    {
-        *Object = NULL;
-    }
+    PREGISTRYKEY    DriverKey;
+    PREGISTRYKEY    SettingsKey;
 
-    if (*Object)
+    NTSTATUS ntStatus = PcNewRegistryKey(
+        &DriverKey,
+        NULL,
+        DriverRegistryKey,
+        KEY_READ,
+        m_pDeviceObject,
+        NULL,
+        NULL,
+        0,
+        NULL
+    );
+
+    if (NT_SUCCESS(ntStatus))
     {
-        PUNKNOWN(*Object)->AddRef();
-        return STATUS_SUCCESS;
+        UNICODE_STRING KeyName;
+
+        RtlInitUnicodeString(&KeyName, L"Settings");
+
+        ntStatus = DriverKey->NewSubKey(
+            &SettingsKey,
+            NULL,
+            KEY_READ,
+            &KeyName,
+            REG_OPTION_NON_VOLATILE,
+            NULL
+        );
+
+        if (NT_SUCCESS(ntStatus))
+        {
+            ULONG ResultLength;
+
+            RtlInitUnicodeString(&KeyName, ValueName);
+
+            ntStatus = SettingsKey->QueryValueKey(
+                &KeyName,
+                KeyValuePartialInformation,
+                KeyInfo,
+                KeyInfoSize,
+                &ResultLength
+            );
+
+            SettingsKey->Release();
+        }
+
+        DriverKey->Release();
     }
 
-    return STATUS_INVALID_PARAMETER;
+    return ntStatus;
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::GetInterruptSync()
+ * CAdapterCommon::QuerySettingsValue()
  *****************************************************************************
- * Returns a pointer to the interrupt synchronization object.
+ * Read a DWORD value from the driver's Settings registry key.
  */
-STDMETHODIMP_(PINTERRUPTSYNC)
+STDMETHODIMP_(NTSTATUS)
 CAdapterCommon::
-GetInterruptSync
-(   void
+QuerySettingsValue
+(
+    IN      PCWSTR  ValueName,
+    OUT     PULONG  Value
 )
 {
     PAGED_CODE();
 
-    return m_pInterruptSync;
-}
+    ASSERT(ValueName);
+    ASSERT(Value);
 
+    NTSTATUS ntStatus;
 
-/*****************************************************************************
- * CAdapterCommon::ControlRegReset()
- *****************************************************************************
- * Reset mixer registers to defaults (from registry or hardcoded).
- */
-STDMETHODIMP_(void)
+    PKEY_VALUE_PARTIAL_INFORMATION PartialInfo = PKEY_VALUE_PARTIAL_INFORMATION(
+        ExAllocatePool(
+            PagedPool,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD)
+        )
+    );
+
+    if (NULL != PartialInfo)
+    {
+        ntStatus = QuerySettings(
+            ValueName,
+            PartialInfo,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD)
+        );
+
+        if (NT_SUCCESS(ntStatus))
+        {
+            if (PartialInfo->DataLength == sizeof(DWORD))
+            {
+                *Value = *(PDWORD(PartialInfo->Data));
+            }
+            else
+            {
+                ntStatus = STATUS_INVALID_PARAMETER;
+            }
+        }
+
+        ExFreePool(PartialInfo);
+    }
+    else
+    {
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return ntStatus;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::QuerySettingsString()
+ *****************************************************************************
+ * Read a REG_SZ value from the driver's Settings registry key.  BufferSize
+ * is in bytes; the string is always returned NUL-terminated, and one that
+ * does not fit fails with STATUS_BUFFER_OVERFLOW.
+ */
+STDMETHODIMP_(NTSTATUS)
+CAdapterCommon::
+QuerySettingsString
+(
+    IN      PCWSTR  ValueName,
+    OUT     PWSTR   Buffer,
+    IN      ULONG   BufferSize
+)
+{
+    PAGED_CODE();
+
+    ASSERT(ValueName);
+    ASSERT(Buffer);
+
+    if (BufferSize < sizeof(WCHAR))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    NTSTATUS ntStatus;
+
+    PKEY_VALUE_PARTIAL_INFORMATION PartialInfo = PKEY_VALUE_PARTIAL_INFORMATION(
+        ExAllocatePool(
+            PagedPool,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) + BufferSize
+        )
+    );
+
+    if (NULL != PartialInfo)
+    {
+        ntStatus = QuerySettings(
+            ValueName,
+            PartialInfo,
+            sizeof(KEY_VALUE_PARTIAL_INFORMATION) + BufferSize
+        );
+
+        if (NT_SUCCESS(ntStatus))
+        {
+            ULONG chars = PartialInfo->DataLength / sizeof(WCHAR);
+
+            /* The stored terminator is optional */
+            if (chars && ((PWSTR)PartialInfo->Data)[chars - 1] == L'\0')
+            {
+                chars--;
+            }
+
+            if (PartialInfo->Type != REG_SZ)
+            {
+                ntStatus = STATUS_INVALID_PARAMETER;
+            }
+            else if ((chars + 1) * sizeof(WCHAR) > BufferSize)
+            {
+                ntStatus = STATUS_BUFFER_OVERFLOW;
+            }
+            else
+            {
+                RtlCopyMemory(Buffer, PartialInfo->Data, chars * sizeof(WCHAR));
+                Buffer[chars] = L'\0';
+            }
+        }
+
+        ExFreePool(PartialInfo);
+    }
+    else
+    {
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return ntStatus;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::~CAdapterCommon()
+ *****************************************************************************
+ * Destructor.
+ */
+CAdapterCommon::
+~CAdapterCommon
+(   void
+)
+{
+    PAGED_CODE();
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("[CAdapterCommon::~CAdapterCommon]"));
+
+    if (m_ClockRunning)
+    {
+        StopOPL3Clock();
+    }
+
+    if (m_pInterruptSync)
+    {
+        m_pInterruptSync->Disconnect();
+        m_pInterruptSync->Release();
+        m_pInterruptSync = NULL;
+    }
+
+    /* The interrupt is gone; drop any service pass it left queued */
+    KeRemoveQueueDpc(&m_ServiceDpc);
+    KeRemoveQueueDpc(&m_ClockDpc);
+
+    KeCancelTimer(&m_MixerTimer);
+    KeRemoveQueueDpc(&m_MixerDpc);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::NonDelegatingQueryInterface()
+ *****************************************************************************
+ * Obtains an interface.
+ */
+STDMETHODIMP
+CAdapterCommon::
+NonDelegatingQueryInterface
+(
+    REFIID  Interface,
+    PVOID * Object
+)
+{
+    PAGED_CODE();
+
+    ASSERT(Object);
+
+    if (IsEqualGUIDAligned(Interface, IID_IUnknown))
+    {
+        *Object = PVOID(PUNKNOWN(PADAPTERCOMMON(this)));
+    }
+    else
+    if (IsEqualGUIDAligned(Interface, IID_IAdapterCommon))
+    {
+        *Object = PVOID(PADAPTERCOMMON(this));
+    }
+    else
+    if (IsEqualGUIDAligned(Interface, IID_IAdapterPowerManagment))
+    {
+        *Object = PVOID(PADAPTERPOWERMANAGMENT(this));
+    }
+    else
+    {
+        *Object = NULL;
+    }
+
+    if (*Object)
+    {
+        PUNKNOWN(*Object)->AddRef();
+        return STATUS_SUCCESS;
+    }
+
+    return STATUS_INVALID_PARAMETER;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::GetInterruptSync()
+ *****************************************************************************
+ * Returns a pointer to the interrupt synchronization object.
+ */
+STDMETHODIMP_(PINTERRUPTSYNC)
+CAdapterCommon::
+GetInterruptSync
+(   void
+)
+{
+    PAGED_CODE();
+
+    return m_pInterruptSync;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ControlRegReset()
+ *****************************************************************************
+ * Reset mixer registers to defaults (from registry or hardcoded).  The
+ * shadow is first loaded from the chip, which restored its EEPROM at
+ * power-on, so only registers that differ are written; slow ones go to
+ * the mixer timer and land while the subdevices install.
+ */
+STDMETHODIMP_(void)
 CAdapterCommon::
 ControlRegReset
 (   void
@@ -431,19 +1114,57 @@ ControlRegReset
 
     ASSERT(m_pPortBase);
 
+    LoadControlRegs();
+
     NTSTATUS ntStatus = RestoreMixerSettingsFromRegistry();
     if (!NT_SUCCESS(ntStatus))
     {
         for (ULONG i = 0; i < SIZEOF_ARRAY(DefaultMixerSettings); i++)
         {
-            ControlRegWrite(DefaultMixerSettings[i].RegisterIndex,
-                            DefaultMixerSettings[i].RegisterSetting);
+            ControlRegUpdate(DefaultMixerSettings[i].RegisterIndex,
+                             DefaultMixerSettings[i].RegisterSetting);
         }
     }
 
     /* Ensure reserved register is zero */
-    ControlRegWrite(CTRL_REG_RESERVED, 0x00);
+    ControlRegUpdate(CTRL_REG_RESERVED, 0x00);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ControlRegUpdate()
+ *****************************************************************************
+ * Write a register only if the shadow says the chip holds something else
+ * (see ControlRegWriteDeferred() for how it is written).
+ */
+void
+CAdapterCommon::
+ControlRegUpdate
+(
+    IN      BYTE    Register,
+    IN      BYTE    Value
+)
+{
+    PAGED_CODE();
+
+    ASSERT(Register < CTRL_REG_MAX);
+
+    if (m_ControlRegs[Register] != Value)
+    {
+        ControlRegWriteDeferred(Register, Value);
+    }
+}
+
+
+/*****************************************************************************
+ * Synchronized Control Chip read context
+ */
+typedef struct
+{
+    CAdapterCommon *    AdapterCommon;
+    PBYTE               Values;
 }
+SYNCREADCONTEXT, *PSYNCREADCONTEXT;
 
 
 /*****************************************************************************
@@ -483,227 +1204,1430 @@ WaitForReady
 )
 {
     ULONG   timeout = 1000;
+    ULONG   reads = 0;
     UCHAR   status;
 
     do
     {
         status = READ_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR);
+        reads++;
     } while ((status & ALG_STATUS_BUSY_MASK) && --timeout);
 
+    PerfCount(ADLIBGOLD_PERF_CONTROL_IO, reads);
+    if (!timeout)
+    {
+        PerfCount(ADLIBGOLD_PERF_WAIT_TIMEOUT, 1);
+    }
+
     return (timeout > 0);
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::ControlRegWrite()
+ * CAdapterCommon::OPL3Delay()
+ *****************************************************************************
+ * Wait out one OPL3 address or data write, as selected by InitOPL3Timing().
+ */
+void
+CAdapterCommon::
+OPL3Delay
+(   void
+)
+{
+    ULONG i;
+
+    if (m_OPL3DelayReads)
+    {
+        for (i = 0; i < m_OPL3DelayReads; i++)
+        {
+            (void) READ_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_ADDR);
+        }
+        PerfCount(ADLIBGOLD_PERF_OPL3_IO, m_OPL3DelayReads);
+    }
+    else
+    {
+        PerfStall(ADLIBGOLD_PERF_OPL3_STALL_US, m_OPL3DelayUs);
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::SelectControlBank()
+ *****************************************************************************
+ * Switch base+2/3 to the Control Chip unless it is already selected.
+ *
+ * The tracked bank is updated before the port write, and the ISR always
+ * writes the control select itself, so an interrupt in between cannot
+ * leave the hardware and m_Bank disagreeing.  Callers run inside the
+ * interrupt sync (or before the interrupt is connected), which is what
+ * keeps a Control Chip sequence and a bank 1 OPL3 write from switching
+ * the bank under each other.
+ */
+void
+CAdapterCommon::
+SelectControlBank
+(   void
+)
+{
+    if (m_Bank != ALG_BANK_CONTROL)
+    {
+        m_Bank = ALG_BANK_CONTROL;
+        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_CONTROL);
+        PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 1);
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::SelectOPL3Bank()
+ *****************************************************************************
+ * Switch base+2/3 back to OPL3 array 1 unless it is already selected.
+ * The ISR restores OPL3 whenever m_Bank says OPL3, so the tracked bank is
+ * again updated first.
+ */
+void
+CAdapterCommon::
+SelectOPL3Bank
+(   void
+)
+{
+    if (m_Bank != ALG_BANK_OPL3)
+    {
+        m_Bank = ALG_BANK_OPL3;
+        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
+        PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 1);
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::WriteControlRegs()
  *****************************************************************************
- * Write a value to a Control Chip register.
+ * Write a run of Control Chip registers under one bank switch.
  *
- * Performs the full bank-switch sequence:
  *   1. Enable control bank (write 0xFF)
  *   2. Poll SB/RB until ready
- *   3. Write register index
- *   4. Write data value
- *   5. Apply timing delay (register-dependent)
+ *   3. Write register index, then data value
+ *   4. Apply timing delay (register-dependent)
+ *   5. Repeat 2-4 per register, skipping the poll when the previous
+ *      register's completion poll already saw the chip ready
  *   6. Restore OPL3 bank (write 0xFE)
  *
  * Always updates the shadow cache, even if the hardware write is skipped
- * due to power state.
- *
- * CALLER RESPONSIBILITY: After the interrupt is connected, this must be
- * called within InterruptSync->CallSynchronizedRoutine() to prevent
- * races with the ISR.  During Init (before Connect), no sync is needed.
+ * due to power state.  The caller provides the synchronization.
+ */
+void
+CAdapterCommon::
+WriteControlRegs
+(
+    IN      PCONTROLREGWRITE    Writes,
+    IN      ULONG               Count
+)
+{
+    ASSERT(m_pPortBase);
+    ASSERT(Writes || !Count);
+
+    ULONG i;
+
+    /* Only hit hardware if in an acceptable power state */
+    if ((m_PowerState <= PowerDeviceD1) && Count)
+    {
+        BOOLEAN ready = FALSE;
+
+        SelectControlBank();
+
+        for (i = 0; i < Count; i++)
+        {
+            BYTE Register = Writes[i].Register;
+            LONGLONG waitStart = 0;
+
+            if (m_TraceEnabled)
+            {
+                waitStart = KeQueryPerformanceCounter(NULL).QuadPart;
+            }
+
+            if (!ready)
+            {
+                WaitForReady();
+            }
+
+            WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, Register);
+            WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA, Writes[i].Value);
+            PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 2);
+
+            if (waitStart && m_PerfFrequency)
+            {
+                ULONGLONG waited = ULONGLONG(KeQueryPerformanceCounter(NULL).QuadPart -
+                                             waitStart);
+                Trace(ADLIBGOLD_TRACE_CONTROL_WRITE,
+                      Register | (ULONG(Writes[i].Value) << 8),
+                      ULONG(waited * 1000000 / m_PerfFrequency));
+            }
+
+            if (CTRL_REG_IS_SLOW(Register))
+            {
+                /* Registers 4-8: ~450us — poll SB/RB for completion */
+                ready = WaitForReady();
+            }
+            else
+            {
+                if (Register >= 0x09 && Register <= 0x16)
+                {
+                    /* Registers 9-16h: 5us delay */
+                    PerfStall(ADLIBGOLD_PERF_CONTROL_STALL_US, 5);
+                }
+                ready = FALSE;
+            }
+        }
+
+        SelectOPL3Bank();
+    }
+
+    /* Always update shadow cache */
+    for (i = 0; i < Count; i++)
+    {
+        if (Writes[i].Register < CTRL_REG_MAX)
+        {
+            m_ControlRegs[Writes[i].Register] = Writes[i].Value;
+        }
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ControlRegWrite()
+ *****************************************************************************
+ * Write a value to a Control Chip register (see WriteControlRegs()).
+ *
+ * CALLER RESPONSIBILITY: After the interrupt is connected, this must be
+ * called within InterruptSync->CallSynchronizedRoutine() to prevent
+ * races with the ISR.  During Init (before Connect), no sync is needed.
+ * ControlRegWriteBatch() does the synchronization itself.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+ControlRegWrite
+(
+    IN      BYTE    Register,
+    IN      BYTE    Value
+)
+{
+    CONTROLREGWRITE write;
+
+    write.Register = Register;
+    write.Value    = Value;
+
+    WriteControlRegs(&write, 1);
+}
+
+
+/*****************************************************************************
+ * Synchronized Control Chip batch context
+ */
+typedef struct
+{
+    CAdapterCommon *    AdapterCommon;
+    PCONTROLREGWRITE    Writes;
+    ULONG               Count;
+}
+SYNCCONTROLCONTEXT, *PSYNCCONTROLCONTEXT;
+
+
+/*****************************************************************************
+ * SynchronizedControlRegWrite()
+ *****************************************************************************
+ * Synchronized routine for ControlRegWriteBatch().
+ */
+NTSTATUS
+SynchronizedControlRegWrite
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    PSYNCCONTROLCONTEXT context = PSYNCCONTROLCONTEXT(DynamicContext);
+
+    context->AdapterCommon->WriteControlRegs(context->Writes, context->Count);
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ReadControlRegs()
+ *****************************************************************************
+ * Read the Control Chip register file into Values.  Registers 0 and 1
+ * do not read back what was written, so their entries are left alone and
+ * keep whatever the caller had there (normally the shadow).  Reads do not
+ * busy the chip, so one ready poll covers them all.  The caller provides
+ * the synchronization.
+ */
+void
+CAdapterCommon::
+ReadControlRegs
+(
+    OUT     PBYTE   Values
+)
+{
+    ASSERT(m_pPortBase);
+    ASSERT(Values);
+
+    BYTE reg;
+
+    SelectControlBank();
+    WaitForReady();
+
+    for (reg = CTRL_REG_READ_FIRST; reg < CTRL_REG_MAX; reg++)
+    {
+        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, reg);
+        Values[reg] = READ_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA);
+    }
+    PerfCount(ADLIBGOLD_PERF_CONTROL_IO,
+              2 * (CTRL_REG_MAX - CTRL_REG_READ_FIRST));
+
+    SelectOPL3Bank();
+}
+
+
+/*****************************************************************************
+ * SynchronizedControlRegRead()
+ *****************************************************************************
+ * Synchronized routine for LoadControlRegs().
+ */
+NTSTATUS
+SynchronizedControlRegRead
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    PSYNCREADCONTEXT context = PSYNCREADCONTEXT(DynamicContext);
+
+    context->AdapterCommon->ReadControlRegs(context->Values);
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::LoadControlRegs()
+ *****************************************************************************
+ * Refresh the shadow from the chip's register file.  Slow registers with
+ * a deferred write still pending keep their shadow value, which is what
+ * the chip is about to hold.  Non-pageable for the m_MixerLock spinlock.
+ */
+void
+CAdapterCommon::
+LoadControlRegs
+(   void
+)
+{
+    BYTE            values[CTRL_REG_MAX];
+    SYNCREADCONTEXT context;
+    KIRQL           oldIrql;
+    BYTE            reg;
+
+    if (m_PowerState > PowerDeviceD1)
+    {
+        return;
+    }
+
+    context.AdapterCommon = this;
+    context.Values        = values;
+
+    if (m_pInterruptSync)
+    {
+        m_pInterruptSync->CallSynchronizedRoutine(
+            SynchronizedControlRegRead, PVOID(&context));
+    }
+    else
+    {
+        SynchronizedControlRegRead(NULL, PVOID(&context));
+    }
+
+    KeAcquireSpinLock(&m_MixerLock, &oldIrql);
+
+    for (reg = CTRL_REG_READ_FIRST; reg < CTRL_REG_MAX; reg++)
+    {
+        if (!(m_MixerDirty & (1 << reg)))
+        {
+            m_ControlRegs[reg] = values[reg];
+        }
+    }
+
+    KeReleaseSpinLock(&m_MixerLock, oldIrql);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ControlRegWriteBatch()
+ *****************************************************************************
+ * Write several Control Chip registers in one synchronized section with a
+ * single bank switch.  A stereo pair of mixer registers costs one select
+ * and restore and one ready poll between the writes, instead of two full
+ * ControlRegWrite() sequences.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+ControlRegWriteBatch
+(
+    IN      PCONTROLREGWRITE    Writes,
+    IN      ULONG               Count
+)
+{
+    SYNCCONTROLCONTEXT context;
+
+    context.AdapterCommon = this;
+    context.Writes        = Writes;
+    context.Count         = Count;
+
+    if (m_pInterruptSync)
+    {
+        m_pInterruptSync->CallSynchronizedRoutine(
+            SynchronizedControlRegWrite, PVOID(&context));
+    }
+    else
+    {
+        SynchronizedControlRegWrite(NULL, PVOID(&context));
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ControlRegWriteDeferred()
+ *****************************************************************************
+ * Mixer property SETs land here.  A slow register (04h-08h) only has its
+ * shadow updated and is marked dirty; the mixer timer writes the latest
+ * value later, so dragging a slider costs one hardware write per timer
+ * tick rather than a 450us busy-wait per step.  Other registers are cheap
+ * and go straight to the chip.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+ControlRegWriteDeferred
+(
+    IN      BYTE    Register,
+    IN      BYTE    Value
+)
+{
+    if (!CTRL_REG_IS_SLOW(Register))
+    {
+        CONTROLREGWRITE write;
+
+        write.Register = Register;
+        write.Value    = Value;
+
+        ControlRegWriteBatch(&write, 1);
+        return;
+    }
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&m_MixerLock, &oldIrql);
+
+    m_ControlRegs[Register] = Value;
+    m_MixerDirty |= (1 << Register);
+    ArmMixerTimer();
+
+    KeReleaseSpinLock(&m_MixerLock, oldIrql);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ArmMixerTimer()
+ *****************************************************************************
+ * Start the mixer timer unless it is already pending.  Called with
+ * m_MixerLock held.
+ */
+void
+CAdapterCommon::
+ArmMixerTimer
+(   void
+)
+{
+    if (!m_MixerArmed)
+    {
+        LARGE_INTEGER dueTime;
+
+        dueTime.QuadPart = -LONGLONG(CTRL_DEFER_INTERVAL_US) * 10;
+        m_MixerArmed = TRUE;
+        KeSetTimer(&m_MixerTimer, dueTime, &m_MixerDpc);
+    }
+}
+
+
+/*****************************************************************************
+ * Synchronized mixer write context
+ */
+typedef struct
+{
+    CAdapterCommon *    AdapterCommon;
+    BYTE                Register;
+    BYTE                Value;
+    BOOLEAN             Written;
+}
+SYNCMIXERCONTEXT, *PSYNCMIXERCONTEXT;
+
+
+/*****************************************************************************
+ * SynchronizedMixerWrite()
+ *****************************************************************************
+ * Try one deferred mixer write.  Gives up (Written stays FALSE) if SB/RB
+ * say the chip is still busy; the register is retried on the next tick.
+ *
+ * Switching back to OPL3 while the chip is busy with a slow register
+ * would corrupt the write, so the completion poll (~450us, bounded by
+ * WaitForReady's timeout) runs here before OPL3 is restored.  The bank
+ * is never left selected once this returns.
+ */
+NTSTATUS
+SynchronizedMixerWrite
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    PSYNCMIXERCONTEXT context = PSYNCMIXERCONTEXT(DynamicContext);
+    CAdapterCommon *that = context->AdapterCommon;
+
+    context->Written = FALSE;
+
+    if (that->m_PowerState > PowerDeviceD1)
+    {
+        /* The D0 restore writes the shadow; nothing to do now */
+        context->Written = TRUE;
+        return STATUS_SUCCESS;
+    }
+
+    that->SelectControlBank();
+
+    UCHAR status = READ_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR);
+    that->PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 1);
+    if (!(status & ALG_STATUS_BUSY_MASK))
+    {
+        WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR, context->Register);
+        WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_DATA, context->Value);
+        that->PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 2);
+        context->Written = TRUE;
+
+        if (CTRL_REG_IS_SLOW(context->Register))
+        {
+            that->WaitForReady();
+        }
+    }
+
+    that->SelectOPL3Bank();
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ServiceMixerWrites()
+ *****************************************************************************
+ * Mixer timer work: write the lowest dirty slow register from its shadow
+ * value, then re-arm while anything is left.  Each write is waited out
+ * inside the synchronized routine, so one register per tick keeps the
+ * time spent at DIRQL to a single ~450us busy period.
+ */
+void
+CAdapterCommon::
+ServiceMixerWrites
+(   void
+)
+{
+    SYNCMIXERCONTEXT context;
+    ULONG   bit = 0;
+    BYTE    reg;
+
+    context.AdapterCommon = this;
+    context.Register      = 0;
+    context.Value         = 0;
+    context.Written       = FALSE;
+
+    KeAcquireSpinLockAtDpcLevel(&m_MixerLock);
+
+    for (reg = CTRL_REG_MASTER_VOL_L; reg <= CTRL_REG_OUTPUT_MODE; reg++)
+    {
+        if (m_MixerDirty & (1 << reg))
+        {
+            bit = (1 << reg);
+            context.Register = reg;
+            context.Value    = m_ControlRegs[reg];
+            m_MixerDirty &= ~bit;
+            break;
+        }
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&m_MixerLock);
+
+    if (bit)
+    {
+        if (m_pInterruptSync)
+        {
+            m_pInterruptSync->CallSynchronizedRoutine(
+                SynchronizedMixerWrite, PVOID(&context));
+        }
+        else
+        {
+            SynchronizedMixerWrite(NULL, PVOID(&context));
+        }
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&m_MixerLock);
+
+    if (bit && !context.Written)
+    {
+        m_MixerDirty |= bit;
+    }
+
+    m_MixerArmed = FALSE;
+    if (m_MixerDirty)
+    {
+        ArmMixerTimer();
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&m_MixerLock);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::FlushMixerWrites()
+ *****************************************************************************
+ * Write every pending mixer register now, e.g. before the chip's register
+ * file is saved to EEPROM.
+ */
+void
+CAdapterCommon::
+FlushMixerWrites
+(   void
+)
+{
+    CONTROLREGWRITE writes[CTRL_REG_OUTPUT_MODE - CTRL_REG_MASTER_VOL_L + 1];
+    ULONG   count = 0;
+    KIRQL   oldIrql;
+    BYTE    reg;
+
+    KeAcquireSpinLock(&m_MixerLock, &oldIrql);
+
+    for (reg = CTRL_REG_MASTER_VOL_L; reg <= CTRL_REG_OUTPUT_MODE; reg++)
+    {
+        if (m_MixerDirty & (1 << reg))
+        {
+            writes[count].Register = reg;
+            writes[count++].Value  = m_ControlRegs[reg];
+        }
+    }
+    m_MixerDirty = 0;
+
+    KeReleaseSpinLock(&m_MixerLock, oldIrql);
+
+    if (count)
+    {
+        ControlRegWriteBatch(writes, count);
+    }
+}
+
+
+/*****************************************************************************
+ * MixerTimerDPC()
+ *****************************************************************************
+ * Timer DPC for deferred mixer writes.
+ */
+VOID
+NTAPI
+MixerTimerDPC
+(
+    IN      PKDPC   Dpc,
+    IN      PVOID   DeferredContext,
+    IN      PVOID   SystemArgument1,
+    IN      PVOID   SystemArgument2
+)
+{
+    ASSERT(DeferredContext);
+
+    ((CAdapterCommon *)DeferredContext)->ServiceMixerWrites();
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ControlRegRead()
+ *****************************************************************************
+ * Read a Control Chip register value from the shadow cache.
+ */
+STDMETHODIMP_(BYTE)
+CAdapterCommon::
+ControlRegRead
+(
+    IN      BYTE    Register
+)
+{
+    if (Register < CTRL_REG_MAX)
+    {
+        return m_ControlRegs[Register];
+    }
+
+    return 0;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::EnableControlBank()
+ *****************************************************************************
+ * Switch base+2/3 to Control Chip register access.
+ * Must be called within an InterruptSync synchronized routine.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+EnableControlBank
+(   void
+)
+{
+    ASSERT(m_pPortBase);
+    SelectControlBank();
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::EnableOPL3Bank1()
+ *****************************************************************************
+ * Switch base+2/3 to OPL3 array 1 register access.
+ * Must be called within an InterruptSync synchronized routine.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+EnableOPL3Bank1
+(   void
+)
+{
+    ASSERT(m_pPortBase);
+    SelectOPL3Bank();
+}
+
+
+/*****************************************************************************
+ * Synchronized EEPROM command context
+ */
+typedef struct
+{
+    CAdapterCommon *    AdapterCommon;
+    BYTE                Command;        /* CTRL_ID_SAVE or CTRL_ID_RESTORE */
+}
+SYNCEEPROMCONTEXT, *PSYNCEEPROMCONTEXT;
+
+
+/*****************************************************************************
+ * SynchronizedEEPROMCommand()
+ *****************************************************************************
+ * Synchronized routine for SaveToEEPROM() and RestoreFromEEPROM().  The
+ * Control Chip bank stays selected until the command completes, so the
+ * wait runs here too: a save polls RB, a restore has no status bit and
+ * takes a fixed 2.5ms, after which the restored registers are read back
+ * into the shadow cache.
+ */
+NTSTATUS
+SynchronizedEEPROMCommand
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    PSYNCEEPROMCONTEXT context = PSYNCEEPROMCONTEXT(DynamicContext);
+    CAdapterCommon *that = context->AdapterCommon;
+
+    /* Enable control bank */
+    that->SelectControlBank();
+    that->WaitForReady();
+
+    /* Select register 0 (Control/ID) and write the ST or RT bit */
+    WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR, CTRL_REG_CONTROL_ID);
+    WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_DATA, context->Command);
+    that->PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 2);
+
+    if (context->Command == CTRL_ID_SAVE)
+    {
+        /* Wait for RB to clear (hardware auto-clears ST when done) */
+        that->WaitForReady();
+
+        /* Restore OPL3 bank */
+        that->SelectOPL3Bank();
+    }
+    else
+    {
+        /* No status bit — must wait 2.5ms for completion */
+        that->PerfStall(ADLIBGOLD_PERF_CONTROL_STALL_US, 2500);
+
+        /*
+         * Re-read the registers into the shadow cache (the model ID and
+         * telephone control keep theirs); restores OPL3 bank
+         */
+        that->ReadControlRegs(that->m_ControlRegs);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::RunEEPROMCommand()
+ *****************************************************************************
+ * Run an EEPROM save or restore under the interrupt sync.
+ */
+void
+CAdapterCommon::
+RunEEPROMCommand
+(
+    IN      BYTE    Command
+)
+{
+    SYNCEEPROMCONTEXT context;
+
+    context.AdapterCommon = this;
+    context.Command       = Command;
+
+    if (m_pInterruptSync)
+    {
+        m_pInterruptSync->CallSynchronizedRoutine(
+            SynchronizedEEPROMCommand, PVOID(&context));
+    }
+    else
+    {
+        SynchronizedEEPROMCommand(NULL, PVOID(&context));
+    }
+}
+
+
+/*****************************************************************************
+ * Synchronized OPL3 write context
+ */
+typedef struct
+{
+    CAdapterCommon *    AdapterCommon;
+    BYTE                Address;
+    BYTE                Data;
+}
+SYNCOPL3CONTEXT, *PSYNCOPL3CONTEXT;
+
+
+/*****************************************************************************
+ * SynchronizedOPL3Write()
+ *****************************************************************************
+ * Synchronized routine for a bank 1 WriteOPL3(): select OPL3 on base+2/3
+ * (free when it is already the tracked bank) and write the register.
+ */
+NTSTATUS
+SynchronizedOPL3Write
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    PSYNCOPL3CONTEXT context = PSYNCOPL3CONTEXT(DynamicContext);
+    CAdapterCommon *that = context->AdapterCommon;
+
+    that->SelectOPL3Bank();
+    WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR, context->Address);
+    that->OPL3Delay();
+    WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_DATA, context->Data);
+    that->OPL3Delay();
+    that->PerfCount(ADLIBGOLD_PERF_OPL3_IO, 2);
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::WriteOPL3()
+ *****************************************************************************
+ * Write to an OPL3 register with bank coordination.
+ *
+ * Address < 0x100: Bank 0 (ports base+0/1) — no conflict with Control Chip.
+ * Address >= 0x100: Bank 1 (ports base+2/3) — shared with the Control
+ *                   Chip, so the bank select and the write go through the
+ *                   interrupt sync like every Control Chip sequence.
+ *
+ * The wait after each write is chosen at Init (see InitOPL3Timing()).
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+WriteOPL3
+(
+    IN      ULONG   Address,
+    IN      UCHAR   Data
+)
+{
+    ASSERT(m_pPortBase);
+
+    if (m_PowerState > PowerDeviceD1)
+        return;
+
+    if (Address < 0x100)
+    {
+        /*
+         * Bank 0: no conflict with the Control Chip, but Timer 1 belongs
+         * to the adapter clock.  Its preset is ours, and its bits in the
+         * control register are kept whatever the caller wrote (the FM
+         * miniport's board reset masks both timers).
+         */
+        if (Address == OPL3_REG_TIMER1)
+        {
+            Data = m_ClockPreset;
+        }
+        else if ((Address == OPL3_REG_TIMER_CONTROL) &&
+                 !(Data & OPL3_TIMER_IRQ_RESET))
+        {
+            Data = (Data & ~OPL3_TIMER1_BITS) | m_ClockControl;
+        }
+        WriteOPL3Port(BYTE(Address), Data);
+    }
+    else
+    {
+        SYNCOPL3CONTEXT context;
+
+        context.AdapterCommon = this;
+        context.Address       = BYTE(Address & 0xFF);
+        context.Data          = Data;
+
+        if (m_pInterruptSync)
+        {
+            m_pInterruptSync->CallSynchronizedRoutine(
+                SynchronizedOPL3Write, PVOID(&context));
+        }
+        else
+        {
+            SynchronizedOPL3Write(NULL, PVOID(&context));
+        }
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::WriteOPL3Port()
+ *****************************************************************************
+ * Write an array 0 register with the ports held (see m_OPL3PortLock).
+ * Runs at DISPATCH_LEVEL or above so a holder cannot be preempted by
+ * another writer spinning on the same CPU.
+ */
+void
+CAdapterCommon::
+WriteOPL3Port
+(
+    IN      BYTE    Address,
+    IN      BYTE    Data
+)
+{
+    KIRQL oldIrql = KeGetCurrentIrql();
+
+    if (oldIrql < DISPATCH_LEVEL)
+    {
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    }
+
+    /* Held for one register write by another CPU at most */
+    while (InterlockedExchange((PLONG)&m_OPL3PortLock, 1))
+    {
+        ;
+    }
+
+    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_ADDR, Address);
+    OPL3Delay();
+    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_DATA, Data);
+    OPL3Delay();
+    PerfCount(ADLIBGOLD_PERF_OPL3_IO, 2);
+
+    ReleaseOPL3Port();
+
+    if (oldIrql < DISPATCH_LEVEL)
+    {
+        KeLowerIrql(oldIrql);
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ReleaseOPL3Port()
+ *****************************************************************************
+ * Release the array 0 ports, first writing any timer reset the ISR left
+ * pending.  The second test catches an ISR that found the ports still
+ * held after the first; one that comes after the release writes its own.
+ */
+void
+CAdapterCommon::
+ReleaseOPL3Port(void)
+{
+    for (;;)
+    {
+        if (m_OPL3AckPending)
+        {
+            m_OPL3AckPending = FALSE;
+            WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_ADDR, OPL3_REG_TIMER_CONTROL);
+            OPL3Delay();
+            WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_DATA, OPL3_TIMER_IRQ_RESET);
+            OPL3Delay();
+            PerfCount(ADLIBGOLD_PERF_OPL3_IO, 2);
+        }
+
+        InterlockedExchange((PLONG)&m_OPL3PortLock, 0);
+
+        if (!m_OPL3AckPending ||
+            InterlockedExchange((PLONG)&m_OPL3PortLock, 1))
+        {
+            break;
+        }
+    }
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::WriteOPL3Clock()
+ *****************************************************************************
+ * Program Timer 1 from m_ClockPreset and m_ClockControl.  Timer 2 is left
+ * masked and stopped, as the FM miniport leaves it.
+ */
+void
+CAdapterCommon::
+WriteOPL3Clock(void)
+{
+    if (m_PowerState > PowerDeviceD1)
+        return;
+
+    WriteOPL3Port(OPL3_REG_TIMER1, m_ClockPreset);
+    WriteOPL3Port(OPL3_REG_TIMER_CONTROL, OPL3_TIMER_IRQ_RESET);
+    WriteOPL3Port(OPL3_REG_TIMER_CONTROL, OPL3_TIMER2_MASK | m_ClockControl);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::StartOPL3Clock()
+ *****************************************************************************
+ * Start Timer 1 interrupting every PeriodTicks * 80us and calling Routine
+ * from the clock DPC.  The timer is a free-running hardware source, so
+ * the interrupt period does not drift with DPC latency; Ticks tells the
+ * callback how much time really passed.
+ */
+STDMETHODIMP_(NTSTATUS)
+CAdapterCommon::
+StartOPL3Clock
+(
+    IN      ULONG                       PeriodTicks,
+    IN      PADLIBGOLD_CLOCK_ROUTINE    Routine,
+    IN      PVOID                       Context
+)
+{
+    KIRQL oldIrql;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+    ASSERT(Routine);
+
+    if (!PeriodTicks || (PeriodTicks > OPL3_TIMER1_MAX_PERIOD))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireSpinLock(&m_ClockLock, &oldIrql);
+    if (m_ClockRoutine)
+    {
+        KeReleaseSpinLock(&m_ClockLock, oldIrql);
+        return STATUS_DEVICE_BUSY;
+    }
+    m_ClockRoutine = Routine;
+    m_ClockContext = Context;
+    KeReleaseSpinLock(&m_ClockLock, oldIrql);
+
+    m_ClockTicks   = 0;
+    m_ClockPeriod  = PeriodTicks;
+    m_ClockPreset  = BYTE(OPL3_TIMER1_MAX_PERIOD - PeriodTicks);
+    m_ClockControl = OPL3_TIMER1_START;
+    m_ClockRunning = TRUE;
+
+    WriteOPL3Clock();
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("StartOPL3Clock: %dus period",
+        PeriodTicks * OPL3_TIMER1_TICK_US));
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::StopOPL3Clock()
+ *****************************************************************************
+ * Mask and stop Timer 1, then wait out any callback in progress.  A clock
+ * DPC still queued finds no routine and returns.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+StopOPL3Clock(void)
+{
+    KIRQL oldIrql;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    m_ClockRunning = FALSE;
+    m_ClockControl = OPL3_TIMER1_MASK;
+    WriteOPL3Clock();
+
+    KeAcquireSpinLock(&m_ClockLock, &oldIrql);
+    m_ClockRoutine = NULL;
+    m_ClockContext = NULL;
+    KeReleaseSpinLock(&m_ClockLock, oldIrql);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::WriteMMA()
+ *****************************************************************************
+ * Write to a YMZ263 MMA register (Channel 0).
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+WriteMMA
+(
+    IN      BYTE    Register,
+    IN      BYTE    Value
+)
+{
+    WriteMMAChannel(MMA_CHANNEL_0, Register, Value);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ReadMMA()
+ *****************************************************************************
+ * Read from a YMZ263 MMA register (Channel 0).
+ */
+STDMETHODIMP_(BYTE)
+CAdapterCommon::
+ReadMMA
+(
+    IN      BYTE    Register
+)
+{
+    return ReadMMAChannel(MMA_CHANNEL_0, Register);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::WriteMMAChannel()
+ *****************************************************************************
+ * Write to a YMZ263 MMA register on the given channel.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+WriteMMAChannel
+(
+    IN      BYTE    Channel,
+    IN      BYTE    Register,
+    IN      BYTE    Value
+)
+{
+    ASSERT(m_pPortBase);
+    ASSERT(Channel < MMA_CHANNELS);
+
+    if (m_PowerState > PowerDeviceD1)
+        return;
+
+    WRITE_PORT_UCHAR(m_pPortBase + MMA_ADDR_PORT(Channel), Register);
+    PerfStall(ADLIBGOLD_PERF_MMA_STALL_US, 1);
+    WRITE_PORT_UCHAR(m_pPortBase + MMA_DATA_PORT(Channel), Value);
+    PerfStall(ADLIBGOLD_PERF_MMA_STALL_US, 1);
+    PerfCount(ADLIBGOLD_PERF_MMA_IO, 2);
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::ReadMMAChannel()
+ *****************************************************************************
+ * Read from a YMZ263 MMA register on the given channel.
+ */
+STDMETHODIMP_(BYTE)
+CAdapterCommon::
+ReadMMAChannel
+(
+    IN      BYTE    Channel,
+    IN      BYTE    Register
+)
+{
+    ASSERT(m_pPortBase);
+    ASSERT(Channel < MMA_CHANNELS);
+
+    if (m_PowerState > PowerDeviceD1)
+        return 0;
+
+    WRITE_PORT_UCHAR(m_pPortBase + MMA_ADDR_PORT(Channel), Register);
+    PerfStall(ADLIBGOLD_PERF_MMA_STALL_US, 1);
+    PerfCount(ADLIBGOLD_PERF_MMA_IO, 2);
+    return READ_PORT_UCHAR(m_pPortBase + MMA_DATA_PORT(Channel));
+}
+
+
+/*****************************************************************************
+ * CAdapterCommon::WriteMMABurst()
+ *****************************************************************************
+ * Write a run of bytes to one YMZ263 FIFO register on the given channel.
+ * The register index is latched once; the data port then takes every byte
+ * back to back, the ISA cycle itself providing the spacing.
  */
 STDMETHODIMP_(void)
 CAdapterCommon::
-ControlRegWrite
+WriteMMABurst
 (
+    IN      BYTE    Channel,
     IN      BYTE    Register,
-    IN      BYTE    Value
+    IN      PUCHAR  Buffer,
+    IN      ULONG   Count
 )
 {
     ASSERT(m_pPortBase);
+    ASSERT(Buffer || !Count);
 
-    /* Only hit hardware if in an acceptable power state */
-    if (m_PowerState <= PowerDeviceD1)
-    {
-        /* 1. Enable control bank */
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_CONTROL);
-
-        /* 2. Poll until not busy */
-        WaitForReady();
+    if ((m_PowerState > PowerDeviceD1) || !Count)
+        return;
 
-        /* 3. Write register index */
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, Register);
+    WRITE_PORT_UCHAR(m_pPortBase + MMA_ADDR_PORT(Channel), Register);
+    PerfStall(ADLIBGOLD_PERF_MMA_STALL_US, 1);
+    WRITE_PORT_BUFFER_UCHAR(m_pPortBase + MMA_DATA_PORT(Channel), Buffer, Count);
+    PerfCount(ADLIBGOLD_PERF_MMA_IO, 1 + Count);
+}
 
-        /* 4. Write data value */
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA, Value);
 
-        /* 5. Apply required delay based on register number */
-        if (Register >= 0x04 && Register <= 0x08)
-        {
-            /* Registers 4-8: ~450us — poll SB/RB for completion */
-            WaitForReady();
-        }
-        else if (Register >= 0x09 && Register <= 0x16)
-        {
-            /* Registers 9-16h: 5us delay */
-            KeStallExecutionProcessor(5);
-        }
+/*****************************************************************************
+ * CAdapterCommon::ReadMMABurst()
+ *****************************************************************************
+ * Read a run of bytes from one YMZ263 FIFO register on the given channel.
+ */
+STDMETHODIMP_(void)
+CAdapterCommon::
+ReadMMABurst
+(
+    IN      BYTE    Channel,
+    IN      BYTE    Register,
+    OUT     PUCHAR  Buffer,
+    IN      ULONG   Count
+)
+{
+    ASSERT(m_pPortBase);
+    ASSERT(Buffer || !Count);
 
-        /* 6. Restore OPL3 bank 1 access */
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
-    }
+    if (!Count)
+        return;
 
-    /* Always update shadow cache */
-    if (Register < CTRL_REG_MAX)
+    if (m_PowerState > PowerDeviceD1)
     {
-        m_ControlRegs[Register] = Value;
+        RtlZeroMemory(Buffer, Count);
+        return;
     }
+
+    WRITE_PORT_UCHAR(m_pPortBase + MMA_ADDR_PORT(Channel), Register);
+    PerfStall(ADLIBGOLD_PERF_MMA_STALL_US, 1);
+    READ_PORT_BUFFER_UCHAR(m_pPortBase + MMA_DATA_PORT(Channel), Buffer, Count);
+    PerfCount(ADLIBGOLD_PERF_MMA_IO, 1 + Count);
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::ControlRegRead()
+ * CAdapterCommon::ReadMMAStatus()
  *****************************************************************************
- * Read a Control Chip register value from the shadow cache.
+ * Read an MMA channel's status port from the service DPC.  The read clears
+ * every pending bit, so bits the caller does not handle itself are kept
+ * for the DPC's next pass instead of being lost.
+ *
+ * Must be called with m_MmaLock held (i.e. from a miniport's ServiceWave
+ * or ServiceMidi callback).
  */
 STDMETHODIMP_(BYTE)
 CAdapterCommon::
-ControlRegRead
+ReadMMAStatus
 (
-    IN      BYTE    Register
+    IN      BYTE    Channel,
+    IN      BYTE    Handled
 )
 {
-    if (Register < CTRL_REG_MAX)
-    {
-        return m_ControlRegs[Register];
-    }
+    ASSERT(m_pPortBase);
+    ASSERT(Channel < MMA_CHANNELS);
 
-    return 0;
+    if (m_PowerState > PowerDeviceD1)
+        return 0;
+
+    BYTE status = READ_PORT_UCHAR(m_pPortBase + MMA_ADDR_PORT(Channel));
+    PerfCount(ADLIBGOLD_PERF_MMA_IO, 1);
+
+    m_DpcMmaStatus[Channel] |= (status & ~Handled) & MMA_STATUS_SERVICE;
+
+    return status;
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::EnableControlBank()
+ * CAdapterCommon::CallMmaSynchronized()
  *****************************************************************************
- * Switch base+2/3 to Control Chip register access.
- * Must be called within an InterruptSync synchronized routine.
+ * Run a routine under the MMA lock.  The ISR no longer touches the MMA
+ * register index, so code that programs the FIFO or MIDI registers only
+ * has to exclude the service DPC, not the interrupt.
  */
-STDMETHODIMP_(void)
+STDMETHODIMP_(NTSTATUS)
 CAdapterCommon::
-EnableControlBank
-(   void
+CallMmaSynchronized
+(
+    IN      PINTERRUPTSYNCROUTINE   Routine,
+    IN      PVOID                   DynamicContext
 )
 {
-    ASSERT(m_pPortBase);
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_CONTROL);
+    ASSERT(Routine);
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&m_MmaLock, &oldIrql);
+
+    NTSTATUS ntStatus = Routine(m_pInterruptSync, DynamicContext);
+
+    KeReleaseSpinLock(&m_MmaLock, oldIrql);
+
+    return ntStatus;
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::EnableOPL3Bank1()
+ * CAdapterCommon::SetFMSynth()
  *****************************************************************************
- * Switch base+2/3 to OPL3 array 1 register access.
- * Must be called within an InterruptSync synchronized routine.
+ * Register (or with NULL, unregister) the FM synth as the soft-thru
+ * target.  Taking the MMA lock waits out a ServiceMidi that is using the
+ * old pointer, so the synth may go away as soon as this returns.
  */
 STDMETHODIMP_(void)
 CAdapterCommon::
-EnableOPL3Bank1
-(   void
+SetFMSynth
+(
+    IN      PFMSYNTHADLIBGOLD   Synth
 )
 {
-    ASSERT(m_pPortBase);
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&m_MmaLock, &oldIrql);
+
+    m_pFMSynth = Synth;
+
+    KeReleaseSpinLock(&m_MmaLock, oldIrql);
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::WriteOPL3()
+ * CAdapterCommon::QueryPerfCounters()
  *****************************************************************************
- * Write to an OPL3 register with bank coordination.
- *
- * Address < 0x100: Bank 0 (ports base+0/1) — no conflict with Control Chip.
- * Address >= 0x100: Bank 1 (ports base+2/3) — ensure OPL3 mode first.
+ * Sum the per-CPU hot-path counters into Totals and/or zero them.  No
+ * lock: a count that races the reset may survive it or be lost.
  */
 STDMETHODIMP_(void)
 CAdapterCommon::
-WriteOPL3
+QueryPerfCounters
 (
-    IN      ULONG   Address,
-    IN      UCHAR   Data
+    OUT     PADLIBGOLD_PERF_COUNTERS    Totals  OPTIONAL,
+    IN      BOOLEAN                     Reset
 )
 {
-    ASSERT(m_pPortBase);
-
-    if (m_PowerState > PowerDeviceD1)
-        return;
+    ULONG cpu, i;
 
-    if (Address < 0x100)
+    if (Totals)
     {
-        /* Bank 0: direct access, no conflict */
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_ADDR, (UCHAR)Address);
-        KeStallExecutionProcessor(23);
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM0_DATA, Data);
-        KeStallExecutionProcessor(23);
+        RtlZeroMemory(Totals, sizeof(*Totals));
+        for (cpu = 0; cpu < ALG_PERF_CPUS; cpu++)
+        {
+            for (i = 0; i < ADLIBGOLD_PERF_COUNTERS; i++)
+            {
+                Totals->Counter[i] += m_Perf[cpu].Perf.Counter[i];
+            }
+        }
     }
-    else
+
+    if (Reset)
     {
-        /* Bank 1: ensure OPL3 mode, then write */
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, (UCHAR)(Address & 0xFF));
-        KeStallExecutionProcessor(23);
-        WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA, Data);
-        KeStallExecutionProcessor(23);
+        RtlZeroMemory(m_Perf, ALG_PERF_CPUS * sizeof(ALG_PERF_BLOCK));
     }
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::WriteMMA()
+ * CAdapterCommon::WriteTraceRecord()
  *****************************************************************************
- * Write to a YMZ263 MMA register (Channel 0).
+ * Store one trace record.  Safe at any IRQL, the ISR included: the slot
+ * is claimed with an interlocked increment and nothing waits.
  */
-STDMETHODIMP_(void)
+void
 CAdapterCommon::
-WriteMMA
+WriteTraceRecord
 (
-    IN      BYTE    Register,
-    IN      BYTE    Value
+    IN      ULONG   Event,
+    IN      ULONG   Arg0,
+    IN      ULONG   Arg1
 )
 {
-    ASSERT(m_pPortBase);
+    ULONG sequence = ULONG(InterlockedIncrement((PLONG)&m_TraceSequence));
+    PADLIBGOLD_TRACE_RECORD record = &m_Trace[sequence & ALG_TRACE_MASK];
 
-    if (m_PowerState > PowerDeviceD1)
-        return;
+    *(volatile ULONG *)&record->Sequence = 0;
+
+    record->Event     = USHORT(Event);
+    record->Processor = UCHAR(KeGetCurrentProcessorNumber());
+    record->Time      = KeQueryPerformanceCounter(NULL).QuadPart;
+    record->Arg[0]    = Arg0;
+    record->Arg[1]    = Arg1;
 
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_MMA0_ADDR, Register);
-    KeStallExecutionProcessor(1);
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_MMA0_DATA, Value);
-    KeStallExecutionProcessor(1);
+    *(volatile ULONG *)&record->Sequence = sequence;
 }
 
 
 /*****************************************************************************
- * CAdapterCommon::ReadMMA()
+ * CAdapterCommon::ReadTrace()
  *****************************************************************************
- * Read from a YMZ263 MMA register (Channel 0).
+ * Copy the newest finished records that fit in Size bytes, oldest first.
+ * Records overwritten or still being written during the copy are left
+ * out, which shows up as a gap in the sequence numbers.
  */
-STDMETHODIMP_(BYTE)
+STDMETHODIMP_(ULONG)
 CAdapterCommon::
-ReadMMA
+ReadTrace
 (
-    IN      BYTE    Register
+    OUT     PADLIBGOLD_TRACE    Buffer,
+    IN      ULONG               Size
 )
 {
-    ASSERT(m_pPortBase);
+    ASSERT(Buffer);
+    ASSERT(Size >= FIELD_OFFSET(ADLIBGOLD_TRACE, Record));
 
-    if (m_PowerState > PowerDeviceD1)
-        return 0;
+    ULONG room = (Size - FIELD_OFFSET(ADLIBGOLD_TRACE, Record)) /
+                 sizeof(ADLIBGOLD_TRACE_RECORD);
+    ULONG last = ULONG(m_TraceSequence);
+    ULONG first;
+    ULONG sequence;
+    ULONG count = 0;
+
+    if (room > ADLIBGOLD_TRACE_RECORDS)
+    {
+        room = ADLIBGOLD_TRACE_RECORDS;
+    }
+    first = (last > room) ? last - room + 1 : 1;
+
+    for (sequence = first; sequence <= last; sequence++)
+    {
+        PADLIBGOLD_TRACE_RECORD record = &m_Trace[sequence & ALG_TRACE_MASK];
+
+        if (*(volatile ULONG *)&record->Sequence != sequence)
+        {
+            continue;
+        }
+
+        Buffer->Record[count] = *record;
+
+        /* Drop it if a writer took the slot while we copied */
+        if (*(volatile ULONG *)&record->Sequence == sequence)
+        {
+            count++;
+        }
+    }
+
+    Buffer->Frequency    = m_PerfFrequency;
+    Buffer->NextSequence = last + 1;
+    Buffer->Count        = count;
 
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_MMA0_ADDR, Register);
-    KeStallExecutionProcessor(1);
-    return READ_PORT_UCHAR(m_pPortBase + ALG_REG_MMA0_DATA);
+    return FIELD_OFFSET(ADLIBGOLD_TRACE, Record) +
+           count * sizeof(ADLIBGOLD_TRACE_RECORD);
 }
 
 
@@ -714,6 +2638,10 @@ ReadMMA
  *
  * Reads the Control Chip status register to determine interrupt source(s).
  * Note: interrupt status bits are ACTIVE LOW (0 = pending).
+ *
+ * Only the acknowledgement happens here: each status register is read
+ * once (which clears it), the MMA bits are latched for the service DPC,
+ * and the line is released.  FIFO transfers run in InterruptServiceDPC.
  */
 NTSTATUS
 InterruptServiceRoutine
@@ -728,50 +2656,236 @@ InterruptServiceRoutine
     CAdapterCommon *that = (CAdapterCommon *)DynamicContext;
     ASSERT(that->m_pPortBase);
 
-    /* Enable control bank to read status */
+    that->PerfCount(ADLIBGOLD_PERF_ISR, 1);
+    that->Trace(ADLIBGOLD_TRACE_ISR_ENTRY, 0, 0);
+
+    /*
+     * Enable control bank to read status.  The select is always written
+     * (the interrupted code may be about to write it itself); the restore
+     * is skipped when that code has the Control Chip bank selected.
+     */
     WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_CONTROL);
     UCHAR status = READ_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR);
-    WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
+    if (that->m_Bank != ALG_BANK_CONTROL)
+    {
+        WRITE_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
+        that->PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 1);
+    }
+    that->PerfCount(ADLIBGOLD_PERF_CONTROL_IO, 2);
 
     /*
      * If all IRQ source bits are 1 (inactive), this is not our interrupt.
      */
     if ((status & ALG_STATUS_IRQ_MASK) == ALG_STATUS_IRQ_MASK)
     {
+        that->PerfCount(ADLIBGOLD_PERF_ISR_NOT_OURS, 1);
+        that->Trace(ADLIBGOLD_TRACE_ISR_EXIT, status, ULONG(~0));
         return STATUS_UNSUCCESSFUL;
     }
 
+    ULONG mmaTrace = 0;
+
     /* Sampling/MMA interrupt (D1 = 0 means pending) */
     if (!(status & ALG_STATUS_SMP_IRQ))
     {
         /*
-         * Read MMA status once.  Status bits auto-clear on read,
-         * so a single read must serve both wave (PRQ) and MIDI (RRQ).
+         * Read each MMA channel's status once.  Status bits auto-clear on
+         * read, so channel 0's read must serve both wave (PRQ) and MIDI
+         * (RRQ).  Reading the address port leaves the register index
+         * alone, so this cannot disturb a FIFO transfer in the DPC.
          */
-        UCHAR mmaStatus = READ_PORT_UCHAR(that->m_pPortBase + ALG_REG_MMA0_ADDR);
+        UCHAR mma0Status = READ_PORT_UCHAR(that->m_pPortBase + ALG_REG_MMA0_ADDR);
+        UCHAR mma1Status = READ_PORT_UCHAR(that->m_pPortBase + ALG_REG_MMA1_ADDR);
+        that->PerfCount(ADLIBGOLD_PERF_MMA_IO, 2);
+        mmaTrace = mma0Status | (ULONG(mma1Status) << 8);
 
-        if (that->m_pWaveMiniport)
-        {
-            that->m_pWaveMiniport->ServiceWaveISR();
-        }
+        mma0Status &= MMA_STATUS_SERVICE;
+        mma1Status &= MMA_STATUS_PRQ;
 
-        if ((mmaStatus & MMA_STATUS_RRQ) && that->m_pMidiMiniport)
+        if (mma0Status | mma1Status)
         {
-            that->m_pMidiMiniport->ServiceMidiISR();
+            /*
+             * Stamp MIDI input here rather than in the DPC, so capture
+             * times do not carry DPC scheduling jitter.
+             */
+            if ((mma0Status & MMA_STATUS_RRQ) && !that->m_IsrRxTime)
+            {
+                that->m_IsrRxTime = KeQueryPerformanceCounter(NULL).QuadPart;
+            }
+
+            that->m_IsrMmaStatus[MMA_CHANNEL_0] |= mma0Status;
+            that->m_IsrMmaStatus[MMA_CHANNEL_1] |= mma1Status;
+
+            KeInsertQueueDpc(&that->m_ServiceDpc, NULL, NULL);
         }
     }
 
     /* FM/OPL3 timer interrupt (D0 = 0 means pending) */
     if (!(status & ALG_STATUS_FM_IRQ))
     {
-        /* Read OPL3 status to acknowledge */
-        READ_PORT_UCHAR(that->m_pPortBase + ALG_REG_FM0_ADDR);
+        /*
+         * Reset the timer flags, which releases the line.  If WriteOPL3
+         * has the array 0 ports, its release writes the reset for us.
+         */
+        that->m_OPL3AckPending = TRUE;
+        if (!InterlockedExchange((PLONG)&that->m_OPL3PortLock, 1))
+        {
+            that->ReleaseOPL3Port();
+        }
+
+        if (that->m_ClockRunning)
+        {
+            that->m_ClockTicks += that->m_ClockPeriod;
+            that->PerfCount(ADLIBGOLD_PERF_CLOCK_TICK, 1);
+            KeInsertQueueDpc(&that->m_ClockDpc, NULL, NULL);
+        }
+    }
+
+    that->Trace(ADLIBGOLD_TRACE_ISR_EXIT, status, mmaTrace);
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CollectMmaStatus()
+ *****************************************************************************
+ * Synchronized routine: move the status the ISR latched over to the DPC.
+ */
+NTSTATUS
+CollectMmaStatus
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    CAdapterCommon *that = (CAdapterCommon *)DynamicContext;
+
+    for (ULONG ch = 0; ch < MMA_CHANNELS; ch++)
+    {
+        that->m_DpcMmaStatus[ch] |= that->m_IsrMmaStatus[ch];
+        that->m_IsrMmaStatus[ch]  = 0;
     }
 
+    if (!that->m_DpcRxTime)
+    {
+        that->m_DpcRxTime = that->m_IsrRxTime;
+    }
+    that->m_IsrRxTime = 0;
+
     return STATUS_SUCCESS;
 }
 
 
+/*****************************************************************************
+ * InterruptServiceDPC()
+ *****************************************************************************
+ * Deferred half of the ISR.  Takes the MMA lock, collects the latched
+ * status and hands each request to its miniport: PRQ on either channel to
+ * the wave miniport, RRQ/TXRQ on channel 0 to the MIDI miniport.  Requests the
+ * miniports uncover on their own status reads (ReadMMAStatus) or that the
+ * ISR latches meanwhile are picked up by the next pass.
+ */
+VOID
+NTAPI
+InterruptServiceDPC
+(
+    IN      PKDPC   Dpc,
+    IN      PVOID   DeferredContext,
+    IN      PVOID   SystemArgument1,
+    IN      PVOID   SystemArgument2
+)
+{
+    CAdapterCommon *that = (CAdapterCommon *)DeferredContext;
+    ASSERT(that);
+
+    BYTE status[MMA_CHANNELS];
+    ULONG ch;
+    LONGLONG start = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    KeAcquireSpinLockAtDpcLevel(&that->m_MmaLock);
+
+    for (;;)
+    {
+        if (that->m_pInterruptSync)
+        {
+            that->m_pInterruptSync->CallSynchronizedRoutine(
+                CollectMmaStatus, PVOID(that));
+        }
+
+        for (ch = 0; ch < MMA_CHANNELS; ch++)
+        {
+            status[ch] = that->m_DpcMmaStatus[ch];
+            that->m_DpcMmaStatus[ch] = 0;
+        }
+
+        if (!(status[MMA_CHANNEL_0] | status[MMA_CHANNEL_1]))
+        {
+            break;
+        }
+
+        if (that->m_pWaveMiniport)
+        {
+            for (ch = 0; ch < MMA_CHANNELS; ch++)
+            {
+                if (status[ch] & MMA_STATUS_PRQ)
+                {
+                    that->Trace(ADLIBGOLD_TRACE_SERVICE_WAVE, ch, status[ch]);
+                    that->m_pWaveMiniport->ServiceWave(ch);
+                }
+            }
+        }
+
+        if ((status[MMA_CHANNEL_0] & MMA_STATUS_MIDI) && that->m_pMidiMiniport)
+        {
+            that->Trace(ADLIBGOLD_TRACE_SERVICE_MIDI, status[MMA_CHANNEL_0], 0);
+            that->m_pMidiMiniport->ServiceMidi(status[MMA_CHANNEL_0],
+                                               that->m_DpcRxTime);
+        }
+        that->m_DpcRxTime = 0;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&that->m_MmaLock);
+
+    if (that->m_PerfFrequency)
+    {
+        ULONGLONG elapsed = ULONGLONG(KeQueryPerformanceCounter(NULL).QuadPart - start);
+        that->PerfCount(ADLIBGOLD_PERF_SERVICE_US,
+                        ULONG(elapsed * 1000000 / that->m_PerfFrequency));
+    }
+}
+
+
+/*****************************************************************************
+ * ClockDPC()
+ *****************************************************************************
+ * Deliver OPL3 clock ticks.  Several interrupts may be folded into one
+ * call; the routine reads the elapsed count, not the number of calls.
+ */
+VOID
+NTAPI
+ClockDPC
+(
+    IN      PKDPC   Dpc,
+    IN      PVOID   DeferredContext,
+    IN      PVOID   SystemArgument1,
+    IN      PVOID   SystemArgument2
+)
+{
+    CAdapterCommon *that = (CAdapterCommon *)DeferredContext;
+    ASSERT(that);
+
+    KeAcquireSpinLockAtDpcLevel(&that->m_ClockLock);
+
+    if (that->m_ClockRoutine)
+    {
+        that->m_ClockRoutine(that->m_ClockContext, that->m_ClockTicks);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&that->m_ClockLock);
+}
+
+
 /*****************************************************************************
  * Pageable code — registry persistence and EEPROM
  */
@@ -834,8 +2948,8 @@ RestoreMixerSettingsFromRegistry
                 /* New key — write defaults */
                 for (ULONG i = 0; i < SIZEOF_ARRAY(DefaultMixerSettings); i++)
                 {
-                    ControlRegWrite(DefaultMixerSettings[i].RegisterIndex,
-                                    DefaultMixerSettings[i].RegisterSetting);
+                    ControlRegUpdate(DefaultMixerSettings[i].RegisterIndex,
+                                     DefaultMixerSettings[i].RegisterSetting);
                 }
             }
             else
@@ -868,7 +2982,7 @@ RestoreMixerSettingsFromRegistry
 
                             if (PartialInfo->DataLength == sizeof(DWORD))
                             {
-                                ControlRegWrite(
+                                ControlRegUpdate(
                                     DefaultMixerSettings[i].RegisterIndex,
                                     BYTE(*(PDWORD(PartialInfo->Data)))
                                 );
@@ -877,7 +2991,7 @@ RestoreMixerSettingsFromRegistry
                         else
                         {
                             /* Key missing — use default */
-                            ControlRegWrite(
+                            ControlRegUpdate(
                                 DefaultMixerSettings[i].RegisterIndex,
                                 DefaultMixerSettings[i].RegisterSetting
                             );
@@ -891,8 +3005,8 @@ RestoreMixerSettingsFromRegistry
                     /* Allocation failed — use defaults */
                     for (ULONG i = 0; i < SIZEOF_ARRAY(DefaultMixerSettings); i++)
                     {
-                        ControlRegWrite(DefaultMixerSettings[i].RegisterIndex,
-                                        DefaultMixerSettings[i].RegisterSetting);
+                        ControlRegUpdate(DefaultMixerSettings[i].RegisterIndex,
+                                         DefaultMixerSettings[i].RegisterSetting);
                     }
                     ntStatus = STATUS_INSUFFICIENT_RESOURCES;
                 }
@@ -1002,21 +3116,11 @@ SaveToEEPROM
     if (m_PowerState > PowerDeviceD1)
         return STATUS_DEVICE_POWERED_OFF;
 
-    /* Enable control bank */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_CONTROL);
-    WaitForReady();
-
-    /* Select register 0 (Control/ID) */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, CTRL_REG_CONTROL_ID);
+    /* The EEPROM takes the chip's registers, so land pending mixer writes */
+    FlushMixerWrites();
 
     /* Write ST bit (D1) to trigger EEPROM save */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA, CTRL_ID_SAVE);
-
-    /* Wait for RB to clear (hardware auto-clears ST when done) */
-    WaitForReady();
-
-    /* Restore OPL3 bank */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
+    RunEEPROMCommand(CTRL_ID_SAVE);
 
     return STATUS_SUCCESS;
 }
@@ -1039,37 +3143,17 @@ RestoreFromEEPROM
     if (m_PowerState > PowerDeviceD1)
         return STATUS_DEVICE_POWERED_OFF;
 
-    /* Enable control bank */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_CONTROL);
-    WaitForReady();
-
-    /* Select register 0 (Control/ID) */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, CTRL_REG_CONTROL_ID);
+    /* Write RT bit (D0) to trigger EEPROM restore; re-reads the shadow */
+    RunEEPROMCommand(CTRL_ID_RESTORE);
 
-    /* Write RT bit (D0) to trigger EEPROM restore */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA, CTRL_ID_RESTORE);
-
-    /* No status bit — must wait 2.5ms for completion */
-    KeStallExecutionProcessor(2500);
-
-    /* Re-read all registers into shadow cache */
-    WaitForReady();
+    /* The restored values replace any mixer writes still pending */
     {
-        BYTE reg;
-        for (reg = 0; reg < CTRL_REG_MAX; reg++)
-        {
-            WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, reg);
-            m_ControlRegs[reg] = READ_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_DATA);
-        }
+        KIRQL oldIrql;
+        KeAcquireSpinLock(&m_MixerLock, &oldIrql);
+        m_MixerDirty = 0;
+        KeReleaseSpinLock(&m_MixerLock, oldIrql);
     }
 
-    /* Restore OPL3 bank */
-    WRITE_PORT_UCHAR(m_pPortBase + ALG_REG_FM1_ADDR, ALG_BANK_OPL3);
-
-    /* Update model fields from the refreshed cache */
-    m_CardModel   = m_ControlRegs[CTRL_REG_CONTROL_ID] & CTRL_ID_MODEL_MASK;
-    m_CardOptions = m_ControlRegs[CTRL_REG_CONTROL_ID];
-
     return STATUS_SUCCESS;
 }
 
@@ -1102,16 +3186,71 @@ PowerChangeState
         case PowerDeviceD0:
             /*
              * Entering full power.  Restore mixer registers from the
-             * shadow cache to hardware.  Must set m_PowerState first
-             * so ControlRegWrite will hit the hardware.
+             * shadow cache to hardware, comparing against what the chip
+             * came back with (often all of it, if the card kept power or
+             * reloaded the settings from its EEPROM).  Differing fast
+             * registers are written now; slow ones go to the mixer
+             * timer so the wake path does not spin ~450us on each.
+             * Must set m_PowerState first so the writes hit the hardware.
              */
             m_PowerState = NewState.DeviceState;
             {
-                BYTE i;
+                CONTROLREGWRITE writes[CTRL_MIXER_LAST - CTRL_MIXER_FIRST + 1];
+                BYTE    values[CTRL_REG_MAX];
+                SYNCREADCONTEXT context;
+                ULONG   count = 0;
+                ULONG   dirty = 0;
+                KIRQL   oldIrql;
+                BYTE    i;
+
+                context.AdapterCommon = this;
+                context.Values        = values;
+
+                if (m_pInterruptSync)
+                {
+                    m_pInterruptSync->CallSynchronizedRoutine(
+                        SynchronizedControlRegRead, PVOID(&context));
+                }
+                else
+                {
+                    SynchronizedControlRegRead(NULL, PVOID(&context));
+                }
+
+                KeAcquireSpinLock(&m_MixerLock, &oldIrql);
+
                 for (i = CTRL_MIXER_FIRST; i <= CTRL_MIXER_LAST; i++)
                 {
-                    ControlRegWrite(i, m_ControlRegs[i]);
+                    if (values[i] == m_ControlRegs[i])
+                    {
+                        continue;
+                    }
+                    if (CTRL_REG_IS_SLOW(i))
+                    {
+                        dirty |= (1 << i);
+                    }
+                    else
+                    {
+                        writes[count].Register = i;
+                        writes[count++].Value  = m_ControlRegs[i];
+                    }
+                }
+
+                /* Supersedes the deferred writes from before power-down */
+                m_MixerDirty = dirty;
+                if (m_MixerDirty)
+                {
+                    ArmMixerTimer();
                 }
+
+                KeReleaseSpinLock(&m_MixerLock, oldIrql);
+
+                ControlRegWriteBatch(writes, count);
+            }
+
+            /* The timer stopped with the power; restart the clock */
+            if (m_ClockRunning)
+            {
+                WriteOPL3Clock();
             }
             _DbgPrintF(DEBUGLVL_VERBOSE, ("  Entering D0 (full power)"));
             break;
@@ -1120,6 +3259,7 @@ PowerChangeState
         case PowerDeviceD2:
         case PowerDeviceD3:
             m_PowerState = NewState.DeviceState;
+            m_Bank       = ALG_BANK_UNKNOWN;    /* Lost with power */
             _DbgPrintF(DEBUGLVL_VERBOSE, ("  Entering D%d",
                 ULONG(m_PowerState) - ULONG(PowerDeviceD0)));
             break;
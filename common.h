@@ -11,6 +11,7 @@
 
 #include "stdunk.h"
 #include "portcls.h"
+#include "dmusicks.h"
 #include "ksdebug.h"
 
 /*****************************************************************************
@@ -48,6 +49,16 @@
 #define ALG_REG_MMA1_ADDR       0x06
 #define ALG_REG_MMA1_DATA       0x07
 
+/*
+ * MMA channel numbers for the channel-addressed accessors.  Channel 1's
+ * address/data pair sits two ports above channel 0's.
+ */
+#define MMA_CHANNEL_0           0
+#define MMA_CHANNEL_1           1
+#define MMA_CHANNELS            2
+#define MMA_ADDR_PORT(ch)       (ALG_REG_MMA0_ADDR + 2 * (ch))
+#define MMA_DATA_PORT(ch)       (ALG_REG_MMA0_DATA + 2 * (ch))
+
 /*****************************************************************************
  * Bank switching values
  *
@@ -56,6 +67,7 @@
  */
 #define ALG_BANK_CONTROL        0xFF    /* Enable Control Chip access        */
 #define ALG_BANK_OPL3           0xFE    /* Enable OPL3 array 1 access        */
+#define ALG_BANK_UNKNOWN        0x00    /* Tracked bank: not known (reset)   */
 
 /*****************************************************************************
  * Status register bits (read from base+2 in Control Chip mode)
@@ -77,6 +89,60 @@
 #define ALG_STATUS_FM_IRQ       0x01
 #define ALG_STATUS_IRQ_MASK     0x0F    /* All four IRQ source bits          */
 
+/*****************************************************************************
+ * OPL3 register access timing (CAdapterCommon::WriteOPL3)
+ *
+ * Selected by the "OPL3Timing" DWORD under the driver's Settings key.
+ * The YMF262 needs 32 master clocks (2.2us at 14.318MHz) after both the
+ * address and the data write; the 23us figure is the OPL2 data-write wait
+ * inherited from the DDK sample.  Calibrated mode replaces the stall with
+ * reads of the OPL3 status port, timed against the performance counter
+ * at Init; if calibration fails it falls back to OPL3_TIMING_YMF262.
+ */
+#define OPL3_TIMING_CONSERVATIVE    0   /* 23us stalls (OPL2-safe)           */
+#define OPL3_TIMING_YMF262          1   /* 3us stalls                        */
+#define OPL3_TIMING_CALIBRATED      2   /* Status-port reads (default)       */
+
+#define OPL3_DELAY_CONSERVATIVE_US  23
+#define OPL3_DELAY_YMF262_US        3
+#define OPL3_DELAY_YMF262_NS        2240    /* 32 cycles at 14.318MHz        */
+
+#define OPL3_CALIBRATE_READS        256     /* Status reads timed at Init    */
+#define OPL3_MIN_READ_NS            200     /* Faster reads are not ISA      */
+#define OPL3_MAX_DELAY_READS        32
+
+/*****************************************************************************
+ * OPL3 timer registers (array 0)
+ *
+ * The adapter owns Timer 1 as a periodic clock (StartOPL3Clock()).  The
+ * timer reloads its preset on each overflow, so the interrupt rate is
+ * 80us times (256 - preset) with no reprogramming.  WriteOPL3() keeps
+ * the FM miniport's writes to these registers from disturbing it.
+ */
+#define OPL3_REG_TIMER1             0x02    /* Timer 1 preset, 80us counts   */
+#define OPL3_REG_TIMER_CONTROL      0x04    /* IRQ reset, masks, start bits  */
+
+#define OPL3_TIMER_IRQ_RESET        0x80    /* Clears both flags and the IRQ */
+#define OPL3_TIMER1_MASK            0x40
+#define OPL3_TIMER2_MASK            0x20
+#define OPL3_TIMER2_START           0x02
+#define OPL3_TIMER1_START           0x01
+#define OPL3_TIMER1_BITS            (OPL3_TIMER1_MASK | OPL3_TIMER1_START)
+
+#define OPL3_TIMER1_TICK_US         80
+#define OPL3_TIMER1_MAX_PERIOD      256     /* Ticks per interrupt           */
+
+/*
+ * Clock callback, at DISPATCH_LEVEL from the adapter's clock DPC.  Ticks
+ * counts 80us units since StartOPL3Clock (wrapping after ~95 hours); a
+ * late DPC sees more than one period's worth.
+ */
+typedef VOID (*PADLIBGOLD_CLOCK_ROUTINE)
+(
+    IN      PVOID   Context,
+    IN      ULONG   Ticks
+);
+
 /*****************************************************************************
  * MMA status register bits (read from base+4, MMA Channel 0 address port)
  *
@@ -85,6 +151,9 @@
 #define MMA_STATUS_TRQ          0x01    /* Timer interrupt request            */
 #define MMA_STATUS_PRQ          0x02    /* Playback FIFO request              */
 #define MMA_STATUS_RRQ          0x04    /* MIDI receive data ready            */
+#define MMA_STATUS_TXRQ         0x08    /* MIDI transmit FIFO empty (SDK TRQ) */
+#define MMA_STATUS_MIDI         (MMA_STATUS_RRQ | MMA_STATUS_TXRQ)
+#define MMA_STATUS_SERVICE      (MMA_STATUS_PRQ | MMA_STATUS_MIDI)
 
 /*****************************************************************************
  * Control Chip register indices (0x00 through 0x18)
@@ -116,6 +185,7 @@
 #define CTRL_REG_SURROUND       0x18    /* Surround sound module (YM7128)     */
 
 #define CTRL_REG_MAX            0x19    /* Total number of Control Chip regs  */
+#define CTRL_REG_READ_FIRST     0x02    /* 00h/01h do not read back           */
 
 /*
  * Range of mixer-related registers for shadow cache restore on D0 entry.
@@ -124,6 +194,15 @@
 #define CTRL_MIXER_FIRST        0x04
 #define CTRL_MIXER_LAST         0x0F
 
+/*
+ * Registers 0x04-0x08 keep the chip busy (SB) for ~450us after a write.
+ * ControlRegWriteDeferred() hands them to a timer DPC, which writes one
+ * per tick, latest value first, once SB/RB read idle.
+ */
+#define CTRL_REG_IS_SLOW(r)     ((r) >= CTRL_REG_MASTER_VOL_L && \
+                                 (r) <= CTRL_REG_OUTPUT_MODE)
+#define CTRL_DEFER_INTERVAL_US  1000    /* Mixer write timer period          */
+
 /*****************************************************************************
  * Register 0x00 (Control/ID) bit definitions
  */
@@ -213,11 +292,24 @@ typedef struct
     BYTE    RegisterSetting;
 } MIXERSETTING, *PMIXERSETTING;
 
+/*****************************************************************************
+ * One entry of a grouped Control Chip write (ControlRegWriteBatch)
+ */
+typedef struct
+{
+    BYTE    Register;
+    BYTE    Value;
+} CONTROLREGWRITE, *PCONTROLREGWRITE;
+
 /*****************************************************************************
  * Forward declarations for miniport interfaces
  *
  * These are defined in their respective headers (algwave.h, midi.h).
- * We only need opaque pointers here for the ISR dispatch mechanism.
+ * We only need opaque pointers here for the interrupt dispatch mechanism.
+ *
+ * The ISR only reads and acknowledges status; the FIFO work is handed to
+ * the miniports from the adapter's service DPC at DISPATCH_LEVEL, with
+ * the adapter's MMA lock held (see IAdapterCommon::ReadMMAStatus).
  */
 
 /* {A1B2C3D4-1111-2222-3333-AABBCCDDEEFF} */
@@ -228,8 +320,9 @@ DECLARE_INTERFACE_(IWaveMiniportAdLibGold, IUnknown)
 {
     DEFINE_ABSTRACT_UNKNOWN()
 
-    STDMETHOD_(void,ServiceWaveISR)
-    (   THIS
+    STDMETHOD_(void,ServiceWave)
+    (   THIS_
+        IN      ULONG   Channel         /* MMA_CHANNEL_x with PRQ set */
     )   PURE;
 };
 
@@ -243,13 +336,206 @@ DECLARE_INTERFACE_(IMidiMiniportAdLibGold, IUnknown)
 {
     DEFINE_ABSTRACT_UNKNOWN()
 
-    STDMETHOD_(void,ServiceMidiISR)
-    (   THIS
+    STDMETHOD_(void,ServiceMidi)
+    (   THIS_
+        IN      BYTE        Status      /* Channel 0 status, RRQ/TXRQ */
+    ,   IN      ULONGLONG   RxTime      /* ISR perf counter at RRQ, 0 */
     )   PURE;
 };
 
 typedef IMidiMiniportAdLibGold *PMIDIMINIPORTADLIBGOLD;
 
+/*
+ * FM synth entry for MIDI soft-thru.  Messages are packed like a short
+ * MIDI message (status | data1 << 8 | data2 << 16) and go through the
+ * open FM stream's note engine; with no stream open they are dropped.
+ * Called at DISPATCH_LEVEL with the MMA lock held.
+ */
+
+/* {A1B2C3D4-BBBB-CCCC-DDDD-AABBCCDDEEFF} */
+DEFINE_GUID(IID_IFMSynthAdLibGold,
+0xa1b2c3d4, 0xbbbb, 0xcccc, 0xdd, 0xdd, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff);
+
+DECLARE_INTERFACE_(IFMSynthAdLibGold, IUnknown)
+{
+    DEFINE_ABSTRACT_UNKNOWN()
+
+    STDMETHOD_(void,PlayMidiMessages)
+    (   THIS_
+        IN      PULONG      Messages
+    ,   IN      ULONG       Count
+    )   PURE;
+};
+
+typedef IFMSynthAdLibGold *PFMSYNTHADLIBGOLD;
+
+/*****************************************************************************
+ * Private property set
+ *
+ * Driver-specific diagnostics and switches, reachable from user mode with
+ * IOCTL_KS_PROPERTY on the filter that lists the item.
+ */
+
+/* {A1B2C3D4-AAAA-BBBB-CCCC-AABBCCDDEEFF} */
+#define STATIC_KSPROPSETID_AdLibGold \
+    0xa1b2c3d4, 0xaaaa, 0xbbbb, 0xcc, 0xcc, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+DEFINE_GUIDSTRUCT("A1B2C3D4-AAAA-BBBB-CCCC-AABBCCDDEEFF", KSPROPSETID_AdLibGold);
+#define KSPROPSETID_AdLibGold DEFINE_GUIDNAMED(KSPROPSETID_AdLibGold)
+
+typedef enum
+{
+    KSPROPERTY_ADLIBGOLD_MIDI_CAPTURE_STATS,    /* MIDI filter: GET, SET=reset */
+    KSPROPERTY_ADLIBGOLD_MIDI_SOFT_THRU,        /* MIDI filter: ULONG, GET/SET */
+    KSPROPERTY_ADLIBGOLD_PERF_COUNTERS,         /* Topology filter: GET, SET=reset */
+    KSPROPERTY_ADLIBGOLD_TRACE,                 /* Topology filter: GET, SET=ULONG on/off */
+    KSPROPERTY_ADLIBGOLD_FM_PATCH_BANK          /* FM filters: GET, SET=load a bank */
+} KSPROPERTY_ADLIBGOLD;
+
+/*
+ * KSPROPERTY_ADLIBGOLD_MIDI_CAPTURE_STATS value.  DeliveryMaxUs is the worst
+ * time from the receive interrupt to the byte leaving Read().
+ */
+typedef struct
+{
+    ULONG   BufferSize;         /* Capture ring size, bytes             */
+    ULONG   BytesReceived;      /* Bytes stored since the last reset    */
+    ULONG   Overflows;          /* Bytes dropped on a full ring         */
+    ULONG   DeliveryMaxUs;
+} ADLIBGOLD_MIDI_CAPTURE_STATS, *PADLIBGOLD_MIDI_CAPTURE_STATS;
+
+/*
+ * KSPROPERTY_ADLIBGOLD_PERF_COUNTERS value: hot-path event counts summed
+ * over all processors, indexed by ADLIBGOLD_PERF_xxx.  Counters wrap, so
+ * readers should graph differences between samples.  "Stall" counters
+ * are microseconds spent in KeStallExecutionProcessor.  Dividing the I/O,
+ * stall and service time deltas by the FM message or FIFO byte deltas
+ * gives the cost per event or per second of audio.  These are measured
+ * on the card; the driver has no host build to replay MIDI or PCM
+ * through with the port I/O and stalls simulated.
+ */
+typedef enum
+{
+    ADLIBGOLD_PERF_OPL3_IO,             /* OPL3 port reads and writes       */
+    ADLIBGOLD_PERF_OPL3_STALL_US,
+    ADLIBGOLD_PERF_MMA_IO,              /* MMA port reads and writes        */
+    ADLIBGOLD_PERF_MMA_STALL_US,
+    ADLIBGOLD_PERF_CONTROL_IO,          /* Control Chip and bank selects    */
+    ADLIBGOLD_PERF_CONTROL_STALL_US,
+    ADLIBGOLD_PERF_ISR,                 /* ISR invocations                  */
+    ADLIBGOLD_PERF_ISR_NOT_OURS,        /* ...of which another device's     */
+    ADLIBGOLD_PERF_FIFO_REFILL,         /* Wave FIFO chunks moved by PIO    */
+    ADLIBGOLD_PERF_FIFO_UNDERRUN,       /* Playback ran dry                 */
+    ADLIBGOLD_PERF_FIFO_OVERRUN,        /* Capture overflowed               */
+    ADLIBGOLD_PERF_MIDI_INPUT_DROP,     /* MIDI bytes lost, capture ring full */
+    ADLIBGOLD_PERF_VOICE_STEAL,         /* FM notes cut off for a new one   */
+    ADLIBGOLD_PERF_WAIT_TIMEOUT,        /* Control Chip never went ready    */
+    ADLIBGOLD_PERF_FM_MESSAGES,         /* MIDI messages applied by the synth */
+    ADLIBGOLD_PERF_FIFO_BYTES,          /* Wave bytes moved by PIO          */
+    ADLIBGOLD_PERF_SERVICE_US,          /* CPU time in the service DPC      */
+    ADLIBGOLD_PERF_CLOCK_TICK,          /* OPL3 Timer 1 interrupts          */
+    ADLIBGOLD_PERF_COUNTERS
+} ADLIBGOLD_PERF_COUNTER;
+
+typedef struct
+{
+    ULONG   Counter[ADLIBGOLD_PERF_COUNTERS];
+} ADLIBGOLD_PERF_COUNTERS, *PADLIBGOLD_PERF_COUNTERS;
+
+/*
+ * KSPROPERTY_ADLIBGOLD_TRACE: timestamped events from the I/O pipeline,
+ * kept in a ring in the adapter while tracing is on (it is off at load).
+ * Event records carry two arguments:
+ *
+ *   ISR_ENTRY          -                   -
+ *   ISR_EXIT           Control status      MMA0 | MMA1 << 8 status, or
+ *                                          ~0 for another device's IRQ
+ *   SERVICE_WAVE       MMA channel         Channel status
+ *   SERVICE_MIDI       Channel 0 status    -
+ *   FIFO_START/END     Bytes asked/moved   STREAM_WAVE_RENDER/CAPTURE
+ *   FM_MESSAGE         Packed message      -
+ *   CONTROL_WRITE      Reg | Value << 8    Busy-wait before it, us
+ *   STREAM_STATE       New KSSTATE         STREAM_xxx
+ *
+ * GET returns an ADLIBGOLD_TRACE with as many of the newest records as
+ * fit, oldest first.  Sequence numbers are consecutive; a gap means the
+ * ring wrapped (or a record was being written) between two reads.
+ */
+typedef enum
+{
+    ADLIBGOLD_TRACE_ISR_ENTRY = 1,
+    ADLIBGOLD_TRACE_ISR_EXIT,
+    ADLIBGOLD_TRACE_SERVICE_WAVE,
+    ADLIBGOLD_TRACE_SERVICE_MIDI,
+    ADLIBGOLD_TRACE_FIFO_START,
+    ADLIBGOLD_TRACE_FIFO_END,
+    ADLIBGOLD_TRACE_FM_MESSAGE,
+    ADLIBGOLD_TRACE_CONTROL_WRITE,
+    ADLIBGOLD_TRACE_STREAM_STATE
+} ADLIBGOLD_TRACE_EVENT;
+
+typedef enum
+{
+    ADLIBGOLD_TRACE_STREAM_WAVE_RENDER,
+    ADLIBGOLD_TRACE_STREAM_WAVE_CAPTURE,
+    ADLIBGOLD_TRACE_STREAM_MIDI_RENDER,
+    ADLIBGOLD_TRACE_STREAM_MIDI_CAPTURE,
+    ADLIBGOLD_TRACE_STREAM_FM
+} ADLIBGOLD_TRACE_STREAM;
+
+/*
+ * Trace ring size, so GET with room for this many records returns all of
+ * it.  A power of 2; 1024 records cover a few hundred milliseconds of a
+ * busy full-duplex stream.
+ */
+#define ADLIBGOLD_TRACE_RECORDS 1024
+
+typedef struct
+{
+    ULONG       Sequence;           /* From 1, written last             */
+    USHORT      Event;              /* ADLIBGOLD_TRACE_xxx              */
+    UCHAR       Processor;
+    UCHAR       Reserved;
+    ULONGLONG   Time;               /* KeQueryPerformanceCounter        */
+    ULONG       Arg[2];
+} ADLIBGOLD_TRACE_RECORD, *PADLIBGOLD_TRACE_RECORD;
+
+typedef struct
+{
+    ULONGLONG   Frequency;          /* Performance counter, Hz          */
+    ULONG       NextSequence;       /* Sequence of the next record      */
+    ULONG       Count;              /* Records that follow              */
+    ADLIBGOLD_TRACE_RECORD Record[1];
+} ADLIBGOLD_TRACE, *PADLIBGOLD_TRACE;
+
+/*
+ * KSPROPERTY_ADLIBGOLD_FM_PATCH_BANK value, also the format of the file
+ * named by the FMPatchBank Settings value: a header and PatchCount 28-byte
+ * OPL3 patches laid out like the built-in table (programs 0-127, then the
+ * drum notes as patches 128-255).  Patches past PatchCount keep their
+ * built-in sound, and SET with PatchCount 0 goes back to the built-in
+ * bank.  GET returns the active bank with all 256 patches.
+ */
+#define ADLIBGOLD_FM_BANK_SIGNATURE     0x42474c41      /* "ALGB" */
+#define ADLIBGOLD_FM_BANK_VERSION       1
+#define ADLIBGOLD_FM_BANK_PATCHES       256
+#define ADLIBGOLD_FM_PATCH_SIZE         28
+
+typedef struct
+{
+    ULONG       Signature;          /* ADLIBGOLD_FM_BANK_SIGNATURE      */
+    ULONG       Version;            /* ADLIBGOLD_FM_BANK_VERSION        */
+    ULONG       PatchCount;         /* 0 to ADLIBGOLD_FM_BANK_PATCHES   */
+    ULONG       Reserved;
+    UCHAR       Patch[1][ADLIBGOLD_FM_PATCH_SIZE];
+} ADLIBGOLD_FM_BANK, *PADLIBGOLD_FM_BANK;
+
+#define ADLIBGOLD_FM_BANK_SIZE(Patches) \
+    (FIELD_OFFSET(ADLIBGOLD_FM_BANK, Patch) + (Patches) * ADLIBGOLD_FM_PATCH_SIZE)
+
+/* {A1B2C3D4-7777-8888-9999-AABBCCDDEEFF} -- reported in SYNTHCAPS */
+DEFINE_GUID(CLSID_MiniportDriverDMusFMAdLibGold,
+0xa1b2c3d4, 0x7777, 0x8888, 0x99, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff);
+
 /*****************************************************************************
  * IAdapterCommon
  *****************************************************************************
@@ -291,6 +577,26 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     (   THIS
     )   PURE;
 
+    /*
+     * Write several registers in one synchronized section and one bank
+     * switch, e.g. both channels of a stereo control.
+     */
+    STDMETHOD_(void,ControlRegWriteBatch)
+    (   THIS_
+        IN      PCONTROLREGWRITE    Writes,
+        IN      ULONG               Count
+    )   PURE;
+
+    /*
+     * Update the shadow and return; slow registers (CTRL_REG_IS_SLOW)
+     * reach the chip from the mixer timer, others are written at once.
+     */
+    STDMETHOD_(void,ControlRegWriteDeferred)
+    (   THIS_
+        IN      BYTE    Register,
+        IN      BYTE    Value
+    )   PURE;
+
     /* Bank switching */
     STDMETHOD_(void,EnableControlBank)
     (   THIS
@@ -319,7 +625,60 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
         IN      BYTE    Register
     )   PURE;
 
-    /* Miniport registration for ISR dispatch */
+    /* Same, on either MMA channel (ReadMMA/WriteMMA use channel 0) */
+    STDMETHOD_(void,WriteMMAChannel)
+    (   THIS_
+        IN      BYTE    Channel,
+        IN      BYTE    Register,
+        IN      BYTE    Value
+    )   PURE;
+
+    STDMETHOD_(BYTE,ReadMMAChannel)
+    (   THIS_
+        IN      BYTE    Channel,
+        IN      BYTE    Register
+    )   PURE;
+
+    /* MMA FIFO burst access: register selected once, then N data bytes */
+    STDMETHOD_(void,WriteMMABurst)
+    (   THIS_
+        IN      BYTE    Channel,
+        IN      BYTE    Register,
+        IN      PUCHAR  Buffer,
+        IN      ULONG   Count
+    )   PURE;
+
+    STDMETHOD_(void,ReadMMABurst)
+    (   THIS_
+        IN      BYTE    Channel,
+        IN      BYTE    Register,
+        OUT     PUCHAR  Buffer,
+        IN      ULONG   Count
+    )   PURE;
+
+    /*
+     * Service DPC only: read an MMA channel's status port.  Bits outside
+     * Handled are kept and dispatched on the DPC's next pass, since the
+     * read clears them in hardware.
+     */
+    STDMETHOD_(BYTE,ReadMMAStatus)
+    (   THIS_
+        IN      BYTE    Channel,
+        IN      BYTE    Handled
+    )   PURE;
+
+    /*
+     * Run Routine under the MMA lock at DISPATCH_LEVEL, serialized with
+     * the service DPC's FIFO work.  Routine gets the interrupt sync (or
+     * NULL) as its first argument, like CallSynchronizedRoutine.
+     */
+    STDMETHOD_(NTSTATUS,CallMmaSynchronized)
+    (   THIS_
+        IN      PINTERRUPTSYNCROUTINE   Routine,
+        IN      PVOID                   DynamicContext
+    )   PURE;
+
+    /* Miniport registration for interrupt dispatch */
     STDMETHOD_(void,SetWaveMiniport)
     (   THIS_
         IN      PWAVEMINIPORTADLIBGOLD  Miniport
@@ -330,6 +689,41 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
         IN      PMIDIMINIPORTADLIBGOLD  Miniport
     )   PURE;
 
+    /*
+     * Soft-thru target.  SetFMSynth takes the MMA lock, so the pointer
+     * GetFMSynth returns stays valid while the caller holds it.
+     */
+    STDMETHOD_(void,SetFMSynth)
+    (   THIS_
+        IN      PFMSYNTHADLIBGOLD       Synth
+    )   PURE;
+
+    STDMETHOD_(PFMSYNTHADLIBGOLD,GetFMSynth)
+    (   THIS
+    )   PURE;
+
+    /*
+     * Periodic clock from OPL3 Timer 1, one client at a time (PASSIVE_LEVEL).
+     * PeriodTicks is 1 to OPL3_TIMER1_MAX_PERIOD counts of 80us.  Once
+     * StopOPL3Clock returns, Routine is not running and will not be called
+     * again; Routine must not call either method itself.
+     */
+    STDMETHOD_(NTSTATUS,StartOPL3Clock)
+    (   THIS_
+        IN      ULONG                       PeriodTicks,
+        IN      PADLIBGOLD_CLOCK_ROUTINE    Routine,
+        IN      PVOID                       Context
+    )   PURE;
+
+    STDMETHOD_(void,StopOPL3Clock)
+    (   THIS
+    )   PURE;
+
+    /* Ticks since StartOPL3Clock, callable at any IRQL */
+    STDMETHOD_(ULONG,ReadOPL3Clock)
+    (   THIS
+    )   PURE;
+
     /* Registry persistence */
     STDMETHOD_(NTSTATUS,RestoreMixerSettingsFromRegistry)
     (   THIS
@@ -339,6 +733,61 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     (   THIS
     )   PURE;
 
+    /*
+     * Hot-path counters (see ADLIBGOLD_PERF_COUNTERS).  CountPerfEvent is
+     * callable at any IRQL; QueryPerfCounters sums the per-CPU copies and
+     * optionally zeroes them.
+     */
+    STDMETHOD_(void,CountPerfEvent)
+    (   THIS_
+        IN      ULONG   Counter,        /* ADLIBGOLD_PERF_xxx */
+        IN      ULONG   Amount
+    )   PURE;
+
+    STDMETHOD_(void,QueryPerfCounters)
+    (   THIS_
+        OUT     PADLIBGOLD_PERF_COUNTERS    Totals  OPTIONAL,
+        IN      BOOLEAN                     Reset
+    )   PURE;
+
+    /*
+     * Event trace (see ADLIBGOLD_TRACE).  TraceEvent is callable at any
+     * IRQL and costs one test while tracing is off.  ReadTrace fills up to
+     * Size bytes and returns the number used.
+     */
+    STDMETHOD_(void,TraceEvent)
+    (   THIS_
+        IN      ULONG   Event,          /* ADLIBGOLD_TRACE_xxx */
+        IN      ULONG   Arg0,
+        IN      ULONG   Arg1
+    )   PURE;
+
+    STDMETHOD_(void,EnableTrace)
+    (   THIS_
+        IN      BOOLEAN Enable
+    )   PURE;
+
+    STDMETHOD_(ULONG,ReadTrace)
+    (   THIS_
+        OUT     PADLIBGOLD_TRACE    Trace,
+        IN      ULONG               Size
+    )   PURE;
+
+    /* DWORD tunables under the driver's Settings key (PASSIVE_LEVEL) */
+    STDMETHOD_(NTSTATUS,QuerySettingsValue)
+    (   THIS_
+        IN      PCWSTR  ValueName,
+        OUT     PULONG  Value
+    )   PURE;
+
+    /* String value under the Settings key, NUL-terminated (PASSIVE_LEVEL) */
+    STDMETHOD_(NTSTATUS,QuerySettingsString)
+    (   THIS_
+        IN      PCWSTR  ValueName,
+        OUT     PWSTR   Buffer,
+        IN      ULONG   BufferSize
+    )   PURE;
+
     /* EEPROM persistence */
     STDMETHOD_(NTSTATUS,SaveToEEPROM)
     (   THIS
@@ -0,0 +1,1279 @@
+/*****************************************************************************
+ * dmusfm.cpp - Ad Lib Gold FM synth DirectMusic miniport implementation.
+ *****************************************************************************
+ *
+ * IMiniportDMus/IMXF front end for the OPL3 FM synth.  The synth engine,
+ * register shadow and write queue all come from CMiniportMidiFMAdLibGold;
+ * this file adds the DirectMusic port binding and a render stream that
+ * holds presentation-timestamped events until their time comes round on
+ * the port's master clock.
+ *
+ * The event handling follows the DDK DMusUART sample.
+ *
+ * Adapted for Ad Lib Gold, 2026.
+ */
+
+#include "fmsynth.h"
+
+#define STR_MODULENAME "AdLibGoldDMusFM: "
+
+
+/*****************************************************************************
+ * Prototypes
+ */
+NTSTATUS PropertyHandler_SynthFM(IN PPCPROPERTY_REQUEST);
+NTSTATUS PropertyHandler_DMusFMPrivate(IN PPCPROPERTY_REQUEST);
+VOID DMusFMClockRoutine(IN PVOID Context, IN ULONG Ticks);
+
+
+/*****************************************************************************
+ * Filter description
+ *****************************************************************************
+ * Same shape as the MIDI port filter (stream pin 0, bridge pin 1) so the
+ * physical connection registered by the adapter applies to either.  The
+ * stream pin also accepts the DirectMusic format.
+ */
+static
+KSDATARANGE_MUSIC PinDataRangesStreamDMus[] =
+{
+    {
+        {
+            sizeof(KSDATARANGE_MUSIC),
+            0,
+            0,
+            0,
+            STATICGUIDOF(KSDATAFORMAT_TYPE_MUSIC),
+            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_MIDI),
+            STATICGUIDOF(KSDATAFORMAT_SPECIFIER_NONE)
+        },
+        STATICGUIDOF(KSMUSIC_TECHNOLOGY_FMSYNTH),
+        NUM2VOICES,
+        NUM2VOICES,
+        0xffffffff
+    },
+    {
+        {
+            sizeof(KSDATARANGE_MUSIC),
+            0,
+            0,
+            0,
+            STATICGUIDOF(KSDATAFORMAT_TYPE_MUSIC),
+            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_DIRECTMUSIC),
+            STATICGUIDOF(KSDATAFORMAT_SPECIFIER_NONE)
+        },
+        STATICGUIDOF(KSMUSIC_TECHNOLOGY_FMSYNTH),
+        NUM2VOICES,
+        NUM2VOICES,
+        0xffffffff
+    }
+};
+
+static
+PKSDATARANGE PinDataRangePointersStreamDMus[] =
+{
+    PKSDATARANGE(&PinDataRangesStreamDMus[0]),
+    PKSDATARANGE(&PinDataRangesStreamDMus[1])
+};
+
+static
+KSDATARANGE PinDataRangesBridgeDMus[] =
+{
+   {
+      sizeof(KSDATARANGE),
+      0,
+      0,
+      0,
+      STATICGUIDOF(KSDATAFORMAT_TYPE_MUSIC),
+      STATICGUIDOF(KSDATAFORMAT_SUBTYPE_MIDI_BUS),
+      STATICGUIDOF(KSDATAFORMAT_SPECIFIER_NONE)
+   }
+};
+
+static
+PKSDATARANGE PinDataRangePointersBridgeDMus[] =
+{
+    &PinDataRangesBridgeDMus[0]
+};
+
+static
+PCPROPERTY_ITEM SynthPropertiesFM[] =
+{
+    {
+        &KSPROPSETID_Synth,
+        KSPROPERTY_SYNTH_CAPS,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_SynthFM
+    },
+    {
+        &KSPROPSETID_Synth,
+        KSPROPERTY_SYNTH_LATENCYCLOCK,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_SynthFM
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationSynthFM, SynthPropertiesFM);
+
+static
+PCPROPERTY_ITEM FilterPropertiesDMusFM[] =
+{
+    {
+        &KSPROPSETID_AdLibGold,
+        KSPROPERTY_ADLIBGOLD_FM_PATCH_BANK,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_DMusFMPrivate
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationDMusFMFilter, FilterPropertiesDMusFM);
+
+static
+PCPIN_DESCRIPTOR MiniportPinsDMus[] =
+{
+    {
+        1,1,1,  // InstanceCount
+        NULL,   // AutomationTable
+        {       // KsPinDescriptor
+            0,                                              // InterfacesCount
+            NULL,                                           // Interfaces
+            0,                                              // MediumsCount
+            NULL,                                           // Mediums
+            SIZEOF_ARRAY(PinDataRangePointersStreamDMus),   // DataRangesCount
+            PinDataRangePointersStreamDMus,                 // DataRanges
+            KSPIN_DATAFLOW_IN,                              // DataFlow
+            KSPIN_COMMUNICATION_SINK,                       // Communication
+            (GUID *) &KSNODETYPE_SYNTHESIZER,               // Category
+            NULL,                                           // Name
+            0                                               // Reserved
+        }
+    },
+    {
+        0,0,0,  // InstanceCount
+        NULL,   // AutomationTable
+        {       // KsPinDescriptor
+            0,                                              // InterfacesCount
+            NULL,                                           // Interfaces
+            0,                                              // MediumsCount
+            NULL,                                           // Mediums
+            SIZEOF_ARRAY(PinDataRangePointersBridgeDMus),   // DataRangesCount
+            PinDataRangePointersBridgeDMus,                 // DataRanges
+            KSPIN_DATAFLOW_OUT,                             // DataFlow
+            KSPIN_COMMUNICATION_NONE,                       // Communication
+            (GUID *) &KSCATEGORY_AUDIO,                     // Category
+            NULL,                                           // Name
+            0                                               // Reserved
+        }
+    }
+};
+
+enum {
+    eDMusSynthNode  = 0
+};
+
+enum {
+    eDMusNodeOutput = 0,
+    eDMusNodeInput  = 1
+};
+
+enum {
+    eDMusFilterInput  = eDMusNodeOutput,
+    eDMusBridgeOutput = eDMusNodeInput
+};
+
+static
+PCNODE_DESCRIPTOR MiniportNodesDMus[] =
+{
+    {
+        0,                          // Flags
+        &AutomationSynthFM,         // AutomationTable
+        &KSNODETYPE_SYNTHESIZER,    // Type
+        NULL                        // Name
+    }
+};
+
+static
+PCCONNECTION_DESCRIPTOR MiniportConnectionsDMus[] =
+{
+    //  FromNode,       FromPin,            ToNode,         ToPin
+    {   PCFILTER_NODE,  eDMusFilterInput,   eDMusSynthNode, eDMusNodeInput },
+    {   eDMusSynthNode, eDMusNodeOutput,    PCFILTER_NODE,  eDMusBridgeOutput }
+};
+
+static
+PCFILTER_DESCRIPTOR MiniportFilterDescriptorDMus =
+{
+    0,                                      // Version
+    &AutomationDMusFMFilter,                // AutomationTable
+    sizeof(PCPIN_DESCRIPTOR),               // PinSize
+    SIZEOF_ARRAY(MiniportPinsDMus),         // PinCount
+    MiniportPinsDMus,                       // Pins
+    sizeof(PCNODE_DESCRIPTOR),              // NodeSize
+    SIZEOF_ARRAY(MiniportNodesDMus),        // NodeCount
+    MiniportNodesDMus,                      // Nodes
+    SIZEOF_ARRAY(MiniportConnectionsDMus),  // ConnectionCount
+    MiniportConnectionsDMus,                // Connections
+    0,                                      // CategoryCount
+    NULL                                    // Categories
+};
+
+static const WCHAR wszDMusFMDescription[] = L"Ad Lib Gold OPL3 FM Synth";
+
+
+/*****************************************************************************
+ * CreateMiniportDMusFMAdLibGold()
+ *****************************************************************************
+ * Creates a DirectMusic FM synth miniport.
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+CreateMiniportDMusFMAdLibGold
+(
+    OUT     PUNKNOWN *  Unknown,
+    IN      REFCLSID,
+    IN      PUNKNOWN    UnknownOuter    OPTIONAL,
+    IN      POOL_TYPE   PoolType
+)
+{
+    PAGED_CODE();
+    ASSERT(Unknown);
+
+    STD_CREATE_BODY_(CMiniportDMusFMAdLibGold, Unknown, UnknownOuter, PoolType, PMINIPORTDMUS);
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::NonDelegatingQueryInterface()
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP
+CMiniportDMusFMAdLibGold::
+NonDelegatingQueryInterface
+(
+    REFIID  Interface,
+    PVOID * Object
+)
+{
+    PAGED_CODE();
+    ASSERT(Object);
+
+    if (IsEqualGUIDAligned(Interface, IID_IUnknown))
+    {
+        *Object = PVOID(PUNKNOWN(PMINIPORTDMUS(this)));
+    }
+    else if (IsEqualGUIDAligned(Interface, IID_IMiniport))
+    {
+        *Object = PVOID(PMINIPORT(PMINIPORTDMUS(this)));
+    }
+    else if (IsEqualGUIDAligned(Interface, IID_IMiniportDMus))
+    {
+        *Object = PVOID(PMINIPORTDMUS(this));
+    }
+    else if (IsEqualGUIDAligned(Interface, IID_IFMSynthAdLibGold))
+    {
+        *Object = PVOID(PFMSYNTHADLIBGOLD(this));
+    }
+    else if (IsEqualGUIDAligned(Interface, IID_IPowerNotify))
+    {
+        *Object = PVOID(PPOWERNOTIFY(this));
+    }
+    else
+    {
+        *Object = NULL;
+    }
+
+    if (*Object)
+    {
+        PUNKNOWN(*Object)->AddRef();
+        return STATUS_SUCCESS;
+    }
+
+    return STATUS_INVALID_PARAMETER;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::~CMiniportDMusFMAdLibGold()
+ *****************************************************************************
+ * The base destructor silences and resets the chip.
+ */
+#pragma code_seg()
+CMiniportDMusFMAdLibGold::
+~CMiniportDMusFMAdLibGold
+(   void
+)
+{
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("CMiniportDMusFMAdLibGold::~CMiniportDMusFMAdLibGold"));
+
+    if (m_PortDMus)
+    {
+        m_PortDMus->Release();
+        m_PortDMus = NULL;
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::Init()
+ *****************************************************************************
+ * Initializes the miniport for the DirectMusic port driver.
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP
+CMiniportDMusFMAdLibGold::
+Init
+(
+    IN      PUNKNOWN        UnknownAdapter  OPTIONAL,
+    IN      PRESOURCELIST   ResourceList,
+    IN      PPORTDMUS       Port_,
+    OUT     PSERVICEGROUP * ServiceGroup
+)
+{
+    PAGED_CODE();
+
+    ASSERT(ResourceList);
+    ASSERT(Port_);
+    ASSERT(ServiceGroup);
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("CMiniportDMusFMAdLibGold::Init"));
+
+    m_PortDMus = Port_;
+    m_PortDMus->AddRef();
+
+    KeInitializeMutex(&m_ClockMutex, 0);
+    m_ClockUsers   = 0;
+    KeInitializeSpinLock(&m_ClockListLock);
+    m_ClockStreams = NULL;
+
+    NTSTATUS ntStatus = InitSynth(UnknownAdapter, ServiceGroup);
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        m_PortDMus->RegisterServiceGroup(m_ServiceGroup);
+    }
+    else
+    {
+        m_PortDMus->Release();
+        m_PortDMus = NULL;
+    }
+
+    return ntStatus;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::NewStream()
+ *****************************************************************************
+ * Creates the render stream.  The port is asked to deliver events
+ * FMDMUS_PREFETCH ahead of their presentation time; the stream places
+ * them itself.
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP
+CMiniportDMusFMAdLibGold::
+NewStream
+(
+    OUT     PMXF                  * MXF,
+    IN      PUNKNOWN                OuterUnknown    OPTIONAL,
+    IN      POOL_TYPE               PoolType,
+    IN      ULONG                   PinID,
+    IN      DMUS_STREAM_TYPE        StreamType,
+    IN      PKSDATAFORMAT           DataFormat,
+    OUT     PSERVICEGROUP         * ServiceGroup,
+    IN      PAllocatorMXF           AllocatorMXF,
+    IN      PMASTERCLOCK            MasterClock,
+    OUT     PULONGLONG              SchedulePreFetch
+)
+{
+    PAGED_CODE();
+
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    if (StreamType != DMUS_STREAM_MIDI_RENDER)
+    {
+        _DbgPrintF(DEBUGLVL_TERSE, ("NewStream: unsupported stream type %d", StreamType));
+        ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else
+    {
+        /* Any number of streams; they share the voice pool */
+        CMiniportDMusStreamFMAdLibGold *pStream =
+            new(PoolType) CMiniportDMusStreamFMAdLibGold(OuterUnknown);
+
+        if (pStream)
+        {
+            pStream->AddRef();
+
+            ntStatus = pStream->Init(this, AllocatorMXF, MasterClock);
+
+            if (NT_SUCCESS(ntStatus))
+            {
+                *MXF = PMXF(pStream);
+                (*MXF)->AddRef();
+
+                *ServiceGroup = NULL;
+                *SchedulePreFetch = FMDMUS_PREFETCH;
+            }
+
+            pStream->Release();
+        }
+        else
+        {
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    return ntStatus;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::Service()
+ *****************************************************************************
+ * DPC-mode service call.  Pushes the queued OPL3 writes to the hardware.
+ */
+#pragma code_seg()
+STDMETHODIMP_(void)
+CMiniportDMusFMAdLibGold::
+Service
+(   void
+)
+{
+    ServiceWriteQueue();
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::AttachClock()
+ *****************************************************************************
+ * Put a new stream on the OPL3 clock, starting the clock for the first
+ * one.  Returns FALSE if the adapter's clock is not available, in which
+ * case the stream schedules with its own timer.  PASSIVE_LEVEL.
+ */
+#pragma code_seg()
+BOOLEAN
+CMiniportDMusFMAdLibGold::
+AttachClock
+(
+    IN      CMiniportDMusStreamFMAdLibGold *    Stream
+)
+{
+    BOOLEAN fAttached = FALSE;
+    KIRQL   oldIrql;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    KeWaitForSingleObject(&m_ClockMutex, Executive, KernelMode, FALSE, NULL);
+
+    if (m_ClockUsers ||
+        NT_SUCCESS(m_AdapterCommon->StartOPL3Clock(FMDMUS_CLOCK_TICKS,
+                                                   DMusFMClockRoutine,
+                                                   PVOID(this))))
+    {
+        m_ClockUsers++;
+
+        KeAcquireSpinLock(&m_ClockListLock, &oldIrql);
+        Stream->m_NextClockStream = m_ClockStreams;
+        m_ClockStreams = Stream;
+        KeReleaseSpinLock(&m_ClockListLock, oldIrql);
+
+        fAttached = TRUE;
+    }
+    else
+    {
+        _DbgPrintF(DEBUGLVL_TERSE, ("AttachClock: OPL3 clock busy, using a timer"));
+    }
+
+    KeReleaseMutex(&m_ClockMutex, FALSE);
+
+    return fAttached;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::DetachClock()
+ *****************************************************************************
+ * Take a stream off the OPL3 clock, stopping it after the last one.  The
+ * list lock waits out a clock call playing the stream's events, so the
+ * clock is done with the stream once this returns.  PASSIVE_LEVEL.
+ */
+#pragma code_seg()
+void
+CMiniportDMusFMAdLibGold::
+DetachClock
+(
+    IN      CMiniportDMusStreamFMAdLibGold *    Stream
+)
+{
+    CMiniportDMusStreamFMAdLibGold **ppLink;
+    KIRQL   oldIrql;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    KeWaitForSingleObject(&m_ClockMutex, Executive, KernelMode, FALSE, NULL);
+
+    KeAcquireSpinLock(&m_ClockListLock, &oldIrql);
+    for (ppLink = &m_ClockStreams; *ppLink; ppLink = &(*ppLink)->m_NextClockStream)
+    {
+        if (*ppLink == Stream)
+        {
+            *ppLink = Stream->m_NextClockStream;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&m_ClockListLock, oldIrql);
+
+    if (!--m_ClockUsers)
+    {
+        m_AdapterCommon->StopOPL3Clock();
+    }
+
+    KeReleaseMutex(&m_ClockMutex, FALSE);
+}
+
+
+/*****************************************************************************
+ * DMusFMClockRoutine()
+ *****************************************************************************
+ * OPL3 clock callback (adapter clock DPC, DISPATCH_LEVEL): plays whatever
+ * has come due on each running stream.  Events are placed against the
+ * master clock, so Ticks is not needed.
+ */
+#pragma code_seg()
+VOID
+DMusFMClockRoutine
+(
+    IN      PVOID   Context,
+    IN      ULONG   Ticks
+)
+{
+    ASSERT(Context);
+
+    CMiniportDMusFMAdLibGold *that = (CMiniportDMusFMAdLibGold *)Context;
+    CMiniportDMusStreamFMAdLibGold *pStream;
+    BOOLEAN fPlay;
+
+    KeAcquireSpinLockAtDpcLevel(&that->m_ClockListLock);
+
+    for (pStream = that->m_ClockStreams; pStream; pStream = pStream->m_NextClockStream)
+    {
+        KeAcquireSpinLockAtDpcLevel(&pStream->m_EventLock);
+        fPlay = (BOOLEAN)((pStream->m_State == KSSTATE_RUN) && pStream->m_EventHead);
+        KeReleaseSpinLockFromDpcLevel(&pStream->m_EventLock);
+
+        if (fPlay)
+        {
+            pStream->PlayDueEvents();
+        }
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&that->m_ClockListLock);
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold::GetDescription()
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP
+CMiniportDMusFMAdLibGold::
+GetDescription
+(
+    OUT     PPCFILTER_DESCRIPTOR *  OutFilterDescriptor
+)
+{
+    PAGED_CODE();
+    ASSERT(OutFilterDescriptor);
+
+    *OutFilterDescriptor = &MiniportFilterDescriptorDMus;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * PropertyHandler_SynthFM()
+ *****************************************************************************
+ * Synth node properties: capabilities, and the latency clock DirectMusic
+ * schedules against (the master clock -- events are placed on time, so
+ * there is no extra output latency to report).
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+PropertyHandler_SynthFM
+(
+    IN      PPCPROPERTY_REQUEST     PropertyRequest
+)
+{
+    PAGED_CODE();
+    ASSERT(PropertyRequest);
+
+    NTSTATUS ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        if (PropertyRequest->ValueSize >= sizeof(ULONG) && PropertyRequest->Value)
+        {
+            *PULONG(PropertyRequest->Value) =
+                KSPROPERTY_TYPE_BASICSUPPORT | KSPROPERTY_TYPE_GET;
+            ntStatus = STATUS_SUCCESS;
+        }
+        else
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+        }
+        PropertyRequest->ValueSize = sizeof(ULONG);
+        return ntStatus;
+    }
+
+    if (!(PropertyRequest->Verb & KSPROPERTY_TYPE_GET))
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    switch (PropertyRequest->PropertyItem->Id)
+    {
+    case KSPROPERTY_SYNTH_CAPS:
+        if (PropertyRequest->ValueSize < sizeof(SYNTHCAPS) || !PropertyRequest->Value)
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+        }
+        else
+        {
+            SYNTHCAPS *caps = (SYNTHCAPS *)PropertyRequest->Value;
+
+            RtlZeroMemory(caps, sizeof(SYNTHCAPS));
+            caps->Guid             = CLSID_MiniportDriverDMusFMAdLibGold;
+            caps->Flags            = SYNTH_PC_GMINHARDWARE;
+            caps->MemorySize       = 0;
+            caps->MaxChannelGroups = 1;
+            caps->MaxVoices        = NUM2VOICES;
+            caps->MaxAudioChannels = 2;
+            caps->EffectFlags      = 0;
+            RtlCopyMemory(caps->Description, wszDMusFMDescription,
+                          sizeof(wszDMusFMDescription));
+            ntStatus = STATUS_SUCCESS;
+        }
+        PropertyRequest->ValueSize = sizeof(SYNTHCAPS);
+        break;
+
+    case KSPROPERTY_SYNTH_LATENCYCLOCK:
+        if (PropertyRequest->ValueSize < sizeof(ULONGLONG) || !PropertyRequest->Value)
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+        }
+        else if (PropertyRequest->MinorTarget)
+        {
+            CMiniportDMusStreamFMAdLibGold *that =
+                (CMiniportDMusStreamFMAdLibGold *)PMXF(PropertyRequest->MinorTarget);
+
+            ntStatus = that->m_MasterClock->GetTime((REFERENCE_TIME *)PropertyRequest->Value);
+        }
+        else
+        {
+            *(REFERENCE_TIME *)PropertyRequest->Value = 0;
+            ntStatus = STATUS_INVALID_PARAMETER;
+        }
+        PropertyRequest->ValueSize = sizeof(ULONGLONG);
+        break;
+    }
+
+    return ntStatus;
+}
+
+
+/*****************************************************************************
+ * PropertyHandler_DMusFMPrivate()
+ *****************************************************************************
+ * KSPROPSETID_AdLibGold items on the DirectMusic FM filter; the patch bank
+ * is shared with the MIDI variant (see PropertyPatchBank()).
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+PropertyHandler_DMusFMPrivate
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+)
+{
+    PAGED_CODE();
+
+    ASSERT(PropertyRequest);
+
+    CMiniportDMusFMAdLibGold *that =
+        (CMiniportDMusFMAdLibGold *)(PMINIPORTDMUS(PropertyRequest->MajorTarget));
+
+    return that->PropertyPatchBank(PropertyRequest);
+}
+
+
+/*****************************************************************************
+ * DMusFMTimerDPC()
+ *****************************************************************************
+ * Timer DPC: plays the events whose presentation time has arrived.  The
+ * run is counted so the stream's destructor can wait it out; with no
+ * KeFlushQueuedDpcs before XP, m_fTimerArmed covers the gap between the
+ * DPC being dequeued and this routine taking the lock.
+ *
+ * PutMessage or SetState can re-arm the timer while this run is queued.
+ * KeSetTimer resets the timer's signal state, so the flag is cleared
+ * only if the timer still reads signaled: the expiry this run serves is
+ * then the latest one, and a re-arm's run stays owed.
+ */
+#pragma code_seg()
+VOID
+NTAPI
+DMusFMTimerDPC
+(
+    IN      PKDPC   Dpc,
+    IN      PVOID   DeferredContext,
+    IN      PVOID   SystemArgument1,
+    IN      PVOID   SystemArgument2
+)
+{
+    ASSERT(DeferredContext);
+
+    CMiniportDMusStreamFMAdLibGold *that =
+        (CMiniportDMusStreamFMAdLibGold *)DeferredContext;
+    BOOLEAN fPlay;
+
+    KeAcquireSpinLockAtDpcLevel(&that->m_EventLock);
+    if (KeReadStateTimer(&that->m_EventTimer))
+    {
+        that->m_fTimerArmed = FALSE;
+    }
+    that->m_cDpcActive++;
+    fPlay = !that->m_fClosing;
+    KeReleaseSpinLockFromDpcLevel(&that->m_EventLock);
+
+    if (fPlay)
+    {
+        that->PlayDueEvents();
+    }
+
+    /* The destructor may free the stream once the lock is released */
+    KeAcquireSpinLockAtDpcLevel(&that->m_EventLock);
+    if (!--that->m_cDpcActive && that->m_fClosing && !that->m_fTimerArmed)
+    {
+        KeSetEvent(&that->m_DpcIdle, 0, FALSE);
+    }
+    KeReleaseSpinLockFromDpcLevel(&that->m_EventLock);
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::NonDelegatingQueryInterface()
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP
+CMiniportDMusStreamFMAdLibGold::
+NonDelegatingQueryInterface
+(
+    REFIID  Interface,
+    PVOID * Object
+)
+{
+    PAGED_CODE();
+    ASSERT(Object);
+
+    if (IsEqualGUIDAligned(Interface, IID_IUnknown))
+    {
+        *Object = PVOID(PUNKNOWN(PMXF(this)));
+    }
+    else if (IsEqualGUIDAligned(Interface, IID_IMXF))
+    {
+        *Object = PVOID(PMXF(this));
+    }
+    else
+    {
+        *Object = NULL;
+    }
+
+    if (*Object)
+    {
+        PUNKNOWN(*Object)->AddRef();
+        return STATUS_SUCCESS;
+    }
+
+    return STATUS_INVALID_PARAMETER;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::~CMiniportDMusStreamFMAdLibGold()
+ *****************************************************************************
+ * Leaves the OPL3 clock, stops the event timer and waits for a timer DPC
+ * already under way, then returns any unplayed events to the allocator.  The base
+ * destructor silences the voices and releases the miniport.
+ */
+#pragma code_seg("PAGE")
+CMiniportDMusStreamFMAdLibGold::
+~CMiniportDMusStreamFMAdLibGold
+(   void
+)
+{
+    PAGED_CODE();
+
+    KIRQL   oldIrql;
+    BOOLEAN fWait;
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("~CMiniportDMusStreamFMAdLibGold"));
+
+    if (m_fOnClock)
+    {
+        ((CMiniportDMusFMAdLibGold *)m_Miniport)->DetachClock(this);
+        m_fOnClock = FALSE;
+    }
+
+    if (m_AllocatorMXF)     /* Init got as far as the timer */
+    {
+        KeAcquireSpinLock(&m_EventLock, &oldIrql);
+        m_fClosing = TRUE;
+        if (CancelEventTimer())
+        {
+            m_fTimerArmed = FALSE;
+        }
+        fWait = m_fTimerArmed || m_cDpcActive;
+        KeReleaseSpinLock(&m_EventLock, oldIrql);
+
+        if (fWait)
+        {
+            KeWaitForSingleObject(&m_DpcIdle, Executive, KernelMode, FALSE, NULL);
+        }
+    }
+
+    if (m_AllocatorMXF)
+    {
+        FlushEvents();
+        m_AllocatorMXF->Release();
+        m_AllocatorMXF = NULL;
+    }
+    if (m_MasterClock)
+    {
+        m_MasterClock->Release();
+        m_MasterClock = NULL;
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::Init()
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+CMiniportDMusStreamFMAdLibGold::
+Init
+(
+    IN      CMiniportDMusFMAdLibGold *  Miniport,
+    IN      PAllocatorMXF               AllocatorMXF,
+    IN      PMASTERCLOCK                MasterClock
+)
+{
+    PAGED_CODE();
+    ASSERT(Miniport);
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("CMiniportDMusStreamFMAdLibGold::Init"));
+
+    NTSTATUS ntStatus = CMiniportMidiStreamFMAdLibGold::Init(Miniport);
+
+    if (NT_SUCCESS(ntStatus) && (!AllocatorMXF || !MasterClock))
+    {
+        ntStatus = STATUS_INVALID_PARAMETER;
+    }
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        m_AllocatorMXF = AllocatorMXF;
+        m_AllocatorMXF->AddRef();
+        m_MasterClock = MasterClock;
+        m_MasterClock->AddRef();
+
+        m_State     = KSSTATE_STOP;
+        m_EventHead = NULL;
+        m_EventTail = NULL;
+        KeInitializeSpinLock(&m_EventLock);
+
+        m_fTimerArmed = FALSE;
+        m_fClosing    = FALSE;
+        m_cDpcActive  = 0;
+        KeInitializeEvent(&m_DpcIdle, NotificationEvent, FALSE);
+        KeInitializeDpc(&m_EventDpc, ::DMusFMTimerDPC, PVOID(this));
+        KeInitializeTimer(&m_EventTimer);
+
+        m_NextClockStream = NULL;
+        m_fOnClock = Miniport->AttachClock(this);
+    }
+
+    return ntStatus;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::SetState()
+ *****************************************************************************
+ * RUN starts the event timer, unless the OPL3 clock is already polling
+ * the stream.  Leaving RUN silences the synth and holds the pending
+ * events; STOP also discards them along with parser state.
+ */
+#pragma code_seg()
+STDMETHODIMP
+CMiniportDMusStreamFMAdLibGold::
+SetState
+(
+    IN      KSSTATE     NewState
+)
+{
+    KIRQL oldIrql;
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("CMiniportDMusStreamFMAdLibGold::SetState %d", NewState));
+
+    m_Miniport->m_AdapterCommon->TraceEvent(ADLIBGOLD_TRACE_STREAM_STATE,
+        NewState, ADLIBGOLD_TRACE_STREAM_FM);
+
+    KeAcquireSpinLock(&m_EventLock, &oldIrql);
+    m_State = NewState;
+    if (NewState == KSSTATE_RUN)
+    {
+        if (!m_fOnClock)
+        {
+            ArmEventTimer(0);
+        }
+    }
+    else if (CancelEventTimer())
+    {
+        m_fTimerArmed = FALSE;
+    }
+    KeReleaseSpinLock(&m_EventLock, oldIrql);
+
+    if (NewState == KSSTATE_RUN)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (NewState == KSSTATE_STOP)
+    {
+        FlushEvents();
+
+        KeAcquireSpinLock(&m_Miniport->m_SpinLock, &oldIrql);
+        m_bRunningStatus = 0;
+        m_cbMsgData      = 0;
+        m_cbMsgNeeded    = 0;
+        m_fInSysEx       = FALSE;
+        KeReleaseSpinLock(&m_Miniport->m_SpinLock, oldIrql);
+    }
+
+    Opl3_AllNotesOff();
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::ConnectOutput()
+ *****************************************************************************
+ * Render only; there is no output to connect.
+ */
+#pragma code_seg()
+NTSTATUS
+CMiniportDMusStreamFMAdLibGold::
+ConnectOutput(PMXF sinkMXF)
+{
+    return STATUS_UNSUCCESSFUL;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::DisconnectOutput()
+ */
+#pragma code_seg()
+NTSTATUS
+CMiniportDMusStreamFMAdLibGold::
+DisconnectOutput(PMXF sinkMXF)
+{
+    return STATUS_UNSUCCESSFUL;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::PutMessage()
+ *****************************************************************************
+ * Accepts a chain of events from the port.  Package events are unpacked
+ * into the queue and their headers returned.  While running, anything
+ * already due is played at once; the rest waits for the timer.
+ */
+#pragma code_seg()
+NTSTATUS
+CMiniportDMusStreamFMAdLibGold::
+PutMessage(PDMUS_KERNEL_EVENT pDMKEvt)
+{
+    PDMUS_KERNEL_EVENT pNext;
+    PDMUS_KERNEL_EVENT pFree = NULL;
+    KSSTATE            state;
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    KeAcquireSpinLockAtDpcLevel(&m_EventLock);
+
+    while (pDMKEvt)
+    {
+        pNext = pDMKEvt->pNextEvt;
+        pDMKEvt->pNextEvt = NULL;
+
+        if (PACKAGE_EVT(pDMKEvt))
+        {
+            /* Put the package back at the front of the work list */
+            PDMUS_KERNEL_EVENT pPackage = pDMKEvt->uData.pPackageEvt;
+            PDMUS_KERNEL_EVENT pLast = pPackage;
+
+            while (pLast && pLast->pNextEvt)
+            {
+                pLast = pLast->pNextEvt;
+            }
+            if (pLast)
+            {
+                pLast->pNextEvt = pNext;
+                pNext = pPackage;
+            }
+
+            pDMKEvt->uData.pPackageEvt = NULL;
+            pDMKEvt->cbEvent = 0;
+            pDMKEvt->pNextEvt = pFree;
+            pFree = pDMKEvt;
+        }
+        else if (!pDMKEvt->cbEvent)
+        {
+            pDMKEvt->pNextEvt = pFree;
+            pFree = pDMKEvt;
+        }
+        else
+        {
+            QueueEvent(pDMKEvt);
+        }
+
+        pDMKEvt = pNext;
+    }
+
+    state = m_State;
+
+    KeReleaseSpinLockFromDpcLevel(&m_EventLock);
+
+    if (pFree)
+    {
+        m_AllocatorMXF->PutMessage(pFree);
+    }
+
+    if (state == KSSTATE_RUN)
+    {
+        PlayDueEvents();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::QueueEvent()
+ *****************************************************************************
+ * Inserts an event in presentation-time order, after any event with the
+ * same time.  Sequencer output is already ascending, so the common case
+ * is an O(1) append.  Called with m_EventLock held.
+ */
+#pragma code_seg()
+void
+CMiniportDMusStreamFMAdLibGold::
+QueueEvent
+(
+    IN      PDMUS_KERNEL_EVENT  pEvent
+)
+{
+    PDMUS_KERNEL_EVENT pPrev;
+
+    if (!m_EventTail || (pEvent->ullPresTime100ns >= m_EventTail->ullPresTime100ns))
+    {
+        if (m_EventTail)
+            m_EventTail->pNextEvt = pEvent;
+        else
+            m_EventHead = pEvent;
+        m_EventTail = pEvent;
+        return;
+    }
+
+    if (pEvent->ullPresTime100ns < m_EventHead->ullPresTime100ns)
+    {
+        pEvent->pNextEvt = m_EventHead;
+        m_EventHead = pEvent;
+        return;
+    }
+
+    pPrev = m_EventHead;
+    while (pPrev->pNextEvt->ullPresTime100ns <= pEvent->ullPresTime100ns)
+    {
+        pPrev = pPrev->pNextEvt;
+    }
+    pEvent->pNextEvt = pPrev->pNextEvt;
+    pPrev->pNextEvt = pEvent;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::FlushEvents()
+ *****************************************************************************
+ * Returns every pending event to the allocator unplayed.
+ */
+#pragma code_seg()
+void
+CMiniportDMusStreamFMAdLibGold::
+FlushEvents(void)
+{
+    PDMUS_KERNEL_EVENT pEvents;
+    KIRQL              oldIrql;
+
+    KeAcquireSpinLock(&m_EventLock, &oldIrql);
+    pEvents = m_EventHead;
+    m_EventHead = NULL;
+    m_EventTail = NULL;
+    KeReleaseSpinLock(&m_EventLock, oldIrql);
+
+    if (pEvents)
+    {
+        m_AllocatorMXF->PutMessage(pEvents);
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::PlayDueEvents()
+ *****************************************************************************
+ * Plays every pending event due within FMDMUS_EARLY of the master clock.
+ * On the OPL3 clock this runs every FMDMUS_CLOCK_TICKS, so an event
+ * plays at most about a clock period (plus DPC latency) late.  Without
+ * it the event timer is re-armed for the next event; that only fires on
+ * a system clock tick (10-15.6ms unless someone raised the timer
+ * resolution), so an event can play up to a tick late.  FMDMUS_EARLY
+ * rounds the due time down, it does not bound the error.  The miniport
+ * spinlock is held across dequeue and playback so events from concurrent
+ * callers cannot be reordered.  Channel group 0 (broadcast) and 1 are
+ * played; the synth has only 16 channels.
+ */
+#pragma code_seg()
+void
+CMiniportDMusStreamFMAdLibGold::
+PlayDueEvents(void)
+{
+    PDMUS_KERNEL_EVENT pDue = NULL;
+    PDMUS_KERNEL_EVENT pEvent;
+    REFERENCE_TIME     rtNow;
+    ULONGLONG          ullNext = 0;
+    KIRQL              oldIrql;
+
+    if (!NT_SUCCESS(m_MasterClock->GetTime(&rtNow)))
+    {
+        return;
+    }
+
+    KeAcquireSpinLock(&m_Miniport->m_SpinLock, &oldIrql);
+
+    KeAcquireSpinLockAtDpcLevel(&m_EventLock);
+    if (m_State == KSSTATE_RUN)
+    {
+        pEvent = m_EventHead;
+        while (pEvent &&
+               (pEvent->ullPresTime100ns <= ULONGLONG(rtNow) + FMDMUS_EARLY))
+        {
+            pEvent = pEvent->pNextEvt;
+        }
+
+        if (pEvent != m_EventHead)
+        {
+            /* Cut the due run [head, pEvent) off the queue */
+            PDMUS_KERNEL_EVENT pLast = m_EventHead;
+
+            while (pLast->pNextEvt != pEvent)
+            {
+                pLast = pLast->pNextEvt;
+            }
+            pLast->pNextEvt = NULL;
+
+            pDue = m_EventHead;
+            m_EventHead = pEvent;
+            if (!pEvent)
+                m_EventTail = NULL;
+        }
+
+        if (m_EventHead && !m_fOnClock)
+        {
+            /* Relative due time, FMDMUS_EARLY ahead of the next event */
+            ullNext = m_EventHead->ullPresTime100ns;
+            ArmEventTimer((ullNext > ULONGLONG(rtNow) + FMDMUS_EARLY) ?
+                -LONGLONG(ullNext - ULONGLONG(rtNow) - FMDMUS_EARLY) : 0);
+        }
+    }
+    KeReleaseSpinLockFromDpcLevel(&m_EventLock);
+
+    for (pEvent = pDue; pEvent; pEvent = pEvent->pNextEvt)
+    {
+        if (pEvent->usChannelGroup > 1)
+        {
+            continue;
+        }
+
+        if (pEvent->cbEvent <= sizeof(PBYTE))
+        {
+            ParseMidiBytes(pEvent->uData.abData, pEvent->cbEvent);
+        }
+        else
+        {
+            ParseMidiBytes(pEvent->uData.pbData, pEvent->cbEvent);
+        }
+    }
+
+    KeReleaseSpinLock(&m_Miniport->m_SpinLock, oldIrql);
+
+    m_Miniport->KickWriteQueue();
+
+    if (pDue)
+    {
+        m_AllocatorMXF->PutMessage(pDue);
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::ArmEventTimer()
+ *****************************************************************************
+ * Sets the event timer (relative 100ns units, 0 for at once) unless the
+ * stream is closing.  Called with m_EventLock held.
+ */
+#pragma code_seg()
+void
+CMiniportDMusStreamFMAdLibGold::
+ArmEventTimer(IN LONGLONG DueTime100ns)
+{
+    LARGE_INTEGER timeDue100ns;
+
+    if (m_fClosing)
+    {
+        return;
+    }
+
+    timeDue100ns.QuadPart = DueTime100ns;
+    KeSetTimer(&m_EventTimer, timeDue100ns, &m_EventDpc);
+    m_fTimerArmed = TRUE;
+}
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold::CancelEventTimer()
+ *****************************************************************************
+ * Cancels the event timer and dequeues its DPC.  Both are tried: a run
+ * from an earlier expiry can still be queued when a re-arm is cancelled,
+ * and cancelling the timer alone would leave it behind.  Returns TRUE if
+ * either was pending.  Called with m_EventLock held.
+ */
+#pragma code_seg()
+BOOLEAN
+CMiniportDMusStreamFMAdLibGold::
+CancelEventTimer(void)
+{
+    BOOLEAN fCancelled = KeCancelTimer(&m_EventTimer);
+
+    return KeRemoveQueueDpc(&m_EventDpc) || fCancelled;
+}
@@ -19,6 +19,33 @@
 #define STR_MODULENAME "AdLibGoldFM: "
 
 
+/*****************************************************************************
+ * Forward declarations
+ */
+NTSTATUS
+PropertyHandler_FMPrivate
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+);
+
+static
+fmBank *
+NewPatchBank
+(
+    IN      const patchStruct * Patches     OPTIONAL,
+    IN      ULONG               Count
+);
+
+static
+void
+VoiceListAppend
+(
+    voiceList * pList,
+    voiceLink * pLinks,
+    BYTE        bVoice
+);
+
+
 /*****************************************************************************
  * Velocity attenuation lookup table
  * Converts linear MIDI velocity to logarithmic attenuation.
@@ -91,39 +118,76 @@ static BYTE gbPercMap[53][2] =
 };
 
 /*****************************************************************************
- * Operator offset table
- * Maps voice number (0-17) to operator register offsets for each of 2 ops.
+ * Note-on address table
+ * The register each FMPROG_xxx step writes, for each voice (0-17): the
+ * channel's B0, its two operators' 20-E0, then its A0, C0 and B0 again.
  */
-static WORD gw2OpOffset[NUM2VOICES][2] =
-{
-   { 0x000,0x003 },
-   { 0x001,0x004 },
-   { 0x002,0x005 },
-   { 0x008,0x00b },
-   { 0x009,0x00c },
-   { 0x00a,0x00d },
-   { 0x010,0x013 },
-   { 0x011,0x014 },
-   { 0x012,0x015 },
-   { 0x100,0x103 },
-   { 0x101,0x104 },
-   { 0x102,0x105 },
-   { 0x108,0x10b },
-   { 0x109,0x10c },
-   { 0x10a,0x10d },
-   { 0x110,0x113 },
-   { 0x111,0x114 },
-   { 0x112,0x115 },
+#define NOTEON_OP(op)           0x20 + (op), 0x40 + (op), 0x60 + (op), \
+                                0x80 + (op), 0xE0 + (op)
+#define NOTEON_ROW(ch, op0, op1) \
+    { 0xB0 + (ch), NOTEON_OP(op0), NOTEON_OP(op1),                      \
+      0xA0 + (ch), 0xC0 + (ch), 0xB0 + (ch) }
+
+static WORD gwNoteOnAddress[NUM2VOICES][FMPROG_STEPS] =
+{
+    NOTEON_ROW(0x000, 0x000, 0x003),
+    NOTEON_ROW(0x001, 0x001, 0x004),
+    NOTEON_ROW(0x002, 0x002, 0x005),
+    NOTEON_ROW(0x003, 0x008, 0x00b),
+    NOTEON_ROW(0x004, 0x009, 0x00c),
+    NOTEON_ROW(0x005, 0x00a, 0x00d),
+    NOTEON_ROW(0x006, 0x010, 0x013),
+    NOTEON_ROW(0x007, 0x011, 0x014),
+    NOTEON_ROW(0x008, 0x012, 0x015),
+    NOTEON_ROW(0x100, 0x100, 0x103),
+    NOTEON_ROW(0x101, 0x101, 0x104),
+    NOTEON_ROW(0x102, 0x102, 0x105),
+    NOTEON_ROW(0x103, 0x108, 0x10b),
+    NOTEON_ROW(0x104, 0x109, 0x10c),
+    NOTEON_ROW(0x105, 0x10a, 0x10d),
+    NOTEON_ROW(0x106, 0x110, 0x113),
+    NOTEON_ROW(0x107, 0x111, 0x114),
+    NOTEON_ROW(0x108, 0x112, 0x115)
 };
 
+#undef NOTEON_ROW
+#undef NOTEON_OP
+
+/*
+ * Adds Atten to the total level in a 40h register byte, keeping the key
+ * scale bits and saturating the level at 0x3f (silent).
+ */
+static __inline
+BYTE
+ApplyLevelAtten(BYTE bAt40, WORD wAtten)
+{
+    WORD wLevel = (WORD)((bAt40 & 0x3f) + wAtten);
+
+    return (BYTE)((bAt40 & 0xc0) | ((wLevel > 0x3f) ? 0x3f : wLevel));
+}
+
 /*****************************************************************************
  * Pitch table
- * OPL3 frequency numbers for notes C through B at middle octave.
+ * OPL3 F-number and block offset for one octave from C in 1/PITCH_STEPS
+ * semitone steps (see PITCH_FB()).  Built at compile time from the note
+ * frequency defines, so EUROPE tuning selects its own table.
  */
-static DWORD gdwPitch[12] = {
-        PITCH(C), PITCH(CSHARP), PITCH(D), PITCH(DSHARP),
-        PITCH(E), PITCH(F), PITCH(FSHARP), PITCH(G),
-        PITCH(GSHARP), PITCH(A), PITCH(ASHARP), PITCH(B)};
+#define PITCH_ROW8(x)   PITCH_FB((x) * PITCH_FINE0), PITCH_FB((x) * PITCH_FINE1), \
+                        PITCH_FB((x) * PITCH_FINE2), PITCH_FB((x) * PITCH_FINE3), \
+                        PITCH_FB((x) * PITCH_FINE4), PITCH_FB((x) * PITCH_FINE5), \
+                        PITCH_FB((x) * PITCH_FINE6), PITCH_FB((x) * PITCH_FINE7)
+#define PITCH_ROW(x)    PITCH_ROW8((x) * PITCH_COARSE0), PITCH_ROW8((x) * PITCH_COARSE1), \
+                        PITCH_ROW8((x) * PITCH_COARSE2), PITCH_ROW8((x) * PITCH_COARSE3), \
+                        PITCH_ROW8((x) * PITCH_COARSE4), PITCH_ROW8((x) * PITCH_COARSE5), \
+                        PITCH_ROW8((x) * PITCH_COARSE6), PITCH_ROW8((x) * PITCH_COARSE7)
+
+static WORD gwPitchFAndB[PITCH_OCTAVE] = {
+        PITCH_ROW(C), PITCH_ROW(CSHARP), PITCH_ROW(D), PITCH_ROW(DSHARP),
+        PITCH_ROW(E), PITCH_ROW(F), PITCH_ROW(FSHARP), PITCH_ROW(G),
+        PITCH_ROW(GSHARP), PITCH_ROW(A), PITCH_ROW(ASHARP), PITCH_ROW(B)};
+
+#undef PITCH_ROW
+#undef PITCH_ROW8
 
 /*****************************************************************************
  * Slot offset table
@@ -786,11 +850,24 @@ PCCONNECTION_DESCRIPTOR MiniportConnections[] =
     {   eFMSynthNode,   eFMNodeOutput,  PCFILTER_NODE,  eBridgeOutput }
 };
 
+static
+PCPROPERTY_ITEM MiniportProperties[] =
+{
+    {
+        &KSPROPSETID_AdLibGold,
+        KSPROPERTY_ADLIBGOLD_FM_PATCH_BANK,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_FMPrivate
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationFMFilter, MiniportProperties);
+
 static
 PCFILTER_DESCRIPTOR MiniportFilterDescriptor =
 {
     0,                                  // Version
-    NULL,                               // AutomationTable
+    &AutomationFMFilter,                // AutomationTable
     sizeof(PCPIN_DESCRIPTOR),           // PinSize
     SIZEOF_ARRAY(MiniportPins),         // PinCount
     MiniportPins,                       // Pins
@@ -853,6 +930,10 @@ NonDelegatingQueryInterface
     {
         *Object = PVOID(PMINIPORTMIDI(this));
     }
+    else if (IsEqualGUIDAligned(Interface, IID_IFMSynthAdLibGold))
+    {
+        *Object = PVOID(PFMSYNTHADLIBGOLD(this));
+    }
     else if (IsEqualGUIDAligned(Interface, IID_IPowerNotify))
     {
         *Object = PVOID(PPOWERNOTIFY(this));
@@ -885,15 +966,27 @@ CMiniportMidiFMAdLibGold::
 
     _DbgPrintF(DEBUGLVL_VERBOSE, ("CMiniportMidiFMAdLibGold::~CMiniportMidiFMAdLibGold"));
 
+    /* Waits out any soft-thru delivery still running in the MIDI DPC */
+    if (m_AdapterCommon)
+    {
+        m_AdapterCommon->SetFMSynth(NULL);
+    }
+
     KeAcquireSpinLock(&m_SpinLock, &oldIrql);
 
     Opl3_BoardReset();
 
     /* Clear NEW bit to restore OPL2 compatibility before unload */
-    SoundMidiSendFM(AD_NEW, 0x00);
+    SoundMidiForceFM(AD_NEW, 0x00);
+
+    FlushWriteQueue();
 
     KeReleaseSpinLock(&m_SpinLock, oldIrql);
 
+    if (m_ServiceGroup)
+    {
+        m_ServiceGroup->Release();
+    }
     if (m_Port)
     {
         m_Port->Release();
@@ -902,15 +995,18 @@ CMiniportMidiFMAdLibGold::
     {
         m_AdapterCommon->Release();
     }
+    if (m_Bank)
+    {
+        ExFreePool(m_Bank);
+    }
 }
 
 
 /*****************************************************************************
  * CMiniportMidiFMAdLibGold::Init()
  *****************************************************************************
- * Initializes the miniport.  Obtains adapter common for hardware access
- * and resets the OPL3 chip.  No board detection is done here -- the
- * adapter common already verified the card during its own Init().
+ * Initializes the miniport for the MIDI port driver.  The synth itself is
+ * brought up by InitSynth(), shared with the DirectMusic variant.
  */
 #pragma code_seg("PAGE")
 STDMETHODIMP
@@ -929,14 +1025,70 @@ Init
     ASSERT(Port_);
     ASSERT(ServiceGroup);
 
-    int i;
-
     _DbgPrintF(DEBUGLVL_VERBOSE, ("CMiniportMidiFMAdLibGold::Init"));
 
     m_Port = Port_;
     m_Port->AddRef();
 
+    NTSTATUS ntStatus = InitSynth(UnknownAdapter, ServiceGroup);
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        m_Port->RegisterServiceGroup(m_ServiceGroup);
+    }
+    else
+    {
+        m_Port->Release();
+        m_Port = NULL;
+    }
+
+    return ntStatus;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::InitSynth()
+ *****************************************************************************
+ * Obtains adapter common for hardware access, creates the service group
+ * that drains the OPL3 write queue, and resets the OPL3 chip.  No board
+ * detection is done here -- the adapter common already verified the card
+ * during its own Init().  Cleans up after itself on failure.
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+CMiniportMidiFMAdLibGold::
+InitSynth
+(
+    IN      PUNKNOWN        UnknownAdapter  OPTIONAL,
+    OUT     PSERVICEGROUP * ServiceGroup
+)
+{
+    PAGED_CODE();
+
+    int i;
+
     KeInitializeSpinLock(&m_SpinLock);
+    KeInitializeSpinLock(&m_QueueLock);
+
+    m_QueueHead  = 0;
+    m_QueueTail  = 0;
+    m_fDraining  = FALSE;
+    for (i = 0; i < 0x200; i++)
+        m_QueuePending[i] = FM_QUEUE_NONE;
+
+    /* No streams yet; all voices start on the free list in index order */
+    m_StreamList = NULL;
+    m_VoiceQuota = FM_VOICE_QUOTA;
+
+    RtlZeroMemory(&m_Pool, sizeof(m_Pool));
+    m_Pool.dwCurTime = 1;
+    m_Pool.FreeList.bHead = m_Pool.FreeList.bTail = VOICE_NONE;
+    m_Pool.ReleasedList.bHead = m_Pool.ReleasedList.bTail = VOICE_NONE;
+    for (i = 0; i < NUM2VOICES; i++)
+    {
+        m_Pool.bNoteNext[i] = VOICE_NONE;
+        VoiceListAppend(&m_Pool.FreeList, m_Pool.StateLink, (BYTE)i);
+    }
 
     /*
      * Obtain IAdapterCommon from the adapter.
@@ -952,6 +1104,30 @@ Init
         ntStatus = STATUS_INVALID_PARAMETER;
     }
 
+    /*
+     * Create the service group whose DPC drains the write queue.
+     */
+    if (NT_SUCCESS(ntStatus))
+    {
+        ntStatus = PcNewServiceGroup(&m_ServiceGroup, NULL);
+        if (NT_SUCCESS(ntStatus) && !m_ServiceGroup)
+        {
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    /*
+     * Compile the built-in patches; a bank file may replace them below.
+     */
+    if (NT_SUCCESS(ntStatus))
+    {
+        m_Bank = NewPatchBank(NULL, 0);
+        if (!m_Bank)
+        {
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
     if (NT_SUCCESS(ntStatus))
     {
         KIRQL oldIrql;
@@ -962,16 +1138,45 @@ Init
 
         /* No board detection -- adapter common already verified the card. */
         Opl3_BoardReset();
+        FlushWriteQueue();
 
         KeReleaseSpinLock(&m_SpinLock, oldIrql);
 
-        *ServiceGroup = NULL;
+        *ServiceGroup = m_ServiceGroup;
+        m_ServiceGroup->AddRef();
+
+        /* A bank named in the registry replaces the built-in patches */
+        LoadPatchBankFile();
+
+        /* Cap on the voices any one client can hold while others play */
+        ULONG quota;
+        if (NT_SUCCESS(m_AdapterCommon->QuerySettingsValue(L"FMStreamVoices",
+                                                           &quota)) &&
+            quota)
+        {
+            if (quota > NUM2VOICES)
+            {
+                quota = NUM2VOICES;
+            }
+            m_VoiceQuota = quota;
+
+            _DbgPrintF(DEBUGLVL_VERBOSE,
+                ("InitSynth: %d voices per stream", m_VoiceQuota));
+        }
+
+        /* Accept MIDI soft-thru from the UART miniport */
+        m_AdapterCommon->SetFMSynth(PFMSYNTHADLIBGOLD(this));
     }
 
     if (!NT_SUCCESS(ntStatus))
     {
-        m_Port->Release();
-        m_Port = NULL;
+        if (m_ServiceGroup)
+        {
+            m_ServiceGroup->Release();
+            m_ServiceGroup = NULL;
+        }
+        *ServiceGroup = NULL;
+
         if (m_AdapterCommon)
         {
             m_AdapterCommon->Release();
@@ -1004,37 +1209,29 @@ NewStream
 
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
-    if (m_fStreamExists)
-    {
-        _DbgPrintF(DEBUGLVL_TERSE, ("NewStream: stream already exists"));
-        ntStatus = STATUS_INVALID_DEVICE_REQUEST;
-    }
-    else
-    {
-        CMiniportMidiStreamFMAdLibGold *pStream =
-            new(PoolType) CMiniportMidiStreamFMAdLibGold(OuterUnknown);
-
-        if (pStream)
-        {
-            pStream->AddRef();
-
-            ntStatus = pStream->Init(this);
+    /* Any number of streams; they share the voice pool */
+    CMiniportMidiStreamFMAdLibGold *pStream =
+        new(PoolType) CMiniportMidiStreamFMAdLibGold(OuterUnknown);
 
-            if (NT_SUCCESS(ntStatus))
-            {
-                *Stream = PMINIPORTMIDISTREAM(pStream);
-                (*Stream)->AddRef();
+    if (pStream)
+    {
+        pStream->AddRef();
 
-                *ServiceGroup = NULL;
-                m_fStreamExists = TRUE;
-            }
+        ntStatus = pStream->Init(this);
 
-            pStream->Release();
-        }
-        else
+        if (NT_SUCCESS(ntStatus))
         {
-            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+            *Stream = PMINIPORTMIDISTREAM(pStream);
+            (*Stream)->AddRef();
+
+            *ServiceGroup = NULL;
         }
+
+        pStream->Release();
+    }
+    else
+    {
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
     }
 
     return ntStatus;
@@ -1044,7 +1241,8 @@ NewStream
 /*****************************************************************************
  * CMiniportMidiFMAdLibGold::Service()
  *****************************************************************************
- * No DPC callback needed -- FM synth is write-only.
+ * DPC-mode service call from the port driver.  Pushes the queued OPL3
+ * writes to the hardware.
  */
 #pragma code_seg()
 STDMETHODIMP_(void)
@@ -1053,210 +1251,1108 @@ Service
 (   void
 )
 {
+    ServiceWriteQueue();
 }
 
 
 /*****************************************************************************
- * CMiniportMidiFMAdLibGold::GetDescription()
- */
-#pragma code_seg("PAGE")
-STDMETHODIMP
-CMiniportMidiFMAdLibGold::
-GetDescription
-(
-    OUT     PPCFILTER_DESCRIPTOR *  OutFilterDescriptor
-)
-{
-    PAGED_CODE();
-    ASSERT(OutFilterDescriptor);
-
-    *OutFilterDescriptor = &MiniportFilterDescriptor;
-
-    return STATUS_SUCCESS;
-}
-
-
-/*****************************************************************************
- * CMiniportMidiFMAdLibGold::PowerChangeNotify()
+ * CMiniportMidiFMAdLibGold::PlayMidiMessages()
+ *****************************************************************************
+ * Soft-thru entry from the MIDI UART's service DPC: applies complete
+ * channel messages as if the newest open stream had been written them,
+ * under one acquisition of the spinlock.  Channel state lives in the
+ * stream, so with no stream open there is nothing to play them on.
+ *
+ * Called at DISPATCH_LEVEL with the adapter's MMA lock held.
  */
-#pragma code_seg("PAGE")
+#pragma code_seg()
 STDMETHODIMP_(void)
 CMiniportMidiFMAdLibGold::
-PowerChangeNotify
+PlayMidiMessages
 (
-    IN  POWER_STATE PowerState
+    IN      PULONG      Messages,
+    IN      ULONG       Count
 )
 {
-    PAGED_CODE();
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+    ASSERT(Messages);
 
-    _DbgPrintF(DEBUGLVL_VERBOSE, ("PowerChangeNotify(%d)", PowerState));
+    BOOLEAN played = FALSE;
+    ULONG   i;
 
-    switch (PowerState.DeviceState)
+    KeAcquireSpinLockAtDpcLevel(&m_SpinLock);
+
+    if (m_StreamList)
     {
-    case PowerDeviceD0:
-        if (m_PowerState.DeviceState != PowerDeviceD0)
+        for (i = 0; i < Count; i++)
         {
-            MiniportMidiFMResume();
+            m_StreamList->WriteMidiData(Messages[i]);
         }
-        break;
+        played = TRUE;
+    }
 
-    case PowerDeviceD1:
-    case PowerDeviceD2:
-    case PowerDeviceD3:
-    default:
-        break;
+    KeReleaseSpinLockFromDpcLevel(&m_SpinLock);
+
+    if (played)
+    {
+        KickWriteQueue();
     }
-    m_PowerState.DeviceState = PowerState.DeviceState;
 }
 
 
 /*****************************************************************************
- * CMiniportMidiFMAdLibGold::SoundMidiSendFM()
+ * CMiniportMidiFMAdLibGold::AddStream()
  *****************************************************************************
- * Core OPL3 register write.  Delegates to adapter common for bank-
- * coordinated access, then updates the shadow register.
- *
- * Called at DISPATCH_LEVEL within spinlock.
+ * Put a stream on the open list, where it becomes the soft-thru target.
  */
 #pragma code_seg()
 void
 CMiniportMidiFMAdLibGold::
-SoundMidiSendFM
+AddStream
 (
-    ULONG   Address,
-    UCHAR   Data
+    IN      CMiniportMidiStreamFMAdLibGold *    Stream
 )
 {
-    ASSERT(Address < 0x200);
-    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
-
-    _DbgPrintF(DEBUGLVL_VERBOSE, ("%X\t%X", Address, Data));
+    KIRQL oldIrql;
 
-    m_AdapterCommon->WriteOPL3(Address, Data);
-    m_SavedRegValues[Address] = Data;
+    KeAcquireSpinLock(&m_SpinLock, &oldIrql);
+    Stream->m_NextStream = m_StreamList;
+    m_StreamList = Stream;
+    KeReleaseSpinLock(&m_SpinLock, oldIrql);
 }
 
 
 /*****************************************************************************
- * CMiniportMidiFMAdLibGold::Opl3_BoardReset()
+ * CMiniportMidiFMAdLibGold::RemoveStream()
  *****************************************************************************
- * Silence and reset the OPL3 chip.  Sets the NEW bit to enable OPL3 mode
- * with stereo output (Ad Lib Gold-specific addition to the DDK pattern).
+ * Take a closing stream off the open list and out of the voice pool, in
+ * one hold of the spinlock so soft-thru cannot play a note on it in
+ * between.  Its notes are released and its released voices disowned;
+ * they go on sounding out on the pool's released list.
  */
 #pragma code_seg()
 void
 CMiniportMidiFMAdLibGold::
-Opl3_BoardReset()
+RemoveStream
+(
+    IN      CMiniportMidiStreamFMAdLibGold *    Stream
+)
 {
-    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
-
-    BYTE i;
-
-    _DbgPrintF(DEBUGLVL_VERBOSE, ("Opl3_BoardReset"));
-
-    /* Enable OPL3 mode (stereo, 18 voices, extra waveforms) */
-    SoundMidiSendFM(AD_NEW, 0x01);
-    SoundMidiSendFM(AD_MASK, 0x60);
-    SoundMidiSendFM(AD_CONNECTION, 0x00);
-    SoundMidiSendFM(AD_NTS, 0x00);
+    CMiniportMidiStreamFMAdLibGold **ppLink;
+    KIRQL   oldIrql;
+    BYTE    i;
 
-    /* Turn off drums, use high vibrato/modulation */
-    SoundMidiSendFM(AD_DRUM, 0xc0);
+    KeAcquireSpinLock(&m_SpinLock, &oldIrql);
 
-    /* Turn off all oscillators (max attenuation) */
-    for (i = 0; i <= 0x15; i++)
+    for (ppLink = &m_StreamList; *ppLink; ppLink = &(*ppLink)->m_NextStream)
     {
-        if ((i & 0x07) <= 0x05)
+        if (*ppLink == Stream)
         {
-            SoundMidiSendFM(AD_LEVEL + i, 0x3f);
-            SoundMidiSendFM(AD_LEVEL2 + i, 0x3f);
+            *ppLink = Stream->m_NextStream;
+            break;
         }
     }
 
-    /* Turn off all voices and set stereo output to both channels */
-    for (i = 0; i <= 0x08; i++)
+    while ((i = Stream->m_ActiveList.bHead) != VOICE_NONE)
     {
-        SoundMidiSendFM(AD_BLOCK + i, 0x00);
-        SoundMidiSendFM(AD_BLOCK2 + i, 0x00);
-
-        /* Set STL + STR bits (D5 + D4) for stereo output on all voices */
-        SoundMidiSendFM(AD_FEEDBACK + i, 0x30);
-        SoundMidiSendFM(AD_FEEDBACK2 + i, 0x30);
+        Stream->Opl3_ReleaseVoice(i);
+    }
+    for (i = 0; i < NUM2VOICES; i++)
+    {
+        if (m_Pool.Owner[i] == Stream)
+        {
+            m_Pool.Owner[i] = NULL;
+        }
     }
+
+    KeReleaseSpinLock(&m_SpinLock, oldIrql);
+
+    KickWriteQueue();
 }
 
 
 /*****************************************************************************
- * CMiniportMidiFMAdLibGold::MiniportMidiFMResume()
+ * CompilePatch()
  *****************************************************************************
- * Restores all OPL3 registers from shadow on power resume.
+ * Compiles a patch to its note-on program (see FMPROG_xxx).  Which
+ * operators take the note's volume depends only on the patch's connection
+ * type, so it is decided here rather than on every note.
  */
-#pragma code_seg()
+#pragma code_seg("PAGE")
+static
 void
-CMiniportMidiFMAdLibGold::
-MiniportMidiFMResume()
+CompilePatch
+(
+    IN      const patchStruct * Patch,
+    OUT     fmProgram *         Program
+)
 {
-    KIRQL oldIrql;
-    BYTE  i;
+    PAGED_CODE();
 
-    _DbgPrintF(DEBUGLVL_VERBOSE, ("MiniportMidiFMResume"));
-    KeAcquireSpinLock(&m_SpinLock, &oldIrql);
+    const noteStruct *lpSN = &Patch->note;
+    BYTE bMode = (BYTE)((lpSN->bAtC0[0] & 0x01) * 2 + 4);
+    BYTE bVolume;
+    int  i, step;
 
-    SoundMidiSendFM(AD_LSI, m_SavedRegValues[AD_LSI]);
-    SoundMidiSendFM(AD_LSI2, m_SavedRegValues[AD_LSI2]);
-    SoundMidiSendFM(AD_TIMER1, m_SavedRegValues[AD_TIMER1]);
-    SoundMidiSendFM(AD_TIMER2, m_SavedRegValues[AD_TIMER2]);
-    SoundMidiSendFM(AD_MASK, m_SavedRegValues[AD_MASK]);
-    SoundMidiSendFM(AD_CONNECTION, m_SavedRegValues[AD_CONNECTION]);
-    SoundMidiSendFM(AD_NEW, m_SavedRegValues[AD_NEW]);
-    SoundMidiSendFM(AD_NTS, m_SavedRegValues[AD_NTS]);
-    SoundMidiSendFM(AD_DRUM, m_SavedRegValues[AD_DRUM]);
+    RtlZeroMemory(Program, sizeof(fmProgram));
 
-    for (i = 0; i <= 0x15; i++)
+    Program->bValue[FMPROG_KEYOFF] = 0;
+    Program->bOp[FMPROG_KEYOFF]    = FMOP_FIXED;
+
+    for (i = 0; i < 2; i++)
     {
-        if ((i & 0x07) <= 0x05)
+        const operStruct *lpOS = &lpSN->op[i];
+
+        switch (bMode)
         {
-            SoundMidiSendFM(AD_MULT + i, m_SavedRegValues[AD_MULT + i]);
-            SoundMidiSendFM(AD_MULT2 + i, m_SavedRegValues[AD_MULT2 + i]);
-            SoundMidiSendFM(AD_LEVEL + i, m_SavedRegValues[AD_LEVEL + i]);
-            SoundMidiSendFM(AD_LEVEL2 + i, m_SavedRegValues[AD_LEVEL2 + i]);
-            SoundMidiSendFM(AD_AD + i, m_SavedRegValues[AD_AD + i]);
-            SoundMidiSendFM(AD_AD2 + i, m_SavedRegValues[AD_AD2 + i]);
-            SoundMidiSendFM(AD_SR + i, m_SavedRegValues[AD_SR + i]);
-            SoundMidiSendFM(AD_SR2 + i, m_SavedRegValues[AD_SR2 + i]);
-            SoundMidiSendFM(AD_WAVE + i, m_SavedRegValues[AD_WAVE + i]);
-            SoundMidiSendFM(AD_WAVE2 + i, m_SavedRegValues[AD_WAVE2 + i]);
+        case 4:  bVolume = (BYTE)(i == 1); break;   /* FM: carrier only */
+        case 6:  bVolume = TRUE; break;             /* AM: both         */
+        default: bVolume = FALSE; break;
         }
+
+        step = FMPROG_OP0 + 5 * i;
+        Program->bValue[step + 0] = lpOS->bAt20;
+        Program->bValue[step + 1] = lpOS->bAt40;
+        Program->bValue[step + 2] = lpOS->bAt60;
+        Program->bValue[step + 3] = lpOS->bAt80;
+        Program->bValue[step + 4] = lpOS->bAtE0;
+        Program->bOp[step + 1] = bVolume ? FMOP_VOLUME : FMOP_FIXED;
     }
 
-    for (i = 0; i <= 0x08; i++)
+    Program->bOp[FMPROG_FNUMBER]     = FMOP_FNUMBER;
+    Program->bValue[FMPROG_FEEDBACK] = lpSN->bAtC0[0];
+    Program->bOp[FMPROG_FEEDBACK]    = FMOP_STEREO;
+    Program->bOp[FMPROG_KEYON]       = FMOP_KEYON;
+
+    /*
+     * Pitch position offset: the patch's block as octaves, plus one octave
+     * so a full downward bend of the lowest note stays positive.
+     */
+    for (i = 0; i < 2; i++)
     {
-        SoundMidiSendFM(AD_FNUMBER + i, m_SavedRegValues[AD_FNUMBER + i]);
-        SoundMidiSendFM(AD_FNUMBER2 + i, m_SavedRegValues[AD_FNUMBER2 + i]);
-        SoundMidiSendFM(AD_FEEDBACK + i, m_SavedRegValues[AD_FEEDBACK + i]);
-        SoundMidiSendFM(AD_FEEDBACK2 + i, m_SavedRegValues[AD_FEEDBACK2 + i]);
-        SoundMidiSendFM(AD_BLOCK + i, m_SavedRegValues[AD_BLOCK + i]);
-        SoundMidiSendFM(AD_BLOCK2 + i, m_SavedRegValues[AD_BLOCK2 + i]);
+        Program->bPitchBase[i] =
+            (BYTE)(12 * ((lpSN->bAtB0[i] >> 2) & 0x07) + 12);
     }
-
-    KeReleaseSpinLock(&m_SpinLock, oldIrql);
 }
 
 
-/* ========================================================================= */
-/* Stream class methods                                                      */
-/* ========================================================================= */
-
-
 /*****************************************************************************
- * CMiniportMidiStreamFMAdLibGold::NonDelegatingQueryInterface()
+ * NewPatchBank()
+ *****************************************************************************
+ * Allocates a nonpaged bank holding the built-in patches with the first
+ * Count replaced from Patches, and compiles all of them.
  */
 #pragma code_seg("PAGE")
-STDMETHODIMP
-CMiniportMidiStreamFMAdLibGold::
-NonDelegatingQueryInterface
+static
+fmBank *
+NewPatchBank
 (
-    REFIID  Interface,
+    IN      const patchStruct * Patches     OPTIONAL,
+    IN      ULONG               Count
+)
+{
+    PAGED_CODE();
+
+    ASSERT(Count <= NUMPATCHES);
+    ASSERT(sizeof(glpPatch) == sizeof(((fmBank *)0)->Patch));
+
+    fmBank *bank = (fmBank *)ExAllocatePool(NonPagedPool, sizeof(fmBank));
+    ULONG   i;
+
+    if (bank)
+    {
+        RtlCopyMemory(bank->Patch, glpPatch, sizeof(bank->Patch));
+        if (Count)
+        {
+            RtlCopyMemory(bank->Patch, Patches, Count * sizeof(patchStruct));
+        }
+
+        for (i = 0; i < NUMPATCHES; i++)
+        {
+            CompilePatch(&bank->Patch[i], &bank->Program[i]);
+        }
+    }
+
+    return bank;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::LoadPatchBank()
+ *****************************************************************************
+ * Validates an ADLIBGOLD_FM_BANK and makes it the active bank.  The
+ * patches are checked here, once, copied over the built-in table into a
+ * nonpaged arena the note engine can read at DISPATCH_LEVEL, and compiled
+ * to note-on programs there.  Streams keep playing across the swap; notes
+ * already sounding keep the old patch's registers until they are
+ * released.  PatchCount 0 returns to the built-in bank.
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+CMiniportMidiFMAdLibGold::
+LoadPatchBank
+(
+    IN      PADLIBGOLD_FM_BANK  Bank,
+    IN      ULONG               Size
+)
+{
+    PAGED_CODE();
+
+    ASSERT(Bank);
+    ASSERT(sizeof(patchStruct) == ADLIBGOLD_FM_PATCH_SIZE);
+
+    if (Size < ADLIBGOLD_FM_BANK_SIZE(0))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    if (Bank->Signature != ADLIBGOLD_FM_BANK_SIGNATURE ||
+        Bank->Version != ADLIBGOLD_FM_BANK_VERSION ||
+        Bank->PatchCount > NUMPATCHES)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (Size < ADLIBGOLD_FM_BANK_SIZE(Bank->PatchCount))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    patchStruct *patches = (patchStruct *)Bank->Patch;
+    ULONG i;
+
+    for (i = 0; i < Bank->PatchCount; i++)
+    {
+        if (patches[i].note.bOp > PATCH_1_2OP)
+        {
+            _DbgPrintF(DEBUGLVL_TERSE, ("LoadPatchBank: bad patch %d", i));
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    fmBank *arena = NewPatchBank(patches, Bank->PatchCount);
+
+    if (!arena)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    arena = SwapPatchBank(arena);
+    if (arena)
+    {
+        ExFreePool(arena);
+    }
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("LoadPatchBank: %d patches", Bank->PatchCount));
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::SwapPatchBank()
+ *****************************************************************************
+ * Makes Bank the active bank and returns the one it replaces.  Once the
+ * lock is dropped no note engine call can still be reading the old one.
+ */
+#pragma code_seg()
+fmBank *
+CMiniportMidiFMAdLibGold::
+SwapPatchBank
+(
+    IN      fmBank *    Bank
+)
+{
+    KIRQL    oldIrql;
+    fmBank * oldBank;
+
+    ASSERT(Bank);
+
+    KeAcquireSpinLock(&m_SpinLock, &oldIrql);
+
+    oldBank = m_Bank;
+    m_Bank  = Bank;
+
+    KeReleaseSpinLock(&m_SpinLock, oldIrql);
+
+    return oldBank;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::LoadPatchBankFile()
+ *****************************************************************************
+ * Loads the bank file named by the "FMPatchBank" setting, a full NT path
+ * such as \SystemRoot\System32\drivers\algold.bnk.  Without the setting,
+ * or if the file is unreadable or invalid, the built-in bank stays.
+ */
+#pragma code_seg("PAGE")
+void
+CMiniportMidiFMAdLibGold::
+LoadPatchBankFile
+(   void
+)
+{
+    PAGED_CODE();
+
+    WCHAR path[FM_BANK_PATH_CHARS];
+
+    NTSTATUS ntStatus = m_AdapterCommon->QuerySettingsString(
+        L"FMPatchBank", path, sizeof(path));
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        return;
+    }
+
+    UNICODE_STRING      fileName;
+    OBJECT_ATTRIBUTES   attributes;
+    IO_STATUS_BLOCK     ioStatus;
+    HANDLE              file;
+
+    RtlInitUnicodeString(&fileName, path);
+    InitializeObjectAttributes(&attributes, &fileName,
+                               OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    ntStatus = ZwCreateFile(&file,
+                            GENERIC_READ | SYNCHRONIZE,
+                            &attributes,
+                            &ioStatus,
+                            NULL,
+                            FILE_ATTRIBUTE_NORMAL,
+                            FILE_SHARE_READ,
+                            FILE_OPEN,
+                            FILE_SYNCHRONOUS_IO_NONALERT |
+                                FILE_NON_DIRECTORY_FILE,
+                            NULL,
+                            0);
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        /* One byte more than the largest bank, to catch oversized files */
+        ULONG maxSize = ADLIBGOLD_FM_BANK_SIZE(NUMPATCHES);
+        PADLIBGOLD_FM_BANK bank =
+            (PADLIBGOLD_FM_BANK)ExAllocatePool(PagedPool, maxSize + 1);
+
+        if (bank)
+        {
+            ntStatus = ZwReadFile(file, NULL, NULL, NULL, &ioStatus,
+                                  bank, maxSize + 1, NULL, NULL);
+
+            if (NT_SUCCESS(ntStatus))
+            {
+                if (ioStatus.Information > maxSize)
+                {
+                    ntStatus = STATUS_INVALID_PARAMETER;
+                }
+                else
+                {
+                    ntStatus = LoadPatchBank(bank, ULONG(ioStatus.Information));
+                }
+            }
+
+            ExFreePool(bank);
+        }
+        else
+        {
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ZwClose(file);
+    }
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        _DbgPrintF(DEBUGLVL_TERSE,
+            ("LoadPatchBankFile: %ws not loaded (0x%08x)", path, ntStatus));
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::PropertyPatchBank()
+ *****************************************************************************
+ * KSPROPERTY_ADLIBGOLD_FM_PATCH_BANK on either FM filter.  SET loads an
+ * ADLIBGOLD_FM_BANK (see LoadPatchBank()); GET returns the active bank,
+ * all NUMPATCHES patches of it.  The copy out is made under m_SpinLock
+ * into the nonpaged property buffer so a concurrent SET cannot free the
+ * bank underneath it.
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+CMiniportMidiFMAdLibGold::
+PropertyPatchBank
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+)
+{
+    PAGED_CODE();
+
+    ASSERT(PropertyRequest);
+
+    if (PropertyRequest->PropertyItem->Id != KSPROPERTY_ADLIBGOLD_FM_PATCH_BANK)
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        if (PropertyRequest->ValueSize < sizeof(ULONG))
+        {
+            PropertyRequest->ValueSize = sizeof(ULONG);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        *PULONG(PropertyRequest->Value) = KSPROPERTY_TYPE_GET |
+                                          KSPROPERTY_TYPE_SET |
+                                          KSPROPERTY_TYPE_BASICSUPPORT;
+        PropertyRequest->ValueSize = sizeof(ULONG);
+        return STATUS_SUCCESS;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_GET)
+    {
+        ULONG valueSize = ADLIBGOLD_FM_BANK_SIZE(NUMPATCHES);
+
+        if (PropertyRequest->ValueSize < valueSize)
+        {
+            PropertyRequest->ValueSize = valueSize;
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        PADLIBGOLD_FM_BANK bank = PADLIBGOLD_FM_BANK(PropertyRequest->Value);
+        KIRQL oldIrql;
+
+        bank->Signature  = ADLIBGOLD_FM_BANK_SIGNATURE;
+        bank->Version    = ADLIBGOLD_FM_BANK_VERSION;
+        bank->PatchCount = NUMPATCHES;
+        bank->Reserved   = 0;
+
+        KeAcquireSpinLock(&m_SpinLock, &oldIrql);
+        RtlCopyMemory(bank->Patch, m_Bank->Patch, sizeof(m_Bank->Patch));
+        KeReleaseSpinLock(&m_SpinLock, oldIrql);
+
+        PropertyRequest->ValueSize = valueSize;
+        return STATUS_SUCCESS;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_SET)
+    {
+        return LoadPatchBank(PADLIBGOLD_FM_BANK(PropertyRequest->Value),
+                             PropertyRequest->ValueSize);
+    }
+
+    return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+
+/*****************************************************************************
+ * PropertyHandler_FMPrivate()
+ *****************************************************************************
+ * KSPROPSETID_AdLibGold items on the FM filter.
+ */
+#pragma code_seg("PAGE")
+NTSTATUS
+PropertyHandler_FMPrivate
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+)
+{
+    PAGED_CODE();
+
+    ASSERT(PropertyRequest);
+
+    CMiniportMidiFMAdLibGold *that =
+        (CMiniportMidiFMAdLibGold *)(PMINIPORTMIDI(PropertyRequest->MajorTarget));
+
+    return that->PropertyPatchBank(PropertyRequest);
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::GetDescription()
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP
+CMiniportMidiFMAdLibGold::
+GetDescription
+(
+    OUT     PPCFILTER_DESCRIPTOR *  OutFilterDescriptor
+)
+{
+    PAGED_CODE();
+    ASSERT(OutFilterDescriptor);
+
+    *OutFilterDescriptor = &MiniportFilterDescriptor;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::PowerChangeNotify()
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP_(void)
+CMiniportMidiFMAdLibGold::
+PowerChangeNotify
+(
+    IN  POWER_STATE PowerState
+)
+{
+    PAGED_CODE();
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("PowerChangeNotify(%d)", PowerState));
+
+    switch (PowerState.DeviceState)
+    {
+    case PowerDeviceD0:
+        if (m_PowerState.DeviceState != PowerDeviceD0)
+        {
+            MiniportMidiFMResume();
+        }
+        break;
+
+    case PowerDeviceD1:
+    case PowerDeviceD2:
+    case PowerDeviceD3:
+    default:
+        {
+            /* An unfinished resume is moot once the chip powers down */
+            KIRQL oldIrql;
+            KeAcquireSpinLock(&m_SpinLock, &oldIrql);
+            m_fResuming = FALSE;
+            KeReleaseSpinLock(&m_SpinLock, oldIrql);
+        }
+        break;
+    }
+    m_PowerState.DeviceState = PowerState.DeviceState;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::SoundMidiSendFM()
+ *****************************************************************************
+ * Core OPL3 register write.  Skips the write when the shadow register
+ * already holds the value -- each WriteOPL3() costs two 23us stalls, and
+ * volume, pan and pitch bend updates re-send identical bytes constantly.
+ * AD_MASK is always written because its D7 (IRQ reset) is a strobe.
+ *
+ * The shadow is updated at once; the hardware write is queued and goes
+ * out from the service group DPC (see DrainWriteQueue()).
+ *
+ * Called at DISPATCH_LEVEL within spinlock.
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+SoundMidiSendFM
+(
+    ULONG   Address,
+    UCHAR   Data
+)
+{
+    ASSERT(Address < 0x200);
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    if ((m_SavedRegValues[Address] == Data) && (Address != AD_MASK))
+    {
+        return;
+    }
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("%X\t%X", Address, Data));
+
+    m_SavedRegValues[Address] = Data;
+    QueueWriteFM(Address, Data, (BOOLEAN)(Address != AD_MASK));
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::SoundMidiForceFM()
+ *****************************************************************************
+ * Unconditional OPL3 register write.  Updates the shadow register and
+ * queues the write without coalescing.  Used by the reset and resume
+ * paths, where the shadow does not describe the chip; those callers
+ * finish with FlushWriteQueue().
+ *
+ * Called at DISPATCH_LEVEL within spinlock.
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+SoundMidiForceFM
+(
+    ULONG   Address,
+    UCHAR   Data
+)
+{
+    ASSERT(Address < 0x200);
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("%X\t%X", Address, Data));
+
+    m_SavedRegValues[Address] = Data;
+    QueueWriteFM(Address, Data, FALSE);
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::QueueWriteFM()
+ *****************************************************************************
+ * Appends a register/value pair to the write queue.  With Coalesce set, a
+ * write to an address that is still queued replaces the queued value
+ * instead of taking a new slot.  Key-on registers (B0-B8) are never
+ * coalesced: a key-off followed by a key-on must reach the chip as two
+ * writes or the envelope does not retrigger.
+ *
+ * If the ring is full the caller drains it inline.
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+QueueWriteFM
+(
+    ULONG   Address,
+    UCHAR   Data,
+    BOOLEAN Coalesce
+)
+{
+    KIRQL oldIrql;
+    ULONG slot;
+
+    if (AD_KEYON_REG(Address))
+    {
+        Coalesce = FALSE;
+    }
+
+    KeAcquireSpinLock(&m_QueueLock, &oldIrql);
+
+    slot = m_QueuePending[Address];
+    if (Coalesce && (slot != FM_QUEUE_NONE))
+    {
+        m_QueueData[slot] = Data;
+        KeReleaseSpinLock(&m_QueueLock, oldIrql);
+        return;
+    }
+
+    while (((m_QueueHead + 1) & FM_QUEUE_MASK) == m_QueueTail)
+    {
+        _DbgPrintF(DEBUGLVL_VERBOSE, ("QueueWriteFM: queue full"));
+
+        KeReleaseSpinLock(&m_QueueLock, oldIrql);
+        DrainWriteQueue();
+        KeAcquireSpinLock(&m_QueueLock, &oldIrql);
+    }
+
+    slot = m_QueueHead;
+    m_QueueAddress[slot] = (WORD)Address;
+    m_QueueData[slot]    = Data;
+    m_QueuePending[Address] = (WORD)slot;
+    m_QueueHead = (slot + 1) & FM_QUEUE_MASK;
+
+    KeReleaseSpinLock(&m_QueueLock, oldIrql);
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::DrainWriteQueue()
+ *****************************************************************************
+ * Pushes queued writes to the hardware through the adapter common.
+ * Entries are taken FM_QUEUE_BATCH at a time under m_QueueLock and
+ * written with the lock released, so producers are never held off for
+ * more than one batch copy.  Only one drainer runs at a time; a second
+ * caller returns at once and the active drainer picks up its entries.
+ *
+ * Never takes m_SpinLock, so it may be called with or without it held.
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+DrainWriteQueue(void)
+{
+    WORD    address[FM_QUEUE_BATCH];
+    BYTE    data[FM_QUEUE_BATCH];
+    ULONG   count;
+    ULONG   i;
+    KIRQL   oldIrql;
+
+    KeAcquireSpinLock(&m_QueueLock, &oldIrql);
+
+    if (m_fDraining)
+    {
+        KeReleaseSpinLock(&m_QueueLock, oldIrql);
+        return;
+    }
+    m_fDraining = TRUE;
+
+    for (;;)
+    {
+        count = 0;
+        while ((count < FM_QUEUE_BATCH) && (m_QueueTail != m_QueueHead))
+        {
+            address[count] = m_QueueAddress[m_QueueTail];
+            data[count]    = m_QueueData[m_QueueTail];
+
+            if (m_QueuePending[address[count]] == (WORD)m_QueueTail)
+            {
+                m_QueuePending[address[count]] = FM_QUEUE_NONE;
+            }
+
+            m_QueueTail = (m_QueueTail + 1) & FM_QUEUE_MASK;
+            count++;
+        }
+
+        if (!count)
+        {
+            break;
+        }
+
+        KeReleaseSpinLock(&m_QueueLock, oldIrql);
+
+        for (i = 0; i < count; i++)
+        {
+            m_AdapterCommon->WriteOPL3(address[i], data[i]);
+        }
+
+        KeAcquireSpinLock(&m_QueueLock, &oldIrql);
+    }
+
+    m_fDraining = FALSE;
+    KeReleaseSpinLock(&m_QueueLock, oldIrql);
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::FlushWriteQueue()
+ *****************************************************************************
+ * Drains the write queue synchronously and returns only once every
+ * queued write has reached the chip, including those taken by a drainer
+ * running on another processor.
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+FlushWriteQueue(void)
+{
+    KIRQL   oldIrql;
+    BOOLEAN idle;
+
+    for (;;)
+    {
+        DrainWriteQueue();
+
+        KeAcquireSpinLock(&m_QueueLock, &oldIrql);
+        idle = (m_QueueTail == m_QueueHead) && !m_fDraining;
+        KeReleaseSpinLock(&m_QueueLock, oldIrql);
+
+        if (idle)
+        {
+            break;
+        }
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::KickWriteQueue()
+ *****************************************************************************
+ * Schedules the service group DPC if writes are queued.  Requesting
+ * service on the group directly works under either port driver.  The
+ * unlocked head/tail compare is only a hint; the drainer rechecks under
+ * the lock.
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+KickWriteQueue(void)
+{
+    if ((m_QueueHead != m_QueueTail) && m_ServiceGroup)
+    {
+        m_ServiceGroup->RequestService();
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::ServiceWriteQueue()
+ *****************************************************************************
+ * Service group work: runs the next power resume slice, if any, then
+ * drains the write queue.  While a resume is in progress each slice
+ * requests service again, so slices run in separate DPCs and other
+ * queued DPCs get the processor in between.
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+ServiceWriteQueue(void)
+{
+    BOOLEAN fMore = FALSE;
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    if (m_fResuming)
+    {
+        KeAcquireSpinLockAtDpcLevel(&m_SpinLock);
+        if (m_fResuming)
+        {
+            fMore = !MiniportMidiFMResumeSlice();
+        }
+        KeReleaseSpinLockFromDpcLevel(&m_SpinLock);
+    }
+
+    DrainWriteQueue();
+
+    if (fMore)
+    {
+        m_ServiceGroup->RequestService();
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::Opl3_BoardReset()
+ *****************************************************************************
+ * Silence and reset the OPL3 chip.  Sets the NEW bit to enable OPL3 mode
+ * with stereo output (Ad Lib Gold-specific addition to the DDK pattern).
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+Opl3_BoardReset()
+{
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    BYTE i;
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("Opl3_BoardReset"));
+
+    /* Enable OPL3 mode (stereo, 18 voices, extra waveforms) */
+    SoundMidiForceFM(AD_NEW, 0x01);
+    SoundMidiForceFM(AD_MASK, 0x60);
+    SoundMidiForceFM(AD_CONNECTION, 0x00);
+    SoundMidiForceFM(AD_NTS, 0x00);
+
+    /* Turn off drums, use high vibrato/modulation */
+    SoundMidiForceFM(AD_DRUM, 0xc0);
+
+    /* Turn off all oscillators (max attenuation) */
+    for (i = 0; i <= 0x15; i++)
+    {
+        if ((i & 0x07) <= 0x05)
+        {
+            SoundMidiForceFM(AD_LEVEL + i, 0x3f);
+            SoundMidiForceFM(AD_LEVEL2 + i, 0x3f);
+        }
+    }
+
+    /* Turn off all voices and set stereo output to both channels */
+    for (i = 0; i <= 0x08; i++)
+    {
+        SoundMidiForceFM(AD_BLOCK + i, 0x00);
+        SoundMidiForceFM(AD_BLOCK2 + i, 0x00);
+
+        /* Set STL + STR bits (D5 + D4) for stereo output on all voices */
+        SoundMidiForceFM(AD_FEEDBACK + i, 0x30);
+        SoundMidiForceFM(AD_FEEDBACK2 + i, 0x30);
+    }
+}
+
+
+/*****************************************************************************
+ * Power resume register order
+ *
+ * Mode registers first (NEW must precede everything in bank 1), then the
+ * operator and channel registers, then key-on and rhythm last so no voice
+ * sounds before its operators are in place.
+ */
+static WORD gwResumeRanges[][2] =
+{
+    { AD_NEW,           AD_NEW },
+    { AD_CONNECTION,    AD_CONNECTION },
+    { AD_LSI,           AD_MASK },
+    { AD_LSI2,          AD_LSI2 },
+    { AD_NTS,           AD_NTS },
+    { AD_MULT,          AD_MULT + 0x15 },
+    { AD_MULT2,         AD_MULT2 + 0x15 },
+    { AD_LEVEL,         AD_LEVEL + 0x15 },
+    { AD_LEVEL2,        AD_LEVEL2 + 0x15 },
+    { AD_AD,            AD_AD + 0x15 },
+    { AD_AD2,           AD_AD2 + 0x15 },
+    { AD_SR,            AD_SR + 0x15 },
+    { AD_SR2,           AD_SR2 + 0x15 },
+    { AD_WAVE,          AD_WAVE + 0x15 },
+    { AD_WAVE2,         AD_WAVE2 + 0x15 },
+    { AD_FNUMBER,       AD_FNUMBER + 0x08 },
+    { AD_FNUMBER2,      AD_FNUMBER2 + 0x08 },
+    { AD_FEEDBACK,      AD_FEEDBACK + 0x08 },
+    { AD_FEEDBACK2,     AD_FEEDBACK2 + 0x08 },
+    { AD_BLOCK,         AD_BLOCK + 0x08 },
+    { AD_BLOCK2,        AD_BLOCK2 + 0x08 },
+    { AD_DRUM,          AD_DRUM }
+};
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::MiniportMidiFMResume()
+ *****************************************************************************
+ * Starts restoring the OPL3 registers from shadow on power resume.  The
+ * chip may have kept its state (D1/D2, or an ISA board that stayed
+ * powered) or lost it, so nothing can be assumed zero: every voice is
+ * keyed off at once, outside the shadow, and then the whole shadow is
+ * replayed in FM_RESUME_SLICE pieces from the service group DPC (see
+ * ServiceWriteQueue()).
+ */
+#pragma code_seg()
+void
+CMiniportMidiFMAdLibGold::
+MiniportMidiFMResume()
+{
+    KIRQL oldIrql;
+    BYTE  i;
+
+    _DbgPrintF(DEBUGLVL_VERBOSE, ("MiniportMidiFMResume"));
+    KeAcquireSpinLock(&m_SpinLock, &oldIrql);
+
+    /* Silence stale notes before the slices get to key-on */
+    QueueWriteFM(AD_NEW, 0x01, FALSE);
+    for (i = 0; i <= 0x08; i++)
+    {
+        QueueWriteFM(AD_BLOCK + i, 0x00, FALSE);
+        QueueWriteFM(AD_BLOCK2 + i, 0x00, FALSE);
+    }
+
+    m_ResumeRange   = 0;
+    m_ResumeAddress = gwResumeRanges[0][0];
+    m_fResuming     = !MiniportMidiFMResumeSlice();
+
+    KeReleaseSpinLock(&m_SpinLock, oldIrql);
+
+    /* The service group runs the remaining slices */
+    KickWriteQueue();
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiFMAdLibGold::MiniportMidiFMResumeSlice()
+ *****************************************************************************
+ * Queues the next FM_RESUME_SLICE shadow registers in resume order, zero
+ * or not.  Returns TRUE once every range has been covered.  Writes made by
+ * the stream meanwhile update the shadow first, so a later slice simply
+ * replays their current value.
+ *
+ * Called at DISPATCH_LEVEL with m_SpinLock held.
+ */
+#pragma code_seg()
+BOOLEAN
+CMiniportMidiFMAdLibGold::
+MiniportMidiFMResumeSlice(void)
+{
+    ULONG count = 0;
+    ULONG address;
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    while (m_ResumeRange < SIZEOF_ARRAY(gwResumeRanges))
+    {
+        address = m_ResumeAddress;
+
+        if (address > gwResumeRanges[m_ResumeRange][1])
+        {
+            m_ResumeRange++;
+            if (m_ResumeRange < SIZEOF_ARRAY(gwResumeRanges))
+            {
+                m_ResumeAddress = gwResumeRanges[m_ResumeRange][0];
+            }
+            continue;
+        }
+
+        if (count == FM_RESUME_SLICE)
+        {
+            return FALSE;
+        }
+
+        SoundMidiForceFM(address, m_SavedRegValues[address]);
+        count++;
+        m_ResumeAddress = address + 1;
+    }
+
+    return TRUE;
+}
+
+
+/* ========================================================================= */
+/* Stream class methods                                                      */
+/* ========================================================================= */
+
+
+/*****************************************************************************
+ * VoiceListAppend()
+ *****************************************************************************
+ * Appends a voice at the tail (newest end) of an index-linked voice list.
+ */
+#pragma code_seg()
+static
+void
+VoiceListAppend
+(
+    voiceList * pList,
+    voiceLink * pLinks,
+    BYTE        bVoice
+)
+{
+    pLinks[bVoice].bPrev = pList->bTail;
+    pLinks[bVoice].bNext = VOICE_NONE;
+
+    if (pList->bTail != VOICE_NONE)
+        pLinks[pList->bTail].bNext = bVoice;
+    else
+        pList->bHead = bVoice;
+
+    pList->bTail = bVoice;
+}
+
+
+/*****************************************************************************
+ * VoiceListRemove()
+ *****************************************************************************
+ * Unlinks a voice from an index-linked voice list.
+ */
+#pragma code_seg()
+static
+void
+VoiceListRemove
+(
+    voiceList * pList,
+    voiceLink * pLinks,
+    BYTE        bVoice
+)
+{
+    BYTE bPrev = pLinks[bVoice].bPrev;
+    BYTE bNext = pLinks[bVoice].bNext;
+
+    if (bPrev != VOICE_NONE)
+        pLinks[bPrev].bNext = bNext;
+    else
+        pList->bHead = bNext;
+
+    if (bNext != VOICE_NONE)
+        pLinks[bNext].bPrev = bPrev;
+    else
+        pList->bTail = bPrev;
+
+    pLinks[bVoice].bPrev = pLinks[bVoice].bNext = VOICE_NONE;
+}
+
+
+
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::NonDelegatingQueryInterface()
+ */
+#pragma code_seg("PAGE")
+STDMETHODIMP
+CMiniportMidiStreamFMAdLibGold::
+NonDelegatingQueryInterface
+(
+    REFIID  Interface,
     PVOID * Object
 )
 {
@@ -1299,11 +2395,9 @@ CMiniportMidiStreamFMAdLibGold::
 
     _DbgPrintF(DEBUGLVL_VERBOSE, ("~CMiniportMidiStreamFMAdLibGold"));
 
-    Opl3_AllNotesOff();
-
     if (m_Miniport)
     {
-        m_Miniport->m_fStreamExists = FALSE;
+        m_Miniport->RemoveStream(this);
         m_Miniport->Release();
     }
 }
@@ -1330,7 +2424,25 @@ Init
     m_Miniport = Miniport;
     m_Miniport->AddRef();
 
-    m_dwCurTime = 1;
+    /* No voices until the first note-on takes one from the pool */
+    m_Pool    = &m_Miniport->m_Pool;
+    m_cActive = 0;
+    m_ActiveList.bHead = m_ActiveList.bTail = VOICE_NONE;
+    for (i = 0; i < NUMPATCHES; i++)
+    {
+        m_PatchList[i].bHead = m_PatchList[i].bTail = VOICE_NONE;
+    }
+    for (i = 0; i < NUMCHANNELS; i++)
+    {
+        m_ChanList[i].bHead = m_ChanList[i].bTail = VOICE_NONE;
+    }
+    RtlFillMemory(m_bNoteMap, sizeof(m_bNoteMap), VOICE_NONE);
+
+    /* No running status until the first status byte arrives */
+    m_bRunningStatus = 0;
+    m_cbMsgData      = 0;
+    m_cbMsgNeeded    = 0;
+    m_fInSysEx       = FALSE;
 
     /* Synth-level attenuation = 0 (topology handles FM volume) */
     m_wSynthAttenL = 0;
@@ -1343,6 +2455,9 @@ Init
         m_bStereoMask[i] = 0xff;
     }
 
+    /* Open for notes, and soft-thru plays on this stream from now on */
+    m_Miniport->AddStream(this);
+
     return STATUS_SUCCESS;
 }
 
@@ -1360,9 +2475,20 @@ SetState
 {
     PAGED_CODE();
 
+    m_Miniport->m_AdapterCommon->TraceEvent(ADLIBGOLD_TRACE_STREAM_STATE,
+        NewState, ADLIBGOLD_TRACE_STREAM_FM);
+
     switch (NewState)
     {
     case KSSTATE_STOP:
+        /* Drop any partially received message */
+        m_bRunningStatus = 0;
+        m_cbMsgData      = 0;
+        m_cbMsgNeeded    = 0;
+        m_fInSysEx       = FALSE;
+        Opl3_AllNotesOff();
+        break;
+
     case KSSTATE_ACQUIRE:
     case KSSTATE_PAUSE:
         Opl3_AllNotesOff();
@@ -1414,7 +2540,8 @@ Read
 /*****************************************************************************
  * CMiniportMidiStreamFMAdLibGold::Write()
  *****************************************************************************
- * Receives a single MIDI message and dispatches it to WriteMidiData.
+ * Applies a buffer of MIDI bytes under a single acquisition of the
+ * miniport spinlock (see ParseMidiBytes()).
  */
 #pragma code_seg()
 STDMETHODIMP
@@ -1429,34 +2556,108 @@ Write
     ASSERT(BufferAddress);
     ASSERT(BytesWritten);
 
-    BYTE statusByte = *(PBYTE)BufferAddress & 0xF0;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&m_Miniport->m_SpinLock, &oldIrql);
+    ParseMidiBytes(PBYTE(BufferAddress), Length);
+    KeReleaseSpinLock(&m_Miniport->m_SpinLock, oldIrql);
+
+    m_Miniport->KickWriteQueue();
+
     *BytesWritten = Length;
+    return STATUS_SUCCESS;
+}
 
-    if (statusByte < 0x80)
-    {
-        _DbgPrintF(DEBUGLVL_TERSE, ("Write: first byte must be status -- ignored"));
-    }
-    else if (statusByte == 0xF0)
-    {
-        /* System messages not handled */
-    }
-    else if (statusByte == 0xA0)
-    {
-        /* Polyphonic key pressure not handled */
-    }
-    else if (statusByte == 0xD0)
-    {
-        /* Channel pressure not handled */
-    }
-    else if (Length < 4)
-    {
-        WriteMidiData(*(DWORD *)BufferAddress);
-    }
-    else
+
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::ParseMidiBytes()
+ *****************************************************************************
+ * Parses a MIDI byte stream and applies every complete channel message.
+ * Running status is honoured, realtime bytes (F8-FF) are skipped wherever
+ * they appear, and SysEx and system common messages are consumed and
+ * discarded.  Parser state persists across calls, so a message may
+ * straddle two buffers.
+ *
+ * Called at DISPATCH_LEVEL with the miniport spinlock held.
+ */
+#pragma code_seg()
+void
+CMiniportMidiStreamFMAdLibGold::
+ParseMidiBytes
+(
+    IN      PBYTE   pbData,
+    IN      ULONG   cbData
+)
+{
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    BYTE    bData;
+    ULONG   i;
+
+    for (i = 0; i < cbData; i++)
     {
-        _DbgPrintF(DEBUGLVL_TERSE, ("Write: length > 3 not handled"));
+        bData = pbData[i];
+
+        if (bData >= 0xF8)
+        {
+            /* Realtime: may interleave anything, changes no state */
+            continue;
+        }
+
+        if (bData & 0x80)
+        {
+            m_fInSysEx   = (BOOLEAN)(bData == 0xF0);
+            m_cbMsgData  = 0;
+
+            if (bData < 0xF0)
+            {
+                m_bRunningStatus = bData;
+                m_cbMsgNeeded = (BYTE)(((bData & 0xE0) == 0xC0) ? 1 : 2);
+            }
+            else
+            {
+                /* System common cancels running status */
+                m_bRunningStatus = 0;
+                m_cbMsgNeeded = (BYTE)((bData == 0xF2) ? 2 :
+                    ((bData == 0xF1) || (bData == 0xF3)) ? 1 : 0);
+            }
+            continue;
+        }
+
+        if (m_fInSysEx)
+        {
+            continue;
+        }
+
+        if (m_cbMsgData >= m_cbMsgNeeded)
+        {
+            /* Data byte without status or after a completed system msg */
+            _DbgPrintF(DEBUGLVL_VERBOSE, ("Write: stray data byte %x", bData));
+            continue;
+        }
+
+        m_bMsgData[m_cbMsgData++] = bData;
+
+        if (m_cbMsgData == m_cbMsgNeeded)
+        {
+            if (m_bRunningStatus)
+            {
+                WriteMidiData(DWORD(m_bRunningStatus) |
+                              (DWORD(m_bMsgData[0]) << 8) |
+                              (DWORD(m_bMsgData[1]) << 16));
+
+                /* Running status: the next data byte starts a new message */
+                m_cbMsgData = 0;
+                m_bMsgData[1] = 0;
+            }
+            else
+            {
+                /* System common message complete -- ignored */
+                m_cbMsgNeeded = 0;
+                m_cbMsgData = 0;
+            }
+        }
     }
-    return STATUS_SUCCESS;
 }
 
 
@@ -1465,14 +2666,21 @@ Write
 /* ========================================================================= */
 
 
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::WriteMidiData()
+ *****************************************************************************
+ * Applies one complete channel message.  Called from Write() with the
+ * miniport spinlock held.
+ */
 #pragma code_seg()
 void
 CMiniportMidiStreamFMAdLibGold::
 WriteMidiData(DWORD dwData)
 {
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
     BYTE    bMsgType, bChannel, bVelocity, bNote;
     WORD    wTemp;
-    KIRQL   oldIrql;
 
     bMsgType  = (BYTE) dwData & (BYTE)0xf0;
     bChannel  = (BYTE) dwData & (BYTE)0x0f;
@@ -1482,7 +2690,9 @@ WriteMidiData(DWORD dwData)
     _DbgPrintF(DEBUGLVL_VERBOSE, ("WriteMidiData: (%x %x %x)",
         bMsgType + bChannel, bNote, bVelocity));
 
-    KeAcquireSpinLock(&m_Miniport->m_SpinLock, &oldIrql);
+    m_Miniport->m_AdapterCommon->CountPerfEvent(ADLIBGOLD_PERF_FM_MESSAGES, 1);
+    m_Miniport->m_AdapterCommon->TraceEvent(ADLIBGOLD_TRACE_FM_MESSAGE, dwData, 0);
+
     switch (bMsgType)
     {
     case 0x90:
@@ -1551,8 +2761,11 @@ WriteMidiData(DWORD dwData)
         m_iBend[bChannel] = (short)(WORD)(wTemp + 0x8000);
         Opl3_PitchBend(bChannel, m_iBend[bChannel]);
         break;
+
+    default:
+        /* Polyphonic and channel pressure not handled */
+        break;
     }
-    KeReleaseSpinLock(&m_Miniport->m_SpinLock, oldIrql);
 }
 
 
@@ -1565,12 +2778,13 @@ Opl3_AllNotesOff()
     KIRQL oldIrql;
 
     KeAcquireSpinLock(&m_Miniport->m_SpinLock, &oldIrql);
-    for (i = 0; i < NUM2VOICES; i++)
+    while ((i = m_ActiveList.bHead) != VOICE_NONE)
     {
-        Opl3_NoteOff(m_Voice[i].bPatch, m_Voice[i].bNote,
-                     m_Voice[i].bChannel, 0);
+        Opl3_ReleaseVoice(i);
     }
     KeReleaseSpinLock(&m_Miniport->m_SpinLock, oldIrql);
+
+    m_Miniport->KickWriteQueue();
 }
 
 
@@ -1587,7 +2801,7 @@ Opl3_NoteOff
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD wOffset, wTemp;
+    WORD wTemp;
 
     wTemp = Opl3_FindFullSlot(bNote, bChannel);
 
@@ -1595,21 +2809,132 @@ Opl3_NoteOff
     {
         if (bSustain)
         {
-            m_Voice[wTemp].bSusHeld = 1;
+            m_Pool->Voice[wTemp].bSusHeld = 1;
             return;
         }
 
-        wOffset = wTemp;
-        if (wTemp >= (NUM2VOICES / 2))
-            wOffset += (0x100 - (NUM2VOICES / 2));
+        Opl3_ReleaseVoice(wTemp);
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::Opl3_ReleaseVoice()
+ *****************************************************************************
+ * Keys off one of this stream's active voices and moves it to the tail
+ * of the pool's released list.  It stays this stream's until reused, so
+ * channel volume, pan and bend still reach its release.
+ */
+#pragma code_seg()
+void
+CMiniportMidiStreamFMAdLibGold::
+Opl3_ReleaseVoice(WORD wVoice)
+{
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    voiceStruct *pVoice = &m_Pool->Voice[wVoice];
+    WORD wOffset;
+
+    ASSERT(pVoice->bOn);
+    ASSERT(m_Pool->Owner[wVoice] == this);
+
+    wOffset = wVoice;
+    if (wVoice >= (NUM2VOICES / 2))
+        wOffset += (0x100 - (NUM2VOICES / 2));
+
+    m_Miniport->SoundMidiSendFM(AD_BLOCK + wOffset,
+        (BYTE)(pVoice->bBlock[0] & 0x1f));
+
+    Opl3_DetachVoice(wVoice);
+
+    pVoice->bOn = FALSE;
+    pVoice->bSusHeld = 0;
+    pVoice->bBlock[0] &= 0x1f;
+    pVoice->bBlock[1] &= 0x1f;
+    pVoice->dwTime = m_Pool->dwCurTime;
+
+    VoiceListAppend(&m_Pool->ReleasedList, m_Pool->StateLink, (BYTE)wVoice);
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::Opl3_AttachVoice()
+ *****************************************************************************
+ * Makes a newly keyed-on voice this stream's and threads it onto the
+ * active, patch and channel lists and the (channel, note) map.  The voice
+ * must already be detached and its bPatch, bChannel and bNote set.
+ */
+#pragma code_seg()
+void
+CMiniportMidiStreamFMAdLibGold::
+Opl3_AttachVoice(WORD wVoice)
+{
+    fmVoicePool *   pPool  = m_Pool;
+    voiceStruct *   pVoice = &pPool->Voice[wVoice];
+    BYTE            bVoice = (BYTE)wVoice;
+    BYTE *          pbLink;
+
+    pPool->Owner[wVoice] = this;
+    m_cActive++;
+
+    VoiceListAppend(&m_ActiveList, pPool->StateLink, bVoice);
+    VoiceListAppend(&m_PatchList[pVoice->bPatch], pPool->PatchLink, bVoice);
+    VoiceListAppend(&m_ChanList[pVoice->bChannel], pPool->ChanLink, bVoice);
+
+    /* Append so a repeated key releases the oldest voice first */
+    pbLink = &m_bNoteMap[pVoice->bChannel][pVoice->bNote];
+    while (*pbLink != VOICE_NONE)
+    {
+        pbLink = &pPool->bNoteNext[*pbLink];
+    }
+    *pbLink = bVoice;
+    pPool->bNoteNext[bVoice] = VOICE_NONE;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::Opl3_DetachVoice()
+ *****************************************************************************
+ * Unlinks a voice from whichever lists its state puts it on: the pool's
+ * free (dwTime == 0) or released (!bOn) list, or its owner's active
+ * lists -- another stream's, when the voice is being stolen.
+ */
+#pragma code_seg()
+void
+CMiniportMidiStreamFMAdLibGold::
+Opl3_DetachVoice(WORD wVoice)
+{
+    fmVoicePool *   pPool  = m_Pool;
+    voiceStruct *   pVoice = &pPool->Voice[wVoice];
+    BYTE            bVoice = (BYTE)wVoice;
+    BYTE *          pbLink;
+
+    if (!pVoice->dwTime)
+    {
+        VoiceListRemove(&pPool->FreeList, pPool->StateLink, bVoice);
+    }
+    else if (!pVoice->bOn)
+    {
+        VoiceListRemove(&pPool->ReleasedList, pPool->StateLink, bVoice);
+    }
+    else
+    {
+        CMiniportMidiStreamFMAdLibGold *pOwner = pPool->Owner[wVoice];
+        ASSERT(pOwner);
 
-        m_Miniport->SoundMidiSendFM(AD_BLOCK + wOffset,
-            (BYTE)(m_Voice[wTemp].bBlock[0] & 0x1f));
+        VoiceListRemove(&pOwner->m_ActiveList, pPool->StateLink, bVoice);
+        VoiceListRemove(&pOwner->m_PatchList[pVoice->bPatch], pPool->PatchLink, bVoice);
+        VoiceListRemove(&pOwner->m_ChanList[pVoice->bChannel], pPool->ChanLink, bVoice);
+        pOwner->m_cActive--;
 
-        m_Voice[wTemp].bOn = FALSE;
-        m_Voice[wTemp].bBlock[0] &= 0x1f;
-        m_Voice[wTemp].bBlock[1] &= 0x1f;
-        m_Voice[wTemp].dwTime = m_dwCurTime;
+        pbLink = &pOwner->m_bNoteMap[pVoice->bChannel][pVoice->bNote];
+        while (*pbLink != bVoice)
+        {
+            ASSERT(*pbLink != VOICE_NONE);
+            pbLink = &pPool->bNoteNext[*pbLink];
+        }
+        *pbLink = pPool->bNoteNext[bVoice];
+        pPool->bNoteNext[bVoice] = VOICE_NONE;
     }
 }
 
@@ -1625,63 +2950,61 @@ Opl3_FindFullSlot
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD i;
+    BYTE bVoice = m_bNoteMap[bChannel][bNote];
 
-    for (i = 0; i < NUM2VOICES; i++)
-    {
-        if ((bChannel == m_Voice[i].bChannel)
-            && (bNote == m_Voice[i].bNote)
-            && (m_Voice[i].bOn))
-        {
-            return i;
-        }
-    }
-    return 0xFFFF;
+    return (bVoice == VOICE_NONE) ? 0xFFFF : (WORD)bVoice;
 }
 
 
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::Opl3_FMNote()
+ *****************************************************************************
+ * Runs a patch's note-on program on a voice: key off, the operator and
+ * channel registers with the note's level, pan and pitch patched in, then
+ * key on.  Bytes the shadow already holds are dropped by SoundMidiSendFM().
+ */
 #pragma code_seg()
 void
 CMiniportMidiStreamFMAdLibGold::
 Opl3_FMNote
 (
     WORD                wNote,
-    noteStruct FAR *    lpSN
+    const fmProgram *   lpProg,
+    BYTE                bChannel,
+    BYTE                bVelocity,
+    WORD                wFAndB
 )
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD            i;
-    WORD            wOffset;
-    operStruct FAR  *lpOS;
-
-    /* Write note off first */
-    wOffset = wNote;
-    if (wNote >= (NUM2VOICES / 2))
-        wOffset += (0x100 - (NUM2VOICES / 2));
-
-    m_Miniport->SoundMidiSendFM(AD_BLOCK + wOffset, 0);
+    const WORD *lpAddress = gwNoteOnAddress[wNote];
+    WORD        wAtten    = Opl3_CalcAtten(bChannel, bVelocity);
+    BYTE        bStereo   = Opl3_CalcStereoMask(bChannel);
+    BYTE        bValue;
+    WORD        i;
 
-    /* Write operator registers */
-    for (i = 0; i < 2; i++)
+    for (i = 0; i < FMPROG_STEPS; i++)
     {
-        lpOS = &lpSN->op[i];
-        wOffset = gw2OpOffset[wNote][i];
-        m_Miniport->SoundMidiSendFM(0x20 + wOffset, lpOS->bAt20);
-        m_Miniport->SoundMidiSendFM(0x40 + wOffset, lpOS->bAt40);
-        m_Miniport->SoundMidiSendFM(0x60 + wOffset, lpOS->bAt60);
-        m_Miniport->SoundMidiSendFM(0x80 + wOffset, lpOS->bAt80);
-        m_Miniport->SoundMidiSendFM(0xE0 + wOffset, lpOS->bAtE0);
-    }
+        bValue = lpProg->bValue[i];
 
-    /* Write voice registers */
-    wOffset = (wNote < 9) ? wNote : (wNote + 0x100 - 9);
-    m_Miniport->SoundMidiSendFM(0xa0 + wOffset, lpSN->bAtA0[0]);
-    m_Miniport->SoundMidiSendFM(0xc0 + wOffset, lpSN->bAtC0[0]);
+        switch (lpProg->bOp[i])
+        {
+        case FMOP_VOLUME:
+            bValue = ApplyLevelAtten(bValue, wAtten);
+            break;
+        case FMOP_STEREO:
+            bValue &= bStereo;
+            break;
+        case FMOP_FNUMBER:
+            bValue = (BYTE)wFAndB;
+            break;
+        case FMOP_KEYON:
+            bValue = (BYTE)(0x20 | (wFAndB >> 8));
+            break;
+        }
 
-    /* Note on */
-    m_Miniport->SoundMidiSendFM(0xb0 + wOffset,
-        (BYTE)(lpSN->bAtB0[0] | 0x20));
+        m_Miniport->SoundMidiSendFM(lpAddress[i], bValue);
+    }
 }
 
 
@@ -1699,145 +3022,96 @@ Opl3_NoteOn
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD             wTemp, i, j;
-    BYTE             b4Op, bTemp, bMode, bStereo;
-    patchStruct FAR  *lpPS;
-    DWORD            dwBasicPitch, dwPitch[2];
-    noteStruct       NS;
-
-    lpPS = glpPatch + bPatch;
-
-    dwBasicPitch = gdwPitch[bNote % 12];
-    bTemp = bNote / (BYTE)12;
-    if (bTemp > (BYTE)(60 / 12))
-        dwBasicPitch = AsLSHL(dwBasicPitch, (BYTE)(bTemp - (BYTE)(60 / 12)));
-    else if (bTemp < (BYTE)(60 / 12))
-        dwBasicPitch = AsULSHR(dwBasicPitch, (BYTE)((BYTE)(60 / 12) - bTemp));
+    const fmProgram *lpProg;
+    voiceStruct *    pVoice;
+    WORD             wTemp, wFAndB[2], j;
+    DWORD            dwPitch[2];
 
-    RtlCopyMemory((LPSTR)&NS, (LPSTR)&lpPS->note, sizeof(noteStruct));
-    b4Op = (BYTE)(NS.bOp != PATCH_1_2OP);
+    lpProg = &m_Miniport->m_Bank->Program[bPatch];
 
     for (j = 0; j < 2; j++)
     {
-        dwPitch[j] = dwBasicPitch;
-        bTemp = (BYTE)((NS.bAtB0[j] >> 2) & 0x07);
-        if (bTemp > 4)
-            dwPitch[j] = AsLSHL(dwPitch[j], (BYTE)(bTemp - (BYTE)4));
-        else if (bTemp < 4)
-            dwPitch[j] = AsULSHR(dwPitch[j], (BYTE)((BYTE)4 - bTemp));
-
-        wTemp = Opl3_CalcFAndB(Opl3_CalcBend(dwPitch[j], iBend));
-        NS.bAtA0[j] = (BYTE)wTemp;
-        NS.bAtB0[j] = (BYTE)0x20 | (BYTE)(wTemp >> 8);
-    }
-
-    bMode = (BYTE)((NS.bAtC0[0] & 0x01) * 2 + 4);
-
-    for (i = 0; i < 2; i++)
-    {
-        wTemp = (BYTE)Opl3_CalcVolume(
-            (BYTE)(NS.op[i].bAt40 & (BYTE)0x3f),
-            bChannel, bVelocity, (BYTE)i, bMode);
-        NS.op[i].bAt40 = (NS.op[i].bAt40 & (BYTE)0xc0) | (BYTE)wTemp;
+        /* Pitch position in table steps (see CompilePatch()) */
+        dwPitch[j] = ((DWORD)bNote + lpProg->bPitchBase[j]) * PITCH_STEPS;
+        wFAndB[j] = Opl3_CalcFAndB((DWORD)((LONG)dwPitch[j] + (iBend >> 8)));
     }
 
-    bStereo = Opl3_CalcStereoMask(bChannel);
-    NS.bAtC0[0] &= bStereo;
-
     wTemp = Opl3_FindEmptySlot(bPatch);
-
-    Opl3_FMNote(wTemp, &NS);
-    m_Voice[wTemp].bNote = bNote;
-    m_Voice[wTemp].bChannel = bChannel;
-    m_Voice[wTemp].bPatch = bPatch;
-    m_Voice[wTemp].bVelocity = bVelocity;
-    m_Voice[wTemp].bOn = TRUE;
-    m_Voice[wTemp].dwTime = m_dwCurTime++;
-    m_Voice[wTemp].dwOrigPitch[0] = dwPitch[0];
-    m_Voice[wTemp].dwOrigPitch[1] = dwPitch[1];
-    m_Voice[wTemp].bBlock[0] = NS.bAtB0[0];
-    m_Voice[wTemp].bBlock[1] = NS.bAtB0[1];
-    m_Voice[wTemp].bSusHeld = 0;
+    Opl3_DetachVoice(wTemp);
+
+    Opl3_FMNote(wTemp, lpProg, bChannel, bVelocity, wFAndB[0]);
+
+    pVoice = &m_Pool->Voice[wTemp];
+    pVoice->bNote = bNote;
+    pVoice->bChannel = bChannel;
+    pVoice->bPatch = bPatch;
+    pVoice->bVelocity = bVelocity;
+    pVoice->bOn = TRUE;
+    pVoice->dwTime = m_Pool->dwCurTime++;
+    pVoice->dwOrigPitch[0] = dwPitch[0];
+    pVoice->dwOrigPitch[1] = dwPitch[1];
+    pVoice->bBlock[0] = (BYTE)(0x20 | (wFAndB[0] >> 8));
+    pVoice->bBlock[1] = (BYTE)(0x20 | (wFAndB[1] >> 8));
+    pVoice->bSusHeld = 0;
+
+    Opl3_AttachVoice(wTemp);
 }
 
 
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::Opl3_CalcFAndB()
+ *****************************************************************************
+ * Converts a pitch position (see Opl3_NoteOn) to the block and F-number,
+ * packed as the B0 register's low 5 bits over the A0 register byte.  A
+ * pitch bend is just an offset of (iBend >> 8) table steps.
+ */
 #pragma code_seg()
 WORD
 CMiniportMidiStreamFMAdLibGold::
-Opl3_CalcFAndB(DWORD dwPitch)
-{
-    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
-
-    BYTE bBlock;
-
-    for (bBlock = 1; dwPitch >= 0x400; dwPitch >>= 1, bBlock++)
-        ;
-
-    if (bBlock > 0x07)
-        bBlock = 0x07;
-
-    return ((WORD)bBlock << 10) | (WORD)dwPitch;
-}
-
-
-#pragma code_seg()
-DWORD
-CMiniportMidiStreamFMAdLibGold::
-Opl3_CalcBend(DWORD dwOrig, short iBend)
+Opl3_CalcFAndB(DWORD dwPos)
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    DWORD dw;
+    WORD wFAndB = gwPitchFAndB[dwPos % PITCH_OCTAVE];
+    WORD wFNum  = (WORD)(wFAndB & 0x3ff);
+    LONG lBlock = (LONG)(dwPos / PITCH_OCTAVE) - PITCH_BASEOCTAVE +
+                  PITCH_BASEBLOCK + (wFAndB >> 10);
 
-    if (iBend > 0)
+    if (lBlock < 1)
     {
-        dw = (DWORD)((iBend * (LONG)(256.0 * (EQUAL * EQUAL - 1.0))) >> 8);
-        dwOrig += (DWORD)(AsULMUL(dw, dwOrig) >> 15);
+        /* Below block 1 the F-number itself has to drop */
+        wFNum = (WORD)(wFNum >> (1 - lBlock));
+        lBlock = 1;
     }
-    else if (iBend < 0)
+    else if (lBlock > 7)
     {
-        dw = (DWORD)(((-iBend) * (LONG)(256.0 * (1.0 - 1.0 / EQUAL / EQUAL))) >> 8);
-        dwOrig -= (DWORD)(AsULMUL(dw, dwOrig) >> 15);
+        wFNum = 0x3ff;
+        lBlock = 7;
     }
 
-    return dwOrig;
+    return ((WORD)lBlock << 10) | wFNum;
 }
 
 
+/*****************************************************************************
+ * CMiniportMidiStreamFMAdLibGold::Opl3_CalcAtten()
+ *****************************************************************************
+ * Attenuation a note adds to the operators that carry its volume: synth
+ * and channel volume plus velocity, in OPL3 total-level steps.
+ */
 #pragma code_seg()
-BYTE
+WORD
 CMiniportMidiStreamFMAdLibGold::
-Opl3_CalcVolume(BYTE bOrigAtten, BYTE bChannel, BYTE bVelocity,
-                BYTE bOper, BYTE bMode)
+Opl3_CalcAtten(BYTE bChannel, BYTE bVelocity)
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    BYTE bVolume;
-    WORD wTemp;
     WORD wMin;
 
-    switch (bMode)
-    {
-    case 0:  bVolume = (BYTE)(bOper == 3); break;
-    case 1:  bVolume = (BYTE)((bOper == 1) || (bOper == 3)); break;
-    case 2:  bVolume = (BYTE)((bOper == 0) || (bOper == 3)); break;
-    case 3:  bVolume = (BYTE)(bOper != 1); break;
-    case 4:  bVolume = (BYTE)((bOper == 1) || (bOper == 3)); break;
-    case 5:  bVolume = (BYTE)(bOper >= 1); break;
-    case 6:  bVolume = (BYTE)(bOper <= 2); break;
-    case 7:  bVolume = TRUE; break;
-    default: bVolume = FALSE; break;
-    }
-
-    if (!bVolume)
-        return bOrigAtten;
-
     wMin = (m_wSynthAttenL < m_wSynthAttenR) ? m_wSynthAttenL : m_wSynthAttenR;
-    wTemp = bOrigAtten +
-            ((wMin << 1) +
-            m_bChanAtten[bChannel] +
-            gbVelocityAtten[bVelocity >> 1]);
-    return (wTemp > 0x3f) ? (BYTE)0x3f : (BYTE)wTemp;
+    return (WORD)((wMin << 1) +
+                  m_bChanAtten[bChannel] +
+                  gbVelocityAtten[bVelocity >> 1]);
 }
 
 
@@ -1848,15 +3122,11 @@ Opl3_ChannelNotesOff(BYTE bChannel)
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    int i;
+    BYTE bVoice;
 
-    for (i = 0; i < NUM2VOICES; i++)
+    while ((bVoice = m_ChanList[bChannel].bHead) != VOICE_NONE)
     {
-        if ((m_Voice[i].bOn) && (m_Voice[i].bChannel == bChannel))
-        {
-            Opl3_NoteOff(m_Voice[i].bPatch, m_Voice[i].bNote,
-                         m_Voice[i].bChannel, 0);
-        }
+        Opl3_ReleaseVoice(bVoice);
     }
 }
 
@@ -1883,40 +3153,35 @@ Opl3_SetVolume
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD            i, j, wTemp, wOffset;
-    noteStruct FAR  *lpPS;
-    BYTE            bMode, bStereo;
-
-    if (!glpPatch)
-        return;
+    const fmProgram *lpProg;
+    voiceStruct *    pVoice;
+    WORD             i, j, wAtten, wStep;
+    BYTE             bStereo;
 
     for (i = 0; i < NUM2VOICES; i++)
     {
-        if ((m_Voice[i].bChannel == bChannel) || (bChannel == 0xff))
-        {
-            lpPS = &(glpPatch + m_Voice[i].bPatch)->note;
+        pVoice = &m_Pool->Voice[i];
 
-            bMode = (BYTE)((lpPS->bAtC0[0] & 0x01) * 2 + 4);
+        if ((m_Pool->Owner[i] == this) &&
+            ((pVoice->bChannel == bChannel) || (bChannel == 0xff)))
+        {
+            lpProg = &m_Miniport->m_Bank->Program[pVoice->bPatch];
+            wAtten = Opl3_CalcAtten(pVoice->bChannel, pVoice->bVelocity);
 
             for (j = 0; j < 2; j++)
             {
-                wTemp = (BYTE)Opl3_CalcVolume(
-                    (BYTE)(lpPS->op[j].bAt40 & (BYTE)0x3f),
-                    m_Voice[i].bChannel, m_Voice[i].bVelocity,
-                    (BYTE)j, bMode);
-
-                wOffset = gw2OpOffset[i][j];
+                wStep = FMPROG_LEVEL(j);
                 m_Miniport->SoundMidiSendFM(
-                    0x40 + wOffset,
-                    (BYTE)((lpPS->op[j].bAt40 & (BYTE)0xc0) | (BYTE)wTemp));
+                    gwNoteOnAddress[i][wStep],
+                    (lpProg->bOp[wStep] == FMOP_VOLUME) ?
+                        ApplyLevelAtten(lpProg->bValue[wStep], wAtten) :
+                        lpProg->bValue[wStep]);
             }
 
-            bStereo = Opl3_CalcStereoMask(m_Voice[i].bChannel);
-            wOffset = i;
-            if (i >= (NUM2VOICES / 2))
-                wOffset += (0x100 - (NUM2VOICES / 2));
-            m_Miniport->SoundMidiSendFM(0xc0 + wOffset,
-                (BYTE)(lpPS->bAtC0[0] & bStereo));
+            bStereo = Opl3_CalcStereoMask(pVoice->bChannel);
+            m_Miniport->SoundMidiSendFM(
+                gwNoteOnAddress[i][FMPROG_FEEDBACK],
+                (BYTE)(lpProg->bValue[FMPROG_FEEDBACK] & bStereo));
         }
     }
 }
@@ -1951,30 +3216,31 @@ Opl3_PitchBend
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD  i, wTemp[2], wOffset, j;
-    DWORD dwNew;
+    voiceStruct *pVoice;
+    WORD  i, wTemp, wOffset;
 
     m_iBend[bChannel] = iBend;
 
     for (i = 0; i < NUM2VOICES; i++)
     {
-        if (m_Voice[i].bChannel == bChannel)
+        pVoice = &m_Pool->Voice[i];
+
+        if ((m_Pool->Owner[i] == this) && (pVoice->bChannel == bChannel))
         {
-            j = 0;
-            dwNew = Opl3_CalcBend(m_Voice[i].dwOrigPitch[j], iBend);
-            wTemp[j] = Opl3_CalcFAndB(dwNew);
-            m_Voice[i].bBlock[j] =
-                (m_Voice[i].bBlock[j] & (BYTE)0xe0) |
-                (BYTE)(wTemp[j] >> 8);
+            wTemp = Opl3_CalcFAndB((DWORD)((LONG)pVoice->dwOrigPitch[0] + (iBend >> 8)));
+            pVoice->bBlock[0] =
+                (pVoice->bBlock[0] & (BYTE)0xe0) |
+                (BYTE)(wTemp >> 8);
 
             wOffset = i;
             if (i >= (NUM2VOICES / 2))
                 wOffset += (0x100 - (NUM2VOICES / 2));
 
+            /* Unchanged bytes are dropped by the register shadow */
             m_Miniport->SoundMidiSendFM(AD_BLOCK + wOffset,
-                m_Voice[i].bBlock[0]);
+                pVoice->bBlock[0]);
             m_Miniport->SoundMidiSendFM(AD_FNUMBER + wOffset,
-                (BYTE)wTemp[0]);
+                (BYTE)wTemp);
         }
     }
 }
@@ -2011,53 +3277,43 @@ Opl3_FindEmptySlot(BYTE bPatch)
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD  i, found;
-    DWORD dwOldest;
-
-    for (i = 0; i < NUM2VOICES; i++)
-    {
-        if (!m_Voice[i].dwTime)
-            return i;
-    }
+    CMiniportMidiStreamFMAdLibGold *pVictim = this;
+    CMiniportMidiStreamFMAdLibGold *pStream;
 
-    dwOldest = 0xffffffff;
-    found = 0xffff;
-    for (i = 0; i < NUM2VOICES; i++)
+    /* A stream at its quota can only reuse its own sounding voices */
+    if (m_cActive < m_Miniport->m_VoiceQuota)
     {
-        if (!m_Voice[i].bOn && (m_Voice[i].dwTime < dwOldest))
+        /* 1. A voice that has never been used (lowest index first) */
+        if (m_Pool->FreeList.bHead != VOICE_NONE)
+            return m_Pool->FreeList.bHead;
+
+        /* 2. The voice released longest ago, whichever stream played it */
+        if (m_Pool->ReleasedList.bHead != VOICE_NONE)
+            return m_Pool->ReleasedList.bHead;
+
+        /*
+         * Every voice is sounding.  Steal from the stream holding the
+         * most, this one on a tie, so no client loses voices to one
+         * that is playing fewer.
+         */
+        for (pStream = m_Miniport->m_StreamList; pStream;
+             pStream = pStream->m_NextStream)
         {
-            dwOldest = m_Voice[i].dwTime;
-            found = i;
+            if (pStream->m_cActive > pVictim->m_cActive)
+                pVictim = pStream;
         }
     }
-    if (found != 0xffff)
-        return found;
 
-    dwOldest = 0xffffffff;
-    found = 0xffff;
-    for (i = 0; i < NUM2VOICES; i++)
-    {
-        if ((m_Voice[i].bPatch == bPatch) && (m_Voice[i].dwTime < dwOldest))
-        {
-            dwOldest = m_Voice[i].dwTime;
-            found = i;
-        }
-    }
-    if (found != 0xffff)
-        return found;
+    /* Whichever we pick below is stolen */
+    m_Miniport->m_AdapterCommon->CountPerfEvent(ADLIBGOLD_PERF_VOICE_STEAL, 1);
 
-    found = 0;
-    dwOldest = m_Voice[found].dwTime;
-    for (i = (found + 1); i < NUM2VOICES; i++)
-    {
-        if (m_Voice[i].dwTime < dwOldest)
-        {
-            dwOldest = m_Voice[i].dwTime;
-            found = i;
-        }
-    }
+    /* 3. Our own oldest voice playing the same patch */
+    if ((pVictim == this) && (m_PatchList[bPatch].bHead != VOICE_NONE))
+        return m_PatchList[bPatch].bHead;
 
-    return found;
+    /* 4. The victim's oldest voice */
+    ASSERT(pVictim->m_ActiveList.bHead != VOICE_NONE);
+    return pVictim->m_ActiveList.bHead;
 }
 
 
@@ -2068,16 +3324,17 @@ Opl3_SetSustain(BYTE bChannel, BYTE bSusLevel)
 {
     ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    WORD i;
+    BYTE bVoice, bNext;
 
     if (m_bSustain[bChannel] && !bSusLevel)
     {
-        for (i = 0; i < NUM2VOICES; i++)
+        for (bVoice = m_ChanList[bChannel].bHead; bVoice != VOICE_NONE;
+             bVoice = bNext)
         {
-            if ((bChannel == m_Voice[i].bChannel) && m_Voice[i].bSusHeld)
+            bNext = m_Pool->ChanLink[bVoice].bNext;
+            if (m_Pool->Voice[bVoice].bSusHeld)
             {
-                Opl3_NoteOff(m_Voice[i].bPatch, m_Voice[i].bNote,
-                             m_Voice[i].bChannel, 0);
+                Opl3_ReleaseVoice(bVoice);
             }
         }
     }
@@ -65,6 +65,27 @@
 #define AD_WAVE                         (0x0e0)
 #define AD_WAVE2                        (0x1e0)
 
+#define AD_KEYON_REG(a)                 ((((a) & 0xff) >= AD_BLOCK) && \
+                                         (((a) & 0xff) <= AD_BLOCK + 8))
+
+
+/*****************************************************************************
+ * Asynchronous OPL3 write queue
+ *
+ * Stream writes only enqueue register/value pairs; the service group DPC
+ * drains them to the hardware in batches of FM_QUEUE_BATCH.
+ */
+#define FM_QUEUE_SIZE                   (512)   /* Ring entries (power of 2) */
+#define FM_QUEUE_MASK                   (FM_QUEUE_SIZE - 1)
+#define FM_QUEUE_BATCH                  (32)    /* Entries per lock hold     */
+#define FM_QUEUE_NONE                   (0xffff)/* No pending slot           */
+
+/*
+ * Power resume replays the register shadow a slice at a time from the
+ * service group DPC, so no single lock hold covers the whole chip.
+ */
+#define FM_RESUME_SLICE                 (16)    /* Writes per DPC slice      */
+
 
 /*****************************************************************************
  * Patch type defines
@@ -73,6 +94,8 @@
 #define PATCH_2_2OP             (1)     /* use two 2-operator patches */
 #define PATCH_1_2OP             (2)     /* use one 2-operator patch */
 
+#define FM_BANK_PATH_CHARS      (260)   /* FMPatchBank setting, with NUL */
+
 
 /*****************************************************************************
  * Tuning constants
@@ -104,6 +127,44 @@
 #define G                               (FSHARP * EQUAL)
 #define GSHARP                          (G * EQUAL)
 
+/*
+ * Pitch table resolution.  The table covers one octave from C in
+ * 1/PITCH_STEPS semitone steps; a pitch bend of +/-2 semitones spans
+ * +/-(2 * PITCH_STEPS) steps.  Step ratios are 2^(n/768) (fine) and
+ * 2^(8n/768) (coarse).
+ */
+#define PITCH_STEPS                     (64)
+#define PITCH_OCTAVE                    (12 * PITCH_STEPS)
+
+#define PITCH_FINE0                     (1.000000000000)
+#define PITCH_FINE1                     (1.000902942799)
+#define PITCH_FINE2                     (1.001806700904)
+#define PITCH_FINE3                     (1.002711275050)
+#define PITCH_FINE4                     (1.003616665975)
+#define PITCH_FINE5                     (1.004522874417)
+#define PITCH_FINE6                     (1.005429901113)
+#define PITCH_FINE7                     (1.006337746802)
+
+#define PITCH_COARSE0                   (1.000000000000)
+#define PITCH_COARSE1                   (1.007246412224)
+#define PITCH_COARSE2                   (1.014545334938)
+#define PITCH_COARSE3                   (1.021897148654)
+#define PITCH_COARSE4                   (1.029302236643)
+#define PITCH_COARSE5                   (1.036760984953)
+#define PITCH_COARSE6                   (1.044273782427)
+#define PITCH_COARSE7                   (1.051841020729)
+
+/*
+ * Table entry for frequency x in the octave from C: the OPL3 F-number
+ * in bits 0-9 and the block offset above the table's base block in
+ * bit 10.  PITCH() of that octave lies in 0x800-0x1FFF.
+ */
+#define PITCH_FB(x)                     ((WORD)((PITCH(x) >= 0x1000) ?      \
+                                            (0x400 | (PITCH(x) >> 3)) :     \
+                                            (PITCH(x) >> 2)))
+#define PITCH_BASEBLOCK                 (3)     /* Block of C at position 0 */
+#define PITCH_BASEOCTAVE                (10)    /* Octave of note 60, block 4 */
+
 
 /*****************************************************************************
  * Operator and voice structures
@@ -137,6 +198,42 @@ typedef struct _patchStruct {
 #pragma pack()
 
 
+/*****************************************************************************
+ * Compiled note-on programs
+ *
+ * Each patch is compiled at bank load into the register writes a note-on
+ * makes, in write order, with bOp[] saying how the note changes each
+ * byte.  The register each step writes on a given voice comes from the
+ * gwNoteOnAddress table, so a note-on is one pass over the steps.
+ */
+#define FMPROG_KEYOFF           0       /* B0: key off before restarting */
+#define FMPROG_OP0              1       /* 20, 40, 60, 80, E0: operator 0 */
+#define FMPROG_OP1              6       /* 20, 40, 60, 80, E0: operator 1 */
+#define FMPROG_FNUMBER          11      /* A0 */
+#define FMPROG_FEEDBACK         12      /* C0 */
+#define FMPROG_KEYON            13      /* B0 */
+#define FMPROG_STEPS            14
+
+#define FMPROG_LEVEL(op)        (FMPROG_OP0 + 5 * (op) + 1)   /* 40 */
+
+#define FMOP_FIXED              0       /* Patch byte as is             */
+#define FMOP_VOLUME             1       /* Total level, plus attenuation */
+#define FMOP_STEREO             2       /* Masked by the channel's pan  */
+#define FMOP_FNUMBER            3       /* F-number low byte of the note */
+#define FMOP_KEYON              4       /* Key on, block, F-number high */
+
+typedef struct _fmProgram {
+    BYTE    bValue[FMPROG_STEPS];       /* Patch bytes                  */
+    BYTE    bOp[FMPROG_STEPS];          /* FMOP_xxx                     */
+    BYTE    bPitchBase[2];              /* Semitones added for the block */
+} fmProgram;
+
+typedef struct _fmBank {
+    patchStruct Patch[NUMPATCHES];      /* As loaded                    */
+    fmProgram   Program[NUMPATCHES];    /* Compiled from Patch[]        */
+} fmBank;
+
+
 /*****************************************************************************
  * Voice state structure (per-voice runtime data)
  */
@@ -148,12 +245,32 @@ typedef struct _voiceStruct {
     BYTE    bVelocity;          /* velocity                  */
     BYTE    bJunk;              /* padding                   */
     DWORD   dwTime;             /* timestamp (0 = unused)    */
-    DWORD   dwOrigPitch[2];     /* original pitch for bends  */
+    DWORD   dwOrigPitch[2];     /* unbent pitch position     */
     BYTE    bBlock[2];          /* block register value       */
     BYTE    bSusHeld;           /* held by sustain pedal      */
 } voiceStruct;
 
 
+/*****************************************************************************
+ * Voice allocator lists
+ *
+ * Voices are threaded on index-linked lists so allocation, stealing and
+ * note-off never scan the voice array.  Lists are appended at the tail,
+ * so each one stays in dwTime order with the oldest voice at the head.
+ */
+#define VOICE_NONE                      (0xff)
+
+typedef struct _voiceLink {
+    BYTE    bPrev;              /* previous voice or VOICE_NONE */
+    BYTE    bNext;              /* next voice or VOICE_NONE     */
+} voiceLink;
+
+typedef struct _voiceList {
+    BYTE    bHead;              /* oldest voice or VOICE_NONE   */
+    BYTE    bTail;              /* newest voice or VOICE_NONE   */
+} voiceList;
+
+
 /*****************************************************************************
  * Channel enums
  */
@@ -168,6 +285,33 @@ enum {
  * Forward declarations
  */
 class CMiniportMidiStreamFMAdLibGold;
+class CMiniportDMusFMAdLibGold;
+class CMiniportDMusStreamFMAdLibGold;
+
+
+/*****************************************************************************
+ * Shared voice pool
+ *
+ * The miniport owns the 18 voices and every open stream allocates from
+ * them (see Opl3_FindEmptySlot).  A voice belongs to the stream that
+ * last keyed it on: while it sounds it is on that stream's active, patch
+ * and channel lists, and once released or never used it is on the
+ * pool's.  A voice is on one stream's lists at most, so the links are
+ * kept here.  Guarded by the miniport's m_SpinLock.
+ */
+#define FM_VOICE_QUOTA                  NUM2VOICES  /* Default per stream */
+
+typedef struct _fmVoicePool {
+    voiceStruct Voice[NUM2VOICES];
+    CMiniportMidiStreamFMAdLibGold *Owner[NUM2VOICES];  /* NULL if unused */
+    DWORD       dwCurTime;
+    voiceList   FreeList;                       /* Never used, by index     */
+    voiceList   ReleasedList;                   /* Off, oldest release first */
+    voiceLink   StateLink[NUM2VOICES];          /* Free/released/active     */
+    voiceLink   PatchLink[NUM2VOICES];
+    voiceLink   ChanLink[NUM2VOICES];
+    BYTE        bNoteNext[NUM2VOICES];          /* Next on voice, same key  */
+} fmVoicePool;
 
 
 /*****************************************************************************
@@ -182,24 +326,69 @@ class CMiniportMidiStreamFMAdLibGold;
  */
 class CMiniportMidiFMAdLibGold
 :   public IMiniportMidi,
+    public IFMSynthAdLibGold,
     public IPowerNotify,
     public CUnknown
 {
 private:
     PPORTMIDI       m_Port;                     /* Callback interface       */
     PADAPTERCOMMON  m_AdapterCommon;            /* Shared hardware access   */
-    BOOLEAN         m_fStreamExists;            /* Only one stream allowed  */
+
+    /*
+     * Open streams, newest first, under m_SpinLock.  The newest is the
+     * soft-thru target.
+     */
+    CMiniportMidiStreamFMAdLibGold *m_StreamList;
+    ULONG           m_VoiceQuota;               /* Voices one stream may hold */
+    fmVoicePool     m_Pool;
+
+    PSERVICEGROUP   m_ServiceGroup;             /* Write queue drain DPC    */
 
     BYTE            m_SavedRegValues[0x200];    /* Shadow OPL3 registers    */
     POWER_STATE     m_PowerState;               /* Current power state      */
     KSPIN_LOCK      m_SpinLock;                 /* Hardware access serialize */
 
+    fmBank *        m_Bank;                     /* Active patches, swapped
+                                                   under m_SpinLock         */
+
+    /* Asynchronous OPL3 write queue, protected by m_QueueLock */
+    KSPIN_LOCK      m_QueueLock;
+    WORD            m_QueueAddress[FM_QUEUE_SIZE];
+    BYTE            m_QueueData[FM_QUEUE_SIZE];
+    WORD            m_QueuePending[0x200];      /* Newest queued slot       */
+    ULONG           m_QueueHead;                /* Next slot to fill        */
+    ULONG           m_QueueTail;                /* Next slot to drain       */
+    BOOLEAN         m_fDraining;                /* A drainer is active      */
+
+    /* Incremental power resume, protected by m_SpinLock */
+    BOOLEAN         m_fResuming;                /* Slices still to run      */
+    ULONG           m_ResumeRange;              /* Index into resume order  */
+    ULONG           m_ResumeAddress;            /* Next register in range   */
+
     /*
      * Private methods
      */
+    NTSTATUS InitSynth
+    (
+        IN      PUNKNOWN        UnknownAdapter  OPTIONAL,
+        OUT     PSERVICEGROUP * ServiceGroup
+    );
     void SoundMidiSendFM(ULONG Address, UCHAR Data);
+    void SoundMidiForceFM(ULONG Address, UCHAR Data);
+    void QueueWriteFM(ULONG Address, UCHAR Data, BOOLEAN Coalesce);
+    void DrainWriteQueue(void);
+    void FlushWriteQueue(void);
+    void KickWriteQueue(void);
+    void ServiceWriteQueue(void);
     void Opl3_BoardReset(void);
     void MiniportMidiFMResume(void);
+    BOOLEAN MiniportMidiFMResumeSlice(void);
+    void AddStream(CMiniportMidiStreamFMAdLibGold *Stream);
+    void RemoveStream(CMiniportMidiStreamFMAdLibGold *Stream);
+    NTSTATUS LoadPatchBank(IN PADLIBGOLD_FM_BANK Bank, IN ULONG Size);
+    void LoadPatchBankFile(void);
+    fmBank *SwapPatchBank(IN fmBank *Bank);
+    NTSTATUS PropertyPatchBank(IN PPCPROPERTY_REQUEST PropertyRequest);
 
 public:
     DECLARE_STD_UNKNOWN();
@@ -251,6 +440,15 @@ public:
     (   void
     );
 
+    /*
+     * IFMSynthAdLibGold (MIDI soft-thru from the UART miniport)
+     */
+    STDMETHODIMP_(void) PlayMidiMessages
+    (
+        IN      PULONG      Messages,
+        IN      ULONG       Count
+    );
+
     /*
      * IPowerNotify methods
      */
@@ -260,6 +458,10 @@ public:
      * Friends
      */
     friend class CMiniportMidiStreamFMAdLibGold;
+    friend class CMiniportDMusFMAdLibGold;
+    friend class CMiniportDMusStreamFMAdLibGold;
+    friend NTSTATUS PropertyHandler_FMPrivate(IN PPCPROPERTY_REQUEST);
+    friend NTSTATUS PropertyHandler_DMusFMPrivate(IN PPCPROPERTY_REQUEST);
 };
 
 
@@ -276,10 +478,15 @@ class CMiniportMidiStreamFMAdLibGold
 {
 private:
     CMiniportMidiFMAdLibGold *  m_Miniport;     /* Parent miniport          */
+    CMiniportMidiStreamFMAdLibGold *m_NextStream; /* Miniport's stream list */
 
-    /* Voice tracking */
-    voiceStruct m_Voice[NUM2VOICES];
-    DWORD       m_dwCurTime;
+    /* This stream's voices in the shared pool (see Opl3_FindEmptySlot) */
+    fmVoicePool *m_Pool;                        /* m_Miniport->m_Pool       */
+    ULONG       m_cActive;                      /* Voices sounding          */
+    voiceList   m_ActiveList;                   /* On, oldest note-on first */
+    voiceList   m_PatchList[NUMPATCHES];        /* On, per patch            */
+    voiceList   m_ChanList[NUMCHANNELS];        /* On, per MIDI channel     */
+    BYTE        m_bNoteMap[NUMCHANNELS][128];   /* First on voice per key   */
 
     /* Synth attenuation (always 0 -- topology handles FM volume) */
     WORD        m_wSynthAttenL;
@@ -292,9 +499,17 @@ private:
     BYTE        m_bPatch[NUMCHANNELS];
     BYTE        m_bSustain[NUMCHANNELS];
 
+    /* MIDI byte-stream parser state (persists across Write calls) */
+    BYTE        m_bRunningStatus;               /* 0 = none                 */
+    BYTE        m_bMsgData[2];                  /* Data bytes collected     */
+    BYTE        m_cbMsgData;
+    BYTE        m_cbMsgNeeded;                  /* Data bytes for status    */
+    BOOLEAN     m_fInSysEx;                     /* Skipping F0 ... F7       */
+
     /*
      * Private methods -- Opl3 processing
      */
+    void ParseMidiBytes(IN PBYTE pbData, IN ULONG cbData);
     void WriteMidiData(DWORD dwData);
     void Opl3_ChannelVolume(BYTE bChannel, WORD wAtten);
     void Opl3_SetPan(BYTE bChannel, BYTE bPan);
@@ -304,13 +519,15 @@ private:
     void Opl3_AllNotesOff(void);
     void Opl3_ChannelNotesOff(BYTE bChannel);
     WORD Opl3_FindFullSlot(BYTE bNote, BYTE bChannel);
-    WORD Opl3_CalcFAndB(DWORD dwPitch);
-    DWORD Opl3_CalcBend(DWORD dwOrig, short iBend);
-    BYTE Opl3_CalcVolume(BYTE bOrigAtten, BYTE bChannel, BYTE bVelocity, BYTE bOper, BYTE bMode);
+    WORD Opl3_CalcFAndB(DWORD dwPos);
+    WORD Opl3_CalcAtten(BYTE bChannel, BYTE bVelocity);
     BYTE Opl3_CalcStereoMask(BYTE bChannel);
     WORD Opl3_FindEmptySlot(BYTE bPatch);
+    void Opl3_AttachVoice(WORD wVoice);
+    void Opl3_DetachVoice(WORD wVoice);
+    void Opl3_ReleaseVoice(WORD wVoice);
     void Opl3_SetVolume(BYTE bChannel);
-    void Opl3_FMNote(WORD wNote, noteStruct FAR * lpSN);
+    void Opl3_FMNote(WORD wNote, const fmProgram *lpProg, BYTE bChannel, BYTE bVelocity, WORD wFAndB);
     void Opl3_SetSustain(BYTE bChannel, BYTE bSusLevel);
 
 public:
@@ -348,6 +565,216 @@ public:
         IN      ULONG       BytesToWrite,
         OUT     PULONG      BytesWritten
     );
+
+    /*
+     * Friends
+     */
+    friend class CMiniportMidiFMAdLibGold;
+    friend class CMiniportDMusStreamFMAdLibGold;
+};
+
+
+/*****************************************************************************
+ * DirectMusic render defines
+ *
+ * Times are in 100ns units, matching DMUS_KERNEL_EVENT::ullPresTime100ns.
+ */
+#define FMDMUS_PREFETCH                 (100000)    /* 10 ms delivered ahead */
+#define FMDMUS_EARLY                    (5000)      /* Due rounding, 0.5 ms   */
+#define FMDMUS_CLOCK_TICKS              12          /* 80us units, 0.96 ms   */
+
+
+/*****************************************************************************
+ * CMiniportDMusFMAdLibGold
+ *****************************************************************************
+ * DirectMusic variant of the FM synth miniport.  Shares the synth engine,
+ * write queue and power handling with CMiniportMidiFMAdLibGold; only the
+ * port binding and the stream type differ.
+ */
+class CMiniportDMusFMAdLibGold
+:   public CMiniportMidiFMAdLibGold,
+    public IMiniportDMus
+{
+private:
+    PPORTDMUS       m_PortDMus;                 /* Callback interface       */
+
+    /*
+     * Event clock.  While any stream is open the adapter's OPL3 Timer 1
+     * clock plays due events every FMDMUS_CLOCK_TICKS; m_ClockMutex
+     * serializes starting and stopping it.  m_ClockStreams is the list
+     * the clock walks, under m_ClockListLock.  Streams that could not
+     * get the clock (another client holds it) use their own timer.
+     */
+    KMUTEX          m_ClockMutex;
+    ULONG           m_ClockUsers;               /* Streams on the clock     */
+    KSPIN_LOCK      m_ClockListLock;
+    CMiniportDMusStreamFMAdLibGold *m_ClockStreams;
+
+    BOOLEAN AttachClock(IN CMiniportDMusStreamFMAdLibGold * Stream);
+    void DetachClock(IN CMiniportDMusStreamFMAdLibGold * Stream);
+
+public:
+    DECLARE_STD_UNKNOWN();
+
+    CMiniportDMusFMAdLibGold(PUNKNOWN UnknownOuter)
+    :   CMiniportMidiFMAdLibGold(UnknownOuter)
+    {
+    }
+
+    ~CMiniportDMusFMAdLibGold();
+
+    /*
+     * IMiniport methods
+     */
+    STDMETHODIMP
+    GetDescription
+    (   OUT     PPCFILTER_DESCRIPTOR *  OutFilterDescriptor
+    );
+    STDMETHODIMP
+    DataRangeIntersection
+    (   IN      ULONG           PinId
+    ,   IN      PKSDATARANGE    DataRange
+    ,   IN      PKSDATARANGE    MatchingDataRange
+    ,   IN      ULONG           OutputBufferLength
+    ,   OUT     PVOID           ResultantFormat     OPTIONAL
+    ,   OUT     PULONG          ResultantFormatLength
+    )
+    {
+        return STATUS_NOT_IMPLEMENTED;
+    }
+
+    /*
+     * IMiniportDMus methods
+     */
+    STDMETHODIMP Init
+    (
+        IN      PUNKNOWN        UnknownAdapter  OPTIONAL,
+        IN      PRESOURCELIST   ResourceList,
+        IN      PPORTDMUS       Port,
+        OUT     PSERVICEGROUP * ServiceGroup
+    );
+    STDMETHODIMP NewStream
+    (
+        OUT     PMXF                  * Stream,
+        IN      PUNKNOWN                OuterUnknown    OPTIONAL,
+        IN      POOL_TYPE               PoolType,
+        IN      ULONG                   PinID,
+        IN      DMUS_STREAM_TYPE        StreamType,
+        IN      PKSDATAFORMAT           DataFormat,
+        OUT     PSERVICEGROUP         * ServiceGroup,
+        IN      PAllocatorMXF           AllocatorMXF,
+        IN      PMASTERCLOCK            MasterClock,
+        OUT     PULONGLONG              SchedulePreFetch
+    );
+    STDMETHODIMP_(void) Service
+    (   void
+    );
+
+    /*
+     * Friends
+     */
+    friend class CMiniportDMusStreamFMAdLibGold;
+    friend VOID
+    DMusFMClockRoutine
+    (
+        IN      PVOID   Context,
+        IN      ULONG   Ticks
+    );
+};
+
+
+/*****************************************************************************
+ * CMiniportDMusStreamFMAdLibGold
+ *****************************************************************************
+ * DirectMusic FM render stream.  Events arrive ahead of time with
+ * presentation timestamps, are held in time order, and are played from
+ * the miniport's OPL3 clock (or a timer DPC) against the port's master
+ * clock.  Playback reuses the MIDI stream's parser and voice engine.
+ */
+class CMiniportDMusStreamFMAdLibGold
+:   public CMiniportMidiStreamFMAdLibGold,
+    public IMXF
+{
+private:
+    PAllocatorMXF       m_AllocatorMXF;         /* Event source/sink        */
+    PMASTERCLOCK        m_MasterClock;          /* Presentation time base   */
+    KSSTATE             m_State;
+
+    /* Pending events, ascending ullPresTime100ns, protected by m_EventLock */
+    KSPIN_LOCK          m_EventLock;
+    PDMUS_KERNEL_EVENT  m_EventHead;
+    PDMUS_KERNEL_EVENT  m_EventTail;
+
+    /*
+     * Event timer.  m_fTimerArmed says a DPC run is owed (the timer is set
+     * or its DPC queued) and m_cDpcActive counts runs in progress; once
+     * m_fClosing is set nothing re-arms, and the last run out signals
+     * m_DpcIdle.  A run only clears the flag while the timer is still
+     * signaled, i.e. nothing re-armed it since it fired.  All under
+     * m_EventLock.
+     */
+    KDPC                m_EventDpc;
+    KTIMER              m_EventTimer;
+    KEVENT              m_DpcIdle;
+    BOOLEAN             m_fTimerArmed;
+    BOOLEAN             m_fClosing;
+    ULONG               m_cDpcActive;
+
+    /* On the miniport's OPL3 clock, which replaces the event timer */
+    BOOLEAN             m_fOnClock;
+    CMiniportDMusStreamFMAdLibGold *m_NextClockStream;
+
+    /*
+     * Private methods
+     */
+    void QueueEvent(IN PDMUS_KERNEL_EVENT pEvent);
+    void FlushEvents(void);
+    void PlayDueEvents(void);
+    void ArmEventTimer(IN LONGLONG DueTime100ns);
+    BOOLEAN CancelEventTimer(void);
+
+public:
+    NTSTATUS
+    Init
+    (
+        IN      CMiniportDMusFMAdLibGold *  Miniport,
+        IN      PAllocatorMXF               AllocatorMXF,
+        IN      PMASTERCLOCK                MasterClock
+    );
+
+    DECLARE_STD_UNKNOWN();
+
+    CMiniportDMusStreamFMAdLibGold(PUNKNOWN UnknownOuter)
+    :   CMiniportMidiStreamFMAdLibGold(UnknownOuter)
+    {
+    }
+
+    ~CMiniportDMusStreamFMAdLibGold();
+
+    /*
+     * IMXF methods
+     */
+    IMP_IMXF;
+
+    /*
+     * Friends
+     */
+    friend NTSTATUS PropertyHandler_SynthFM(IN PPCPROPERTY_REQUEST);
+    friend VOID NTAPI
+    DMusFMTimerDPC
+    (
+        IN      PKDPC   Dpc,
+        IN      PVOID   DeferredContext,
+        IN      PVOID   SystemArgument1,
+        IN      PVOID   SystemArgument2
+    );
+    friend VOID
+    DMusFMClockRoutine
+    (
+        IN      PVOID   Context,
+        IN      ULONG   Ticks
+    );
+    friend class CMiniportDMusFMAdLibGold;
 };
 
 
@@ -8,7 +8,7 @@
  * Key adaptations from DDK UART sample:
  *   - All hardware access through IAdapterCommon::ReadMMA/WriteMMA
  *     (no direct WRITE_PORT_UCHAR / READ_PORT_UCHAR)
- *   - ISR callback via IMidiMiniportAdLibGold::ServiceMidiISR()
+ *   - Service DPC callback via IMidiMiniportAdLibGold::ServiceMidi()
  *     instead of MPUInterruptServiceRoutine
  *   - MIDI reset via MMA register 0Dh (not MPU-401 command 0xFF/0x3F)
  *   - Uses shared interrupt sync from adapter common
@@ -25,7 +25,7 @@
 /*****************************************************************************
  * Synchronized write context
  *
- * Passed to CallSynchronizedRoutine for transmitting MIDI data at DIRQL.
+ * Passed to CallMmaSynchronized for transmitting MIDI data.
  */
 typedef struct
 {
@@ -36,10 +36,23 @@ typedef struct
 }
 SYNCWRITECONTEXT, *PSYNCWRITECONTEXT;
 
+typedef struct
+{
+    CMiniportMidiUartAdLibGold  *Miniport;
+    BOOLEAN                     Enable;
+}
+SYNCSOFTTHRUCONTEXT, *PSYNCSOFTTHRUCONTEXT;
+
 
 /*****************************************************************************
  * Forward declarations
  */
+NTSTATUS
+PropertyHandler_MidiPrivate
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+);
+
 NTSTATUS
 SynchronizedMidiWrite
 (
@@ -47,6 +60,20 @@ SynchronizedMidiWrite
     IN      PVOID           DynamicContext
 );
 
+NTSTATUS
+SynchronizedMidiSoftThru
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+);
+
+NTSTATUS
+SynchronizedMidiHalt
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+);
+
 
 /*****************************************************************************
  * Filter descriptor tables
@@ -188,11 +215,30 @@ PCCONNECTION_DESCRIPTOR MiniportConnections[] =
     { PCFILTER_NODE,  3,  PCFILTER_NODE,  2 }    /* Capture: pin 3 -> pin 2 */
 };
 
+static
+PCPROPERTY_ITEM MiniportProperties[] =
+{
+    {
+        &KSPROPSETID_AdLibGold,
+        KSPROPERTY_ADLIBGOLD_MIDI_CAPTURE_STATS,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_MidiPrivate
+    },
+    {
+        &KSPROPSETID_AdLibGold,
+        KSPROPERTY_ADLIBGOLD_MIDI_SOFT_THRU,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        PropertyHandler_MidiPrivate
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationMidiFilter, MiniportProperties);
+
 static
 PCFILTER_DESCRIPTOR MiniportFilterDescriptor =
 {
     0,                                      /* Version                       */
-    NULL,                                   /* AutomationTable               */
+    &AutomationMidiFilter,                  /* AutomationTable               */
     sizeof(PCPIN_DESCRIPTOR),               /* PinSize                       */
     SIZEOF_ARRAY(MiniportPins),             /* PinCount                      */
     MiniportPins,                           /* Pins                          */
@@ -345,7 +391,7 @@ CMiniportMidiUartAdLibGold::
             MMA_MIDI_MSK_POV | MMA_MIDI_MSK_MOV |
             MMA_MIDI_MSK_TRQ | MMA_MIDI_MSK_RRQ);
 
-        /* Unregister from ISR dispatch */
+        /* Unregister from interrupt dispatch */
         m_AdapterCommon->SetMidiMiniport(NULL);
 
         m_AdapterCommon->Release();
@@ -401,10 +447,29 @@ Init
     m_KSStateInput      = KSSTATE_STOP;
     m_InputBufferHead   = 0;
     m_InputBufferTail   = 0;
+    m_InputReceived     = 0;
+    m_InputOverflows    = 0;
+    m_InputDeliveryMaxUs = 0;
+    m_TxHead            = 0;
+    m_TxTail            = 0;
+    m_TxActive          = FALSE;
+    m_SoftThru          = FALSE;
+    m_ThruStatus        = 0;
+    m_ThruCount         = 0;
+    m_ThruNeeded        = 0;
+    m_ThruInSysEx       = FALSE;
+    m_ThruSustain       = 0;
+    RtlZeroMemory(m_ThruNotes, sizeof(m_ThruNotes));
     m_PowerState.DeviceState = PowerDeviceD0;
 
     RtlZeroMemory(m_InputBuffer, sizeof(m_InputBuffer));
 
+    {
+        LARGE_INTEGER frequency;
+        KeQueryPerformanceCounter(&frequency);
+        m_PerfFrequency = frequency.QuadPart;
+    }
+
     /*
      * Keep a reference to the port driver.
      */
@@ -454,7 +519,7 @@ Init
      *
      * 1. Reset both transmit and receive circuits
      * 2. Release reset
-     * 3. Mask transmit FIFO and overrun IRQs (we poll for Tx)
+     * 3. Mask transmit FIFO and overrun IRQs (TRQ is unmasked per burst)
      * 4. Enable receive FIFO IRQ (MSK_RRQ = 0)
      */
     if (NT_SUCCESS(ntStatus))
@@ -484,7 +549,7 @@ Init
         }
 
         /*
-         * Register with the adapter common for ISR dispatch.
+         * Register with the adapter common for interrupt dispatch.
          */
         m_AdapterCommon->SetMidiMiniport(
             (PMIDIMINIPORTADLIBGOLD)this);
@@ -600,7 +665,122 @@ NewStream
 
 
 /*****************************************************************************
- * Non-pageable code — DPC callbacks, ISR, and synchronized routines
+ * PropertyHandler_MidiPrivate()
+ *****************************************************************************
+ * KSPROPSETID_AdLibGold items on the MIDI filter.
+ *
+ * KSPROPERTY_ADLIBGOLD_MIDI_CAPTURE_STATS: GET returns the capture ring's
+ * ADLIBGOLD_MIDI_CAPTURE_STATS; SET (any value) zeroes the counters.
+ *
+ * KSPROPERTY_ADLIBGOLD_MIDI_SOFT_THRU: ULONG, non-zero plays MIDI input
+ * on the FM synth in the driver, without the round trip through user
+ * mode.  Off by default; the capture pin still sees every byte.
+ */
+NTSTATUS
+PropertyHandler_MidiPrivate
+(
+    IN      PPCPROPERTY_REQUEST PropertyRequest
+)
+{
+    PAGED_CODE();
+
+    ASSERT(PropertyRequest);
+
+    CMiniportMidiUartAdLibGold *that =
+        (CMiniportMidiUartAdLibGold *)(PMINIPORTMIDI(PropertyRequest->MajorTarget));
+
+    ULONG id = PropertyRequest->PropertyItem->Id;
+    ULONG valueSize;
+
+    switch (id)
+    {
+    case KSPROPERTY_ADLIBGOLD_MIDI_CAPTURE_STATS:
+        valueSize = sizeof(ADLIBGOLD_MIDI_CAPTURE_STATS);
+        break;
+
+    case KSPROPERTY_ADLIBGOLD_MIDI_SOFT_THRU:
+        valueSize = sizeof(ULONG);
+        break;
+
+    default:
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        if (PropertyRequest->ValueSize < sizeof(ULONG))
+        {
+            PropertyRequest->ValueSize = sizeof(ULONG);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        *PULONG(PropertyRequest->Value) = KSPROPERTY_TYPE_GET |
+                                          KSPROPERTY_TYPE_SET |
+                                          KSPROPERTY_TYPE_BASICSUPPORT;
+        PropertyRequest->ValueSize = sizeof(ULONG);
+        return STATUS_SUCCESS;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_GET)
+    {
+        if (PropertyRequest->ValueSize < valueSize)
+        {
+            PropertyRequest->ValueSize = valueSize;
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        if (id == KSPROPERTY_ADLIBGOLD_MIDI_SOFT_THRU)
+        {
+            *PULONG(PropertyRequest->Value) = that->m_SoftThru ? 1 : 0;
+        }
+        else
+        {
+            PADLIBGOLD_MIDI_CAPTURE_STATS stats =
+                PADLIBGOLD_MIDI_CAPTURE_STATS(PropertyRequest->Value);
+
+            stats->BufferSize    = MIDI_INPUT_BUFFER_SIZE;
+            stats->BytesReceived = that->m_InputReceived;
+            stats->Overflows     = that->m_InputOverflows;
+            stats->DeliveryMaxUs = that->m_InputDeliveryMaxUs;
+        }
+
+        PropertyRequest->ValueSize = valueSize;
+        return STATUS_SUCCESS;
+    }
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_SET)
+    {
+        if (id == KSPROPERTY_ADLIBGOLD_MIDI_SOFT_THRU)
+        {
+            if (PropertyRequest->ValueSize < sizeof(ULONG))
+            {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+            if (!that->m_AdapterCommon)
+            {
+                return STATUS_DEVICE_NOT_READY;
+            }
+
+            SYNCSOFTTHRUCONTEXT context;
+            context.Miniport = that;
+            context.Enable   = (BOOLEAN)(*PULONG(PropertyRequest->Value) != 0);
+
+            return that->m_AdapterCommon->CallMmaSynchronized(
+                SynchronizedMidiSoftThru, PVOID(&context));
+        }
+
+        that->m_InputReceived      = 0;
+        that->m_InputOverflows     = 0;
+        that->m_InputDeliveryMaxUs = 0;
+        return STATUS_SUCCESS;
+    }
+
+    return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+
+/*****************************************************************************
+ * Non-pageable code — DPC callbacks and synchronized routines
  */
 #pragma code_seg()
 
@@ -609,7 +789,8 @@ NewStream
  * CMiniportMidiUartAdLibGold::Service()
  *****************************************************************************
  * DPC-mode service call from the port driver.
- * Called when the service group is signaled (after ISR puts data in FIFO).
+ * Called when the service group is signaled (after ServiceMidi puts data
+ * in the software FIFO).
  * Runs at DISPATCH_LEVEL — must be non-paged.
  */
 STDMETHODIMP_(void)
@@ -623,40 +804,326 @@ Service
     if (!m_NumCaptureStreams)
     {
         /*
-         * No capture streams open.  Discard any buffered data.
+         * No capture streams open.  Discard any buffered data (from the
+         * consumer side, which owns the head index).
          */
-        m_InputBufferTail = m_InputBufferHead = 0;
+        m_InputBufferHead = m_InputBufferTail;
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiUartAdLibGold::TransmitFifo()
+ *****************************************************************************
+ * Move up to one FIFO's worth of the TX ring into the (empty) transmit
+ * FIFO.  While data remains the transmit IRQ stays unmasked, so the next
+ * TRQ refills it; once the ring is drained TRQ is masked again.
+ *
+ * Called with the adapter's MMA lock held, either from Write (to start an
+ * idle transmitter) or from ServiceMidi on TRQ.
+ */
+void
+CMiniportMidiUartAdLibGold::
+TransmitFifo
+(   void
+)
+{
+    ULONG pending = (m_TxTail - m_TxHead) & MIDI_TX_BUFFER_MASK;
+
+    if (!pending)
+    {
+        if (m_TxActive)
+        {
+            m_TxActive = FALSE;
+            m_AdapterCommon->WriteMMA(MMA_REG_MIDI_CTRL,
+                MMA_MIDI_CTRL_DEFAULT);
+        }
+        return;
+    }
+
+    if (pending > MMA_MIDI_FIFO_SIZE)
+    {
+        pending = MMA_MIDI_FIFO_SIZE;
+    }
+
+    /* At most two bursts: up to the end of the ring, then from the start */
+    ULONG first = MIDI_TX_BUFFER_SIZE - m_TxHead;
+    if (first > pending)
+    {
+        first = pending;
+    }
+
+    m_AdapterCommon->WriteMMABurst(MMA_CHANNEL_0, MMA_REG_MIDI_DATA,
+                                   &m_TxBuffer[m_TxHead], first);
+    if (pending > first)
+    {
+        m_AdapterCommon->WriteMMABurst(MMA_CHANNEL_0, MMA_REG_MIDI_DATA,
+                                       &m_TxBuffer[0], pending - first);
+    }
+
+    m_TxHead = (m_TxHead + pending) & MIDI_TX_BUFFER_MASK;
+
+    if (!m_TxActive)
+    {
+        m_TxActive = TRUE;
+        m_AdapterCommon->WriteMMA(MMA_REG_MIDI_CTRL,
+            MMA_MIDI_CTRL_TX_ACTIVE);
     }
 }
 
 
 /*****************************************************************************
- * CMiniportMidiUartAdLibGold::ServiceMidiISR()
+ * CMiniportMidiUartAdLibGold::ParseThruByte()
  *****************************************************************************
- * Called from the adapter common ISR when MMA status indicates MIDI
- * receive data is available (RRQ bit set).
+ * Soft-thru parser, one received byte at a time.  Returns TRUE with the
+ * packed message (status | data1 << 8 | data2 << 16) when the byte
+ * completes a channel message.  Running status is honoured; realtime
+ * bytes are skipped wherever they appear, and SysEx and system common
+ * messages are consumed and dropped.  Same rules as the FM stream's own
+ * Write parser, kept separate so thru and render traffic never share
+ * running status.
  *
- * Drains the YMZ263 MIDI receive FIFO into the software ring buffer.
- * Signals the service group so the port driver's DPC will call Read().
+ * Called with the adapter's MMA lock held.
+ */
+BOOLEAN
+CMiniportMidiUartAdLibGold::
+ParseThruByte
+(
+    IN      UCHAR   Data,
+    OUT     PULONG  Message
+)
+{
+    if (Data >= 0xF8)
+    {
+        return FALSE;   /* Realtime: may interleave anything */
+    }
+
+    if (Data & 0x80)
+    {
+        m_ThruInSysEx = (BOOLEAN)(Data == 0xF0);
+        m_ThruCount   = 0;
+
+        if (Data < 0xF0)
+        {
+            m_ThruStatus = Data;
+            m_ThruNeeded = (BYTE)(((Data & 0xE0) == 0xC0) ? 1 : 2);
+        }
+        else
+        {
+            /* System common cancels running status */
+            m_ThruStatus = 0;
+            m_ThruNeeded = (BYTE)((Data == 0xF2) ? 2 :
+                ((Data == 0xF1) || (Data == 0xF3)) ? 1 : 0);
+        }
+        return FALSE;
+    }
+
+    if (m_ThruInSysEx || (m_ThruCount >= m_ThruNeeded))
+    {
+        return FALSE;
+    }
+
+    m_ThruData[m_ThruCount++] = Data;
+
+    if (m_ThruCount < m_ThruNeeded)
+    {
+        return FALSE;
+    }
+
+    m_ThruCount = 0;
+
+    if (!m_ThruStatus)
+    {
+        m_ThruNeeded = 0;   /* System common message complete */
+        return FALSE;
+    }
+
+    *Message = ULONG(m_ThruStatus) |
+               (ULONG(m_ThruData[0]) << 8) |
+               ((m_ThruNeeded > 1) ? (ULONG(m_ThruData[1]) << 16) : 0);
+    return TRUE;
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiUartAdLibGold::TrackThruMessage()
+ *****************************************************************************
+ * Note which keys and sustain pedals a thru message leaves down.  All
+ * Sound Off and All Notes Off from the keyboard clear the channel's keys.
  *
- * Runs at DIRQL — no pageable code, no blocking.
+ * Called with the adapter's MMA lock held.
  */
-STDMETHODIMP_(void)
+void
 CMiniportMidiUartAdLibGold::
-ServiceMidiISR
+TrackThruMessage
+(
+    IN      ULONG   Message
+)
+{
+    ULONG channel = Message & 0x0F;
+    ULONG data1   = (Message >> 8) & 0x7F;
+    ULONG data2   = (Message >> 16) & 0x7F;
+
+    switch (Message & 0xF0)
+    {
+    case 0x90:
+        if (data2)
+        {
+            m_ThruNotes[channel][data1 >> 5] |= (1 << (data1 & 31));
+            break;
+        }
+        /* Velocity 0 is a note off */
+
+    case 0x80:
+        m_ThruNotes[channel][data1 >> 5] &= ~(1 << (data1 & 31));
+        break;
+
+    case 0xB0:
+        if (data1 == 64)
+        {
+            if (data2 >= 64)
+            {
+                m_ThruSustain |= USHORT(1 << channel);
+            }
+            else
+            {
+                m_ThruSustain &= USHORT(~(1 << channel));
+            }
+        }
+        else if ((data1 == 120) || (data1 == 123))
+        {
+            RtlZeroMemory(m_ThruNotes[channel], sizeof(m_ThruNotes[channel]));
+        }
+        break;
+    }
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiUartAdLibGold::ReleaseThruNotes()
+ *****************************************************************************
+ * Lift the sustain pedals and key off the notes thru left down, and
+ * nothing else, so a render stream sharing the synth keeps playing.
+ * Clears the tracking.
+ *
+ * Called with the adapter's MMA lock held.
+ */
+void
+CMiniportMidiUartAdLibGold::
+ReleaseThruNotes
 (   void
 )
+{
+    PFMSYNTHADLIBGOLD synth = m_AdapterCommon->GetFMSynth();
+
+    if (synth)
+    {
+        ULONG   messages[16];
+        ULONG   count = 0;
+        ULONG   channel;
+        ULONG   note;
+
+        for (channel = 0; channel < 16; channel++)
+        {
+            /* Pedal first, or the note offs would only be sustained */
+            if (m_ThruSustain & (1 << channel))
+            {
+                messages[count++] = 0xB0 | channel | (64 << 8);
+            }
+
+            for (note = 0; note < 128; note++)
+            {
+                if (!(m_ThruNotes[channel][note >> 5] & (1 << (note & 31))))
+                {
+                    continue;
+                }
+
+                if (count == SIZEOF_ARRAY(messages))
+                {
+                    synth->PlayMidiMessages(messages, count);
+                    count = 0;
+                }
+                messages[count++] = 0x80 | channel | (note << 8) | (0x40 << 16);
+            }
+
+            /* Leave room for the next channel's pedal */
+            if (count == SIZEOF_ARRAY(messages))
+            {
+                synth->PlayMidiMessages(messages, count);
+                count = 0;
+            }
+        }
+
+        if (count)
+        {
+            synth->PlayMidiMessages(messages, count);
+        }
+    }
+
+    m_ThruSustain = 0;
+    RtlZeroMemory(m_ThruNotes, sizeof(m_ThruNotes));
+}
+
+
+/*****************************************************************************
+ * CMiniportMidiUartAdLibGold::ServiceMidi()
+ *****************************************************************************
+ * Called from the adapter common's service DPC when MMA status indicates
+ * MIDI receive data is available (RRQ) or the transmit FIFO has emptied
+ * (TXRQ).  Status is the channel 0 status the ISR already read, so the
+ * first byte needs no second read.
+ *
+ * Drains the YMZ263 MIDI receive FIFO into the software ring buffer and
+ * signals the service group so the port driver's DPC will call Read().
+ * Refills the transmit FIFO from the TX ring.
+ *
+ * Runs at DISPATCH_LEVEL with the adapter's MMA lock held.
+ */
+STDMETHODIMP_(void)
+CMiniportMidiUartAdLibGold::
+ServiceMidi
+(
+    IN      BYTE        Status,
+    IN      ULONGLONG   RxTime
+)
 {
     BOOLEAN newBytesAvailable = FALSE;
     ULONG   bytesDrained = 0;
+    UCHAR   mmaStatus = Status;
+    ULONG   tail = m_InputBufferTail;
+    ULONG   thruMessages[MMA_MIDI_FIFO_SIZE];
+    ULONG   thruCount = 0;
+
+    /*
+     * RxTime is when the ISR saw RRQ.  Requests found by our own status
+     * reads have no interrupt time; stamp those now.
+     */
+    if (!RxTime && (Status & MMA_STATUS_RRQ))
+    {
+        RxTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+
+    /*
+     * TXRQ reads set whenever the FIFO is empty, masked or not; only an
+     * active transmitter has anything to do with it.
+     */
+    if ((Status & MMA_STATUS_TXRQ) && m_TxActive)
+    {
+        TransmitFifo();
+    }
 
     /*
      * Read bytes from the hardware FIFO until no more data is available
-     * or we've drained a reasonable number (16 = MIDI FIFO depth).
+     * or we've drained a reasonable number (16 = MIDI FIFO depth).  Any
+     * other request seen on the way is passed back to the adapter.
      */
-    while (bytesDrained < 16)
+    while (bytesDrained < MMA_MIDI_FIFO_SIZE)
     {
-        UCHAR mmaStatus = m_AdapterCommon->ReadMMA(MMA_REG_STATUS);
+        if (bytesDrained)
+        {
+            mmaStatus = m_AdapterCommon->ReadMMAStatus(MMA_CHANNEL_0,
+                                                       MMA_STATUS_RRQ);
+        }
         if (!(mmaStatus & MMA_STATUS_RRQ))
         {
             break;      /* No more MIDI data available */
@@ -665,6 +1132,13 @@ ServiceMidiISR
         UCHAR dataByte = m_AdapterCommon->ReadMMA(MMA_REG_MIDI_DATA);
         bytesDrained++;
 
+        /* At most one message completes per byte, so this cannot overrun */
+        if (m_SoftThru && ParseThruByte(dataByte, &thruMessages[thruCount]))
+        {
+            TrackThruMessage(thruMessages[thruCount]);
+            thruCount++;
+        }
+
         if ((m_KSStateInput != KSSTATE_RUN) || (!m_NumCaptureStreams))
         {
             continue;   /* Discard data if not running */
@@ -673,19 +1147,40 @@ ServiceMidiISR
         /*
          * Check for buffer overflow.
          */
-        ULONG nextTail = (m_InputBufferTail + 1) % MIDI_INPUT_BUFFER_SIZE;
-        if (nextTail == m_InputBufferHead)
+        if ((tail - m_InputBufferHead) >= MIDI_INPUT_BUFFER_SIZE)
         {
-            _DbgPrintF(DEBUGLVL_TERSE,
-                ("ServiceMidiISR: input buffer overflow"));
+            m_AdapterCommon->CountPerfEvent(ADLIBGOLD_PERF_MIDI_INPUT_DROP, 1);
+            if (!m_InputOverflows++)
+            {
+                _DbgPrintF(DEBUGLVL_TERSE,
+                    ("ServiceMidi: input buffer overflow"));
+            }
             continue;   /* Drop byte on overflow */
         }
 
-        m_InputBuffer[m_InputBufferTail] = dataByte;
-        m_InputBufferTail = nextTail;
+        m_InputBuffer[tail & MIDI_INPUT_BUFFER_MASK] = dataByte;
+        m_InputStamp[tail & MIDI_INPUT_BUFFER_MASK]  = RxTime;
+        tail++;
+        m_InputReceived++;
         newBytesAvailable = TRUE;
     }
 
+    /* Publish the bytes to Read in one store, after the data */
+    m_InputBufferTail = tail;
+
+    /*
+     * Soft-thru: play the whole drain in one call.  The MMA lock keeps
+     * the synth registered until we are done with it.
+     */
+    if (thruCount)
+    {
+        PFMSYNTHADLIBGOLD synth = m_AdapterCommon->GetFMSynth();
+        if (synth)
+        {
+            synth->PlayMidiMessages(thruMessages, thruCount);
+        }
+    }
+
     /*
      * Notify the port driver that data is available.
      */
@@ -740,9 +1235,8 @@ PowerChangeState
          */
         if (m_PowerState.DeviceState == PowerDeviceD0)
         {
-            m_AdapterCommon->WriteMMA(MMA_REG_MIDI_CTRL,
-                MMA_MIDI_MSK_POV | MMA_MIDI_MSK_MOV |
-                MMA_MIDI_MSK_TRQ | MMA_MIDI_MSK_RRQ);
+            m_AdapterCommon->CallMmaSynchronized(
+                SynchronizedMidiHalt, PVOID(this));
         }
     }
 
@@ -753,11 +1247,13 @@ PowerChangeState
 /*****************************************************************************
  * SynchronizedMidiWrite()
  *****************************************************************************
- * Synchronized routine to transmit MIDI data.
- * Writes bytes to the YMZ263 MIDI data register (0Eh) via WriteMMA.
+ * Synchronized routine to queue MIDI data for transmit.
+ * Copies as much of the caller's buffer as fits into the TX ring and, if
+ * the transmitter is idle, starts it with the first FIFO's worth.  The
+ * rest goes out from ServiceMidi, a FIFO per TRQ interrupt.
  *
- * Called via InterruptSync->CallSynchronizedRoutine() to serialize
- * with the ISR.
+ * Called via IAdapterCommon::CallMmaSynchronized() to serialize with
+ * the service DPC's MMA accesses.
  */
 NTSTATUS
 SynchronizedMidiWrite
@@ -776,19 +1272,36 @@ SynchronizedMidiWrite
     ULONG   count = 0;
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
+    CMiniportMidiUartAdLibGold *that = context->Miniport;
+
     /*
-     * Write bytes one at a time to the MIDI transmit FIFO.
      * The YMZ263 has a 16-byte transmit FIFO.  At 31.25 kbaud,
      * each byte takes ~320us to transmit, giving ~5ms of buffer.
-     *
-     * We write up to 16 bytes per call (FIFO depth).  If the caller
-     * has more data (e.g., SysEx), the port driver will retry.
+     * The ring takes the whole buffer unless it is nearly full; the
+     * port driver retries whatever is left over.
      */
-    while (count < context->Length && count < 16)
+    ULONG space = MIDI_TX_BUFFER_MASK -
+                  ((that->m_TxTail - that->m_TxHead) & MIDI_TX_BUFFER_MASK);
+
+    count = context->Length;
+    if (count > space)
+    {
+        count = space;
+    }
+
+    ULONG first = MIDI_TX_BUFFER_SIZE - that->m_TxTail;
+    if (first > count)
+    {
+        first = count;
+    }
+
+    RtlCopyMemory(&that->m_TxBuffer[that->m_TxTail], pMidiData, first);
+    RtlCopyMemory(&that->m_TxBuffer[0], pMidiData + first, count - first);
+    that->m_TxTail = (that->m_TxTail + count) & MIDI_TX_BUFFER_MASK;
+
+    if (!that->m_TxActive)
     {
-        context->Miniport->m_AdapterCommon->WriteMMA(
-            MMA_REG_MIDI_DATA, pMidiData[count]);
-        count++;
+        that->TransmitFifo();
     }
 
     *(context->BytesWritten) = count;
@@ -797,6 +1310,77 @@ SynchronizedMidiWrite
 }
 
 
+/*****************************************************************************
+ * SynchronizedMidiSoftThru()
+ *****************************************************************************
+ * Switch soft-thru on or off between two ServiceMidi passes.  The parser
+ * starts clean either way, and switching off keys off the notes played
+ * through (see ReleaseThruNotes()) so none is left hanging on the FM
+ * synth.
+ *
+ * Called via IAdapterCommon::CallMmaSynchronized().
+ */
+NTSTATUS
+SynchronizedMidiSoftThru
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    PSYNCSOFTTHRUCONTEXT context = (PSYNCSOFTTHRUCONTEXT)DynamicContext;
+
+    ASSERT(context->Miniport);
+
+    CMiniportMidiUartAdLibGold *that = context->Miniport;
+
+    if (that->m_SoftThru && !context->Enable)
+    {
+        that->ReleaseThruNotes();
+    }
+
+    that->m_SoftThru    = context->Enable;
+    that->m_ThruStatus  = 0;
+    that->m_ThruCount   = 0;
+    that->m_ThruNeeded  = 0;
+    that->m_ThruInSysEx = FALSE;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*****************************************************************************
+ * SynchronizedMidiHalt()
+ *****************************************************************************
+ * Mask the MIDI interrupts and drop unsent output before a power-down.
+ * Unsent output does not survive the transmitter reset, and running
+ * under the MMA lock keeps ServiceMidi and a Write from refilling the
+ * FIFO or moving the ring indices halfway through.
+ *
+ * Called via IAdapterCommon::CallMmaSynchronized().
+ */
+NTSTATUS
+SynchronizedMidiHalt
+(
+    IN      PINTERRUPTSYNC  InterruptSync,
+    IN      PVOID           DynamicContext
+)
+{
+    CMiniportMidiUartAdLibGold *that =
+        (CMiniportMidiUartAdLibGold *)DynamicContext;
+
+    ASSERT(that);
+
+    that->m_AdapterCommon->WriteMMA(MMA_REG_MIDI_CTRL,
+        MMA_MIDI_MSK_POV | MMA_MIDI_MSK_MOV |
+        MMA_MIDI_MSK_TRQ | MMA_MIDI_MSK_RRQ);
+
+    that->m_TxHead   = that->m_TxTail;
+    that->m_TxActive = FALSE;
+
+    return STATUS_SUCCESS;
+}
+
+
 /*****************************************************************************
  * Pageable code — stream methods
  */
@@ -901,7 +1485,6 @@ Init
     _DbgPrintF(DEBUGLVL_VERBOSE,
         ("Stream::Init capture=%d", fCapture));
 
-    m_NumFailedTries = 0;
     m_pMiniport = pMiniport;
     m_pMiniport->AddRef();
 
@@ -953,6 +1536,10 @@ SetState
 {
     _DbgPrintF(DEBUGLVL_VERBOSE, ("Stream::SetState %d", NewState));
 
+    m_pMiniport->m_AdapterCommon->TraceEvent(ADLIBGOLD_TRACE_STREAM_STATE,
+        NewState, m_fCapture ? ADLIBGOLD_TRACE_STREAM_MIDI_CAPTURE :
+                               ADLIBGOLD_TRACE_STREAM_MIDI_RENDER);
+
     if (m_fCapture)
     {
         m_pMiniport->m_KSStateInput = NewState;
@@ -962,8 +1549,7 @@ SetState
             /*
              * Discard all buffered data on stop.
              */
-            m_pMiniport->m_InputBufferHead = 0;
-            m_pMiniport->m_InputBufferTail = 0;
+            m_pMiniport->m_InputBufferHead = m_pMiniport->m_InputBufferTail;
         }
     }
 
@@ -976,9 +1562,10 @@ SetState
  *****************************************************************************
  * Reads incoming MIDI data from the software ring buffer.
  *
- * The ISR (ServiceMidiISR) has already read the hardware FIFO and placed
- * bytes into the software buffer.  This method drains the software buffer
- * into the caller's buffer.
+ * The service DPC (ServiceMidi) has already read the hardware FIFO and placed
+ * bytes into the software buffer.  This method copies what is there to the
+ * caller's buffer in at most two contiguous spans, and records how long the
+ * oldest byte waited since its receive interrupt.
  */
 STDMETHODIMP
 CMiniportMidiStreamUartAdLibGold::
@@ -999,18 +1586,47 @@ Read
         return STATUS_INVALID_DEVICE_REQUEST;
     }
 
+    CMiniportMidiUartAdLibGold *miniport = m_pMiniport;
+
     PUCHAR pDest = PUCHAR(BufferAddress);
-    ULONG  count = 0;
+    ULONG  head  = miniport->m_InputBufferHead;
+    ULONG  count = miniport->m_InputBufferTail - head;
+
+    if (count > Length)
+    {
+        count = Length;
+    }
 
-    while ((m_pMiniport->m_InputBufferHead != m_pMiniport->m_InputBufferTail)
-           && (count < Length))
+    if (count)
     {
-        *pDest = m_pMiniport->m_InputBuffer[m_pMiniport->m_InputBufferHead];
-        pDest++;
-        count++;
+        ULONG index = head & MIDI_INPUT_BUFFER_MASK;
+        ULONG first = MIDI_INPUT_BUFFER_SIZE - index;
+        if (first > count)
+        {
+            first = count;
+        }
+
+        RtlCopyMemory(pDest, &miniport->m_InputBuffer[index], first);
+        RtlCopyMemory(pDest + first, &miniport->m_InputBuffer[0], count - first);
+
+        if (miniport->m_PerfFrequency)
+        {
+            ULONGLONG now = KeQueryPerformanceCounter(NULL).QuadPart;
+            ULONGLONG waitUs = ((now - miniport->m_InputStamp[index]) * 1000000) /
+                               miniport->m_PerfFrequency;
 
-        m_pMiniport->m_InputBufferHead =
-            (m_pMiniport->m_InputBufferHead + 1) % MIDI_INPUT_BUFFER_SIZE;
+            if (waitUs > MAXULONG)
+            {
+                waitUs = MAXULONG;
+            }
+            if (waitUs > miniport->m_InputDeliveryMaxUs)
+            {
+                miniport->m_InputDeliveryMaxUs = ULONG(waitUs);
+            }
+        }
+
+        /* Hand the space back to ServiceMidi only after the copy */
+        miniport->m_InputBufferHead = head + count;
     }
 
     *BytesRead = count;
@@ -1022,9 +1638,12 @@ Read
 /*****************************************************************************
  * CMiniportMidiStreamUartAdLibGold::Write()
  *****************************************************************************
- * Writes outgoing MIDI data to the YMZ263 MIDI transmit FIFO.
+ * Queues outgoing MIDI data for the YMZ263 MIDI transmit FIFO.
  *
- * Uses a synchronized routine to serialize with the ISR.
+ * Uses a routine synchronized on the adapter's MMA lock to serialize with
+ * the service DPC.  A full TX ring is a short (possibly empty) write, not
+ * an error: a long SysEx dump outruns the 31.25 kbaud line by far, and
+ * the port driver retries the rest as the ring drains.
  */
 STDMETHODIMP
 CMiniportMidiStreamUartAdLibGold::
@@ -1060,32 +1679,8 @@ Write
         context.Length           = Length;
         context.BytesWritten    = &count;
 
-        PINTERRUPTSYNC pInterruptSync =
-            m_pMiniport->m_AdapterCommon->GetInterruptSync();
-
-        if (pInterruptSync)
-        {
-            ntStatus = pInterruptSync->CallSynchronizedRoutine(
-                SynchronizedMidiWrite, PVOID(&context));
-        }
-        else
-        {
-            ntStatus = SynchronizedMidiWrite(NULL, PVOID(&context));
-        }
-
-        if (count == 0)
-        {
-            m_NumFailedTries++;
-            if (m_NumFailedTries >= 100)
-            {
-                ntStatus = STATUS_IO_DEVICE_ERROR;
-                m_NumFailedTries = 0;
-            }
-        }
-        else
-        {
-            m_NumFailedTries = 0;
-        }
+        ntStatus = m_pMiniport->m_AdapterCommon->CallMmaSynchronized(
+            SynchronizedMidiWrite, PVOID(&context));
     }
 
     *BytesWritten = count;
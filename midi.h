@@ -6,7 +6,7 @@
  * the Windows 2000 DDK uart/miniport sample driver.
  *
  * Hardware access is delegated to the adapter common object's ReadMMA()
- * and WriteMMA() methods.  The ISR in common.cpp calls ServiceMidiISR()
+ * and WriteMMA() methods.  The service DPC in common.cpp calls ServiceMidi()
  * when MMA status indicates MIDI receive data is available (RRQ bit).
  */
 
@@ -44,17 +44,36 @@
 /*
  * Default control value: mask overrun IRQs and transmit FIFO IRQ,
  * but enable receive FIFO IRQ (MSK_RRQ = 0).
- * Transmit uses polling, not interrupts.
+ *
+ * The transmit FIFO IRQ fires while the FIFO is empty, so it is only
+ * unmasked (MMA_MIDI_CTRL_TX_ACTIVE) while the software TX ring has data.
  */
 #define MMA_MIDI_CTRL_DEFAULT   (MMA_MIDI_MSK_POV | MMA_MIDI_MSK_MOV | \
                                  MMA_MIDI_MSK_TRQ)
+#define MMA_MIDI_CTRL_TX_ACTIVE (MMA_MIDI_CTRL_DEFAULT & ~MMA_MIDI_MSK_TRQ)
+
+#define MMA_MIDI_FIFO_SIZE      16      /* Transmit/receive FIFO depth        */
 
 /*****************************************************************************
- * Software FIFO for ISR-buffered MIDI input
+ * Software capture ring for MIDI input
  *
- * Must be a power of 2 for efficient modular arithmetic.
+ * Single producer (ServiceMidi, service DPC) and single consumer (Read,
+ * port DPC), so no lock: the indices run free and are masked on use, and
+ * each side writes only its own.  Every byte carries the performance
+ * counter of the receive interrupt that announced it.  Must be a power
+ * of 2; 1KB is ~330ms of a saturated 31.25kbaud input.
  */
-#define MIDI_INPUT_BUFFER_SIZE  256
+#define MIDI_INPUT_BUFFER_SIZE  1024
+#define MIDI_INPUT_BUFFER_MASK  (MIDI_INPUT_BUFFER_SIZE - 1)
+
+/*****************************************************************************
+ * Software TX ring (filled by Write, drained a FIFO at a time on TRQ)
+ *
+ * Power of 2; holds SIZE - 1 bytes.  4KB is ~1.3s of output at 31.25kbaud
+ * and takes typical SysEx dumps in one Write.
+ */
+#define MIDI_TX_BUFFER_SIZE     4096
+#define MIDI_TX_BUFFER_MASK     (MIDI_TX_BUFFER_SIZE - 1)
 
 
 /*****************************************************************************
@@ -88,7 +107,7 @@ class CMiniportMidiStreamUartAdLibGold;
  *
  * Adapted from DDK CMiniportMidiUart.  Key differences:
  *   - No direct port I/O; all access via IAdapterCommon::ReadMMA/WriteMMA
- *   - ISR callback via IMidiMiniportAdLibGold::ServiceMidiISR()
+ *   - Service DPC callback via IMidiMiniportAdLibGold::ServiceMidi()
  *   - Uses shared interrupt sync from adapter common (not its own)
  *   - MIDI reset via MMA reg 0Dh instead of MPU-401 commands
  */
@@ -107,13 +126,58 @@ private:
     USHORT          m_NumRenderStreams;      /* Active render streams         */
     KSSTATE         m_KSStateInput;         /* Capture stream state          */
 
-    /* Software input FIFO (filled by ISR, drained by Read) */
+    /* Software capture ring (filled by ServiceMidi, drained by Read) */
     UCHAR           m_InputBuffer[MIDI_INPUT_BUFFER_SIZE];
-    ULONG           m_InputBufferHead;      /* Consumer index (Read)         */
-    ULONG           m_InputBufferTail;      /* Producer index (ISR)          */
+    ULONGLONG       m_InputStamp[MIDI_INPUT_BUFFER_SIZE];
+    volatile ULONG  m_InputBufferHead;      /* Consumer index (Read)         */
+    volatile ULONG  m_InputBufferTail;      /* Producer index (ServiceMidi)  */
+    ULONG           m_InputReceived;        /* Bytes stored                  */
+    ULONG           m_InputOverflows;       /* Bytes dropped, ring full      */
+    ULONG           m_InputDeliveryMaxUs;   /* Worst interrupt-to-Read time  */
+    ULONGLONG       m_PerfFrequency;        /* KeQueryPerformanceCounter Hz  */
+
+    /*
+     * Software TX ring.  Write and ServiceMidi both run under the
+     * adapter's MMA lock, which serializes the indices and the FIFO.
+     */
+    UCHAR           m_TxBuffer[MIDI_TX_BUFFER_SIZE];
+    ULONG           m_TxHead;               /* Consumer index (FIFO refill)  */
+    ULONG           m_TxTail;               /* Producer index (Write)        */
+    BOOLEAN         m_TxActive;             /* FIFO draining, TRQ unmasked   */
+
+    /*
+     * Soft-thru parser: received channel messages go straight to the FM
+     * synth's note engine.  Touched by ServiceMidi and the property SET,
+     * both under the adapter's MMA lock.
+     */
+    BOOLEAN         m_SoftThru;             /* KSPROPERTY_..._SOFT_THRU      */
+    BYTE            m_ThruStatus;           /* Running status, 0 = none      */
+    BYTE            m_ThruData[2];          /* Data bytes collected          */
+    BYTE            m_ThruCount;
+    BYTE            m_ThruNeeded;           /* Data bytes for status         */
+    BOOLEAN         m_ThruInSysEx;          /* Skipping F0 ... F7            */
+
+    /*
+     * What thru has left sounding, so switching it off releases only
+     * that and not the render stream's own notes.
+     */
+    ULONG           m_ThruNotes[16][4];     /* Keyed-on bit per channel/note */
+    USHORT          m_ThruSustain;          /* Sustain held, bit per channel */
 
     POWER_STATE     m_PowerState;           /* Current power state           */
 
+    void TransmitFifo(void);                /* Ring -> FIFO, MMA lock held   */
+    BOOLEAN ParseThruByte                   /* TRUE and *Message when done   */
+    (
+        IN      UCHAR   Data,
+        OUT     PULONG  Message
+    );
+    void TrackThruMessage                   /* Note/sustain state for release */
+    (
+        IN      ULONG   Message
+    );
+    void ReleaseThruNotes(void);            /* Key off what thru left on     */
+
 public:
     DECLARE_STD_UNKNOWN();
     DEFINE_STD_CONSTRUCTOR(CMiniportMidiUartAdLibGold);
@@ -165,10 +229,12 @@ public:
     );
 
     /*
-     * IMidiMiniportAdLibGold (ISR dispatch from adapter common)
+     * IMidiMiniportAdLibGold (service DPC dispatch from adapter common)
      */
-    STDMETHODIMP_(void) ServiceMidiISR
-    (   void
+    STDMETHODIMP_(void) ServiceMidi
+    (
+        IN      BYTE        Status,
+        IN      ULONGLONG   RxTime
     );
 
     /*
@@ -180,6 +246,33 @@ public:
      * Friends
      */
     friend class CMiniportMidiStreamUartAdLibGold;
+    friend
+    NTSTATUS
+    PropertyHandler_MidiPrivate
+    (
+        IN      PPCPROPERTY_REQUEST PropertyRequest
+    );
+    friend
+    NTSTATUS
+    SynchronizedMidiWrite
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedMidiSoftThru
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
+    friend
+    NTSTATUS
+    SynchronizedMidiHalt
+    (
+        IN      PINTERRUPTSYNC  InterruptSync,
+        IN      PVOID           DynamicContext
+    );
 };
 
 
@@ -196,7 +289,6 @@ class CMiniportMidiStreamUartAdLibGold
 private:
     CMiniportMidiUartAdLibGold *m_pMiniport; /* Parent miniport               */
     BOOLEAN     m_fCapture;                 /* TRUE for capture stream        */
-    long        m_NumFailedTries;           /* Deadman counter for Tx errors  */
 
 public:
     DECLARE_STD_UNKNOWN();